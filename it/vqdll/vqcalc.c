@@ -70,6 +70,7 @@
 #include <limits.h>
 #include <float.h>
 #include <assert.h>
+#include <string.h>
 
 #include "vqcalc.h"
 
@@ -133,15 +134,23 @@
 	*/
 	#define FLOAT_AS_INT(int_in_mem) (*((int*)(&(int_in_mem))))
 
+	/*
+	// ...and one that turns it into an int in the same order as the float.
+	// The negative ones are sign and magnitude, so their other bits have to
+	// be flipped (which also puts -0 just before +0).
+	*/
+	#define FLOAT_SORT_KEY(float_in_mem) ((FLOAT_AS_INT(float_in_mem) < 0) ? \
+							(FLOAT_AS_INT(float_in_mem) ^ 0x7FFFFFFF) : FLOAT_AS_INT(float_in_mem))
 #endif
 
 /*
 // The following was an experiment to add GLA passes. To be honest, it didn't
-// appear to improve anything anyway, so  the "extra" GLA iterations are currently 
-// turned off.
+// appear to improve anything anyway, so  the "extra" GLA iterations are
+// turned off by default. They can be turned on at run time with
+// SetVqContextRefinement, up to MAX_EXTRA_GLA_ITERATIONS of them.
 */
 
-#define MAX_EXTRA_GLA_ITERATIONS (6)
+#define MAX_EXTRA_GLA_ITERATIONS (15)
 #define EXTRA_GLA_ITS (0)
 
 
@@ -160,6 +169,128 @@
 */
 #define TRY_RED_BLUE_BIASING (0)
 
+
+/*
+// Identical image vectors (there are lots in flat shaded art, fonts etc) are
+// merged into one weighted vector before the quantizer sorts them and, when
+// there's no error diffusion, only the distinct vectors are mapped to the
+// codes (see MergeDuplicateVectors).
+*/
+#define MERGE_DUPLICATE_VECTORS (1)
+
+
+/*
+// When training on a subset of the vectors (see SetVqContextSubsample), use
+// at least this many per rep requested, however small the subset asked for.
+*/
+#define MIN_SUBSAMPLES_PER_REP (8)
+
+
+/*
+// Find each partition's principal axis by power iteration (see
+// FindPrincipalAxis) rather than by computing all the eigenvectors. The
+// matrix is squared POWER_ITERATION_SQUARINGS times first. It stops when a
+// step moves the axis less than POWER_ITERATION_TOLERANCE (squared
+// distance), or changes the variance along it by less than
+// POWER_ITERATION_VARIANCE_TOLERANCE (relative), or gives up and uses jacobi
+// after MAX_POWER_ITERATIONS.
+*/
+#define USE_POWER_ITERATION (1)
+#define POWER_ITERATION_SQUARINGS (3)
+#define MAX_POWER_ITERATIONS (32)
+#define POWER_ITERATION_TOLERANCE (1.0e-8f)
+#define POWER_ITERATION_VARIANCE_TOLERANCE (1.0e-5f)
+
+
+/*
+// Sort the vectors along the axis with a radix sort (see RadixSortRefs),
+// which is linear in the number of vectors, rather than the old shell sort.
+// Partitions shorter than RADIX_SORT_THRESHOLD are insertion sorted instead.
+//
+// Both sort by position and then by vector index (FindPartition splits
+// between equal positions too, so the order of ties matters), which gives
+// exactly the same refs, and so the same partitions, either way.
+*/
+#define USE_RADIX_SORT (1)
+#define RADIX_SORT_THRESHOLD (64)
+
+
+/*
+// Mapping the image vectors to the reps, and splitting the partitions, can
+// be shared out amongst several threads (see SetVqThreadCount). This needs
+// C11 threads and atomics.
+*/
+#if !WIN32 && !defined(__STDC_NO_THREADS__) && !defined(__STDC_NO_ATOMICS__)
+	#define MULTI_THREADED (1)
+#else
+	#define MULTI_THREADED (0)
+#endif
+
+#if MULTI_THREADED
+	#include <threads.h>
+	#include <stdatomic.h>
+
+	typedef atomic_int ROW_PROGRESS_TYPE;
+
+	#define THREAD_LOCAL thread_local
+#else
+	typedef int ROW_PROGRESS_TYPE;
+
+	#if defined(_MSC_VER)
+		#define THREAD_LOCAL __declspec(thread)
+	#else
+		#define THREAD_LOCAL
+	#endif
+#endif
+
+/*
+// The number of threads new contexts start with (see SetVqThreadCount)
+*/
+static int DefaultThreads = 1;
+
+/*
+// The stats of the last job on each thread (see GetLastVqStats)
+*/
+static THREAD_LOCAL VQ_STATS LastJobStats;
+
+/*
+// Don't bother with threads for levels with fewer vectors than this (64x64)
+*/
+#define MIN_THREADED_MAP_VECTORS (4096)
+
+/*
+// With more than one thread, the VectorQuantizer splits up to
+// SPLITS_PER_THREAD partitions per thread at a time, provided they've got
+// MIN_THREADED_SPLIT_VECTORS vectors between them (see SplitPartitions).
+*/
+#define SPLITS_PER_THREAD (2)
+#define MIN_THREADED_SPLIT_VECTORS (16384)
+
+
+/*
+// Use SSE2/AVX2 versions of the distance calcs, chosen at run time. This
+// needs the GCC/Clang target attributes.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define X86_VECTOR_KERNELS (1)
+
+	#include <immintrin.h>
+#else
+	#define X86_VECTOR_KERNELS (0)
+#endif
+
+/*
+// Forces the generic partitioning routines to be inlined into each of
+// their fixed size copies (see SelectQuantizerFuncs)
+*/
+#if defined(__GNUC__)
+	#define FORCE_INLINE __attribute__((always_inline)) inline
+#elif defined(_MSC_VER)
+	#define FORCE_INLINE __forceinline
+#else
+	#define FORCE_INLINE
+#endif
+
 /******************************************************************************/
 /*  DEBUG/BUILD options                                                       */
 /******************************************************************************/
@@ -200,9 +331,13 @@
 	#include <stdio.h>
 	#include <string.h> 
 
-	static FILE *DebFile;
+	/*
+	// The debug file of the job running on this thread, if it got one (see
+	// OpenDebugFile)
+	*/
+	static THREAD_LOCAL FILE *DebFile;
 
-	#define DEB_OUT  fprintf(DebFile, 
+	#define DEB_OUT  if(DebFile) fprintf(DebFile, 
 	
 #else
 	#error "DEBUG must be defined"
@@ -241,9 +376,30 @@ typedef unsigned char U8;
 #define CHECK_FAST_LOOKUP (0)
 
 /*
-// gather statistics on how well the fast-lookup code is doing
+// check every search (see BuildSearchIndex) picks the same code as trying
+// them all, ties included, i.e. -VN 0, 1 and 2 give the same output
+*/
+#define CHECK_SEARCH_INDEX (0)
+
+/*
+// check the SIMD distance routines against the scalar ones, and time them
+// (the results go to the debug file)
+*/
+#define TEST_VECTOR_KERNELS (0)
+
+/*
+// check the fixed size partitioning routines against the generic ones, and
+// time them (again, the results go to the debug file)
+*/
+#define TEST_QUANTIZER_FUNCS (0)
+
+/*
+// check the sorts put positions either side of zero in order (the results
+// go to the debug file)
 */
-#define GATHER_STATS (0)
+#define TEST_SORT_ALONG_AXIS (0)
+
+#include <time.h>
 
 
 #if DEBUG
@@ -253,10 +409,6 @@ typedef unsigned char U8;
 	#define ASSERT(X)
 #endif
 
-#if DEBUG
-	int FlatCount = 0;
-#endif		
-
 
 
 
@@ -284,6 +436,8 @@ typedef unsigned char U8;
 
 #define HALF(X)  ((X)>=0)?((X)>>1):(-(-(X)>>1))
 
+#define MIN(A, B) (((A) < (B)) ? (A) : (B))
+
 /*********************************************************/
 /*********************************************************/
 
@@ -305,11 +459,27 @@ typedef unsigned char U8;
 
 #define MAX_MIP_LEVELS (11)  /*defined by the max res: Logb2(maxres) + 1 */
 
+#if (MAX_MIP_LEVELS > VQ_STATS_MAX_LEVELS) || (MAX_EXTRA_GLA_ITERATIONS + 1 > VQ_STATS_MAX_PASSES)
+	#error "VQ_STATS doesn't have room for all the levels and passes"
+#endif
+
 /*
 //Max number of Quantized Vectors
 */
 #define MAX_CODES	 (256)
 
+/*
+// The smaller codebooks that can be kept on the way to the full one (see
+// SetVqContextSmallCodebooks): 8, 16, 32, 64 or 128 codes
+*/
+#define MIN_SMALL_CODES		(8)
+#define MAX_SMALL_CODES		(MAX_CODES / 2)
+#define MAX_SMALL_CODEBOOKS (5)
+
+#if (MAX_SMALL_CODEBOOKS > VQ_STATS_MAX_CODEBOOKS)
+	#error "VQ_STATS doesn't have room for all the smaller codebooks"
+#endif
+
 /*
 // From now on, hardwire the dimensions of the vectors. For an
 // RGB+A 2x2 this gives a vector length of 16.
@@ -364,6 +534,27 @@ static const int Weights[MAX_MIP_LEVELS] =
 };
 #endif
 
+/*
+// Ordered dithering (VQOrderedDither) adds an offset to each vector before
+// it's matched, which depends only on where the vector is in its level: a
+// 4x4 Bayer matrix, scaled to about +/- ORDERED_DITHER_RANGE/2. Unlike error
+// diffusion, no vector depends on any other, so they can be mapped in any
+// order.
+//
+// The offset is the same for all 4 pixels of a vector. A pattern within the
+// vector would mostly cancel out (a code is picked for the vector as a
+// whole), and only adds detail the codes can't match.
+*/
+#define ORDERED_DITHER_RANGE (8)
+
+static const int OrderedDitherMatrix[4][4] =
+{
+	{ 0,  8,  2, 10},
+	{12,  4, 14,  6},
+	{ 3, 11,  1,  9},
+	{15,  7, 13,  5}
+};
+
 /******************************************************************************
  * LOCAL Data Structures Definitions
  ******************************************************************************/
@@ -412,16 +603,22 @@ typedef struct
 
 
 /* 
-// Define a Vector Format for the image. To save a small amount of space,
-// when doing images less than maximum size, but still have "easy to write"
-// code, this structure has a fixed MAX number of rows, but each row is 
-// dynamically allocated.
+// Define a Vector Format for the image. To still have "easy to write"
+// code, this structure has a fixed MAX number of row pointers, but the
+// vectors themselves are in one contiguous block (shared by all the MIP
+// levels - see AllocateVectorMaps), so the passes over the whole
+// image just stream through memory.
 */
 typedef struct 
 {
 	int xVDim, yVDim;
 	PIXEL_VECT *Rows[MAX_Y_PIXELS/PIXEL_BLOCK_SIZE];
 
+	/*
+	// This level's vectors, in raster order
+	*/
+	PIXEL_VECT *pVectors;
+
 }IMAGE_VECTOR_STRUCT;
 
 
@@ -435,7 +632,7 @@ typedef struct _SearchTreeNode
 {
 	int LeafRepIndex;
 
-	int SplittingAxis[VECLEN];
+	short SplittingAxis[VECLEN]; /*differences of reps, so they fit in a short*/
 	int d;	
 	
 	struct _SearchTreeNode *pLess, *pMore;
@@ -454,79 +651,20 @@ typedef struct
 
 
 
-/******************************************************************************/
-/******************************************************************************/	
-/*
-//  Major Prototypes
-*/
-/******************************************************************************/
-/******************************************************************************/
-
-/*
-// Vector Quantizer routine
-//
-//
-// To do: DESCRIBE INPUTS/OUTPUTS etc
-//
-*/
-static int VectorQuantizer(IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
-					int NumMaps,
-					int NumRepsRequired,
-					int Format,
-					int	bAlphaOn,
-					int Metric,			/*how to estimate colour differences*/
-
-	   SearchTreeNode 	**ppSearchRoot,
-
-			PIXEL_VECT 	*pReps, 
-					int *pVectorCount);
-
-
 /*
-// Map Image to vectors.
-//
-// Steps through the image vectors and assigns the closest representative
-// to each vector.
+// The distance and dot product routines used when searching for the
+// closest rep (see SelectVectorKernels).
 */
-static float MapImageToIndices(IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
-										int NumMaps,
-						SearchTreeNode 	  	*pSearchRoot,
-					   	const PIXEL_VECT 	*pRepVectors,
-					   		          int 	NumReps,
-					   	 SUM_USAGE_STRUCT 	SumAndUsage[MAX_CODES], /*debug data*/
-									  int 	DiffusionLevel,
-									  int	DitherJust1stComponent);
-
-
-/******************************************************************************/
-/******************************************************************************/
+typedef int (*VECTOR_DISTANCE_FUNC)(const short Vector[VECLEN], const U8 Rep[VECLEN]);
+typedef int (*VECTOR_DOT_FUNC)(const short Vector[VECLEN], const short Axis[VECLEN]);
 
-#if DEBUG
-static void myAssert(int expression, char * File, int line)
+typedef struct
 {
-	if(!expression)
-	{
-		volatile int a;
-		fprintf(stderr, "Failed Assertion: File %s, Line %d\n", File, line);
-
-		a = 1;  /* put a break point here when debugging*/
-		(void)a;
-		assert(0);
-	}
-
-}
-#endif
-
+	VECTOR_DISTANCE_FUNC pfnDistance;
+	VECTOR_DOT_FUNC		 pfnDotProduct;
+	const char			*pszName;
+}VECTOR_KERNELS;
 
-/******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
-/*
-//  Quantization Code:
-*/
-/******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
 
 /*
 // Partition Structure:
@@ -549,107 +687,512 @@ typedef struct
 
 /*
 // When partitioning the data, we don't want to shuffle the original data
-// so instead we will move pointers to the data. At the same time, we
+// so instead we will move references to the data. At the same time, we
 // also store the value used to order the vectors along a particular axis.
+//
+// The reference is an index into the image vectors (all the MIP levels
+// are in one block, see AllocateVectorMaps) rather than a pointer, which
+// keeps this down to 8 bytes. It's what the sort shuffles about.
 */
 typedef struct
 {
-	PIXEL_VECT * pVec;
+	int   Index;
 	float d;
 
 }VECTOR_REF_STRUCT;
 
 
-/****************************/
+/*
+// The partitioning routines used by the VectorQuantizer. There's a copy
+// of each for every number of dimensions we use, so the compiler knows the
+// loop lengths (see SelectQuantizerFuncs).
+*/
+typedef int (*ACCUMULATE_COV_FUNC)(const PIXEL_VECT *pVectors,
+								   const VECTOR_REF_STRUCT *pPartitionStart,
+								   int NumVectors,
+								   DMTYPE Cov[VECLEN][VECLEN],
+								   DMTYPE Sum[VECLEN]);
+
+typedef void (*GENERATE_AXIS_FUNC)(const PIXEL_VECT *pVectors,
+									const VECTOR_REF_STRUCT *pPartitionStart,
+									int NumVectors,
+									ACCUMULATE_COV_FUNC pfnAccumulateCov,
+									SMTYPE MainAxis[VECLEN],
+									DMTYPE OutSQSums[VECLEN],
+									DMTYPE OutSums[VECLEN],
+									int *pOutWeightSum);
+
+typedef void (*SORT_ALONG_AXIS_FUNC)(const PIXEL_VECT *pVectors,
+									 VECTOR_REF_STRUCT *pPartitionStart,
+									 VECTOR_REF_STRUCT *pScratch,
+									 int NumVectors,
+									 const SMTYPE Axis[VECLEN]);
+
+typedef void (*FIND_PARTITION_FUNC)(const PIXEL_VECT *pVectors,
+									const VECTOR_REF_STRUCT *pPartitionStart,
+									PARTITION_ENTRY *pOrigPart,
+									PARTITION_ENTRY *pNewPart,
+									const DMTYPE InSQSums[VECLEN],
+									const DMTYPE InSums[VECLEN],
+									const int WeightSum);
+
+typedef struct
+{
+	int						NumDims;
+	ACCUMULATE_COV_FUNC		pfnAccumulateCov;
+	GENERATE_AXIS_FUNC		pfnGenerateAxis;
+	SORT_ALONG_AXIS_FUNC	pfnSortAlongAxis;
+	FIND_PARTITION_FUNC		pfnFindPartition;
+}QUANTIZER_FUNCS;
 
 
 /*
-// Data structure and function used to map 8bit values to lower
-// resolution equivalents
+// An entry in a rep's list of nearest neighbours
 */
-static const int BitDepths[4][4]=
+typedef struct
 {
- 	/* FORMAT_4444*/
-	{4, 4, 4, 4},   /*Red, Green, Blue, Alpha*/
+	int OtherRep;
+	int Distance;
+}NeighbInfo;
 
-	/* FORMAT_1555   -- is also 555*/ 
-	{5, 5, 5, 1},
+typedef NeighbInfo NeighbourArrayType[MAX_CODES][MAX_CODES - 1];
 
-	/* FORMAT_565 */
-	{5, 6, 5, 0},
+/*
+// How often each pair of codes are next to each other (see OptimisePlacement)
+*/
+typedef int NeighbCountType[MAX_CODES][MAX_CODES];
 
-	/* FORMAT_YUV */
-	{8, 8, 0, 0}
 
-};
+/*
+// Search statistics, for each pass of mapping the image (see VQ_STATS). A
+// dot product with a splitting plane counts as a distance calc. TreeHits
+// counts the VQSearchNeighbours searches where the tree's guess was right.
+*/
+typedef struct
+{
+	int NumSearches;
+	int NumDistanceCalcs;
+	int SetupCalcs;
+	int TreeHits;
+}SEARCH_STATS;
 
 
-/******************************************************************************/
 /*
-// ConvertBitDepth
-// Given an 8 bit value and the final bit depth, this finds the best matching
-// value at the lower bit depth and then expands it back to an equivalent
-// full 8 bit value (as done in the PowerVR hardware).
+// A node of the k-d tree over the reps (see BuildKdTree). The reps in the
+// Less child all have v[SplitDim] <= LessMax, and those in the More child
+// v[SplitDim] >= MoreMin. A leaf has a SplitDim of -1, and lists its reps
+// in KdReps[Less] to KdReps[Less + More - 1].
 */
-/******************************************************************************/
+typedef struct
+{
+	int SplitDim;
+	int LessMax, MoreMin;
+	int Less, More;
+}KD_NODE;
 
-static U8 ConvertBitDepth(int BitDepth, int Val)
+#define KD_LEAF_SIZE (4)
+#define MAX_KD_NODES (2 * MAX_CODES)
+
+
+/*
+// Everything the nearest rep searches need to know about the reps. It's
+// only read while mapping, so all the mapping threads can share it. Which
+// of the search structures are filled in depends on the index in use (see
+// BuildSearchIndex).
+*/
+typedef struct REP_SEARCH_TAG REP_SEARCH_STRUCT;
+
+typedef int (*FIND_CLOSEST_FUNC)(const int Vector[VECLEN],
+								 const REP_SEARCH_STRUCT *pSearch,
+								 SEARCH_STATS *pStats,
+								 int *pDistance);
+
+struct REP_SEARCH_TAG
 {
+	FIND_CLOSEST_FUNC		 pfnFindClosest;
+
+#if CHECK_SEARCH_INDEX
+	FIND_CLOSEST_FUNC		 pfnCheckedFind;
+#endif
+
+	const PIXEL_VECT		*pRepVectors;
+	int						 NumReps;
+	const VECTOR_KERNELS	*pKernels;
+
 	/*
-	// special case each one. there are only handfull
+	// VQSearchNeighbours
 	*/
-	switch(BitDepth)
-	{
-		case 4:
-		{
-			/*
-			// Convert down to 4 bit
-			*/
-			Val = (int) (Val * (15.0f/ 255.0f) + 0.5f);
+	const SearchTreeNode	*pSearchRoot;
+	const NeighbInfo	   (*pNeighbours)[MAX_CODES - 1];
 
-			/*
-			// Convert back to equivalent 8 bit
-			*/
-			Val = Val | (Val << 4);
-			break;
-		}
+	/*
+	// VQSearchKdTree
+	*/
+	const KD_NODE			*pKdNodes;
+	const int				*pKdReps;
+};
 
-		case 5:
-		{
-			/*
-			// Convert down to 5 bit
-			*/
-			Val = (int) (Val * (31.0f / 255.0f) + 0.5f);
 
-			/*
-			// Convert back to equivalent 8 bit
-			*/
-			Val = (Val >> 2) | (Val << 3);
-			break;
-		}
+/*
+// A smaller codebook kept while the codes are built (see
+// SetVqContextSmallCodebooks). It's the partitions as they were when there
+// were NumParts of them: their stretches of the refs, which the later
+// splits only divide up, and the tree nodes that were their leaves.
+// LeafIndex is what gets swapped into those nodes to make the search tree
+// the codebook's (see SwapSmallCodebookLeaves).
+*/
+typedef struct
+{
+	int NumCodes;	/*the codebook size, including any reserved code*/
+	int NumParts;	/*the partitions wanted, then how many there were*/
 
-		case 6:
-		{
-			/*
-			// Convert down to 6 bit
-			*/
-			Val = (int) (Val * (63.0f / 255.0f) + 0.5f);
+	int Start[MAX_SMALL_CODES];
+	int Length[MAX_SMALL_CODES];
+	int Node[MAX_SMALL_CODES];
+	int LeafIndex[MAX_SMALL_CODES];
+}SMALL_CODEBOOK;
 
-			/*
-			// Convert back to equivalent 8 bit
-			*/
-			Val = (Val >> 4) | (Val << 2);
-			break;
-		}
 
-		case 8:
-		case 0: /*the zero case here allows for "null" values in the table of bit depths*/
-		{
-			/*
-			// Don't change it
-			*/
-			break;
-		}
+/*
+// A context's working memory (see AllocateFromArena). Everything a job
+// needs that's as big as the image comes out of one block, and it's all
+// given back at once when the next job starts. If a job needs more than
+// the block holds, the rest is malloced separately, and the block is made
+// big enough for it when the next job starts.
+*/
+typedef struct ARENA_EXTRA_TAG
+{
+	struct ARENA_EXTRA_TAG *pNext;
+}ARENA_EXTRA;
+
+typedef struct
+{
+	unsigned char		*pBlock;
+	size_t				 BlockSize;
+	size_t				 Used;
+
+	ARENA_EXTRA			*pExtras;
+	size_t				 ExtraSize;
+
+	/*
+	// the most the job has had at once, and how many allocations it has
+	// made, and how many of those (including the block) went to malloc
+	*/
+	size_t				 Peak;
+	int					 NumAllocs;
+	int					 NumSystemAllocs;
+}VQ_ARENA;
+
+/*
+// See MarkArena
+*/
+typedef struct
+{
+	size_t				 Used;
+	ARENA_EXTRA			*pExtras;
+	size_t				 ExtraSize;
+}ARENA_MARK;
+
+#define ARENA_ALIGN (16)
+#define ARENA_ROUNDING (65536)
+#define ARENA_EXTRA_HEADER ((sizeof(ARENA_EXTRA) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+
+/*
+// The VQ context:
+// This holds all of a job's working memory, so jobs with different contexts
+// can run at the same time. It keeps its allocations from one job to the
+// next, so it's worth reusing one for a batch of textures.
+*/
+struct VQ_CONTEXT_TAG
+{
+	/*
+	// Where the job's image sized arrays come from: the vectors, the
+	// references and the duplicate merging arrays below, and the mapping
+	// threads' buffers
+	*/
+	VQ_ARENA			 Arena;
+
+	/*
+	// The image vectors of every MIP level of every texture, in one block
+	// (see AllocateVectorMaps): all the maps in the block's order, widest
+	// first, and each texture's, top level first. The last
+	// NumSinglePixelMaps in the block are 1x1 levels.
+	*/
+	IMAGE_VECTOR_STRUCT	*Maps[VQ_MAX_SET_TEXTURES * MAX_MIP_LEVELS];
+	IMAGE_VECTOR_STRUCT	*TextureMaps[VQ_MAX_SET_TEXTURES][MAX_MIP_LEVELS];
+	int					 NumSinglePixelMaps;
+
+	/*
+	// The references the VectorQuantizer sorts. Only the vectors it trains
+	// on (the distinct ones, or a subset of them) get one.
+	*/
+	VECTOR_REF_STRUCT	*pVectRefs;
+	VECTOR_REF_STRUCT	*pSortScratch;
+	int					 NumUniqueVectors;
+
+	/*
+	// Train on just one vector in every Subsample (1 = all of them)
+	*/
+	int					 Subsample;
+
+	/*
+	// Duplicate merging (see MergeDuplicateVectors): for each vector, the
+	// index of the first one identical to it, and for those first ones, how
+	// many copies there are and the distance to their rep (see
+	// MapUniqueVectors). NumMergedVectors is 0 if nothing was merged.
+	*/
+	int					*pFirstCopy;
+	int					*pNumCopies;
+	int					*pDistances;
+	int					 NumMergedVectors;
+
+	/*
+	// The search tree. Each split adds two nodes to the root, so
+	// MAX_CODES leaves never need more than 2*MAX_CODES-1 of them.
+	*/
+	SearchTreeNode		 TreeNodes[2 * MAX_CODES];
+	int					 NumTreeNodes;
+
+	/*
+	// How to find the nearest rep when mapping (a VQ_SEARCH_INDEX), and
+	// the k-d tree for VQSearchKdTree
+	*/
+	int					 SearchIndex;
+	KD_NODE				 KdNodes[MAX_KD_NODES];
+	int					 KdReps[MAX_CODES];
+
+	/*
+	// each rep's neighbours, nearest first (see BuildNeighbourList)
+	*/
+	NeighbourArrayType	 NeighbourArray;
+
+	/*
+	// The reps, and the usage counts and sums from the last mapping
+	*/
+	PIXEL_VECT			 Reps[MAX_CODES];
+	SUM_USAGE_STRUCT	 SumAndUsage[MAX_CODES];
+
+	NeighbCountType		 NeighbCount;
+
+	int					 NumThreads;
+
+	/*
+	// GLA passes after the first (see SetVqContextRefinement), and the
+	// RMS error from each pass of the last job
+	*/
+	int					 MaxExtraPasses;
+	float				 MinImprovement;
+	float				 TimeBudget;
+
+	int					 NumPasses;
+	float				 PassErrors[MAX_EXTRA_GLA_ITERATIONS + 1];
+
+	SEARCH_STATS		 Stats;
+
+	/*
+	// The smaller codebook sizes to try (see SetVqContextSmallCodebooks),
+	// the codebooks the last job kept, the reps of the one being tried, and
+	// the size it wrote in the end
+	*/
+	int					 SmallSizes[MAX_SMALL_CODEBOOKS];
+	int					 NumSmallSizes;
+	float				 SmallMaxError;
+
+	SMALL_CODEBOOK		 SmallBooks[MAX_SMALL_CODEBOOKS];
+	int					 NumSmallBooks;
+	PIXEL_VECT			 SmallReps[MAX_SMALL_CODES];
+	int					 CodebookSize;
+
+	/*
+	// A codebook to start from instead of building one (see
+	// SetVqContextWarmStart), as it was written
+	*/
+	U8					 WarmCodebook[MAX_CODES * 8];
+	int					 NumWarmCodes;
+
+	/*
+	// Build the codes from only the MIP levels at most this wide (see
+	// SetVqContextCoarseTraining), or 0 for all of them
+	*/
+	int					 CoarseWidth;
+
+	/*
+	// What the last job did (see GetVqContextStats)
+	*/
+	VQ_STATS			 JobStats;
+
+#if DEBUG
+	int					 FlatCount;
+#endif
+};
+
+
+
+/******************************************************************************/
+/******************************************************************************/	
+/*
+//  Major Prototypes
+*/
+/******************************************************************************/
+/******************************************************************************/
+
+/*
+// Vector Quantizer routine
+//
+//
+// To do: DESCRIBE INPUTS/OUTPUTS etc
+//
+*/
+static int VectorQuantizer(VQ_CONTEXT *pContext,
+		IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+					int NumMaps,
+					int FirstTrainingMap,
+					int NumRepsRequired,
+					int Format,
+	const QUANTIZER_FUNCS	*pFuncs,
+					int Metric,			/*how to estimate colour differences*/
+
+			PIXEL_VECT 	*pReps, 
+					int *pVectorCount);
+
+
+/*
+// Map Image to vectors.
+//
+// Steps through the image vectors and assigns the closest representative
+// to each vector. The usage counts and sums go in the context's SumAndUsage.
+*/
+static float MapImageToIndices(VQ_CONTEXT *pContext,
+				IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+										int NumMaps,
+							 const PIXEL_VECT *pRepVectors,
+					   		          int 	NumReps,
+				   const VECTOR_KERNELS 	*pKernels,
+									  int 	DiffusionLevel,
+									  int	DitherJust1stComponent);
+
+
+/******************************************************************************/
+/******************************************************************************/
+
+#if DEBUG
+static void myAssert(int expression, char * File, int line)
+{
+	if(!expression)
+	{
+		volatile int a;
+		fprintf(stderr, "Failed Assertion: File %s, Line %d\n", File, line);
+
+		a = 1;  /* put a break point here when debugging*/
+		(void)a;
+		assert(0);
+	}
+
+}
+#endif
+
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+/*
+//  Quantization Code:
+*/
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+/****************************/
+
+
+/*
+// Data structure and function used to map 8bit values to lower
+// resolution equivalents
+*/
+static const int BitDepths[4][4]=
+{
+ 	/* FORMAT_4444*/
+	{4, 4, 4, 4},   /*Red, Green, Blue, Alpha*/
+
+	/* FORMAT_1555   -- is also 555*/ 
+	{5, 5, 5, 1},
+
+	/* FORMAT_565 */
+	{5, 6, 5, 0},
+
+	/* FORMAT_YUV */
+	{8, 8, 0, 0}
+
+};
+
+
+/******************************************************************************/
+/*
+// ConvertBitDepth
+// Given an 8 bit value and the final bit depth, this finds the best matching
+// value at the lower bit depth and then expands it back to an equivalent
+// full 8 bit value (as done in the PowerVR hardware).
+*/
+/******************************************************************************/
+
+static U8 ConvertBitDepth(int BitDepth, int Val)
+{
+	/*
+	// special case each one. there are only handfull
+	*/
+	switch(BitDepth)
+	{
+		case 4:
+		{
+			/*
+			// Convert down to 4 bit
+			*/
+			Val = (int) (Val * (15.0f/ 255.0f) + 0.5f);
+
+			/*
+			// Convert back to equivalent 8 bit
+			*/
+			Val = Val | (Val << 4);
+			break;
+		}
+
+		case 5:
+		{
+			/*
+			// Convert down to 5 bit
+			*/
+			Val = (int) (Val * (31.0f / 255.0f) + 0.5f);
+
+			/*
+			// Convert back to equivalent 8 bit
+			*/
+			Val = (Val >> 2) | (Val << 3);
+			break;
+		}
+
+		case 6:
+		{
+			/*
+			// Convert down to 6 bit
+			*/
+			Val = (int) (Val * (63.0f / 255.0f) + 0.5f);
+
+			/*
+			// Convert back to equivalent 8 bit
+			*/
+			Val = (Val >> 4) | (Val << 2);
+			break;
+		}
+
+		case 8:
+		case 0: /*the zero case here allows for "null" values in the table of bit depths*/
+		{
+			/*
+			// Don't change it
+			*/
+			break;
+		}
 
 		/*
 		// Default: Assume it's one!
@@ -1171,98 +1714,40 @@ static int jacobi(float a[VECLEN][VECLEN],
 
 /*********************************************************/
 /*
-// 	GenerateAxis:
-//
-// This function generates the Covariance matrix of the set of
-// vectors in the given partition. From this it finds the best
-// splitting axis, which is subsequently used to further divide
-// this partition.
-//
-//
-// NOTE: From profiling, this routine can take up to 50% of the time
-//		of the whole VQ process. 
-//		The process of computing the Covariance matrix is proportional
-//		to the square of dimension of the vectors. We can thus get
-//		a potential increase in speed (nearly 50% comparing 16x16 V. 12x12)
-//		by having a special case for when we aren't really processing
-//		alpha. (Actually on a PC this didn't appear to materialise, probably
-//		because it's limited by the memory subsystem)
+// 	AccumulateCovariance:
 //
+// Sums the (weighted) vectors of a partition, and their products, i.e. the
+// upper triangle (including the leading diagonal) of the uncorrected
+// covariance matrix. Returns the sum of the weights. Cov and Sum must start
+// off as zeros.
 //
-//	NOTE2: This routine assumes NumDims is divisible by 4
+// ***This loop is one of the most expensive parts of the whole VQ
+// computation. *** From profiling, it takes the bulk of the time of
+// GenerateAxis, which can be up to 50% of the time of the whole VQ process.
+// The work is proportional to the square of the dimension of the vectors,
+// hence the fixed size copies (see SelectQuantizerFuncs).
 //
+// NOTE: This routine assumes NumDims is divisible by 4
 */
 /*********************************************************/
-static void GenerateAxis(const VECTOR_REF_STRUCT * pPartitionStart, 
-						    int NumVectors,
-						 SMTYPE MainAxis[VECLEN],
-					  const int	NumDims,
-						 DMTYPE	OutSQSums[VECLEN],
-						 DMTYPE	OutSums[VECLEN],
-						 	int	*pOutWeightSum)
+static FORCE_INLINE int AccumulateCovariance(const PIXEL_VECT * pVectors,
+							const VECTOR_REF_STRUCT * pPartitionStart,
+									int NumVectors,
+							  const int	NumDims,
+								 DMTYPE	Cov[VECLEN][VECLEN],
+								 DMTYPE	Sum[VECLEN])
 {
-	/*
-	// We use DMTYPEs here because we need around 36-40 bits of precision.
-	// This IS going to cause a problem with the SH4. I suppose we will need
-	// to re-write the code to use long long, or some other hack.
-	//
-	// NOTE We start with only the upper triangle of the Covariance matrix
-	// because of its symmetry. In theory, we could save space, by not
-	// storing the lower triangle, but it'd make the coding somewhat 
-	// more difficult!
-	*/
- 	DMTYPE Cov[VECLEN][VECLEN];
-
-	/*
-	// a floating point version of the matrix for calculating the
-	// eigenvectors and eigenvalues
-	*/
-	float fCov[VECLEN][VECLEN];
-	float EVects[VECLEN][VECLEN];
-	float EVals[VECLEN];
-	
-
-	DMTYPE Sum[VECLEN];
-	int WeightSum;
-	double InvWeightSum;
-
-	int v, i, j;
-
-	/*
-	// The following are used to find the principal axis which is
-	// the eigenvector of the Covariance Matrix with the largest
-	// eigenvalue.
-	*/
-	float MaxVal;
-	int MaxEigen;
-
-
+	int v, i, j;
+	int WeightSum;
+
 	/*
 	// due to optimisations in the looping code, we are assuming that
 	// the number of dimensions is divisible by 4
 	*/
 	ASSERT((NumDims & 3)==0);
 
-	/*
-	// Initialise the Covariance matrix values. We only need to do the
-	// upper triangle (includes leading diagonal)
-	//
-	// NOTE the unused dimensions (eg alpha if opaque)
-	// will remain zero.
-	*/
-	for(i = 0; i < VECLEN; i++)
-	{
-		Sum[i] = (DMTYPE) 0;
-
-		for(j = i; j < VECLEN; j++)
-		{
-			Cov[i][j] = (DMTYPE) 0;
-		}
-	}
 	WeightSum = 0;
 
-
-
 	/*
 	// Step through all the vectors
 	*/
@@ -1270,12 +1755,19 @@ static void GenerateAxis(const VECTOR_REF_STRUCT * pPartitionStart,
 	{
 		const PIXEL_VECT * pVec;
 		SMTYPE Elem1;
+		SMTYPE Elems[VECLEN];
 		int Weight;
 
 		/*
-		// get convenient access to the vector data
+		// get convenient access to the vector data, converting it just
+		// the once rather than for every product
 		*/
-		pVec = pPartitionStart->pVec;
+		pVec = pVectors + pPartitionStart->Index;
+
+		for(i = 0; i < NumDims; i++)
+		{
+			Elems[i] = (SMTYPE) pVec->pv[i];
+		}
 
 		/*
 		// Get hold of the weight for this vector.
@@ -1288,9 +1780,6 @@ static void GenerateAxis(const VECTOR_REF_STRUCT * pPartitionStart,
 		// calculations.
 		//
 		// Note, we only do the alpha components when necessary
-		//
-		// ***This loop is one of the most expensive parts of
-		// the whole VQ computation. ***
 		*/
 		for(i = 0; i < NumDims; i++)
 		{
@@ -1301,7 +1790,7 @@ static void GenerateAxis(const VECTOR_REF_STRUCT * pPartitionStart,
 			// multiplies later, pre-multiply it by the vector
 			// weight.
 			*/
-			Elem1 = pVec->pv[i] * Weight;
+			Elem1 = Elems[i] * Weight;
 
 			/*
 			// Add it to the sum (for the calculating the average )
@@ -1326,7 +1815,7 @@ static void GenerateAxis(const VECTOR_REF_STRUCT * pPartitionStart,
 
 			for(j = i; (j & 0x3); j++)
 			{
-				CovRow[j] += Elem1 * pVec->pv[j];
+				CovRow[j] += Elem1 * Elems[j];
 			}
 
 			/*
@@ -1341,10 +1830,10 @@ static void GenerateAxis(const VECTOR_REF_STRUCT * pPartitionStart,
 				*/
 				DMTYPE Tmp0, Tmp1, Tmp2, Tmp3;
 
-				Tmp0 = CovRow[j]   + Elem1 * pVec->pv[j];
-				Tmp1 = CovRow[j+1] + Elem1 * pVec->pv[j+1];
-				Tmp2 = CovRow[j+2] + Elem1 * pVec->pv[j+2];
-				Tmp3 = CovRow[j+3] + Elem1 * pVec->pv[j+3];
+				Tmp0 = CovRow[j]   + Elem1 * Elems[j];
+				Tmp1 = CovRow[j+1] + Elem1 * Elems[j+1];
+				Tmp2 = CovRow[j+2] + Elem1 * Elems[j+2];
+				Tmp3 = CovRow[j+3] + Elem1 * Elems[j+3];
 
 				CovRow[j]   = Tmp0;
 				CovRow[j+1] = Tmp1;
@@ -1355,157 +1844,548 @@ static void GenerateAxis(const VECTOR_REF_STRUCT * pPartitionStart,
 		pPartitionStart ++;
 	}/*end for v*/
 
-	InvWeightSum = 1.0 / (double) WeightSum;
+	return WeightSum;
+}
+
+
+#if X86_VECTOR_KERNELS && USE_DOUBLES_FOR_MATHS && !PVT_IS_FLOAT
+#define AVX_COVARIANCE (1)
+/*
+// AVX version of AccumulateCovariance. It works on 4 components at a time,
+// but does exactly the same sums (float products, added up in doubles) in
+// the same order, so the results are identical. Rows starting part way
+// through a block of 4 also write a few entries below the diagonal, which
+// aren't used.
+*/
+__attribute__((target("avx"), always_inline))
+static inline int AccumulateCovarianceAVX(const PIXEL_VECT * pVectors,
+							const VECTOR_REF_STRUCT * pPartitionStart,
+									int NumVectors,
+							  const int	NumDims,
+								 DMTYPE	Cov[VECLEN][VECLEN],
+								 DMTYPE	Sum[VECLEN])
+{
+	int v, i, b;
+	int WeightSum;
+
+	ASSERT((NumDims & 3)==0);
+
+	WeightSum = 0;
+
+	for(v = NumVectors; v != 0 ; v--)
+	{
+		const PIXEL_VECT * pVec;
+		__m128 Elems[VECLEN / 4];
+		__m128 Weight;
+		float Elem1[VECLEN];
+
+		pVec = pVectors + pPartitionStart->Index;
+
+		WeightSum += pVec->wc.Weight;
+		Weight = _mm_set1_ps((float) pVec->wc.Weight);
+
+		/*
+		// convert the components to floats, and the weighted ones go in
+		// the sums
+		*/
+		for(b = 0; b < NumDims / 4; b++)
+		{
+			int Packed;
+			__m128 Weighted;
+
+			memcpy(&Packed, pVec->pv + b * 4, sizeof(Packed));
+			Elems[b] = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(Packed)));
+			Weighted = _mm_mul_ps(Elems[b], Weight);
+
+			_mm256_storeu_pd(Sum + b * 4,
+				_mm256_add_pd(_mm256_loadu_pd(Sum + b * 4), _mm256_cvtps_pd(Weighted)));
+			_mm_storeu_ps(Elem1 + b * 4, Weighted);
+		}
+
+		for(i = 0; i < NumDims; i++)
+		{
+			__m128 Elem1i;
+
+			Elem1i = _mm_set1_ps(Elem1[i]);
+
+			for(b = i / 4; b < NumDims / 4; b++)
+			{
+				_mm256_storeu_pd(Cov[i] + b * 4,
+					_mm256_add_pd(_mm256_loadu_pd(Cov[i] + b * 4),
+								  _mm256_cvtps_pd(_mm_mul_ps(Elem1i, Elems[b]))));
+			}
+		}/*end for i*/
+		pPartitionStart ++;
+	}/*end for v*/
+
+	return WeightSum;
+}
+#else
+#define AVX_COVARIANCE (0)
+#endif
+
+
+#if USE_POWER_ITERATION
+/*********************************************************/
+/*
+// 	FindPrincipalAxis:
+//
+// Finds the eigenvector of the (symmetric) covariance matrix with the
+// largest eigenvalue by power iteration: multiplying a vector by the matrix
+// over and over turns it towards that eigenvector, faster the more its
+// eigenvalue stands out. The eigenvalues of a partition are often quite
+// close, so we make them stand out more by squaring the matrix a few times
+// first (scaling it down each time to keep the numbers in range). Starting
+// from the row of the dimension with the most variance, it then usually
+// only takes a few steps.
+//
+// (Starting from the axis the parent partition was split along is no
+// quicker: the split takes out most of the spread along it.)
+//
+// When the top two eigenvalues are very close, the axis can still be
+// turning slowly between their eigenvectors long after the variance along
+// it (all the split cares about) has stopped growing, so that counts as
+// settled too.
+//
+// Returns 0 if it didn't settle down, in which case use jacobi.
+*/
+/*********************************************************/
+static FORCE_INLINE int FindPrincipalAxis(float fCov[VECLEN][VECLEN],
+									const int NumDims,
+										float Axis[VECLEN],
+										float *pEigenValue)
+{
+	float Power[2][VECLEN][VECLEN];
+	float (*pPower)[VECLEN];
+	float Next[VECLEN];
+	float Length, Change, Trace;
+	float EigenValue, PrevEigenValue;
+	int Iteration, Squaring, Widest, i, j, k;
 
-	DEB_OUT "weightsum:%d Inverse WeightSum: %f\n", WeightSum, InvWeightSum);
 	/*
-	// To save recalculation work in the FindPartition Routine,
-	// save the sum values we have so far computed
+	// Power = (Cov / its trace) ^ (2 ^ POWER_ITERATION_SQUARINGS)
 	*/
+	Trace = 0.0f;
 	for(i = 0; i < NumDims; i++)
 	{
-		OutSQSums[i] = Cov[i][i];
-		OutSums[i]	 = Sum[i];
-
-		DEB_OUT "%d: SQSums[]:%f Sums[]:%f\n", i, OutSQSums[i], OutSums[i]);
+		Trace += fCov[i][i];
+	}
+	if(Trace <= 0.0f)
+	{
+		return 0;
 	}
 
-	*pOutWeightSum = WeightSum;
-
-	/* 
-	// The following code cuts some corners:
-	//
-	// The real covariance values are computed from...
-	//
-	// Cov[i][j] = Average(Val[i] * Val[j]) - Average(Val[i]) * Average(Val[j])
-	//
-	// Since we are only interested in relative values, we can multiply through
-	// by the weight sum (i.e as in the averaging bit)
-	//
-	// Again, due to symmetry, only do the upper triangle
-	*/
+	pPower = Power[0];
 	for(i = 0; i < NumDims; i++)
 	{
-		for(j = i; j < NumDims; j++)
+		for(j = 0; j < NumDims; j++)
 		{
-			Cov[i][j] -= (DMTYPE)(Sum[i] * Sum[j] * InvWeightSum);
+			pPower[i][j] = fCov[i][j] / Trace;
 		}
 	}
 
-	/*
-	// Now copy this to our floating point version, and fill in the
-	// entire matrix.
-	*/
-	for(i = 0; i < NumDims; i++)
+	for(Squaring = 0; Squaring < POWER_ITERATION_SQUARINGS; Squaring++)
 	{
+		float (*pSquare)[VECLEN];
+
+		pSquare = Power[(Squaring + 1) & 1];
+
 		/*
-		// allow for the symmetry
+		// (it's symmetric, so only do the upper triangle)
 		*/
-		for(j = 0; j < i; j++)
+		Trace = 0.0f;
+		for(i = 0; i < NumDims; i++)
 		{
-			fCov[i][j] = (float) Cov[j][i]; 
+			for(j = i; j < NumDims; j++)
+			{
+				float Dot;
 
-			DEB_OUT "%f ", fCov[i][j]);
+				Dot = 0.0f;
+				for(k = 0; k < NumDims; k++)
+				{
+					Dot += pPower[i][k] * pPower[k][j];
+				}
+				pSquare[i][j] = Dot;
+			}
+			Trace += pSquare[i][i];
 		}
-		DEB_OUT "\n");
 
-		for(/*nil*/; j < NumDims; j++)
+		if(Trace <= 0.0f)
 		{
-			fCov[i][j] = (float) Cov[i][j]; 
+			return 0;
 		}
-	}
-
-	/*
-	// Compute the Eigenvectors and Eigenvalues
-	*/
-	jacobi(fCov, NumDims, EVals, EVects);
 
+		for(i = 0; i < NumDims; i++)
+		{
+			for(j = i; j < NumDims; j++)
+			{
+				pSquare[i][j] /= Trace;
+				pSquare[j][i]  = pSquare[i][j];
+			}
+		}
+		pPower = pSquare;
+	}/*end for Squaring*/
 
-	/*
-	// Find the largest Eigenvalue. I'm not sure whether negative ones
-	// are SUPPOSED to come out of the routine, but I get the occasional
-	// small negative value. I'll ignore them for the present.
-	*/	
-	MaxVal   = 0.0f;
-	MaxEigen = 0;
-	for(i = 0; i < NumDims; i++)
+	Widest = 0;
+	for(i = 1; i < NumDims; i++)
 	{
-	#if 0
-		if(MaxVal < (float) fabs(EVals[i]))
-	#else
-		if(MaxVal < EVals[i])
-	#endif
+		if(fCov[i][i] > fCov[Widest][Widest])
 		{
-			MaxVal   = (float) fabs(EVals[i]);
-			MaxEigen = i;
+			Widest = i;
 		}
 	}
 
-
-	/*
-	// Grab the corresponding eigenvector - this is the principal
-	// axis. It is in the corresponding **column** of the eigenvec matrix .
-	*/
-	DEB_OUT "EigenVect:%d", MaxEigen);
-
 	for(i = 0; i < NumDims; i++)
 	{
-	#if	USE_DOUBLES_FOR_MATHS
-		MainAxis[i] = EVects[i][MaxEigen];
-	#else
-		MainAxis[i] =(SMTYPE) (EVects[i][MaxEigen] * (INT_MAX >> (8+4)));
-	#endif
+		Axis[i] = fCov[Widest][i];
+	}
+	PrevEigenValue = 0.0f;
 
-		DEB_OUT " %f ", MainAxis[i]);
-	#if DEBUG_FILE
-		if(i%8==7)
+	for(Iteration = 0; Iteration < MAX_POWER_ITERATIONS; Iteration++)
+	{
+		/*
+		// Next = Power * Axis, normalised
+		*/
+		Length = 0.0f;
+		for(i = 0; i < NumDims; i++)
 		{
-			DEB_OUT "\n");
+			float Dot;
+
+			Dot = 0.0f;
+			for(j = 0; j < NumDims; j++)
+			{
+				Dot += pPower[i][j] * Axis[j];
+			}
+			Next[i] = Dot;
+			Length += Dot * Dot;
 		}
-	#endif
 
-	}
-	DEB_OUT "\nwith EigenValue %f (hex)%x\n\n", MaxVal, FLOAT_AS_INT(MaxVal));
+		/*
+		// (i.e. all the vectors are the same, or we've started at right
+		// angles to all of them)
+		*/
+		if(Length <= 0.0f)
+		{
+			return 0;
+		}
 
-	
-}
+		Length = (float) sqrt(Length);
+
+		Change = 0.0f;
+		for(i = 0; i < NumDims; i++)
+		{
+			float Diff;
 
+			Next[i] /= Length;
 
-/*********************************************************/
-/*********************************************************/
+			Diff	= Next[i] - Axis[i];
+			Change += Diff * Diff;
+			Axis[i] = Next[i];
+		}
+
+		/*
+		// The variance along the axis, which is its eigenvalue once it has
+		// converged
+		*/
+		EigenValue = 0.0f;
+		for(i = 0; i < NumDims; i++)
+		{
+			for(j = 0; j < NumDims; j++)
+			{
+				EigenValue += Axis[i] * fCov[i][j] * Axis[j];
+			}
+		}
+
+		if((Iteration > 0) &&
+		   ((Change < POWER_ITERATION_TOLERANCE) ||
+			((float) fabs(EigenValue - PrevEigenValue) < POWER_ITERATION_VARIANCE_TOLERANCE * EigenValue)))
+		{
+			*pEigenValue = EigenValue;
+
+			DEB_OUT "Power iteration converged after %d steps\n", Iteration + 1);
+			return 1;
+		}
+		PrevEigenValue = EigenValue;
+	}/*end for Iteration*/
+
+	DEB_OUT "Power iteration didn't converge\n");
+	return 0;
+}
+#endif
 
 
 /*********************************************************/
 /*
-// Shell Sort
+// 	GenerateAxis:
 //
-// I was originally using quicksort to sort the vectors along
-// the axis, which was wonderful until it hit a pathological image
-// (pictures of a star field. Most of the image was black). 
-// Quicksort rapidly became VerySlowsort :-(
+// This function generates the Covariance matrix of the set of
+// vectors in the given partition. From this it finds the best
+// splitting axis, which is subsequently used to further divide
+// this partition.
 //
 //
-// This routine was obtained from the web, and in the process
-// I came up with a new proverb...
+// NOTE: From profiling, this routine can take up to 50% of the time
+//		of the whole VQ process. 
+//		The process of computing the Covariance matrix is proportional
+//		to the square of dimension of the vectors. We can thus get
+//		a potential increase in speed (nearly 50% comparing 16x16 V. 12x12)
+//		by having a special case for when we aren't really processing
+//		alpha. (Actually on a PC this didn't appear to materialise, probably
+//		because it's limited by the memory subsystem)
 //
-// "Beware not only Greeks bearing gifts, 
-//     but also Pascal programmers bearing C"
 //
-// The original was basing arrays at index 1, which I hadn't
-// initially checked.
+//	NOTE2: This routine assumes NumDims is divisible by 4
 //
 */
 /*********************************************************/
-
-
-static void shellsort(VECTOR_REF_STRUCT * Partition,
-					  int  NumVectors)
+static FORCE_INLINE void GenerateAxis(const PIXEL_VECT * pVectors,
+						const VECTOR_REF_STRUCT * pPartitionStart, 
+						    int NumVectors,
+			ACCUMULATE_COV_FUNC pfnAccumulateCov,
+						 SMTYPE MainAxis[VECLEN],
+					  const int	NumDims,
+						 DMTYPE	OutSQSums[VECLEN],
+						 DMTYPE	OutSums[VECLEN],
+						 	int	*pOutWeightSum)
 {
-	int i, j;
-	VECTOR_REF_STRUCT TempVecRef;
-	int StepSize;	
-
-	#if FP_COMPARE_SLOW
+	/*
+	// We use DMTYPEs here because we need around 36-40 bits of precision.
+	// This IS going to cause a problem with the SH4. I suppose we will need
+	// to re-write the code to use long long, or some other hack.
+	//
+	// NOTE We start with only the upper triangle of the Covariance matrix
+	// because of its symmetry. In theory, we could save space, by not
+	// storing the lower triangle, but it'd make the coding somewhat 
+	// more difficult!
+	*/
+ 	DMTYPE Cov[VECLEN][VECLEN];
+
+	/*
+	// a floating point version of the matrix for calculating the
+	// eigenvectors and eigenvalues
+	*/
+	float fCov[VECLEN][VECLEN];
+	float EVects[VECLEN][VECLEN];
+	float EVals[VECLEN];
+	float Principal[VECLEN];
+	
+
+	DMTYPE Sum[VECLEN];
+	int WeightSum;
+	double InvWeightSum;
+
+	int i, j;
+
+	/*
+	// The following are used to find the principal axis which is
+	// the eigenvector of the Covariance Matrix with the largest
+	// eigenvalue.
+	*/
+	float MaxVal;
+	int MaxEigen;
+
+
+	/*
+	// due to optimisations in the looping code, we are assuming that
+	// the number of dimensions is divisible by 4
+	*/
+	ASSERT((NumDims & 3)==0);
+
+	/*
+	// Initialise the Covariance matrix values. The accumulation only
+	// needs the upper triangle (includes leading diagonal), but the AVX
+	// one writes a few more.
+	//
+	// NOTE the unused dimensions (eg alpha if opaque)
+	// will remain zero.
+	*/
+	for(i = 0; i < VECLEN; i++)
+	{
+		Sum[i] = (DMTYPE) 0;
+
+		for(j = 0; j < VECLEN; j++)
+		{
+			Cov[i][j] = (DMTYPE) 0;
+		}
+	}
+
+	WeightSum = pfnAccumulateCov(pVectors, pPartitionStart, NumVectors, Cov, Sum);
+
+	InvWeightSum = 1.0 / (double) WeightSum;
+
+	DEB_OUT "weightsum:%d Inverse WeightSum: %f\n", WeightSum, InvWeightSum);
+	/*
+	// To save recalculation work in the FindPartition Routine,
+	// save the sum values we have so far computed
+	*/
+	for(i = 0; i < NumDims; i++)
+	{
+		OutSQSums[i] = Cov[i][i];
+		OutSums[i]	 = Sum[i];
+
+		DEB_OUT "%d: SQSums[]:%f Sums[]:%f\n", i, OutSQSums[i], OutSums[i]);
+	}
+
+	*pOutWeightSum = WeightSum;
+
+	/* 
+	// The following code cuts some corners:
+	//
+	// The real covariance values are computed from...
+	//
+	// Cov[i][j] = Average(Val[i] * Val[j]) - Average(Val[i]) * Average(Val[j])
+	//
+	// Since we are only interested in relative values, we can multiply through
+	// by the weight sum (i.e as in the averaging bit)
+	//
+	// Again, due to symmetry, only do the upper triangle
+	*/
+	for(i = 0; i < NumDims; i++)
+	{
+		for(j = i; j < NumDims; j++)
+		{
+			Cov[i][j] -= (DMTYPE)(Sum[i] * Sum[j] * InvWeightSum);
+		}
+	}
+
+	/*
+	// Now copy this to our floating point version, and fill in the
+	// entire matrix.
+	*/
+	for(i = 0; i < NumDims; i++)
+	{
+		/*
+		// allow for the symmetry
+		*/
+		for(j = 0; j < i; j++)
+		{
+			fCov[i][j] = (float) Cov[j][i]; 
+
+			DEB_OUT "%f ", fCov[i][j]);
+		}
+		DEB_OUT "\n");
+
+		for(/*nil*/; j < NumDims; j++)
+		{
+			fCov[i][j] = (float) Cov[i][j]; 
+		}
+	}
+
+#if USE_POWER_ITERATION
+	/*
+	// Usually power iteration gets us the principal axis much more cheaply
+	// than finding all the eigenvectors
+	*/
+	if(FindPrincipalAxis(fCov, NumDims, Principal, &MaxVal))
+	{
+		MaxEigen = -1;
+	}
+	else
+#endif
+	{
+		/*
+		// Compute the Eigenvectors and Eigenvalues
+		*/
+		jacobi(fCov, NumDims, EVals, EVects);
+
+
+		/*
+		// Find the largest Eigenvalue. I'm not sure whether negative ones
+		// are SUPPOSED to come out of the routine, but I get the occasional
+		// small negative value. I'll ignore them for the present.
+		*/	
+		MaxVal   = 0.0f;
+		MaxEigen = 0;
+		for(i = 0; i < NumDims; i++)
+		{
+		#if 0
+			if(MaxVal < (float) fabs(EVals[i]))
+		#else
+			if(MaxVal < EVals[i])
+		#endif
+			{
+				MaxVal   = (float) fabs(EVals[i]);
+				MaxEigen = i;
+			}
+		}
+
+		/*
+		// Grab the corresponding eigenvector - this is the principal
+		// axis. It is in the corresponding **column** of the eigenvec matrix .
+		*/
+		for(i = 0; i < NumDims; i++)
+		{
+			Principal[i] = EVects[i][MaxEigen];
+		}
+	}
+
+
+	DEB_OUT "EigenVect:%d", MaxEigen);
+
+	for(i = 0; i < NumDims; i++)
+	{
+	#if	USE_DOUBLES_FOR_MATHS
+		MainAxis[i] = Principal[i];
+	#else
+		MainAxis[i] =(SMTYPE) (Principal[i] * (INT_MAX >> (8+4)));
+	#endif
+
+		DEB_OUT " %f ", MainAxis[i]);
+	#if DEBUG_FILE
+		if(i%8==7)
+		{
+			DEB_OUT "\n");
+		}
+	#endif
+
+	}
+	DEB_OUT "\nwith EigenValue %f (hex)%x\n\n", MaxVal, FLOAT_AS_INT(MaxVal));
+
+	
+}
+
+
+/*********************************************************/
+/*********************************************************/
+
+
+/*********************************************************/
+/*
+// Shell Sort
+//
+// I was originally using quicksort to sort the vectors along
+// the axis, which was wonderful until it hit a pathological image
+// (pictures of a star field. Most of the image was black). 
+// Quicksort rapidly became VerySlowsort :-(
+//
+//
+// This routine was obtained from the web, and in the process
+// I came up with a new proverb...
+//
+// "Beware not only Greeks bearing gifts, 
+//     but also Pascal programmers bearing C"
+//
+// The original was basing arrays at index 1, which I hadn't
+// initially checked.
+//
+// Equal positions are put in vector index order, so that the result
+// doesn't depend on the order they came in (see USE_RADIX_SORT). (The
+// float compare counts -0 and +0 as equal, but SortAlongAxis never makes
+// a -0: the sums start from +0.)
+//
+*/
+/*********************************************************/
+
+#if !USE_RADIX_SORT || TEST_SORT_ALONG_AXIS
+
+static void shellsort(VECTOR_REF_STRUCT * Partition,
+					  int  NumVectors)
+{
+	int i, j;
+	VECTOR_REF_STRUCT TempVecRef;
+	int StepSize;	
+
+	#if FP_COMPARE_SLOW
 		int CompVal;
 	#endif
 	
@@ -1539,7 +2419,9 @@ static void shellsort(VECTOR_REF_STRUCT * Partition,
 			// other for 0x86s
 			*/
 		#if !FP_COMPARE_SLOW
-         	while ( ( j >= StepSize ) && ( Partition[j - StepSize].d > TempVecRef.d) )
+         	while ( ( j >= StepSize ) && 
+					( ( Partition[j - StepSize].d > TempVecRef.d) ||
+					  ( ( Partition[j - StepSize].d == TempVecRef.d) && ( Partition[j - StepSize].Index > TempVecRef.Index) ) ) )
          	{
             	Partition[j] = Partition[j-StepSize];
             	j -= StepSize;
@@ -1550,37 +2432,19 @@ static void shellsort(VECTOR_REF_STRUCT * Partition,
 			// the horrible version for 0x86's. Pretend floats are ints
 			*******/
 			/*
-			// turn the float value into an "integer"
-			*/
-			CompVal = FLOAT_AS_INT(TempVecRef.d);
-
-			/*
-			// If either of the values being compared are positive (or zero)
-			// then we can use integer compares directly...
-			*/
-			if(CompVal >= 0)
-			{
-         		while ( ( j >= StepSize ) && ( FLOAT_AS_INT(Partition[j - StepSize].d) > CompVal) )
-         		{
-            		Partition[j] = Partition[j-StepSize];
-            		j -= StepSize;
-         		}
-			}
-			/*
-			// BUT if both values are negative, then we'll get it wrong. 
-			// Guarantee we'll be safe by negating both values (i.e. at least one will
-			// now be positive :) ) and reversing the test.
+			// turn the float value into an "integer" that sorts the same way.
+			// (Just negating the negative ones, as this used to, puts them in
+			// the wrong order against each other.)
 			*/
-			else
-			{
-				CompVal = -CompVal;
+			CompVal = FLOAT_SORT_KEY(TempVecRef.d);
 
-		        while ( ( j > StepSize ) && ( -FLOAT_AS_INT(Partition[j - StepSize].d) < CompVal) )
-         		{
-            		Partition[j] = Partition[j-StepSize];
-            		j -= StepSize;
-         		}
-			}
+         	while ( ( j >= StepSize ) && 
+					( ( FLOAT_SORT_KEY(Partition[j - StepSize].d) > CompVal) ||
+					  ( ( FLOAT_SORT_KEY(Partition[j - StepSize].d) == CompVal) && ( Partition[j - StepSize].Index > TempVecRef.Index) ) ) )
+         	{
+            	Partition[j] = Partition[j-StepSize];
+            	j -= StepSize;
+         	}
 		#endif
 
 		/*
@@ -1597,51 +2461,225 @@ static void shellsort(VECTOR_REF_STRUCT * Partition,
    }/*end for h*/	
 }
 
+#endif
 
+#if USE_RADIX_SORT || TEST_SORT_ALONG_AXIS
 
 /*********************************************************/
 /*
-// SortAlongAxis
+// Radix Sort
 //
-// Given the vectors in the partition and the major axis, compute
-// each vectors position along the axis, and then sort them by
-// this value.
+// The positions along the axis are sorted on their bits, 11 at a time,
+// least significant first. Flipping the sign bit of the positive values,
+// and all the bits of the negative ones, makes the unsigned order the same
+// as the float order, so this is exactly the order a comparison sort would
+// give. The sort is stable, so each run of equal positions is then sorted
+// the same way on the vector indices. They're usually only a few long, if
+// there are any at all.
+//
+// It takes three passes over the refs (plus one to count), and the scratch
+// array must be as long as the partition. Any pass where every key has the
+// same digit, e.g. the top one when they're all about the same size, is
+// skipped.
 */
 /*********************************************************/
 
-static void SortAlongAxis(VECTOR_REF_STRUCT * pPartitionStart, 
-						    int NumVectors,
-					const   int NumDims,
-				    const SMTYPE Axis[VECLEN])
+#define RADIX_BITS	  (11)
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES  ((32 + RADIX_BITS - 1) / RADIX_BITS)
+
+static FORCE_INLINE unsigned int RadixKey(float d)
 {
+	unsigned int Bits;
 
-	VECTOR_REF_STRUCT * pRefVec;
-	int i;
-	int j;
+	memcpy(&Bits, &d, sizeof(Bits));
 
-	/*
-	// compute d value
-	*/
-	pRefVec = pPartitionStart;
+	return (Bits & 0x80000000u) ? ~Bits : (Bits | 0x80000000u);
+}
 
 
-	/*
-	// We assume that NumDims is divisible by 4 so that we can unwind the loop
-	*/
-	ASSERT((NumDims & 3)==0);
+/*
+// the key for a pass: the position, or the vector index when sorting a run
+// of equal positions
+*/
+static FORCE_INLINE unsigned int RefSortKey(const VECTOR_REF_STRUCT *pRef, const int bByIndex)
+{
+	return bByIndex ? (unsigned int) pRef->Index : RadixKey(pRef->d);
+}
 
 
-	for(i = NumVectors; i != 0; i--)
-	{
-		float Val;
-		const PIXEL_VECT * pVec;
+static void InsertionSortRefs(VECTOR_REF_STRUCT * Partition,
+							  int NumVectors)
+{
+	int i, j;
+	VECTOR_REF_STRUCT TempVecRef;
+	unsigned int Key, OtherKey;
 
-		pVec = pRefVec->pVec;
+	for(i = 1; i < NumVectors; i++)
+	{
+		TempVecRef = Partition[i];
+		Key = RadixKey(TempVecRef.d);
 
+		for(j = i; j > 0; j--)
+		{
+			OtherKey = RadixKey(Partition[j - 1].d);
 
-		/*
-		// Dot the colour with the vector axis
-		//
+			if((OtherKey < Key) ||
+			   ((OtherKey == Key) && (Partition[j - 1].Index < TempVecRef.Index)))
+			{
+				break;
+			}
+			Partition[j] = Partition[j - 1];
+		}
+		Partition[j] = TempVecRef;
+	}
+}
+
+
+static void RadixSortRefs(VECTOR_REF_STRUCT * Partition,
+						  VECTOR_REF_STRUCT * pScratch,
+						  int NumVectors,
+						  int bByIndex)
+{
+	int Counts[RADIX_PASSES][RADIX_BUCKETS];
+	VECTOR_REF_STRUCT *pSrc, *pDst, *pTmp;
+	unsigned int Key;
+	int i, Pass, Shift, Total, Count, RunEnd;
+
+	/*
+	// (this sorts on both the position and the index, so it does either)
+	*/
+	if(NumVectors < RADIX_SORT_THRESHOLD)
+	{
+		InsertionSortRefs(Partition, NumVectors);
+		return;
+	}
+
+	/*
+	// count the digits for all the passes in one go
+	*/
+	memset(Counts, 0, sizeof(Counts));
+	for(i = 0; i < NumVectors; i++)
+	{
+		Key = RefSortKey(&Partition[i], bByIndex);
+		for(Pass = 0; Pass < RADIX_PASSES; Pass++)
+		{
+			Counts[Pass][(Key >> (Pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+		}
+	}
+
+	pSrc = Partition;
+	pDst = pScratch;
+
+	for(Pass = 0; Pass < RADIX_PASSES; Pass++)
+	{
+		Shift = Pass * RADIX_BITS;
+
+		/*
+		// nothing to do if they've all got the same digit
+		*/
+		if(Counts[Pass][(RefSortKey(&pSrc[0], bByIndex) >> Shift) & (RADIX_BUCKETS - 1)] == NumVectors)
+		{
+			continue;
+		}
+
+		/*
+		// turn the counts into where each digit's refs start
+		*/
+		Total = 0;
+		for(i = 0; i < RADIX_BUCKETS; i++)
+		{
+			Count = Counts[Pass][i];
+			Counts[Pass][i] = Total;
+			Total += Count;
+		}
+
+		for(i = 0; i < NumVectors; i++)
+		{
+			Key = (RefSortKey(&pSrc[i], bByIndex) >> Shift) & (RADIX_BUCKETS - 1);
+			pDst[Counts[Pass][Key]++] = pSrc[i];
+		}
+
+		pTmp = pSrc;
+		pSrc = pDst;
+		pDst = pTmp;
+	}
+
+	if(pSrc != Partition)
+	{
+		memcpy(Partition, pSrc, sizeof(VECTOR_REF_STRUCT) * NumVectors);
+	}
+
+	/*
+	// put any runs of equal positions in index order
+	*/
+	if(!bByIndex)
+	{
+		for(i = 0; i < NumVectors; i = RunEnd)
+		{
+			Key = RadixKey(Partition[i].d);
+			for(RunEnd = i + 1; (RunEnd < NumVectors) && (RadixKey(Partition[RunEnd].d) == Key); RunEnd++)
+			{
+				/*Nothing*/
+			}
+
+			if(RunEnd - i > 1)
+			{
+				RadixSortRefs(Partition + i, pScratch, RunEnd - i, 1);
+			}
+		}
+	}
+}
+
+#endif
+
+
+
+/*********************************************************/
+/*
+// SortAlongAxis
+//
+// Given the vectors in the partition and the major axis, compute
+// each vectors position along the axis, and then sort them by
+// this value.
+*/
+/*********************************************************/
+
+static FORCE_INLINE void SortAlongAxis(const PIXEL_VECT * pVectors,
+						VECTOR_REF_STRUCT * pPartitionStart, 
+						VECTOR_REF_STRUCT * pScratch,
+						    int NumVectors,
+					const   int NumDims,
+				    const SMTYPE Axis[VECLEN])
+{
+
+	VECTOR_REF_STRUCT * pRefVec;
+	int i;
+	int j;
+
+	/*
+	// compute d value
+	*/
+	pRefVec = pPartitionStart;
+
+
+	/*
+	// We assume that NumDims is divisible by 4 so that we can unwind the loop
+	*/
+	ASSERT((NumDims & 3)==0);
+
+
+	for(i = NumVectors; i != 0; i--)
+	{
+		float Val;
+		const PIXEL_VECT * pVec;
+
+		pVec = pVectors + pRefVec->Index;
+
+
+		/*
+		// Dot the colour with the vector axis
+		//
 		// We use a partially unwound version of the loop
 		*/
 		Val = 0.0f;
@@ -1665,9 +2703,14 @@ static void SortAlongAxis(VECTOR_REF_STRUCT * pPartitionStart,
 	// and the run time wasn't O(N log(N)) - more like O(N^2). This was 
 	// bad considering there  were 256K vectors to sort!!
 	//
-	// Shell sort seems to behave more evenly..
+	// Shell sort seems to behave more evenly.. and a radix sort doesn't care
+	// what the values are at all.
 	*/
+#if USE_RADIX_SORT
+	RadixSortRefs(pPartitionStart, pScratch, NumVectors, 0);
+#else
 	shellsort(pPartitionStart, NumVectors);
+#endif
 }
 
 
@@ -1684,7 +2727,8 @@ static void SortAlongAxis(VECTOR_REF_STRUCT * pPartitionStart,
 */
 /*********************************************************/
 
-static void FindPartition(const VECTOR_REF_STRUCT * pPartitionStart, 
+static FORCE_INLINE void FindPartition(const PIXEL_VECT * pVectors,
+		const VECTOR_REF_STRUCT * pPartitionStart, 
 		PARTITION_ENTRY *pOrigPart, 
 		PARTITION_ENTRY *pNewPart,
 		const int 		NumDims, 
@@ -1780,7 +2824,7 @@ static void FindPartition(const VECTOR_REF_STRUCT * pPartitionStart,
 		//
 		// Get easy access to the vector data
 		*/
-		pThisVec = pTmp->pVec;
+		pThisVec = pVectors + pTmp->Index;
 
 		/*
 		// grab the vector's weight
@@ -1861,3105 +2905,7513 @@ static void FindPartition(const VECTOR_REF_STRUCT * pPartitionStart,
 }
 
 
+/*********************************************************/
+/*
+// Fixed size partitioning routines
+//
+// Each of these is a copy of the above with NumDims fixed, so the
+// loops over the vector components have a known length. Opaque RGB
+// only ever looks at 12 components, and YUV at 8.
+*/
+/*********************************************************/
+
+#define DEFINE_QUANTIZER_FUNCS(N)												\
+static int AccumulateCovariance##N(const PIXEL_VECT *pVectors,					\
+								   const VECTOR_REF_STRUCT *pPartitionStart,	\
+								   int NumVectors, DMTYPE Cov[VECLEN][VECLEN],	\
+								   DMTYPE Sum[VECLEN])							\
+{																				\
+	return AccumulateCovariance(pVectors, pPartitionStart, NumVectors, N,		\
+								Cov, Sum);										\
+}																				\
+																				\
+static void GenerateAxis##N(const PIXEL_VECT *pVectors,						\
+							const VECTOR_REF_STRUCT *pPartitionStart,			\
+							int NumVectors,										\
+							ACCUMULATE_COV_FUNC pfnAccumulateCov,				\
+							SMTYPE MainAxis[VECLEN],							\
+							DMTYPE OutSQSums[VECLEN], DMTYPE OutSums[VECLEN],	\
+							int *pOutWeightSum)									\
+{																				\
+	GenerateAxis(pVectors, pPartitionStart, NumVectors, pfnAccumulateCov,		\
+				 MainAxis, N, OutSQSums, OutSums, pOutWeightSum);				\
+}																				\
+																				\
+static void SortAlongAxis##N(const PIXEL_VECT *pVectors,						\
+							 VECTOR_REF_STRUCT *pPartitionStart,				\
+							 VECTOR_REF_STRUCT *pScratch,						\
+							 int NumVectors, const SMTYPE Axis[VECLEN])			\
+{																				\
+	SortAlongAxis(pVectors, pPartitionStart, pScratch, NumVectors, N, Axis);	\
+}																				\
+																				\
+static void FindPartition##N(const PIXEL_VECT *pVectors,						\
+							 const VECTOR_REF_STRUCT *pPartitionStart,			\
+							 PARTITION_ENTRY *pOrigPart,						\
+							 PARTITION_ENTRY *pNewPart,							\
+							 const DMTYPE InSQSums[VECLEN],						\
+							 const DMTYPE InSums[VECLEN],						\
+							 const int WeightSum)								\
+{																				\
+	FindPartition(pVectors, pPartitionStart, pOrigPart, pNewPart, N,			\
+				  InSQSums, InSums, WeightSum);									\
+}
+
+DEFINE_QUANTIZER_FUNCS(16)	/*ARGB*/
+DEFINE_QUANTIZER_FUNCS(12)	/*RGB*/
+DEFINE_QUANTIZER_FUNCS(8)	/*YUV*/
+
+#if AVX_COVARIANCE
+#define DEFINE_AVX_COVARIANCE(N)												\
+__attribute__((target("avx")))													\
+static int AccumulateCovarianceAVX##N(const PIXEL_VECT *pVectors,				\
+									  const VECTOR_REF_STRUCT *pPartitionStart,	\
+									  int NumVectors,							\
+									  DMTYPE Cov[VECLEN][VECLEN],				\
+									  DMTYPE Sum[VECLEN])						\
+{																				\
+	return AccumulateCovarianceAVX(pVectors, pPartitionStart, NumVectors, N,	\
+								   Cov, Sum);									\
+}
+
+DEFINE_AVX_COVARIANCE(16)
+DEFINE_AVX_COVARIANCE(12)
+DEFINE_AVX_COVARIANCE(8)
+#endif
+
 
 /*********************************************************/
 /*
-// FreeSearchTree
+// SelectQuantizerFuncs
 //
-// This just deallocates the "tree" of representative vectors
-// that is used to speed the "nearest"
+// Picks the partitioning routines to match the number of dimensions
+// (see GetNumDims).
 */
 /*********************************************************/
-static void FreeSearchTree(SearchTreeNode * pSearchTree)
+static void SelectQuantizerFuncs(int NumDims, QUANTIZER_FUNCS *pFuncs)
 {
-	if(pSearchTree != NULL)
+#if AVX_COVARIANCE
+	int bAVX;
+
+	__builtin_cpu_init();
+	bAVX = __builtin_cpu_supports("avx");
+#endif
+
+	pFuncs->NumDims = NumDims;
+
+	switch(NumDims)
 	{
-		if(pSearchTree->LeafRepIndex < 0)
+		case 8:
+		{
+			pFuncs->pfnAccumulateCov = AccumulateCovariance8;
+			pFuncs->pfnGenerateAxis  = GenerateAxis8;
+			pFuncs->pfnSortAlongAxis = SortAlongAxis8;
+			pFuncs->pfnFindPartition = FindPartition8;
+			break;
+		}
+		case 12:
+		{
+			pFuncs->pfnAccumulateCov = AccumulateCovariance12;
+			pFuncs->pfnGenerateAxis  = GenerateAxis12;
+			pFuncs->pfnSortAlongAxis = SortAlongAxis12;
+			pFuncs->pfnFindPartition = FindPartition12;
+			break;
+		}
+		default:
 		{
-			FreeSearchTree(pSearchTree->pLess);
-			FreeSearchTree(pSearchTree->pMore);
+			ASSERT(NumDims == 16);
+
+			pFuncs->pfnAccumulateCov = AccumulateCovariance16;
+			pFuncs->pfnGenerateAxis  = GenerateAxis16;
+			pFuncs->pfnSortAlongAxis = SortAlongAxis16;
+			pFuncs->pfnFindPartition = FindPartition16;
+			break;
 		}
-		free(pSearchTree);
+	}/*end switch*/
+
+#if AVX_COVARIANCE
+	if(bAVX)
+	{
+		pFuncs->pfnAccumulateCov = (NumDims == 8)  ? AccumulateCovarianceAVX8 :
+								   (NumDims == 12) ? AccumulateCovarianceAVX12 :
+													 AccumulateCovarianceAVX16;
 	}
+#endif
 }
 
-/*********************************************************/
+
+#if TEST_QUANTIZER_FUNCS
 /*********************************************************/
 /*
-// Basic Vector quantization
-//
-// Given the set of codes, it maps these into perception space and then
-// progressively partitions the original set into smaller sets. The "centre"
-// of each set then becomes a representative.
-//
-// At each iteration the routine:
-// 		*Chooses the partition (i.e. set of vectors) with the greatest error
-//
-//      *Finds the principal axis of the data in the set. This is done
-// 		by computing the principal eigenvector of the covariance matrix
-//		of the vectors in the partition.
-//
-//		*The vectors are then sorted along this axis by taking the dot product of
-//		 each vector and the axis.
-//
-//		*A "locally greedy" algorithm is then used to split the set into two parts
-//		 so that the sum of the errors of these two new partitions is a minimum.
+// TestQuantizerFuncs
 //
-// The function returns the number of reps computed. Occasionally this will
-// be less than the number requested.
+// Runs one split of a largish partition with both the generic and the
+// fixed size routines, for each number of dimensions. Called from
+// CreateVq when TEST_QUANTIZER_FUNCS is set.
 //
-// If it returns VQ_OUTOFMEMORY, then there's been a memory allocation failure.
+// The sort itself is the same either way, so only the axis and
+// partition searches are timed. The generic ones use the scalar
+// covariance code, so this checks the AVX version too.
 */
+/*********************************************************/
 
-static int VectorQuantizer(IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
-				int 	NumMaps,
-				int 	NumRepsRequired,
-				int 	Format,
-				int		bDoingAlpha, 	/*this is for optimisation purposes*/
-				int 	Metric,			/*how to estimate colour differences*/
+#define QUANTIZER_TEST_VECTORS (65536)
+#define QUANTIZER_TEST_PASSES  (8)
 
-	SearchTreeNode 		**ppSearchRoot,
-		PIXEL_VECT 		*pReps,
-				int 	*pVectorCount)
+static void TestQuantizerFuncs(void)
 {
+	static const int DimsList[3] = {8, 12, 16};
+	static const ACCUMULATE_COV_FUNC ScalarCov[3] = {AccumulateCovariance8,
+													 AccumulateCovariance12,
+													 AccumulateCovariance16};
 
-	VECTOR_REF_STRUCT *pSrcVectRefs;
+	static PIXEL_VECT		 Vectors[QUANTIZER_TEST_VECTORS];
+	static VECTOR_REF_STRUCT Refs[QUANTIZER_TEST_VECTORS];
+	static VECTOR_REF_STRUCT Scratch[QUANTIZER_TEST_VECTORS];
 
-	int NumSrcVectors;
+	QUANTIZER_FUNCS Funcs;
+	volatile int GenericDims;
 
-	/*
-	// partition table
-	*/
-	PARTITION_ENTRY Parts[MAX_CODES];
-	int NumPartitions, i, j, k;
-	
-	VECTOR_REF_STRUCT *pPartitionStart, *pTmpVecRef;
+	int d, i, j, Pass, Fixed;
 
-	/*
-	// these are used to identify the next partition to subdivide
-	*/
-	float WorstErrorFound;
-	int   WorstPartition;
+	for(d = 0; d < 3; d++)
+	{
+		SMTYPE MainAxis[2][VECLEN];
+		DMTYPE SQSums[VECLEN], Sums[VECLEN];
+		int WeightSum;
+		int SplitLength[2];
+		double Seconds[2];
 
-	/*
-	// For optimisation purposes, this stores the number of dimensions
-	// we actually need. For full ARGB, we need 16, plain RGB is 12, and
-	// YUV requires 8
-	*/
-	int   NumDims;
+		/*
+		// Make up some test data. The unused components are zero, as they
+		// are in the real thing.
+		*/
+		srand(d + 1);
+		for(i = 0; i < QUANTIZER_TEST_VECTORS; i++)
+		{
+			for(j = 0; j < VECLEN; j++)
+			{
+				Vectors[i].pv[j] = (PV_TYPE) ((j < DimsList[d]) ? (rand() & 255) : 0);
+			}
+			Vectors[i].wc.Weight = 1 + (rand() & 3);
+		}
 
-	/*
-	// For a particular partition, this is the principal axis of the
-	// the data set (ie. it's sort of the longest axis through the data)
-	*/
-	SMTYPE MainAxis[VECLEN];
+		SelectQuantizerFuncs(DimsList[d], &Funcs);
+		GenericDims = DimsList[d];
 
-	DMTYPE SQSums[VECLEN], Sums[VECLEN];
-	int WeightSum;
+		for(Fixed = 0; Fixed < 2; Fixed++)
+		{
+			clock_t Ticks = 0;
 
-	SearchTreeNode *pLess, *pMore;
+			for(Pass = 0; Pass < QUANTIZER_TEST_PASSES; Pass++)
+			{
+				PARTITION_ENTRY Orig, New;
+				clock_t Start;
 
+				for(i = 0; i < QUANTIZER_TEST_VECTORS; i++)
+				{
+					Refs[i].Index = i;
+				}
+				Orig.Start	= 0;
+				Orig.Length = QUANTIZER_TEST_VECTORS;
 
-	/*
-	// some minor checks
-	*/
-	ASSERT(NumRepsRequired <= MAX_CODES);
+				if(Fixed)
+				{
+					Start = clock();
+					Funcs.pfnGenerateAxis(Vectors, Refs, QUANTIZER_TEST_VECTORS, Funcs.pfnAccumulateCov, MainAxis[Fixed], SQSums, Sums, &WeightSum);
+					Ticks += clock() - Start;
 
-	/*
-	// compute the number of vectors
-	*/
-	NumSrcVectors = 0;
-	for(k = 0; k < NumMaps; k++)
-	{
-		NumSrcVectors += (Maps[k]->xVDim * Maps[k]->yVDim);
+					Funcs.pfnSortAlongAxis(Vectors, Refs, Scratch, QUANTIZER_TEST_VECTORS, MainAxis[Fixed]);
+
+					Start = clock();
+					Funcs.pfnFindPartition(Vectors, Refs, &Orig, &New, SQSums, Sums, WeightSum);
+					Ticks += clock() - Start;
+				}
+				else
+				{
+					Start = clock();
+					GenerateAxis(Vectors, Refs, QUANTIZER_TEST_VECTORS, ScalarCov[d], MainAxis[Fixed], GenericDims, SQSums, Sums, &WeightSum);
+					Ticks += clock() - Start;
+
+					SortAlongAxis(Vectors, Refs, Scratch, QUANTIZER_TEST_VECTORS, GenericDims, MainAxis[Fixed]);
+
+					Start = clock();
+					FindPartition(Vectors, Refs, &Orig, &New, GenericDims, SQSums, Sums, WeightSum);
+					Ticks += clock() - Start;
+				}
+				SplitLength[Fixed] = Orig.Length;
+			}
+
+			Seconds[Fixed] = (double) Ticks / CLOCKS_PER_SEC;
+		}
+
+		DEB_OUT "Quantizer NumDims %2d: %s, generic %.2f ms, fixed %.2f ms per split of %d vectors\n",
+			DimsList[d],
+			((SplitLength[0] == SplitLength[1]) &&
+			 !memcmp(MainAxis[0], MainAxis[1], sizeof(SMTYPE) * DimsList[d])) ? "ok" : "FAILED",
+			Seconds[0] * 1000.0 / QUANTIZER_TEST_PASSES,
+			Seconds[1] * 1000.0 / QUANTIZER_TEST_PASSES,
+			QUANTIZER_TEST_VECTORS);
 	}
-	*pVectorCount = NumSrcVectors;
+}
+#endif /*TEST_QUANTIZER_FUNCS*/
 
 
-	/*
-	// Allocate the array that points to all the source
-	// vectors
-	*/
-	pSrcVectRefs = malloc(sizeof(VECTOR_REF_STRUCT) * NumSrcVectors);
+#if TEST_SORT_ALONG_AXIS
+/*********************************************************/
+/*
+// TestSortAlongAxis
+//
+// Sorts made up positions with the shell sort and the radix sort, and
+// checks each comes out in order and still has every ref, and that they
+// both give exactly the same refs. The positions are mostly either side of
+// zero (including -0), as they are when the axis goes through the middle
+// of a partition, with lots of ties. Called from CreateVq when
+// TEST_SORT_ALONG_AXIS is set.
+*/
+/*********************************************************/
 
-	/*
-	// if this fails, abort out of here
-	*/
-	if(pSrcVectRefs == NULL)
+#define SORT_TEST_VECTORS (65536)
+
+static int CheckSortedRefs(const VECTOR_REF_STRUCT *pRefs, int NumVectors)
+{
+	static unsigned char Seen[SORT_TEST_VECTORS];
+	int i;
+
+	memset(Seen, 0, NumVectors);
+	for(i = 0; i < NumVectors; i++)
 	{
-		return VQ_OUTOFMEMORY;
+		if((pRefs[i].Index < 0) || (pRefs[i].Index >= NumVectors) || Seen[pRefs[i].Index])
+		{
+			return 0;
+		}
+		Seen[pRefs[i].Index] = 1;
+
+		if((i > 0) && ((RadixKey(pRefs[i - 1].d) > RadixKey(pRefs[i].d)) ||
+					   ((RadixKey(pRefs[i - 1].d) == RadixKey(pRefs[i].d)) && (pRefs[i - 1].Index > pRefs[i].Index))))
+		{
+			return 0;
+		}
 	}
 
+	return 1;
+}
 
-	pTmpVecRef = pSrcVectRefs;
-	/*
-	// set up the pointers to the vectors. We need to sort the data - it's
-	// easier to just move "pointers" around.
-	*/
-	for(k = 0; k < NumMaps; k++)
+static void TestSortAlongAxis(void)
+{
+	static const int Lengths[5] = {5, 63, 64, 1000, SORT_TEST_VECTORS};
+
+	static VECTOR_REF_STRUCT Refs[2][SORT_TEST_VECTORS];
+	static VECTOR_REF_STRUCT Scratch[SORT_TEST_VECTORS];
+
+	int Case, l, i, NumVectors;
+	int ShellOK, RadixOK, SameOK;
+
+	srand(1);
+	for(Case = 0; Case < 4; Case++)
 	{
-		for(i=0; i < Maps[k]->yVDim; i++)
+		ShellOK = RadixOK = SameOK = 1;
+
+		for(l = 0; l < 5; l++)
 		{
-			for(j=0; j < Maps[k]->xVDim; j++)
+			NumVectors = Lengths[l];
+
+			for(i = 0; i < NumVectors; i++)
 			{
-				pTmpVecRef->pVec = & Maps[k]->Rows[i][j];
-				pTmpVecRef ++;
-			}
-		}
-	} 
+				float d;
 
-	/*
-	// map all the colours into the perception space.
-	//
-	// **NOTE** for RGB{A} textures we reorder the vector components 
-	// so that alpha is placed at the end. This is for the situations
-	// where alpha is always opaque, which means we can save quite a
-	// number of calculations.
-	//
-	// Similarly YUV only uses the first 8 components.
-	*/
-	pTmpVecRef = pSrcVectRefs;
-
-	
-	for(i = NumSrcVectors; i > 0; i--)
-	{
-		PIXEL_VECT *pVec;
+				switch(Case)
+				{
+				case 0: /*anywhere*/
+					d = (float) (rand() - RAND_MAX / 2) / 1000.0f;
+					break;
+				case 1: /*all negative*/
+					d = -1.0f - (float) rand() / 1000.0f;
+					break;
+				case 2: /*close to zero, some of them exactly*/
+					d = (float) ((rand() & 255) - 128) * 1.0e-6f;
+					if((rand() & 15) == 0)
+					{
+						d = (rand() & 1) ? 0.0f : -0.0f;
+					}
+					break;
+				default: /*lots of ties*/
+					d = (float) ((rand() & 15) - 8);
+					break;
+				}
 
-		pVec = pTmpVecRef->pVec;
+				Refs[0][i].Index = i;
+				Refs[0][i].d	 = d;
+			}
+			memcpy(Refs[1], Refs[0], sizeof(VECTOR_REF_STRUCT) * NumVectors);
 
-		RawToPerceptionSpace(Metric, pVec->v, pVec->pv); 
+			shellsort(Refs[0], NumVectors);
+			RadixSortRefs(Refs[1], Scratch, NumVectors, 0);
 
-		pTmpVecRef++;
-	}/*end for i*/
+			ShellOK &= CheckSortedRefs(Refs[0], NumVectors);
+			RadixOK &= CheckSortedRefs(Refs[1], NumVectors);
+			SameOK	&= !memcmp(Refs[0], Refs[1], sizeof(VECTOR_REF_STRUCT) * NumVectors);
+		}
 
+		DEB_OUT "Sort test %d: shell sort %s, radix sort %s, same refs %s\n", Case,
+			ShellOK ? "ok" : "FAILED", RadixOK ? "ok" : "FAILED", SameOK ? "ok" : "FAILED");
+	}
+}
+#endif /*TEST_SORT_ALONG_AXIS*/
 
-	/*
-	// Create the root of the search tree we will use later
-	*/
-	*ppSearchRoot = NEW(SearchTreeNode);
 
-	/*
-	// If this fails, get out of here
-	*/
-	if(ppSearchRoot == NULL)
-	{
-		/*
-		// Clean up our other allocation
-		*/
-		free(pSrcVectRefs);
-		return VQ_OUTOFMEMORY;
-	}
-	
-	ppSearchRoot[0]->LeafRepIndex = 0; /*a safety precaution only*/
 
-	/*
-	// determine the number of dimensions we need to process
-	// Note that the routines that use this value have been coded
-	// such that they assume NumDims is divisible by 4.
-	*/
+/*
+// Work out how many of the vector components we actually need. The ones we
+// don't (alpha for RGB, and the gaps in the packed YUV data) are the same in
+// every image vector and rep, so they can be skipped.
+*/
+static int GetNumDims(int Format, int bDoingAlpha)
+{
 	if(bDoingAlpha)
 	{
-		NumDims = 16; /*i.e. full VECLEN*/
+		return 16; /*i.e. full VECLEN*/
 	}
 	else if(Format == FORMAT_YUV)
 	{
-		NumDims = 8; /*4 Y's, 2U's, and 2V's*/
+		return 8; /*4 Y's, 2U's, and 2V's*/
 	}
 	else
 	{
-		NumDims = 12; /*4 x RGB*/
+		return 12; /*4 x RGB*/
 	}
-	
+}
 
-	/*
-	// Set the initial partition to be all the colours
-	*/
-	NumPartitions = 1;
-	Parts[0].Start  = 0;
-	Parts[0].Length = NumSrcVectors;
+/*
+// The context's working memory (see VQ_ARENA). Memory from
+// AllocateFromArena lasts until the arena is reset, at the start of the
+// next job, or until it's released back to a mark taken before it was
+// allocated.
+*/
+static void InitArena(VQ_ARENA *pArena)
+{
+	pArena->pBlock			= NULL;
+	pArena->BlockSize		= 0;
+	pArena->Used			= 0;
+	pArena->pExtras			= NULL;
+	pArena->ExtraSize		= 0;
+	pArena->Peak			= 0;
+	pArena->NumAllocs		= 0;
+	pArena->NumSystemAllocs = 0;
+}
 
-	Parts[0].Error  = 1.0f; /*This value doesn't really matter for the first one*/
-	
-	Parts[0].pThisNode = *ppSearchRoot;
+/*
+// Frees the extra blocks allocated since pKeep was the newest one (all of
+// them if it's NULL)
+*/
+static void FreeArenaExtras(VQ_ARENA *pArena, ARENA_EXTRA *pKeep, size_t KeepSize)
+{
+	ARENA_EXTRA *pExtra, *pNext;
 
-	/*
-	// Initialise Worst partition: this is to stop compiler warnings, and to trap errors
-	*/
-	WorstPartition = INT_MIN;
+	for(pExtra = pArena->pExtras; pExtra != pKeep; pExtra = pNext)
+	{
+		pNext = pExtra->pNext;
+		free(pExtra);
+	}
+	pArena->pExtras	  = pKeep;
+	pArena->ExtraSize = KeepSize;
+}
+
+static void FreeArena(VQ_ARENA *pArena)
+{
+	FreeArenaExtras(pArena, NULL, 0);
+	free(pArena->pBlock);
+	InitArena(pArena);
+}
+
+static void ResetArena(VQ_ARENA *pArena)
+{
+	size_t Size;
+
+	FreeArenaExtras(pArena, NULL, 0);
+	pArena->NumAllocs		= 0;
+	pArena->NumSystemAllocs = 0;
 
 	/*
-	// Keep iterating until we have created as many partitions as the number
-	// of reps we require.. (unless the image is very simple: see later)
+	// If the last job didn't fit in the block, get one it would have
 	*/
-	while(NumPartitions < NumRepsRequired)
+	if(pArena->Peak > pArena->BlockSize)
 	{
+		Size = (pArena->Peak + ARENA_ROUNDING - 1) & ~(size_t) (ARENA_ROUNDING - 1);
 
-		DEB_OUT "%d\n", NumPartitions);
+		free(pArena->pBlock);
+		pArena->pBlock	  = malloc(Size);
+		pArena->BlockSize = (pArena->pBlock != NULL) ? Size : 0;
+		pArena->NumSystemAllocs++;
+	}
 
-		/*
-		// find the worst 'scoring' partition
-		*/
-		WorstErrorFound = -1.0f; /*errors can't be negative*/
+	pArena->Used = 0;
+	pArena->Peak = 0;
+}
 
-		for(i = 0; i < NumPartitions; i++)
-		{
-			if(WorstErrorFound < Parts[i].Error)
-			{
-				WorstErrorFound = Parts[i].Error;
-				WorstPartition  = i;
-			} 
+/*
+// Returns NULL if it runs out of memory
+*/
+static void *AllocateFromArena(VQ_ARENA *pArena, size_t Size)
+{
+	void *pMem;
+	ARENA_EXTRA *pExtra;
 
-		}/*end for*/
-		
+	Size = (Size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	pArena->NumAllocs++;
 
-		/*
-		// if we've mapped everything exactly, then stop trying to split
-		// partitions...
-		*/
-		if(WorstErrorFound == 0.0f)
+	if(Size <= pArena->BlockSize - pArena->Used)
+	{
+		pMem = pArena->pBlock + pArena->Used;
+		pArena->Used += Size;
+	}
+	else
+	{
+		pExtra = malloc(ARENA_EXTRA_HEADER + Size);
+		pArena->NumSystemAllocs++;
+		if(pExtra == NULL)
 		{
-			break;
+			return NULL;
 		}
 
-		DEB_OUT "Worst Part:%d Error:%f\n", WorstPartition, Parts[WorstPartition].Error);
-		DEB_OUT "   Start:%d  Length %d\n", Parts[WorstPartition].Start, Parts[WorstPartition].Length);
+		pExtra->pNext	   = pArena->pExtras;
+		pArena->pExtras	   = pExtra;
+		pArena->ExtraSize += Size;
 
-		/*
-		// Allocate children for the current search node
-		//
-		*/
-		pLess =	NEW(SearchTreeNode);
-		pMore = NEW(SearchTreeNode);
+		pMem = (unsigned char *) pExtra + ARENA_EXTRA_HEADER;
+	}
 
-		/*
-		// If we have exhausted the memory, then exit. The tree clean up code should
-		// cope with this case, so we only need to free the vector list memory and the
-		// either of the nodes that we didn't link in.
-		*/
-		if((pLess == NULL) || (pMore == NULL))
-		{
+	if(pArena->Used + pArena->ExtraSize > pArena->Peak)
+	{
+		pArena->Peak = pArena->Used + pArena->ExtraSize;
+	}
 
-			DEB_OUT "Out of mem at partition:%d\n", NumPartitions);
+	return pMem;
+}
 
-			if(pLess)
-			{
-				free(pLess);
-			}
-			if(pMore)
-			{
-				free(pMore);
-			}
-			/*
-			// Clean up our other allocation
-			*/
-			free(pSrcVectRefs);
+/*
+// Anything allocated since the mark was taken can be given back with
+// ReleaseArenaToMark
+*/
+static ARENA_MARK MarkArena(const VQ_ARENA *pArena)
+{
+	ARENA_MARK Mark;
 
-			return VQ_OUTOFMEMORY;
-		}
+	Mark.Used	   = pArena->Used;
+	Mark.pExtras   = pArena->pExtras;
+	Mark.ExtraSize = pArena->ExtraSize;
 
+	return Mark;
+}
 
-		/*
-		// just in case we run out of memory in the future, initialise enough
-		// of the nodes so that the cleanup deallocation routine won't
-		// choke.
-		*/
-		pLess->LeafRepIndex = 0;
-		pMore->LeafRepIndex = 0;
+static void ReleaseArenaToMark(VQ_ARENA *pArena, const ARENA_MARK *pMark)
+{
+	ASSERT(pMark->Used <= pArena->Used)
 
-		/*
-		// Connect the nodes into the tree
-		*/
-		Parts[WorstPartition].pThisNode->pLess = pLess;
-		Parts[WorstPartition].pThisNode->pMore = pMore;
+	FreeArenaExtras(pArena, pMark->pExtras, pMark->ExtraSize);
+	pArena->Used = pMark->Used;
+}
 
-		Parts[WorstPartition].pThisNode->LeafRepIndex = -1; /*mark that it's not a leaf*/
+/*
+// Picks the vectors to train on: one from each run of Subsample vectors (a
+// shorter one at the end). It's random, but with a fixed seed, so the
+// output is repeatable. The vectors must be asked about in order.
+*/
+typedef struct
+{
+	unsigned int Seed;
+	int Subsample;
+	int NumVectors;
+	int Pick;
+}SUBSAMPLE_STATE;
 
-		/*
-		// put the node pointers into the child partitions, 
-		// the More/Less bit doesn't matter at the moment
-		*/
-		Parts[NumPartitions].pThisNode  = pLess;
-		Parts[WorstPartition].pThisNode = pMore;
+static void InitSubsample(SUBSAMPLE_STATE *pState, int Subsample, int NumVectors)
+{
+	pState->Seed	   = 12345;
+	pState->Subsample  = Subsample;
+	pState->NumVectors = NumVectors;
+	pState->Pick	   = 0;
+}
 
-		/*
-		// generate the principal axis for the partition
-		*/
-		pPartitionStart = pSrcVectRefs + Parts[WorstPartition].Start;
-		
-		GenerateAxis(pPartitionStart,  Parts[WorstPartition].Length,
-						MainAxis,
-						NumDims,
-						SQSums, 
-						Sums, 
-						&WeightSum);
+static int IsTrainingVector(SUBSAMPLE_STATE *pState, int i)
+{
+	int RunStart, RunLength;
 
-		/*
-		// sort the vectors along the principal axis
-		*/
-		SortAlongAxis(pPartitionStart, Parts[WorstPartition].Length, NumDims, MainAxis);
-		 
-		/*
-		// Find the "best" partitioning point
-		*/
-		FindPartition(pPartitionStart, &Parts[WorstPartition], &Parts[NumPartitions], 
-						NumDims, SQSums, Sums, WeightSum);
+	if(pState->Subsample <= 1)
+	{
+		return 1;
+	}
 
-		NumPartitions++;	
-	}/*end while*/
+	RunStart = i - (i % pState->Subsample);
+
+	if(i == RunStart)
+	{
+		RunLength = MIN(pState->Subsample, pState->NumVectors - RunStart);
+
+		pState->Seed = pState->Seed * 1103515245 + 12345;
+		pState->Pick = RunStart + (int) ((pState->Seed >> 16) % RunLength);
+	}
+
+	return (i == pState->Pick);
+}
+
+
+#if MERGE_DUPLICATE_VECTORS
+/*
+// Hash of a vector's (raw) components
+*/
+static unsigned int HashVector(const U8 v[VECLEN])
+{
+	unsigned long long a, b;
+
+	ASSERT(VECLEN == 16)
+
+	memcpy(&a, v,	  sizeof(a));
+	memcpy(&b, v + 8, sizeof(b));
 
+	a = (a ^ (b * 0x9E3779B97F4A7C15ull)) * 0xC2B2AE3D27D4EB4Full;
 
+	return (unsigned int) (a >> 32);
+}
+
+/*
+// Finds the identical vectors amongst the first NumToMerge of the image
+// vectors. The first of each set of copies gets the total weight of the
+// copies chosen for training (see IsTrainingVector), and a reference in
+// pRefs if there are any. Only the vectors from FirstTraining on can be
+// chosen. The vectors from NumToMerge to NumVectors are left alone, but are
+// always trained on. Returns the number of references, or VQ_OUTOFMEMORY.
+*/
+static int MergeDuplicateVectors(VQ_CONTEXT *pContext,
+								 PIXEL_VECT *pVectors,
+								 int NumVectors,
+								 int NumToMerge,
+								 int FirstTraining,
+								 int Subsample,
+						  VECTOR_REF_STRUCT *pRefs)
+{
+	int i, NumRefs, NumUnique;
+	int TableSize;
+	unsigned int TableMask;
+	ARENA_MARK TableMark;
+
+	int *pFirstCopy, *pNumCopies, *pTable;
+	SUBSAMPLE_STATE Sampler;
 
 	/*
-	// generate the representative for each partition
+	// Get the arrays. The hash table is kept at most half full, and is only
+	// needed in here.
 	*/
-	for(i = 0; i < NumPartitions; i++)
+	TableSize = 1;
+	while(TableSize < 2 * NumToMerge)
 	{
-		int Sum[VECLEN]; /*Sum of all values in a partition*/
+		TableSize <<= 1;
+	}
 
-		for(k = 0; k < VECLEN; k++)
-		{
-			Sum[k] = 0;
-		}
+	pContext->pFirstCopy = AllocateFromArena(&pContext->Arena, sizeof(int) * NumVectors);
+	pContext->pNumCopies = AllocateFromArena(&pContext->Arena, sizeof(int) * NumVectors);
+	pContext->pDistances = AllocateFromArena(&pContext->Arena, sizeof(int) * NumVectors);
 
+	TableMark = MarkArena(&pContext->Arena);
+	pTable	  = AllocateFromArena(&pContext->Arena, sizeof(int) * TableSize);
 
-		/*
-		// step through all the vectors in this partition
-		*/
-		pPartitionStart = pSrcVectRefs + Parts[i].Start;
+	if((pContext->pFirstCopy == NULL) || (pContext->pNumCopies == NULL) ||
+	   (pContext->pDistances == NULL) || (pTable == NULL))
+	{
+		return VQ_OUTOFMEMORY;
+	}
+
+	pFirstCopy = pContext->pFirstCopy;
+	pNumCopies = pContext->pNumCopies;
+	TableMask  = TableSize - 1;
+
+	for(i = 0; i < TableSize; i++)
+	{
+		pTable[i] = -1;
+	}
+
+	/*
+	// Look each vector up in the table. If it's not there, it's the first of
+	// its kind, otherwise add it to the first one. A first one that isn't
+	// trained on has a zero weight until one of its copies is.
+	*/
+	InitSubsample(&Sampler, Subsample, NumToMerge - FirstTraining);
 
-		for(j = Parts[i].Length; j > 0; j--)
+	NumRefs	  = 0;
+	NumUnique = 0;
+	for(i = 0; i < NumToMerge; i++)
+	{
+		PIXEL_VECT *pVec;
+		unsigned int Slot;
+		int bTrain;
+
+		pVec   = pVectors + i;
+		Slot   = HashVector(pVec->v) & TableMask;
+		bTrain = (i >= FirstTraining) && IsTrainingVector(&Sampler, i - FirstTraining);
+
+		while((pTable[Slot] >= 0) &&
+			  memcmp(pVectors[pTable[Slot]].v, pVec->v, VECLEN) != 0)
 		{
-			PIXEL_VECT *pVec;
+			Slot = (Slot + 1) & TableMask;
+		}
 
-			pVec = pPartitionStart->pVec;
+		if(pTable[Slot] < 0)
+		{
+			pTable[Slot]  = i;
+			pFirstCopy[i] = i;
+			pNumCopies[i] = 1;
+			NumUnique++;
 
-			for(k = 0; k < VECLEN; k++)
+			if(bTrain)
 			{
-				Sum[k] += pVec->v[k];
+				pRefs[NumRefs++].Index = i;
+			}
+			else
+			{
+				pVec->wc.Weight = 0;
 			}
-
-			pPartitionStart ++;
 		}
+		else
+		{
+			int First;
 
-		/*
-		// convert the Sum of values into a representative
-		*/
-		SumToRep(Sum, Parts[i].Length, Format, pReps+i);
+			First = pTable[Slot];
 
-		/*
-		// Set the search node to be a leaf
-		*/
-		Parts[i].pThisNode->LeafRepIndex = i;
-	}/*end for i*/
+			pFirstCopy[i] = First;
+			pNumCopies[First]++;
 
+			if(bTrain)
+			{
+				if(pVectors[First].wc.Weight == 0)
+				{
+					pRefs[NumRefs++].Index = First;
+				}
+				pVectors[First].wc.Weight += pVec->wc.Weight;
+			}
+		}
+	}/*end for i*/
 
 	/*
-	// tidy up the "internal only" allocations
+	// and the ones we don't merge
 	*/
-	free(pSrcVectRefs);
-
+	for(/*nil*/; i < NumVectors; i++)
+	{
+		pFirstCopy[i] = i;
+		pNumCopies[i] = 1;
+		NumUnique++;
 
-	return NumPartitions;
-}
+		pRefs[NumRefs++].Index = i;
+	}
 
+	/*
+	// the hash table's done with
+	*/
+	ReleaseArenaToMark(&pContext->Arena, &TableMark);
 
-/******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
-/*
-//  Vector Assignment and Dithering Code
-*/
-/******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
+	pContext->NumMergedVectors = NumToMerge;
+	pContext->NumUniqueVectors = NumUnique;
 
-/*
-// Debug statistics
-*/
-#if GATHER_STATS
-	int NumDistanceCalcs;
-	int SetupCalcs;
+	return NumRefs;
+}
 #endif
 
-/*********************************************************/
-/*********************************************************/
-
 
 
 /*********************************************************/
 /*
+// Partition queue
 //
-// Build Search Tree
-// Complete the building of the search tree, by adding splitting
-// planes etc.
-//
+// The partitions that could still be split are kept in a heap, worst (i.e.
+// highest error) first. Of two with the same error, the one with the lower
+// index comes out first, as it did when we simply searched them in order.
 */
 /*********************************************************/
+typedef struct
+{
+	const PARTITION_ENTRY *pParts;
+	int Heap[MAX_CODES];
+	int Size;
+}PARTITION_QUEUE;
 
-static void RecursiveBuildSearchTree(const PIXEL_VECT *pRepVectors,
-							SearchTreeNode *pTree, 
-										int TreeAverage[VECLEN])
+static FORCE_INLINE int IsWorsePartition(const PARTITION_ENTRY *pParts, int A, int B)
 {
-	int Child1Av[VECLEN], Child2Av[VECLEN];
-	int C1Dot, C2Dot;
-	int i;
+	return (pParts[A].Error > pParts[B].Error) ||
+		   ((pParts[A].Error == pParts[B].Error) && (A < B));
+}
 
-	/*
-	// if this node is a child, simply return it's value as the average
-	*/
-	if(pTree->LeafRepIndex >= 0)
-	{
-		/*
-		// sanity check
-		*/
-		ASSERT(pTree->LeafRepIndex < MAX_CODES)
+static void PushPartition(PARTITION_QUEUE *pQueue, int Part)
+{
+	int i, Parent;
 
-		/*
-		// get access to the rep
-		*/
-		pRepVectors += pTree->LeafRepIndex;
-		for(i=0; i < VECLEN; i++)
+	ASSERT(pQueue->Size < MAX_CODES)
+
+	for(i = pQueue->Size++; i > 0; i = Parent)
+	{
+		Parent = (i - 1) / 2;
+		if(!IsWorsePartition(pQueue->pParts, Part, pQueue->Heap[Parent]))
 		{
-			TreeAverage[i] = pRepVectors->v[i];	
+			break;
 		}
-
+		pQueue->Heap[i] = pQueue->Heap[Parent];
 	}
-	else
-	{
-		/*
-		// check that it's initialised to the correct value
-		*/
-		ASSERT(pTree->LeafRepIndex == -1)
+	pQueue->Heap[i] = Part;
+}
 
-		/*
-		// process the children
-		*/
-		RecursiveBuildSearchTree(pRepVectors,
-									pTree->pLess, 
-									Child1Av);
+static int PopPartition(PARTITION_QUEUE *pQueue)
+{
+	int Worst, Last, i, Child;
 
-		RecursiveBuildSearchTree(pRepVectors,
-									pTree->pMore, 
-									Child2Av);
+	ASSERT(pQueue->Size > 0)
 
-		/*
-		// Compute the average for the parent, and the difference for
-		// the splitting axis, and the dot products
-		*/
-		C1Dot = 0;
-		C2Dot = 0;
+	Worst = pQueue->Heap[0];
+	Last  = pQueue->Heap[--pQueue->Size];
 
-		for(i=0; i < VECLEN; i++)
+	for(i = 0; (Child = 2 * i + 1) < pQueue->Size; i = Child)
+	{
+		if((Child + 1 < pQueue->Size) &&
+		   IsWorsePartition(pQueue->pParts, pQueue->Heap[Child + 1], pQueue->Heap[Child]))
 		{
-			/*
-			// average with rounding -- actually I think the rounding should
-			// alternate... Hmmm. I'll have to think about this.
-			*/
-			TreeAverage[i] = (Child1Av[i] + Child2Av[i] + 1) >> 1;
-
-			/*
-			// Compute the difference vector
-			*/
-			pTree->SplittingAxis[i] = Child1Av[i] - Child2Av[i];
-
-			/*
-			// And the dot products
-			*/
-			C1Dot += Child1Av[i] * pTree->SplittingAxis[i];
-			C2Dot += Child2Av[i] * pTree->SplittingAxis[i]; 
-		}/*end for*/
-
-
-
-#if GATHER_STATS
-	SetupCalcs += 2; /*this is about equivalent to 2 distance calcs*/
-#endif
-
-		/*
-		// If we've got these the wrong way around, swap them
-		*/
-		if(C1Dot > C2Dot)
+			Child++;
+		}
+		if(!IsWorsePartition(pQueue->pParts, pQueue->Heap[Child], Last))
 		{
-			SearchTreeNode *pTmp;
-			
-			pTmp = pTree->pLess;
-			pTree->pLess = pTree->pMore;
-			pTree->pMore = pTmp;
+			break;
 		}
+		pQueue->Heap[i] = pQueue->Heap[Child];
+	}
+	pQueue->Heap[i] = Last;
 
-		/*
-		// get the split value
-		*/
-		pTree->d = (C1Dot + C2Dot) / 2;
-	}/*end if leaf/parent*/
-
-}/*end function*/
-
-
-
+	return Worst;
+}
 
 
+/*********************************************************/
 /*
-// For convience, put a wrapper around the recursive routine
+// Split Partitions
+//
+// Works out how to split a partition: its axis, the order of its vectors
+// along it, and where to cut them. The result only depends on the vectors
+// in the partition, and only touches its own stretch of the refs (and of
+// the sort's scratch array), so any number of partitions can be split at
+// the same time, and before they come to the top of the queue. The split
+// is kept in a PARTITION_SPLIT until the VectorQuantizer gets round to it,
+// which means it makes exactly the same splits in the same order however
+// many threads there are.
 */
-static void BuildSearchTree(const PIXEL_VECT *pRepVectors, 
-										SearchTreeNode *pTree)
+/*********************************************************/
+typedef struct
 {
+	PARTITION_ENTRY Less, More;	/*what the partition becomes, and the new one*/
+	int bReady;
+}PARTITION_SPLIT;
+
+static void SplitPartition(const QUANTIZER_FUNCS *pFuncs,
+						   const PIXEL_VECT *pVectors,
+						   VECTOR_REF_STRUCT *pRefs,
+						   VECTOR_REF_STRUCT *pScratch,
+						   const PARTITION_ENTRY *pPart,
+						   PARTITION_SPLIT *pSplit)
+{
+	VECTOR_REF_STRUCT *pPartitionStart;
 
-	int Dummy[VECLEN];
-
-#if GATHER_STATS
-	NumDistanceCalcs = 0;
-	SetupCalcs = 0;
-#endif
 	/*
-	// call the recursive routine
+	// For a particular partition, this is the principal axis of the
+	// the data set (ie. it's sort of the longest axis through the data)
 	*/
-	RecursiveBuildSearchTree(pRepVectors, pTree, Dummy);
-}
-
-
+	SMTYPE MainAxis[VECLEN];
 
-/*********************************************************
-* Build an NxN List of nearest Neighbours.
-*********************************************************/
+	DMTYPE SQSums[VECLEN], Sums[VECLEN];
+	int WeightSum;
 
-typedef struct
-{
-	int OtherRep;
-	int Distance;
-}NeighbInfo;
+	/*
+	// generate the principal axis for the partition
+	*/
+	pPartitionStart = pRefs + pPart->Start;
 
-static NeighbInfo NeighbourArray[MAX_CODES][MAX_CODES - 1];
+	pFuncs->pfnGenerateAxis(pVectors, pPartitionStart, pPart->Length,
+					pFuncs->pfnAccumulateCov,
+					MainAxis,
+					SQSums,
+					Sums,
+					&WeightSum);
 
+	/*
+	// sort the vectors along the principal axis
+	*/
+	pFuncs->pfnSortAlongAxis(pVectors, pPartitionStart, pScratch + pPart->Start,
+					pPart->Length, MainAxis);
 
+	/*
+	// Find the "best" partitioning point
+	*/
+	pSplit->Less = *pPart;
+	pFuncs->pfnFindPartition(pVectors, pPartitionStart, &pSplit->Less, &pSplit->More,
+					SQSums, Sums, WeightSum);
 
+	pSplit->bReady = 1;
+}
 
-/*********/
 
-static int NeighComp(const void *pA, const void *pB)
+#if MULTI_THREADED
+/*
+// The partitions are handed out to the threads in order, worst first, each
+// thread taking the next one as soon as it's finished its last.
+*/
+typedef struct
 {
-	const NeighbInfo *pN1, *pN2;
-
-	pN1 = pA;
-	pN2 = pB;
+	const QUANTIZER_FUNCS *pFuncs;
+	const PIXEL_VECT *pVectors;
+	VECTOR_REF_STRUCT *pRefs;
+	VECTOR_REF_STRUCT *pScratch;
+	const PARTITION_ENTRY *pParts;
+	PARTITION_SPLIT *pSplits;
+
+	const int *pBatch;
+	int BatchSize;
+	atomic_int NextSplit;
+}SPLIT_JOB;
+
+static int SplitPartitionsThread(void *pArg)
+{
+	SPLIT_JOB *pJob = (SPLIT_JOB *) pArg;
+	int i, Part;
 
-	if(pN1->Distance > pN2->Distance)
-	{
-		return 1;
-	}
-	else if(pN1->Distance < pN2->Distance)
-	{
-		return -1;
-	}
-	else
+	while((i = atomic_fetch_add(&pJob->NextSplit, 1)) < pJob->BatchSize)
 	{
-		return 0;
+		Part = pJob->pBatch[i];
+
+		SplitPartition(pJob->pFuncs, pJob->pVectors, pJob->pRefs, pJob->pScratch,
+					   &pJob->pParts[Part], &pJob->pSplits[Part]);
 	}
 
+	return 0;
 }
+#endif
 
 
-static void	BuildNeighbourList(const PIXEL_VECT *pRepVectors,
-								int NumReps)
+/*
+// Split the worst partition, which has just come off the queue, and if
+// there's more than one thread, the next worst ones that haven't been split
+// yet too. Never more than NumSplitsLeft altogether.
+*/
+static void SplitPartitions(const QUANTIZER_FUNCS *pFuncs,
+							const PIXEL_VECT *pVectors,
+							VECTOR_REF_STRUCT *pRefs,
+							VECTOR_REF_STRUCT *pScratch,
+							const PARTITION_ENTRY *pParts,
+							PARTITION_SPLIT *pSplits,
+							PARTITION_QUEUE *pQueue,
+							int WorstPartition,
+							int NumSplitsLeft,
+							int NumThreads)
 {
-	int i, j, k, dist;
+#if MULTI_THREADED
+	int Batch[MAX_CODES], Popped[MAX_CODES];
+	int BatchSize, BatchVectors, NumPopped;
+	int MaxBatchSize;
+	int i, t, Started;
 
-	const PIXEL_VECT *pRepI, *pRepJ;
-	/*
-	// Step through all the rep vectors calculating the neighbour
-	// distances
-	*/
-	pRepI = pRepVectors;
-	for(i = 0; i < NumReps; i++)
+	SPLIT_JOB Job;
+	thrd_t Threads[MAX_CODES];
+
+	MaxBatchSize = MIN(NumThreads * SPLITS_PER_THREAD, NumSplitsLeft);
+
+	if(MaxBatchSize > 1)
 	{
-		pRepJ = pRepI + 1;
-		for(j= i+1; j < NumReps; j++)
+		/*
+		// Find the next worst partitions that haven't been split, and put
+		// everything we looked at back in the queue
+		*/
+		Batch[0]	 = WorstPartition;
+		BatchSize	 = 1;
+		BatchVectors = pParts[WorstPartition].Length;
+		NumPopped	 = 0;
+
+		while((BatchSize < MaxBatchSize) && (pQueue->Size > 0))
 		{
+			i = PopPartition(pQueue);
+			Popped[NumPopped++] = i;
 
-			dist = 0;
-			for(k = 0; k < VECLEN; k++)
+			if(!pSplits[i].bReady && (pParts[i].Error > 0.0f))
 			{
-				dist += SQ(pRepI->v[k] - pRepJ->v[k]);
+				Batch[BatchSize++] = i;
+				BatchVectors += pParts[i].Length;
 			}
+		}
 
-#if GATHER_STATS
-	SetupCalcs += 1;
-#endif
+		for(i = 0; i < NumPopped; i++)
+		{
+			PushPartition(pQueue, Popped[i]);
+		}
+
+		if((BatchSize > 1) && (BatchVectors >= MIN_THREADED_SPLIT_VECTORS))
+		{
+			Job.pFuncs	  = pFuncs;
+			Job.pVectors  = pVectors;
+			Job.pRefs	  = pRefs;
+			Job.pScratch  = pScratch;
+			Job.pParts	  = pParts;
+			Job.pSplits	  = pSplits;
+			Job.pBatch	  = Batch;
+			Job.BatchSize = BatchSize;
+			atomic_init(&Job.NextSplit, 0);
+
+			NumThreads = MIN(NumThreads, BatchSize);
 
 			/*
-			// store this in the two appropriate places
+			// Start the helpers, and do our share on this thread. If a
+			// thread can't be started, we just carry on with fewer.
 			*/
-			NeighbourArray[i][j-1].OtherRep = j;
-			NeighbourArray[i][j-1].Distance = dist;
-
-			NeighbourArray[j][i].OtherRep = i;
-			NeighbourArray[j][i].Distance = dist;
-
-			pRepJ++;
-		}/*end for j*/
+			for(Started = 1; Started < NumThreads; Started++)
+			{
+				if(thrd_create(&Threads[Started], SplitPartitionsThread, &Job) != thrd_success)
+				{
+					break;
+				}
+			}
 
-		pRepI ++;
-	}/*end for i*/
+			SplitPartitionsThread(&Job);
 
-	/*
-	// Sort each of these into increasing order of distance
-	*/
-	for(i = 0; i < NumReps; i++)
-	{
-		qsort(NeighbourArray[i], NumReps-1, sizeof(NeighbInfo),  NeighComp);
+			for(t = 1; t < Started; t++)
+			{
+				thrd_join(Threads[t], NULL);
+			}
+			return;
+		}
 	}
+#endif
 
+	SplitPartition(pFuncs, pVectors, pRefs, pScratch,
+				   &pParts[WorstPartition], &pSplits[WorstPartition]);
 }
 
 
-/*********************************************************
-* Find Closest Colour (using the Nearest Neighbour table)
-*********************************************************/
-
-
 /*
-// Acceleration structure used to stop retesting of the same codes
+// The rep for a stretch of the refs: the average of their vectors (counting
+// all the copies of merged ones)
 */
-#define SIZE_ALL_READY_TESTED_BLOCK ((MAX_CODES + 31) / 32)
-
-
-
-static int FindClosestVector(const int Vector[VECLEN],
-							 const SearchTreeNode *pSearchRoot,
-
-							 const PIXEL_VECT *pRepVectors,
-					   		   int NumReps,
-					   		 float *pErrorSum)
+static void PartitionToRep(const VQ_CONTEXT *pContext,
+						   const PIXEL_VECT *pVectors,
+								   int		 Start,
+								   int		 Length,
+								   int		 Format,
+								PIXEL_VECT	*pRep)
 {
-	int i, j;
+	const VECTOR_REF_STRUCT *pPartitionStart;
+	int Sum[VECLEN]; /*Sum of all values in a partition*/
+	int Number;
+	int j, k;
 
-	const PIXEL_VECT *pThisRep;
-	int BestDistance, BestIndex, Dist;
-	int CutoffDist;
+	for(k = 0; k < VECLEN; k++)
+	{
+		Sum[k] = 0;
+	}
+	Number = 0;
 
-	unsigned int Done[SIZE_ALL_READY_TESTED_BLOCK];
-	/*
-	// begin by using the tree structure to make an initial guess as to the
-	// best candidate
-	*/
-	while(pSearchRoot->LeafRepIndex < 0)
+	pPartitionStart = pContext->pVectRefs + Start;
+
+	for(j = Length; j > 0; j--)
 	{
-		int DotProd;
-		/*
-		// get the dot product with the splitting planes axis
-		*/
-		DotProd = 0;
-		for(i=0; i < VECLEN; i++)
-		{
-			DotProd += Vector[i] * pSearchRoot->SplittingAxis[i];
-		}
+		const PIXEL_VECT *pVec;
+		int NumCopies;
 
-#if GATHER_STATS
-	NumDistanceCalcs += 1; /*about equivalent to a distance calc*/
-#endif
+		pVec = pVectors + pPartitionStart->Index;
 
-		if(DotProd <= pSearchRoot->d)
-		{
-			pSearchRoot= pSearchRoot->pLess;
-		}
-		else
+	#if MERGE_DUPLICATE_VECTORS
+		NumCopies = pContext->pNumCopies[pPartitionStart->Index];
+	#else
+		NumCopies = 1;
+	#endif
+
+		for(k = 0; k < VECLEN; k++)
 		{
-			pSearchRoot= pSearchRoot->pMore;
+			Sum[k] += pVec->v[k] * NumCopies;
 		}
-	}/*end while*/
+		Number += NumCopies;
 
-	
-	BestIndex = pSearchRoot->LeafRepIndex;
-
-	ASSERT(pSearchRoot->LeafRepIndex < NumReps)
-	
-	
-	/*
-	//Setup which ones we've already done
-	*/
-	for(i = 0; i < SIZE_ALL_READY_TESTED_BLOCK; i++)
-	{ 
-		Done[i] = 0;
+		pPartitionStart ++;
 	}
 
 	/*
-	// Mark off this one
+	// convert the Sum of values into a representative
 	*/
-	Done[BestIndex >> 5] |= (1 << (BestIndex &31));
+	SumToRep(Sum, Number, Format, pRep);
+}
 
-	/*
-	// measure the distance
-	*/
-	pThisRep = pRepVectors + BestIndex; 
 
-	BestDistance = 0;
-	for(i=0; i < VECLEN; i++)
+/*
+// Keep the partitions as they are now as a smaller codebook
+*/
+static void KeepSmallCodebook(SMALL_CODEBOOK *pBook,
+						const PARTITION_ENTRY *pParts,
+								int			   NumPartitions,
+						 const SearchTreeNode *pTreeNodes)
+{
+	int i;
+
+	ASSERT(NumPartitions <= MAX_SMALL_CODES)
+
+	pBook->NumParts = NumPartitions;
+	for(i = 0; i < NumPartitions; i++)
 	{
-		BestDistance += SQ(Vector[i] - pThisRep->v[i]);
+		pBook->Start[i]		= pParts[i].Start;
+		pBook->Length[i]	= pParts[i].Length;
+		pBook->Node[i]		= (int) (pParts[i].pThisNode - pTreeNodes);
+		pBook->LeafIndex[i] = i;
 	}
+}
 
-#if GATHER_STATS
-	NumDistanceCalcs += 1;
-#endif
+/*
+// Swap a smaller codebook's leaf indices with the ones in its nodes. After
+// one swap, the search tree is the smaller codebook's, and the next puts it
+// back as it was.
+*/
+static void SwapSmallCodebookLeaves(VQ_CONTEXT *pContext, SMALL_CODEBOOK *pBook)
+{
+	SearchTreeNode *pNode;
+	int i, Tmp;
 
-	/*
-	// Compute the Cutoff distance. This is the half-way point,
-	// but because we are using the squares of the distance, this
-	// is actually 4* rather than 2*.
-	*/
-	CutoffDist = BestDistance * 4;
+	for(i = 0; i < pBook->NumParts; i++)
+	{
+		pNode = &pContext->TreeNodes[pBook->Node[i]];
+
+		Tmp					= pNode->LeafRepIndex;
+		pNode->LeafRepIndex = pBook->LeafIndex[i];
+		pBook->LeafIndex[i] = Tmp;
+	}
+}
+
+
+/*********************************************************/
+/*********************************************************/
+/*
+// Basic Vector quantization
+//
+// Given the set of codes, it maps these into perception space and then
+// progressively partitions the original set into smaller sets. The "centre"
+// of each set then becomes a representative.
+//
+// At each iteration the routine:
+// 		*Chooses the partition (i.e. set of vectors) with the greatest error
+//		 (they're kept in a PARTITION_QUEUE)
+//
+//      *Finds the principal axis of the data in the set. This is done
+// 		by computing the principal eigenvector of the covariance matrix
+//		of the vectors in the partition.
+//
+//		*The vectors are then sorted along this axis by taking the dot product of
+//		 each vector and the axis.
+//
+//		*A "locally greedy" algorithm is then used to split the set into two parts
+//		 so that the sum of the errors of these two new partitions is a minimum.
+//
+// The last three steps are done by SplitPartitions, which may split a few
+// more of the worst partitions on other threads while it's at it.
+//
+// The function returns the number of reps computed. Occasionally this will
+// be less than the number requested. The search tree is built in the
+// context's TreeNodes, with TreeNodes[0] as the root.
+//
+// On the way, it keeps the context's SmallBooks when there are as many
+// partitions as they want (or at the end, if there never are).
+//
+// Identical vectors are merged first (except for the 1x1 MIP level, which is
+// mapped differently), so the partitions are made up of distinct vectors.
+// All the maps are merged, but only the vectors from Maps[FirstTrainingMap]
+// on are trained on.
+//
+// If it returns VQ_OUTOFMEMORY, then there's been a memory allocation failure.
+*/
+
+/*
+// ExpandBitDepth
+// The inverse of ConvertBitDepth: the full 8 bit equivalent of a value
+// of the given bit depth, as the hardware expands it.
+*/
+static U8 ExpandBitDepth(int BitDepth, int Val)
+{
+	switch(BitDepth)
+	{
+		case 4:  return (U8) (Val | (Val << 4));
+		case 5:  return (U8) ((Val >> 2) | (Val << 3));
+		case 6:  return (U8) ((Val >> 4) | (Val << 2));
+		case 1:  return (U8) (Val ? 255 : 0);
+		default: return (U8) Val;
+	}
+}
+
+
+/*
+// Builds a search tree for reps that weren't made by splitting partitions,
+// by splitting them in half along the component they vary most in. Only
+// the shape matters: BuildSearchTree works out the splitting planes.
+*/
+static SearchTreeNode *WarmStartTree(VQ_CONTEXT *pContext,
+							const PIXEL_VECT *pReps,
+										int  Indices[],
+										int  NumIndices)
+{
+	SearchTreeNode *pNode;
+	int Lowest[VECLEN], Highest[VECLEN];
+	int Comp, Half;
+	int i, j, k;
+
+	pNode = &pContext->TreeNodes[pContext->NumTreeNodes++];
+
+	if(NumIndices == 1)
+	{
+		pNode->LeafRepIndex = Indices[0];
+		return pNode;
+	}
 
 	/*
-	// Check that this IS the best representative vector
+	// find the component with the biggest spread
 	*/
-	for(j = 0; j < NumReps - 1; j++)
+	for(k = 0; k < VECLEN; k++)
 	{
-		int ThisNeighbour;
+		Lowest[k]  = 255;
+		Highest[k] = 0;
+	}
+	for(i = 0; i < NumIndices; i++)
+	{
+		for(k = 0; k < VECLEN; k++)
+		{
+			int Val = pReps[Indices[i]].v[k];
 
-		/*
-		// Can we trivially reject the next nearest neighbour (and hence
-		// ALL other neighbours) 
-		*/
-		if(CutoffDist <= NeighbourArray[BestIndex][j].Distance)
+			if(Val < Lowest[k])
+			{
+				Lowest[k] = Val;
+			}
+			if(Val > Highest[k])
+			{
+				Highest[k] = Val;
+			}
+		}
+	}
+	Comp = 0;
+	for(k = 1; k < VECLEN; k++)
+	{
+		if((Highest[k] - Lowest[k]) > (Highest[Comp] - Lowest[Comp]))
 		{
-			/*
-			// Eureka! we don't need to check any further
-			*/
-			break;
+			Comp = k;
 		}
+	}
 
+	/*
+	// sort along it (there are at most MAX_CODES), and split in the middle
+	*/
+	for(i = 1; i < NumIndices; i++)
+	{
+		int Index = Indices[i];
 
-		ThisNeighbour = NeighbourArray[BestIndex][j].OtherRep;
-		/*
-		// if we've already done this one
-		*/
-		if(Done[ThisNeighbour >> 5] & (1 << (ThisNeighbour &31)))
+		for(j = i; (j > 0) && (pReps[Indices[j - 1]].v[Comp] > pReps[Index].v[Comp]); j--)
 		{
-			continue;
+			Indices[j] = Indices[j - 1];
 		}
+		Indices[j] = Index;
+	}
 
-		/*
-		// Else see if we are actually closer to this neighbour
-		*/
-		pThisRep = pRepVectors + NeighbourArray[BestIndex][j].OtherRep;
-		Dist = 0;
-		for(i=0; i < VECLEN; i++)
-		{
-			Dist += SQ(Vector[i] - pThisRep->v[i]);
-		}
+	Half = NumIndices / 2;
 
-#if GATHER_STATS
-	NumDistanceCalcs += 1;
-#endif
-		/*
-		// if this distance is BETTER than our current best, then
-		// change our best
-		*/
-		if(Dist < BestDistance)
-		{
-			BestDistance = Dist;
-			CutoffDist = BestDistance * 4;
+	pNode->LeafRepIndex = -1;
+	pNode->pLess = WarmStartTree(pContext, pReps, Indices, Half);
+	pNode->pMore = WarmStartTree(pContext, pReps, Indices + Half, NumIndices - Half);
 
-			BestIndex = ThisNeighbour;
+	return pNode;
+}
 
-			/*
-			// restart the for loop
-			*/
-			j = -1;
-		}
 
-		/*
-		// else mark this one off as already done
-		*/
-		else
-		{
-			Done[ThisNeighbour >> 5] |= (1 << (ThisNeighbour &31));
-		} /*end if this other rep is closer*/
-	}/*end for testing the neighbours in order of distance*/
+/*
+// Unpacks the warm start codebook (see SetVqContextWarmStart) into reps,
+// the inverse of WriteVqfMemory, and gives them a search tree. Returns
+// the number of reps.
+*/
+static int WarmStartReps(VQ_CONTEXT *pContext,
+							 int	 Format,
+						PIXEL_VECT	*pReps,
+							 int	 NumReps)
+{
+	int Indices[MAX_CODES];
+	int i, t;
 
 	/*
-	// Sum up the errors
+	// the texels of a code are stored twiddled, like the pixels it's for
 	*/
-	*pErrorSum += BestDistance;
+	static const int TexelPixel[4] = {0, 2, 1, 3};
 
-	#if CHECK_FAST_LOOKUP
-	if(1)  /*this is the first value we actually try*/
+	if(NumReps > pContext->NumWarmCodes)
 	{
-		BestDistance = 0;
-
-		for(j = 0; j < VECLEN; j++)
-		{
-			BestDistance += SQ(pRepVectors[BestIndex].v[j] - Vector[j]);
-		}
+		NumReps = pContext->NumWarmCodes;
+	}
 
+	for(i = 0; i < NumReps; i++)
+	{
+		const U8 *pCode;
 
-		for(i = 0; i < NumReps; i++)
+		pCode = pContext->WarmCodebook + i * 8;
+		for(t = 0; t < 4; t++)
 		{
-			/*
-			// measure the distance
-			*/
-			Dist = 0;
+			U8 *v;
+			int Texel;
 
-			for(j = 0; j < VECLEN; j++)
-			{
-				Dist += SQ(pRepVectors->v[j] - Vector[j]);
-			}
+			v = &pReps[i].v[TexelPixel[t] * MAX_COMPS_PER_PIXEL];
+			Texel = pCode[t * 2] | (pCode[t * 2 + 1] << 8);
 
-			if(Dist < BestDistance)
+			switch(Format)
 			{
+				case FORMAT_4444:
+					v[0] = ExpandBitDepth(4, (Texel >> 8) & 0xF);
+					v[1] = ExpandBitDepth(4, (Texel >> 4) & 0xF);
+					v[2] = ExpandBitDepth(4, Texel & 0xF);
+					v[3] = ExpandBitDepth(4, (Texel >> 12) & 0xF);
+					break;
 
-				DEB_OUT "Error! Best distance NOT obtained (%d vs %d)\n", Dist, BestDistance );
+				case FORMAT_1555:
+					v[0] = ExpandBitDepth(5, (Texel >> 10) & 0x1F);
+					v[1] = ExpandBitDepth(5, (Texel >> 5) & 0x1F);
+					v[2] = ExpandBitDepth(5, Texel & 0x1F);
+					v[3] = ExpandBitDepth(1, (Texel >> 15) & 1);
+					break;
 
-				return i;
+				case FORMAT_565:
+					v[0] = ExpandBitDepth(5, (Texel >> 11) & 0x1F);
+					v[1] = ExpandBitDepth(6, (Texel >> 5) & 0x3F);
+					v[2] = ExpandBitDepth(5, Texel & 0x1F);
+					v[3] = 0xFF;
+					break;
+
+				default: /*YUV: Y, then U or V*/
+					v[0] = (U8) (Texel >> 8);
+					v[1] = (U8) Texel;
+					v[2] = 0;
+					v[3] = 0;
+					break;
 			}
+		}/*end for t*/
 
-			pRepVectors++;
+		Indices[i] = i;
+	}/*end for i*/
 
-		}/*end for i*/
-	}
-	#endif
-	return BestIndex;
-}
+	pContext->NumTreeNodes = 0;
+	WarmStartTree(pContext, pReps, Indices, NumReps);
 
+	return NumReps;
+}
 
 
+static int VectorQuantizer(VQ_CONTEXT *pContext,
+	IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+				int 	NumMaps,
+				int 	FirstTrainingMap,	/*see CoarseTrainingStart*/
+				int 	NumRepsRequired,
+				int 	Format,
+	const QUANTIZER_FUNCS *pFuncs,		/*see SelectQuantizerFuncs*/
+				int 	Metric,			/*how to estimate colour differences*/
 
-/*********************************************************
-* Special case for the 1x1 MIP map level
-*********************************************************/
-static int SinglePixelFind(PIXEL_VECT *pVector,
-							 const PIXEL_VECT *pRepVectors,
-					   		   int NumReps)
+		PIXEL_VECT 		*pReps,
+				int 	*pVectorCount)
 {
-	int i, j;
 
-	int BestDistance, BestIndex, Dist;
+	VECTOR_REF_STRUCT *pSrcVectRefs;
+
+	int NumSrcVectors;
+	int FirstTrainingVector;
+	int NumRefs;
+	int Subsample;
+#if MERGE_DUPLICATE_VECTORS
+	int NumToMerge;
+#endif
 
-	BestDistance = INT_MAX;
-	BestIndex = INT_MAX; /*To stop compiler warnings and trap errors*/
 	/*
-	// Run through ALL of the reps. Since this is a "one off", it's not
-	// significant.
+	// partition table, and the splits worked out for them so far
 	*/
-	for(j = 0; j < NumReps; j++)
-	{
-		/*
-		// measure the distance - BUT ONLY FOR THE FIRST PIXEL
-		*/
-		Dist = 0;
-		for(i=0; i < MAX_COMPS_PER_PIXEL; i++)
-		{
-			Dist += SQ(pVector->v[i] - pRepVectors->v[i]);
-		}
-		pRepVectors ++;
-
+	PARTITION_ENTRY Parts[MAX_CODES];
+	PARTITION_SPLIT Splits[MAX_CODES];
+	int NumPartitions, i, j, k;
+	int NextBook;
 
-		/*
-		// if this distance is better
-		*/
-		if(Dist < BestDistance)
-		{
-			BestDistance = Dist;
+	/*
+	// All the vectors of all the levels, one after the other
+	*/
+	PIXEL_VECT *pVectors;
 
-			BestIndex = j;
-		}
-	}/*end for*/
+	/*
+	// these are used to identify the next partition to subdivide
+	*/
+	PARTITION_QUEUE Queue;
+	int   WorstPartition;
 
-	return BestIndex;
-}
+	SearchTreeNode *pLess, *pMore;
 
 
-/*********************************************************/
-/*********************************************************/
-static float MapImageToIndices(IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
-										int NumMaps,
-						 		SearchTreeNode    *pSearchRoot,
+	/*
+	// some minor checks
+	*/
+	ASSERT(NumRepsRequired <= MAX_CODES);
 
-					   const PIXEL_VECT *pRepVectors,
-					   		              int NumReps,
-					   	   SUM_USAGE_STRUCT   SumAndUsage[MAX_CODES],
-									  int 	DiffusionLevel,
-									  int	DitherJust1stComponent)
-{
-	IMAGE_VECTOR_STRUCT * pImage; /*current image*/
 	/*
-	// **Dithering**
-	// We maintain two rows of pixel error values. One is the
-	// errors from the previous row (i.e. the bottom pixel row of the
-	// previous vector), the other are the error from the bottom
-	// pixels of the "current" row of vectors.
-	//
-	// We alternate the error rows at each row of vectors.
+	// compute the number of vectors
 	*/
-	int VErrRow[2][MAX_X_PIXELS+1][MAX_COMPS_PER_PIXEL];
-	int PrevRowIndex;
-	int *pPreviousRow, *pCurrentRow;
-	
-	int HErr[PIXEL_BLOCK_SIZE][MAX_COMPS_PER_PIXEL];
-
-	int x,y,i, Level;
-	int DiffusionLimit;
-
-	PIXEL_VECT *pVector;
-
-	float Error;
+	NumSrcVectors = 0;
+	FirstTrainingVector = 0;
+	for(k = 0; k < NumMaps; k++)
+	{
+		if(k == FirstTrainingMap)
+		{
+			FirstTrainingVector = NumSrcVectors;
+		}
+		NumSrcVectors += (Maps[k]->xVDim * Maps[k]->yVDim);
+	}
+	*pVectorCount = NumSrcVectors;
 
-	Error = 0.0f;
 
 	/*
-	// the following code ONLY works with a 2x2 pixel block
+	// Get the array that points to all the source vectors, and another as
+	// big for the sort to work in
 	*/
-	ASSERT(PIXEL_BLOCK_SIZE==2)
+	pContext->pVectRefs	   = AllocateFromArena(&pContext->Arena, sizeof(VECTOR_REF_STRUCT) * NumSrcVectors);
+	pContext->pSortScratch = AllocateFromArena(&pContext->Arena, sizeof(VECTOR_REF_STRUCT) * NumSrcVectors);
+	pSrcVectRefs = pContext->pVectRefs;
 
 	/*
-	// initialise the usage count
+	// if this fails, abort out of here
 	*/
-	for(i = 0; i < NumReps; i++)
+	if((pContext->pVectRefs == NULL) || (pContext->pSortScratch == NULL))
 	{
-		SumAndUsage[i].Usage = 0;
-		for(x = 0; x < VECLEN; x++)
-		{
-		 	SumAndUsage[i].Sum[x] = 0;
-		}
+		return VQ_OUTOFMEMORY;
 	}
 
-   	/*
-	// Complete the search tree for the initial Guess
-	*/
-	BuildSearchTree(pRepVectors, pSearchRoot);
 
 	/*
-	// create the NxN Nearest neighbour structure.
+	// set up the references to the vectors. We need to sort the data - it's
+	// easier to just move "pointers" around. The levels are allocated back
+	// to back, so the vectors are simply numbered in order.
 	*/
-	BuildNeighbourList(pRepVectors, NumReps);
+	pVectors = Maps[0]->pVectors;
+
+	j = 0;
+	for(k = 0; k < NumMaps; k++)
+	{
+		ASSERT(Maps[k]->pVectors == pVectors + j);
 
+		j += Maps[k]->xVDim * Maps[k]->yVDim;
+	}
 
 	/*
-	// Step through each map level
+	// If we've been asked to train on a subset, make sure it's not too
+	// small for the number of reps
 	*/
-	for(Level = 0; Level < NumMaps; Level++)
+	Subsample = MIN(pContext->Subsample,
+					(NumSrcVectors - FirstTrainingVector) / (MIN_SUBSAMPLES_PER_REP * NumRepsRequired));
+	if(Subsample < 1)
 	{
-		pImage = Maps[Level];
-
+		Subsample = 1;
+	}
 
-		/*
-		// special case for the 1x1 Mip map level. We are only
-		// interested in matching the top left pixel of the vector
-		*/
-		if((Level == (NumMaps - 1)) && pImage->xVDim == 1)
+#if MERGE_DUPLICATE_VECTORS
+	/*
+	// The 1x1 levels only match their top left pixel, so leave them out
+	*/
+	NumToMerge = NumSrcVectors;
+	for(k = NumMaps - pContext->NumSinglePixelMaps; k < NumMaps; k++)
+	{
+		if(Maps[k]->xVDim == 1)
 		{
-			int Code;
-			/*
-			// Find the closest match
-			*/
-			Code = SinglePixelFind(pImage->Rows[0], pRepVectors, NumReps);
-	    
-			pImage->Rows[0][0].wc.Code = Code;
-
-
-		
-			SumAndUsage[Code].Usage++;
-
-			for(i = 0; i < VECLEN; i++)
-			{
-				SumAndUsage[Code].Sum[i] += pImage->Rows[0][0].v[i];
-			}
-			break;			
+			NumToMerge--;
 		}
+	}
 
+	NumRefs = MergeDuplicateVectors(pContext, pVectors, NumSrcVectors, NumToMerge,
+					FirstTrainingVector, Subsample, pSrcVectRefs);
+	if(NumRefs < 0)
+	{
+		return VQ_OUTOFMEMORY;
+	}
 
-		/*
-		// Intialise the error diffusion values for the 'previous row of pixels'
-		// to be zero
-		*/ 
-		PrevRowIndex = 0;
-	    
-		pPreviousRow = VErrRow[PrevRowIndex][0];
-		for(x = 0; x < pImage->xVDim*PIXEL_BLOCK_SIZE; x++)
-		{
-			for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
-			{	
-				pPreviousRow[i] = 0;
-			}
-	    
-			pPreviousRow+= MAX_COMPS_PER_PIXEL;	
-		}
-
-		/*
-		// if we only want to dither the first component, then set up the
-		// loop limit so that the others aren't touched
-		*/
-		if(DitherJust1stComponent)
-		{
-			DiffusionLimit = 1;
-		}
-		else
-		{
-			DiffusionLimit = MAX_COMPS_PER_PIXEL;					
-		}
+	DEB_OUT "Merged %d duplicate vectors, leaving %d of %d. Training on %d (1 in %d)\n",
+		NumSrcVectors - pContext->NumUniqueVectors, pContext->NumUniqueVectors,
+		NumSrcVectors, NumRefs, Subsample);
+#else
+	{
+		SUBSAMPLE_STATE Sampler;
 
+		InitSubsample(&Sampler, Subsample, NumSrcVectors - FirstTrainingVector);
 
-		/*
-		// Step through the image
-		*/
-		for(y = 0; y < pImage->yVDim; y++)
+		NumRefs = 0;
+		for(i = FirstTrainingVector; i < NumSrcVectors; i++)
 		{
-			/*
-			// get easy access to the previous rows vertical errors, and
-			// the error for this row
-			*/
-			pPreviousRow = VErrRow[PrevRowIndex][0];
-			pCurrentRow  = VErrRow[PrevRowIndex^1][0];
-	    
-   	   		PrevRowIndex ^= 1;
-	    
-			/*
-			// clear the horizontal error...
-			*/
-			for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
+			if(IsTrainingVector(&Sampler, i - FirstTrainingVector))
 			{
-				HErr[0][i] = 0;
-				HErr[1][i] = 0;
-			}
-	    
-			/*
-			// and reset the first output vertical error
-			*/
-			for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
-			{	
-				pCurrentRow[i] = 0;
+				pSrcVectRefs[NumRefs++].Index = i;
 			}
-	    
-	    
-			/*
-			// step through the row
-			*/
-			pVector = pImage->Rows[y];
-			 
-			for(x = 0; x < pImage->xVDim; x++)
-			{
-				int NewVector[VECLEN];
-				int Code;
-	    
-	    
-				/*
-				// Put in the error from neighbouring vectors
-				//
-				// NEED TO DO SOME ASCII ART HERE
-				//
-				*/
-				if(DiffusionLevel > 0)
-				{
-					/*
-					// do error diffusion on only the required components
-					*/
-					for(i = 0; i < DiffusionLimit; i++)
-					{
-						int index;
-	    
-						/*
-						// Top Left
-						*/
-						NewVector[i] = pVector->v[i] + HErr[0][i] + pPreviousRow[i];
-	    
-						CLAMP(NewVector[i], 0, 255);
-	    
-						/*
-						// Top Right
-						*/
-						index = i+MAX_COMPS_PER_PIXEL;
-						NewVector[index] = pVector->v[index] + pPreviousRow[index];
-	    
-						CLAMP(NewVector[index], 0, 255);
-	    
-						/*
-						// Bottom Left
-						*/
-						index += MAX_COMPS_PER_PIXEL;
-						NewVector[index] = pVector->v[index] + HErr[1][i];
-					
-						CLAMP(NewVector[index], 0, 255);
-	    
-						/*
-						// Bottom Right (no error to accumulate)
-						*/
-						index += MAX_COMPS_PER_PIXEL;
-	    
-						NewVector[index] = pVector->v[index];
-		
-					}/*end for*/
-
+		}
+	}
 
-					/*
-					// for any remaining components, just copy the values
-					*/
-					for(/*nil*/; i < MAX_COMPS_PER_PIXEL; i++)
-					{
-						NewVector[i] = pVector->v[i];
-						NewVector[i +   MAX_COMPS_PER_PIXEL] = pVector->v[i +   MAX_COMPS_PER_PIXEL];
-						NewVector[i + 2*MAX_COMPS_PER_PIXEL] = pVector->v[i + 2*MAX_COMPS_PER_PIXEL];
-						NewVector[i + 3*MAX_COMPS_PER_PIXEL] = pVector->v[i + 3*MAX_COMPS_PER_PIXEL];
-					}
-				}
-	    
-				/*
-				// Else no error diffusion
-				*/
-				else
-				{
-					for(i = 0; i < VECLEN; i++)
-					{
-						NewVector[i] = pVector->v[i];
-					}
-				}
-	    
-	    
-				/*
-				// Find the closest match
-				*/
-				Code = FindClosestVector(NewVector, pSearchRoot, 
-						pRepVectors, NumReps, &Error);
-	    
-				pVector->wc.Code = Code;
-	    
-				/*
-				// keep track of the usage frequency, and sum of values
-				*/
-				SumAndUsage[Code].Usage++;
+	pContext->NumMergedVectors = 0;
+	pContext->NumUniqueVectors = NumSrcVectors;
+#endif
 
-				for(i = 0; i < VECLEN; i++)
-				{
-					SumAndUsage[Code].Sum[i] += NewVector[i];
-				}
+	pContext->JobStats.NumVectors		  = NumSrcVectors;
+	pContext->JobStats.NumUniqueVectors	  = pContext->NumUniqueVectors;
+	pContext->JobStats.NumTrainingVectors = NumRefs;
 
-	    
-				if(DiffusionLevel > 0)
-				{
-					/*
-					// Compute the error
-					*/
-					for(i = 0; i < VECLEN; i++)
-					{
-						NewVector[i] =  NewVector[i] - pRepVectors[Code].v[i];
-	    
-						/*
-						// Damp the error - trying to correct too large an error
-						// looks bad, so don't let it get out of hand.
-						*/
-						CLAMP(NewVector[i], -16, 16);
-	    
-						/*
-						// should we halve the error
-						*/
-						if(DiffusionLevel == 1)
-						{
-							NewVector[i] = HALF(NewVector[i]);
-						}
-					}/*end for i*/
-	    
-	    
-					/*
-					// Distribute the error
-					*/
-					for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
-					{
-						int ThreeEighths;
-						int OneQuarter;
-						int ThreeQuarters;
-						int index;
-			  		#if 0
-						/* 
-						// NOTE: The following doesn't appear to improve anything -
-						//  In fact it seems to make things worse, so leave it out
-						// for the moment!
-						*/
-	    
-						/*
-						// Distribute the error from the top left to the errors
-						// of the other pixels
-						*/
-						ThreeEighths = NewVector[i];
-						OneQuarter =  NewVector[i] - 2 * ThreeEighths;
-	    
-						NewVector[i+MAX_COMPS_PER_PIXEL]   += ThreeEighths;
-						NewVector[i+2*MAX_COMPS_PER_PIXEL] += ThreeEighths;
-						NewVector[i+3*MAX_COMPS_PER_PIXEL] += OneQuarter;
-					#endif
-	    
-						/*
-						// Distribute top rights error
-						*/
-						index = i+MAX_COMPS_PER_PIXEL;
-	    
-						ThreeQuarters = THREE_4RS(NewVector[index]);
-						OneQuarter    = NewVector[index] - ThreeQuarters;
-	    
-						HErr[0][i] = ThreeQuarters;
-						HErr[1][i] = OneQuarter;
-	    
-						/*
-						// Distribute the bottom lefts error
-						*/
-						index = i+2*MAX_COMPS_PER_PIXEL;
-	    
-						ThreeQuarters = THREE_4RS(NewVector[index]);
-						OneQuarter = NewVector[index] - ThreeQuarters;
-	    
-						pCurrentRow[i] += ThreeQuarters;  /*NOTE addition here*/
-						pCurrentRow[i+MAX_COMPS_PER_PIXEL]  = OneQuarter;
-	    
-	    
-	    
-						/*
-						// Distribute the bottom rights error: 
-						// i.e. to Right, Bottom, and Bottom Right.
-						*/
-						index = i+3*MAX_COMPS_PER_PIXEL;
-	    
-						ThreeEighths= THREE_8THS(NewVector[index]);
-						OneQuarter =  NewVector[index] - 2*ThreeEighths;
-	    
-						HErr[1][i] += ThreeEighths;			  /*NOTE addition here*/
-						pCurrentRow[i+MAX_COMPS_PER_PIXEL] += ThreeEighths;  /*NOTE addition here*/
-						pCurrentRow[i+2*MAX_COMPS_PER_PIXEL] = OneQuarter;
-					}/*end for i*/
-				}/*end if error diffusion/dithering*/
-	    
-				/*
-				// move along
-				*/			
-				pVector++;
-	    
-				/* 
-				// Note that we are moving two pixels at a time
-				*/
-				pPreviousRow+= (2 * MAX_COMPS_PER_PIXEL);
-				pCurrentRow += (2 * MAX_COMPS_PER_PIXEL);
-	    
-			}/*end for x*/	
-		}/*end for y*/
-	}/*end for level*/
-#if GATHER_STATS
+	/*
+	// With a warm start the codes are there already, so there's nothing to
+	// train. The duplicates are still merged for the mapping.
+	*/
+	if(pContext->NumWarmCodes > 0)
 	{
-		int NumVecs;
-		printf("\n Search statistics\n");
-		
-		NumVecs =  (pImage->yVDim * pImage->xVDim);
-
-		printf("Num vectors:%d    Average Searches PerVector %d  Plus Setup Costs %d\n", 		
-			NumVecs,
-			(NumDistanceCalcs +  NumVecs/2) / NumVecs,
-			(NumDistanceCalcs + SetupCalcs + NumVecs/2) / NumVecs);
+		pContext->JobStats.NumTrainingVectors = 0;
+		return WarmStartReps(pContext, Format, pReps, NumRepsRequired);
 	}
-#endif
-
-	return Error;
-
-}
-
-
-/******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
-/*
-//  MIP map generation, VQ file formatting, and Code order optimisation.
-*/
-/******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
 
+	/*
+	// map all the colours into the perception space.
+	//
+	// **NOTE** for RGB{A} textures we reorder the vector components 
+	// so that alpha is placed at the end. This is for the situations
+	// where alpha is always opaque, which means we can save quite a
+	// number of calculations.
+	//
+	// Similarly YUV only uses the first 8 components.
+	*/
+	for(i = 0; i < NumRefs; i++)
+	{
+		PIXEL_VECT *pVec;
 
-/*********************************************************/
-/*
-// 	Allocation and deallocation of image vector maps:
-*/
-/*********************************************************/
+		pVec = pVectors + pSrcVectRefs[i].Index;
 
+		RawToPerceptionSpace(Metric, pVec->v, pVec->pv); 
+	}/*end for i*/
 
-static IMAGE_VECTOR_STRUCT *AllocateVectorMap(int nWidth)
-{
-	int i;
-	int VecsMaxX, VecsMaxY;
-	IMAGE_VECTOR_STRUCT *pImageVecs;
 
 	/*
-	// Allocate the initial block
+	// Create the root of the search tree we will use later
 	*/
-	pImageVecs = NEW(IMAGE_VECTOR_STRUCT);
-	if(pImageVecs == NULL)
-	{
-		return NULL;
-	}
+	pContext->NumTreeNodes = 1;
+	pContext->TreeNodes[0].LeafRepIndex = 0; /*a safety precaution only*/
 
 	/*
-	// Special case: If the width is 1 (i.e. 1x1 map), then double it's dimension.
+	// Set the initial partition to be all the colours
 	*/
-	if(nWidth == 1)
-	{
-		nWidth = 2;
-	}
+	NumPartitions = 1;
+	Parts[0].Start  = 0;
+	Parts[0].Length = NumRefs;
 
+	Parts[0].Error  = 1.0f; /*This value doesn't really matter for the first one*/
 	
-	/*
-	// Set up the dimensions
-	*/
-	VecsMaxX = nWidth / PIXEL_BLOCK_SIZE;
-	VecsMaxY = nWidth / PIXEL_BLOCK_SIZE;
+	Parts[0].pThisNode = &pContext->TreeNodes[0];
+	Splits[0].bReady   = 0;
 
-	pImageVecs->xVDim = VecsMaxX;
-	pImageVecs->yVDim = VecsMaxY;
+	Queue.pParts = Parts;
+	Queue.Size	 = 0;
+	if(Parts[0].Length > 1)
+	{
+		PushPartition(&Queue, 0);
+	}
+
+	NextBook = 0;
 
 	/*
-	// Allocate all of the rows
+	// Keep iterating until we have created as many partitions as the number
+	// of reps we require.. (unless the image is very simple: see later)
 	*/
-	for(i = 0; i < VecsMaxY; i++)
+	while(NumPartitions < NumRepsRequired)
 	{
-		pImageVecs->Rows[i]	= malloc(sizeof(PIXEL_VECT) * VecsMaxX);
-
-		if(pImageVecs->Rows[i] == NULL)
+		/*
+		// keep a smaller codebook if we've got to its size
+		*/
+		while((NextBook < pContext->NumSmallBooks) &&
+			  (pContext->SmallBooks[NextBook].NumParts == NumPartitions))
 		{
-			break;
+			KeepSmallCodebook(&pContext->SmallBooks[NextBook++], Parts, NumPartitions,
+							  pContext->TreeNodes);
 		}
 
-	}
-	
+		DEB_OUT "%d\n", NumPartitions);
 
-	/*
-	// if we failed an allocation, clean up
-	*/
-	if(i < VecsMaxY)
-	{
-		for(i = i - 1; i >= 0; i--)
+		/*
+		// find the worst 'scoring' partition. A partition of one (possibly
+		// merged) vector can't be split, so it never goes in the queue.
+		*/
+		if(Queue.Size == 0)
 		{
-			free(pImageVecs->Rows[i]);
+			break;
 		}
+		WorstPartition = PopPartition(&Queue);
 
 		/*
-		// free the parent as well
+		// if we've mapped everything exactly, then stop trying to split
+		// partitions...
 		*/
-		free(pImageVecs);
+		if(Parts[WorstPartition].Error == 0.0f)
+		{
+			break;
+		}
 
-		return NULL;
-	}
+		DEB_OUT "Worst Part:%d Error:%f\n", WorstPartition, Parts[WorstPartition].Error);
+		DEB_OUT "   Start:%d  Length %d\n", Parts[WorstPartition].Start, Parts[WorstPartition].Length);
 
-	/*
-	// Else it all went perfectly
-	*/
-	return pImageVecs;
-}
+		/*
+		// Get children for the current search node
+		*/
+		ASSERT(pContext->NumTreeNodes + 2 <= 2 * MAX_CODES)
 
+		pLess =	&pContext->TreeNodes[pContext->NumTreeNodes++];
+		pMore = &pContext->TreeNodes[pContext->NumTreeNodes++];
 
+		/*
+		// initialise enough of the nodes to make them leaves, until they're
+		// split in turn
+		*/
+		pLess->LeafRepIndex = 0;
+		pMore->LeafRepIndex = 0;
 
-static void FreeVectorMap(IMAGE_VECTOR_STRUCT *pImageVecs)
-{
-	int i;
+		/*
+		// Connect the nodes into the tree
+		*/
+		Parts[WorstPartition].pThisNode->pLess = pLess;
+		Parts[WorstPartition].pThisNode->pMore = pMore;
+
+		Parts[WorstPartition].pThisNode->LeafRepIndex = -1; /*mark that it's not a leaf*/
 
-	if(pImageVecs)
-	{
 		/*
-		// free all the rows
+		// Split it, unless that's already been done
 		*/
-		for(i = 0; i < pImageVecs->yVDim; i++)
+		if(!Splits[WorstPartition].bReady)
 		{
-			free(pImageVecs->Rows[i]);
+			SplitPartitions(pFuncs, pVectors, pSrcVectRefs, pContext->pSortScratch,
+							Parts, Splits, &Queue, WorstPartition,
+							NumRepsRequired - NumPartitions, pContext->NumThreads);
 		}
 
-		free(pImageVecs);
-	}
-}
-
-
-/*********************************************************/
-/*
-// 	ConvertBitMapToVectors:
-//
-// Converts the raw RBG and Alpha stream into our internal
-// vector format.
-*/
-/*********************************************************/
-
-static void ConvertBitMapToVectors(const U8 *pRGB,
-								   const U8 *pAlpha,
-
-								   int BGROrder,
-								   int bAlphaOn,
-								   int bInvertAlpha,
-
-							IMAGE_VECTOR_STRUCT *pImageVecs,
-							int PixelWeight)
-{
-	int i, j;
-	int xPos, yPos;
-	int VecsMaxX, VecsMaxY;
-	int PixelWidth;
+		Parts[WorstPartition]  = Splits[WorstPartition].Less;
+		Parts[NumPartitions]   = Splits[WorstPartition].More;
+		Splits[WorstPartition].bReady = 0;
+		Splits[NumPartitions].bReady  = 0;
 
-	PIXEL_VECT *pVect;
+		/*
+		// put the node pointers into the child partitions, 
+		// the More/Less bit doesn't matter at the moment
+		*/
+		Parts[NumPartitions].pThisNode  = pLess;
+		Parts[WorstPartition].pThisNode = pMore;
 
-	const U8 * pTmpRGB;
+		if(Parts[WorstPartition].Length > 1)
+		{
+			PushPartition(&Queue, WorstPartition);
+		}
+		if(Parts[NumPartitions].Length > 1)
+		{
+			PushPartition(&Queue, NumPartitions);
+		}
 
+		NumPartitions++;	
+	}/*end while*/
 
 	/*
-	// if we should invert the sense of the alpha, make it
-	// easy to do so....
+	// If the image ran out of partitions to split, any smaller codebooks
+	// we didn't get to are the whole lot
 	*/
-	if(bInvertAlpha)
+	while(NextBook < pContext->NumSmallBooks)
 	{
-		bInvertAlpha = 0xFF;
+		KeepSmallCodebook(&pContext->SmallBooks[NextBook++], Parts, NumPartitions,
+						  pContext->TreeNodes);
 	}
 
 
+
 	/*
-	//for convenience, get the dimensions
+	// generate the representative for each partition
 	*/
-	VecsMaxX = 	pImageVecs->xVDim;
-	VecsMaxY = 	pImageVecs->yVDim;
-
-	PixelWidth = VecsMaxX * PIXEL_BLOCK_SIZE;
-
-	for(yPos = 0; yPos < VecsMaxY; yPos++)
+	for(i = 0; i < NumPartitions; i++)
 	{
-		int yLower = yPos * PIXEL_BLOCK_SIZE; 
+		PartitionToRep(pContext, pVectors, Parts[i].Start, Parts[i].Length, Format, pReps+i);
 
 		/*
-		// get the pointer to the row
-		*/		
-		pVect = pImageVecs->Rows[yPos];
-	
-		for(xPos = 0; xPos < VecsMaxX; xPos++)
-		{
-			int k =0;
-			int xLower= xPos * PIXEL_BLOCK_SIZE;
+		// Set the search node to be a leaf
+		*/
+		Parts[i].pThisNode->LeafRepIndex = i;
+	}/*end for i*/
 
-			/*
-			// Set the vectors weighting
-			*/
-			pVect->wc.Weight = PixelWeight;
-			/*
-			// Re-arrange the NxN pixels
-			*/
-			for(i = yLower; i < yLower + PIXEL_BLOCK_SIZE; i++)
-			{
-				for(j = xLower; j < xLower + PIXEL_BLOCK_SIZE; j++)
-				{
-					/*
-					// get a pointer to the RGB bits of the pixel
-					*/
-					pTmpRGB = pRGB + (i * PixelWidth + j) * 3;
 
-					if(BGROrder)
-					{
-						pVect->v[k]   =  pTmpRGB[2];
-						pVect->v[k+1] =  pTmpRGB[1];
-						pVect->v[k+2] =  pTmpRGB[0];
-					}
-					else
-					{
-						pVect->v[k]   =  pTmpRGB[0];
-						pVect->v[k+1] =  pTmpRGB[1];
-						pVect->v[k+2] =  pTmpRGB[2];
-					}
 
-					/*
-					// Do the alpha, IF ANY
-					*/
-					if(bAlphaOn)
-					{
-						pVect->v[k+3] = (U8) (pAlpha[i * PixelWidth + j] ^ bInvertAlpha);
-					}
-					else
-					{
-					 	pVect->v[k+3] = 0xFF; /*Fully opaque*/
-					}
 
-					k+=MAX_COMPS_PER_PIXEL;
-				}/*end for j*/
-			}/*end for i*/
+	return NumPartitions;
+}
 
-			/*
-			// Move on to the next vector
-			*/
-			pVect++;
-		}/*end for xPos*/ 
-	
-	}/*end for yPos*/ 
 
-}/*end ConvertBitMapToVectors */
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+/*
+//  Vector Assignment and Dithering Code
+*/
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+/*********************************************************/
+/*********************************************************/
 
 
 
 /*********************************************************/
 /*
-// 	GenerateMIPMapLevel
 //
-// Takes a map with defined vectors along with the next lower res map
-// with uninitialised vectors, and computes the vecs for the lower map.
+// Build Search Tree
+// Complete the building of the search tree, by adding splitting
+// planes etc.
 //
-// It just uses a simple 2x2 filter kernel. There seems little point
-// in using anything else because the compression is usually quite
-// lossy.
 */
 /*********************************************************/
 
-static void GenerateMIPMapLevel(const IMAGE_VECTOR_STRUCT *pHigher,
-						       IMAGE_VECTOR_STRUCT *pLower,
-						       int	Weight)
+static void RecursiveBuildSearchTree(const PIXEL_VECT *pRepVectors,
+							SearchTreeNode *pTree, 
+										int TreeAverage[VECLEN],
+								SEARCH_STATS *pStats)
 {
-	int k;
-	int xLowerPos, yLowerPos, xloc, yloc;
-	
-	int VecsMaxX, VecsMaxY;
-	PIXEL_VECT *pDstVect;
-	const PIXEL_VECT *pSrcVect;
-
-	int Av;
-
-	/*
-	// NOTE routine assumes blocksize is 2
-	*/
-	ASSERT(PIXEL_BLOCK_SIZE == 2)
+	int Child1Av[VECLEN], Child2Av[VECLEN];
+	int C1Dot, C2Dot;
+	int i;
 
 	/*
-	// Special case the lowest resolution map
+	// if this node is a child, simply return it's value as the average
 	*/
-	if(pHigher->xVDim == 1)
+	if(pTree->LeafRepIndex >= 0)
 	{
-		for(k = 0; k < MAX_COMPS_PER_PIXEL; k++ )
-		{
-			Av = pHigher->Rows[0][0].v[k] + 
-				 pHigher->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL] +
-				 pHigher->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*2] +
-				 pHigher->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*3];
-
-			/*
-			// divide with rounding
-			*/
-			Av = (Av + 2) >> 2;
-
-			/*
-			// write the average to ALL pixels in the vector;
-			*/
-			pLower->Rows[0][0].v[k] = (U8) Av;
-			pLower->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL] = 	 (U8) Av;
-			pLower->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*2] = (U8) Av;
-			pLower->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*3] = (U8) Av;
-
-		}/*end for k*/
+		/*
+		// sanity check
+		*/
+		ASSERT(pTree->LeafRepIndex < MAX_CODES)
 
 		/*
-		// intialise it's weight as well
+		// get access to the rep
 		*/
-		pLower->Rows[0][0].wc.Weight = Weight;
-		
-	}		
-	/*
-	// else it's of a more typical size
-	*/
+		pRepVectors += pTree->LeafRepIndex;
+		for(i=0; i < VECLEN; i++)
+		{
+			TreeAverage[i] = pRepVectors->v[i];	
+		}
+
+	}
 	else
-	{	
+	{
 		/*
-		// Check that the sizes match up
+		// check that it's initialised to the correct value
 		*/
-		ASSERT(pHigher->xVDim == pLower->xVDim * PIXEL_BLOCK_SIZE)
+		ASSERT(pTree->LeafRepIndex == -1)
 
 		/*
-		// Step through all the lower res vectors
+		// process the children
 		*/
-		VecsMaxX = pLower->xVDim;
-		VecsMaxY = pLower->xVDim;
+		RecursiveBuildSearchTree(pRepVectors,
+									pTree->pLess, 
+									Child1Av,
+									pStats);
 
-		for(yLowerPos = 0; yLowerPos < VecsMaxY; yLowerPos++)
-		{
-			int yHigher = yLowerPos * PIXEL_BLOCK_SIZE; 
+		RecursiveBuildSearchTree(pRepVectors,
+									pTree->pMore, 
+									Child2Av,
+									pStats);
 
-			/*
-			// get the pointer to the destiation row
-			*/		
-			pDstVect = pLower->Rows[yLowerPos];
-	
+		/*
+		// Compute the average for the parent, and the difference for
+		// the splitting axis, and the dot products
+		*/
+		C1Dot = 0;
+		C2Dot = 0;
 
-			for(xLowerPos = 0; xLowerPos < VecsMaxX; xLowerPos++)
-			{
-				int xHigher= xLowerPos * PIXEL_BLOCK_SIZE;
-
-				U8 *pVecEnt;
-
-				/*
-				// get a pointer to the first vector value. This will be
-				// the red value of the first pixel. It's value will be derived
-				// from all the red components etc...
-				*/
-				pVecEnt = pDstVect->v;
+		for(i=0; i < VECLEN; i++)
+		{
+			/*
+			// average with rounding -- actually I think the rounding should
+			// alternate... Hmmm. I'll have to think about this.
+			*/
+			TreeAverage[i] = (Child1Av[i] + Child2Av[i] + 1) >> 1;
 
-				/*
-				// step through the pixels inside the vector
-				*/
-				for(yloc = 0; yloc < PIXEL_BLOCK_SIZE; yloc++)
-				{
-					/*
-					// get access to the source vector for this
-					// destination pixel
-					*/
-					pSrcVect = &pHigher->Rows[yHigher+yloc][xHigher];
+			/*
+			// Compute the difference vector
+			*/
+			pTree->SplittingAxis[i] = Child1Av[i] - Child2Av[i];
 
-					for(xloc = 0; xloc < PIXEL_BLOCK_SIZE; xloc++)
-					{
-						/*
-						// Step through the colour components
-						*/
-						for(k = 0; k < MAX_COMPS_PER_PIXEL; k++ )
-						{
-							Av = pSrcVect->v[k] + 
-				 				 pSrcVect->v[k+MAX_COMPS_PER_PIXEL] +
-				 				 pSrcVect->v[k+MAX_COMPS_PER_PIXEL*2] +
-				                 pSrcVect->v[k+MAX_COMPS_PER_PIXEL*3];
+			/*
+			// And the dot products
+			*/
+			C1Dot += Child1Av[i] * pTree->SplittingAxis[i];
+			C2Dot += Child2Av[i] * pTree->SplittingAxis[i]; 
+		}/*end for*/
 
-							/*
-							// divide with rounding
-							*/
-							Av = (Av + 2) >> 2;
 
-							/*
-							// store it in the right place in the destination
-							*/
-							*pVecEnt = (U8) Av;
 
-							/*
-							// Move to the next value in the vector
-							*/
-							pVecEnt++;							
-						}/*end for k*/
+	pStats->SetupCalcs += 2; /*this is about equivalent to 2 distance calcs*/
 
-						/*
-						// Move to the next Source vector, which should ne the next one
-						// in the row.
-						*/
-						pSrcVect++;
-					}/*end for x: Stepping through the various source vectors*/
+		/*
+		// If we've got these the wrong way around, swap them
+		*/
+		if(C1Dot > C2Dot)
+		{
+			SearchTreeNode *pTmp;
+			
+			pTmp = pTree->pLess;
+			pTree->pLess = pTree->pMore;
+			pTree->pMore = pTmp;
+		}
 
-				}/*end for y: Stepping through the various source vectors*/
+		/*
+		// get the split value
+		*/
+		pTree->d = (C1Dot + C2Dot) / 2;
+	}/*end if leaf/parent*/
 
-				/*
-				// Store the assigned weight for this map
-				*/
-				pDstVect->wc.Weight = Weight;
+}/*end function*/
 
-				/*
-				// move to the next vector to generate
-				*/
-				pDstVect++;
-			}/*end for xpos*/
 
-		}/*end for ypos*/
 
-	}/*end if then else*/
 
-}
 
-/*********************************************************/
 /*
-// 	ConvertToYUV
-//
-// Converts an RGB map level to YUV. Note that we don't want to
-// use this routine on the 1x1 map, becaues that gets stored as
-// RGB 565.
+// For convience, put a wrapper around the recursive routine
 */
-/*********************************************************/
-
-static void ConvertToYUV(IMAGE_VECTOR_STRUCT *pMap)
+static void BuildSearchTree(const PIXEL_VECT *pRepVectors, 
+										SearchTreeNode *pTree,
+										SEARCH_STATS *pStats)
 {
-	int xPos, yPos;
-	
-	int VecsMaxX, VecsMaxY;
-	int yloc;
-	PIXEL_VECT *pVect;
-
-	/*
-	// NOTE routine assumes blocksize is 2
-	*/
-	ASSERT(PIXEL_BLOCK_SIZE == 2)
 
+	int Dummy[VECLEN];
 
 	/*
-	// Step through all the vectors
+	// call the recursive routine
 	*/
-	VecsMaxX = pMap->xVDim;
-	VecsMaxY = pMap->xVDim;
+	RecursiveBuildSearchTree(pRepVectors, pTree, Dummy, pStats);
+}
 
-	for(yPos = 0; yPos < VecsMaxY; yPos++)
-	{
-		/*
-		// get the pointer to the row
-		*/		
-		pVect = pMap->Rows[yPos];
-	
 
-		for(xPos = 0; xPos < VecsMaxX; xPos++)
-		{
 
-			U8 *pVecEnt;
+/*********************************************************
+* Build an NxN List of nearest Neighbours.
+*********************************************************/
 
-			float YUV[PIXEL_BLOCK_SIZE][3];
+static int NeighComp(const void *pA, const void *pB)
+{
+	const NeighbInfo *pN1, *pN2;
 
-			/*
-			// get a pointer to the first vector value.
-			*/
-			pVecEnt = pVect->v;
+	pN1 = pA;
+	pN2 = pB;
 
-			/*
-			// step through the 2 pairs of pixels in the vector
-			*/
-			for(yloc = 0; yloc < PIXEL_BLOCK_SIZE; yloc++)
-			{
-				float Scale = 1.0f / 187.0f;
-				int tmp;
-				/*
-				// Do the pixel pair:
-				// first compute raw YUV for both pixels
-				*/
-				YUV[0][0] = (pVecEnt[0] * 55.0f + pVecEnt[1] * 110.0f + pVecEnt[2] * 22.0f)* Scale;
-				YUV[0][1] = (pVecEnt[0] *-32.0f + pVecEnt[1] * -64.0f + pVecEnt[2] * 96.0f)* Scale;
-				YUV[0][2] = (pVecEnt[0] * 96.0f + pVecEnt[1] * -80.0f + pVecEnt[2] *-16.0f)* Scale;
+	if(pN1->Distance > pN2->Distance)
+	{
+		return 1;
+	}
+	else if(pN1->Distance < pN2->Distance)
+	{
+		return -1;
+	}
+	else
+	{
+		return 0;
+	}
 
-				YUV[1][0] = (pVecEnt[4] * 55.0f + pVecEnt[5] * 110.0f + pVecEnt[6] * 22.0f)* Scale;
-				YUV[1][1] = (pVecEnt[4] *-32.0f + pVecEnt[5] * -64.0f + pVecEnt[6] * 96.0f)* Scale;
-				YUV[1][2] = (pVecEnt[4] * 96.0f + pVecEnt[5] * -80.0f + pVecEnt[6] *-16.0f)* Scale;
+}
 
 
-				/*
-				// pack these back into the bytes. The individual Y's a stored, but the U and V
-				// values are an average for the pixel pair.
-				//
-				// Note that we need to clamp U and V to the legal range
-				// for bytes because the values can overflow.
-				//
-				// Y0
-				*/
-				pVecEnt[0] = (U8)  (YUV[0][0] + 0.5f); 
-				
-				/*
-				// U average
-				*/
-				tmp = (int) ((YUV[0][1] + YUV[1][1]) * 0.5f + 128.0f);
-				CLAMP(tmp, 0, 255);
-				pVecEnt[1] = (U8) tmp;
+static void	BuildNeighbourList(const PIXEL_VECT *pRepVectors,
+								int NumReps,
+								NeighbInfo NeighbourArray[MAX_CODES][MAX_CODES - 1],
+								SEARCH_STATS *pStats)
+{
+	int i, j, k, dist;
 
-				
-				/*
-				// Y1 and V average
-				*/				
-				pVecEnt[4] = (U8)  (YUV[1][0] + 0.5f);
+	const PIXEL_VECT *pRepI, *pRepJ;
 
-				tmp = (int) ((YUV[0][2] + YUV[1][2]) * 0.5f + 128.0f);
-				CLAMP(tmp, 0, 255);
-				pVecEnt[5] = (U8) tmp;
-				
-				/*
-				// for safety and ease of debugging, zero the other entries
-				*/
-				pVecEnt[2] = 0;
-				pVecEnt[3] = 0;
-				pVecEnt[6] = 0;
-				pVecEnt[7] = 0;
+	/*
+	// Step through all the rep vectors calculating the neighbour
+	// distances
+	*/
+	pRepI = pRepVectors;
+	for(i = 0; i < NumReps; i++)
+	{
+		pRepJ = pRepI + 1;
+		for(j= i+1; j < NumReps; j++)
+		{
 
-				/*
-				// Move to the next values in the vector
-				*/
-				pVecEnt+=8;							
-			}/*end for y: Stepping through the various source vectors*/
+			dist = 0;
+			for(k = 0; k < VECLEN; k++)
+			{
+				dist += SQ(pRepI->v[k] - pRepJ->v[k]);
+			}
+
+	pStats->SetupCalcs += 1;
 
 			/*
-			// move to the next vector to process.
+			// store this in the two appropriate places
 			*/
-			pVect++;
-		}/*end for xpos*/
+			NeighbourArray[i][j-1].OtherRep = j;
+			NeighbourArray[i][j-1].Distance = dist;
 
-	}/*end for ypos*/
+			NeighbourArray[j][i].OtherRep = i;
+			NeighbourArray[j][i].Distance = dist;
 
-}
+			pRepJ++;
+		}/*end for j*/
 
+		pRepI ++;
+	}/*end for i*/
 
-/*************************************************
-//
-// Write out short in big or little endian
-//
-*************************************************/
+	/*
+	// Sort each of these into increasing order of distance
+	*/
+	for(i = 0; i < NumReps; i++)
+	{
+		qsort(NeighbourArray[i], NumReps-1, sizeof(NeighbInfo),  NeighComp);
+	}
 
-static void WriteShortMem( U8 *ucP, int nVal, int nEndian )
+}
+
+
+/*********************************************************
+* Build a k-d tree over the reps
+*********************************************************/
+/*
+// Each node splits its reps in half on the component they vary most in.
+// It stops at KD_LEAF_SIZE reps, or when all the reps are the same. Returns
+// the index of the node it made for reps KdReps[First] to
+// KdReps[First + Count - 1], which it reorders.
+*/
+static int BuildKdNode(const PIXEL_VECT *pRepVectors,
+								 int	*pKdReps,
+								 int	 First,
+								 int	 Count,
+							 KD_NODE	 KdNodes[MAX_KD_NODES],
+								 int	*pNumNodes,
+						SEARCH_STATS	*pStats)
 {
-	if (nEndian == LITTLE_ENDIAN)
+	KD_NODE *pNode;
+	int Node, SplitDim, WidestRange, Half;
+	int i, j, k, Rep, Value;
+
+	ASSERT(*pNumNodes < MAX_KD_NODES)
+
+	Node  = (*pNumNodes)++;
+	pNode = &KdNodes[Node];
+
+	/*
+	// Find the component with the widest range of values
+	*/
+	SplitDim	= -1;
+	WidestRange = 0;
+	for(k = 0; k < VECLEN; k++)
 	{
-		*ucP++ = (U8)( nVal & 0xff );
-		*ucP++ = (U8)( nVal >> 8 );
+		int Min, Max;
+
+		Min = Max = pRepVectors[pKdReps[First]].v[k];
+		for(i = First + 1; i < First + Count; i++)
+		{
+			Value = pRepVectors[pKdReps[i]].v[k];
+			Min	  = MIN(Min, Value);
+			if(Value > Max)
+			{
+				Max = Value;
+			}
+		}
+
+		if(Max - Min > WidestRange)
+		{
+			WidestRange = Max - Min;
+			SplitDim	= k;
+		}
 	}
-	else
+
+	pStats->SetupCalcs += Count;
+
+	if((Count <= KD_LEAF_SIZE) || (SplitDim < 0))
 	{
-		*ucP++ = (U8)( nVal >> 8 );
-		*ucP++ = (U8)( nVal & 0xff );
+		pNode->SplitDim = -1;
+		pNode->Less		= First;
+		pNode->More		= Count;
+		return Node;
+	}
+
+	/*
+	// sort them on that component (there aren't many), and split them
+	// in the middle
+	*/
+	for(i = First + 1; i < First + Count; i++)
+	{
+		Rep	  = pKdReps[i];
+		Value = pRepVectors[Rep].v[SplitDim];
+
+		for(j = i; (j > First) && (pRepVectors[pKdReps[j - 1]].v[SplitDim] > Value); j--)
+		{
+			pKdReps[j] = pKdReps[j - 1];
+		}
+		pKdReps[j] = Rep;
 	}
+
+	Half = Count / 2;
+
+	pNode->SplitDim = SplitDim;
+	pNode->LessMax	= pRepVectors[pKdReps[First + Half - 1]].v[SplitDim];
+	pNode->MoreMin	= pRepVectors[pKdReps[First + Half]].v[SplitDim];
+
+	/*
+	// (pNode is still valid, as the nodes don't move)
+	*/
+	pNode->Less = BuildKdNode(pRepVectors, pKdReps, First, Half,
+							  KdNodes, pNumNodes, pStats);
+	pNode->More = BuildKdNode(pRepVectors, pKdReps, First + Half, Count - Half,
+							  KdNodes, pNumNodes, pStats);
+
+	return Node;
 }
 
-/*************************************************
-//
-// DeTwiddle
-//
-// The textures are stored in twiddled format, i.e. X and Y
-// index bits are alternated.
-//
-// This takes the linear position of a particular pixel in 
-// the twiddled texture, and works out what it's x an y coordinates 
-// are.
-//
-// This is not the most efficient way of doing it, but it's a
-// completely insignificant part of the overall runtime.
+static void BuildKdTree(const PIXEL_VECT *pRepVectors,
+								int		 NumReps,
+							KD_NODE		 KdNodes[MAX_KD_NODES],
+								int		 KdReps[MAX_CODES],
+					   SEARCH_STATS		*pStats)
+{
+	int i, NumNodes;
+
+	for(i = 0; i < NumReps; i++)
+	{
+		KdReps[i] = i;
+	}
+
+	NumNodes = 0;
+	BuildKdNode(pRepVectors, KdReps, 0, NumReps, KdNodes, &NumNodes, pStats);
+}
+
+
+/*********************************************************
+* Distance and dot product kernels
+*********************************************************/
+/*
+// FindClosestVector spends nearly all its time in 16 wide integer dot products
+// (walking the search tree) and squared distances (checking the neighbours).
+// Both are done on a copy of the image vector packed into shorts. Every value
+// fits in 16 bits (vectors and reps are 0..255, the axes -255..255), and the
+// sum of any two products fits in 32, so the SIMD versions can use the
+// multiply-add instructions and still give exactly the same sums.
 //
-*************************************************/
+// The scalar versions use NumDims to skip the components we don't use, i.e.
+// alpha for RGB, and the empty slots of the packed YUV data. Those are the
+// same in every image vector and rep (see GetNumDims) so they add nothing to
+// the sums. In the SIMD versions the unused components are interleaved with
+// the used ones and cost nothing extra, so they are simply included.
+*/
+/*
+// Scalar versions, one for each value of NumDims.
+*/
+static int VectorDistance16(const short Vector[VECLEN], const U8 Rep[VECLEN])
+{
+	int i, Dist;
 
-static void DeTwiddle( int addr, int *xparam, int *yparam )
+	Dist = 0;
+	for(i = 0; i < VECLEN; i++)
+	{
+		Dist += SQ(Vector[i] - Rep[i]);
+	}
+	return Dist;
+}
+
+static int VectorDistance12(const short Vector[VECLEN], const U8 Rep[VECLEN])
 {
-	int p;
-	int x,y;
+	int i, Dist;
 
+	/*
+	// skip the alpha of each pixel
+	*/
+	Dist = 0;
+	for(i = 0; i < VECLEN; i += MAX_COMPS_PER_PIXEL)
+	{
+		Dist += SQ(Vector[i]   - Rep[i]) +
+				SQ(Vector[i+1] - Rep[i+1]) +
+				SQ(Vector[i+2] - Rep[i+2]);
+	}
+	return Dist;
+}
 
-	x = 0;
-	y = 0;
+static int VectorDistance8(const short Vector[VECLEN], const U8 Rep[VECLEN])
+{
+	int i, Dist;
 
 	/*
-	// check the 16 positions
+	// just the Y and U (or V) of each pixel
 	*/
-	for(p = 16; p!=0 ; p --)
+	Dist = 0;
+	for(i = 0; i < VECLEN; i += MAX_COMPS_PER_PIXEL)
 	{
-		y >>= 1;
-		x >>= 1;
+		Dist += SQ(Vector[i]   - Rep[i]) +
+				SQ(Vector[i+1] - Rep[i+1]);
+	}
+	return Dist;
+}
 
-		/*
-		// distribute the next two MSBs to the y and x indices
-		*/
-		y = y | (addr & 1) << 15;
-		addr >>= 1;
-		x = x | (addr & 1) << 15;
-		addr >>= 1;
+static int VectorDot16(const short Vector[VECLEN], const short Axis[VECLEN])
+{
+	int i, DotProd;
+
+	DotProd = 0;
+	for(i = 0; i < VECLEN; i++)
+	{
+		DotProd += Vector[i] * Axis[i];
 	}
+	return DotProd;
+}
 
-	*xparam = x;
-	*yparam = y;
+static int VectorDot12(const short Vector[VECLEN], const short Axis[VECLEN])
+{
+	int i, DotProd;
+
+	DotProd = 0;
+	for(i = 0; i < VECLEN; i += MAX_COMPS_PER_PIXEL)
+	{
+		DotProd += Vector[i]   * Axis[i] +
+				   Vector[i+1] * Axis[i+1] +
+				   Vector[i+2] * Axis[i+2];
+	}
+	return DotProd;
 }
 
-						
-/******************************************************************************
- * From			: vqfmem.c
- * Title		: Vector Quantisation Compression Code
- * Author		: Julian Hodgson.
- * Created		: 17/03/1997
- * Modified		: 17/11/1999 Simon Fenney:
- *							Adapted to new compression algorithm.
- ******************************************************************************/
-int WriteVqfMemory(		void *MemoryOut, 
-						int nFormat,
-						int AlphaSupplied, 
+static int VectorDot8(const short Vector[VECLEN], const short Axis[VECLEN])
+{
+	int i, DotProd;
 
-						int bWriteVQFHeader,
+	DotProd = 0;
+	for(i = 0; i < VECLEN; i += MAX_COMPS_PER_PIXEL)
+	{
+		DotProd += Vector[i]   * Axis[i] +
+				   Vector[i+1] * Axis[i+1];
+	}
+	return DotProd;
+}
 
-						IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
-						int NumMaps,
 
-						PIXEL_VECT Reps[MAX_CODES],
-						int	nNumCodes,
-						int Reorder[MAX_CODES])
+#if X86_VECTOR_KERNELS
+/*
+// SSE2 versions: the 16 components are in two registers
+*/
+__attribute__((target("sse2"), always_inline))
+static inline int HorizontalSumSSE2(__m128i Sum)
+{
+	Sum = _mm_add_epi32(Sum, _mm_shuffle_epi32(Sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	Sum = _mm_add_epi32(Sum, _mm_shuffle_epi32(Sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return _mm_cvtsi128_si32(Sum);
+}
 
+__attribute__((target("sse2")))
+static int VectorDistanceSSE2(const short Vector[VECLEN], const U8 Rep[VECLEN])
 {
-	int			x=0, y=0, addr=0;
-	int			i, j, lev;
-	int			r, g, b, a;
-	int			nTemp=0;
-	PIXEL_VECT	*psVector;
-	int			nHt=0;
-	int			nWd=0;
+	__m128i Zero, RepBytes, Diff0, Diff1;
 
-	int			nEndian=0;
-	int			map=0, size=0, code_book_size=0;
-	int			code_out=0;
-	U8 *ucPtr;
+	Zero	 = _mm_setzero_si128();
+	RepBytes = _mm_loadu_si128((const __m128i *) Rep);
 
-	int InvReorder[MAX_CODES];
+	Diff0 = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) Vector),
+						  _mm_unpacklo_epi8(RepBytes, Zero));
+	Diff1 = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (Vector + 8)),
+						  _mm_unpackhi_epi8(RepBytes, Zero));
 
- 
-#if HACK_SHOW_LOWER_MAPS
- 	int Direction;
-#endif
+	return HorizontalSumSSE2(_mm_add_epi32(_mm_madd_epi16(Diff0, Diff0),
+										   _mm_madd_epi16(Diff1, Diff1)));
+}
 
-	/*
-	// Write as if machine is little endian 
-	*/
-	nEndian = LITTLE_ENDIAN;
+__attribute__((target("sse2")))
+static int VectorDotSSE2(const short Vector[VECLEN], const short Axis[VECLEN])
+{
+	__m128i Prod0, Prod1;
 
-	ucPtr = ( U8 *) MemoryOut;
+	Prod0 = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) Vector),
+						   _mm_loadu_si128((const __m128i *) Axis));
+	Prod1 = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (Vector + 8)),
+						   _mm_loadu_si128((const __m128i *) (Axis + 8)));
 
+	return HorizontalSumSSE2(_mm_add_epi32(Prod0, Prod1));
+}
 
-	/*
-	// round the number of codes up to the next power 2 that we handle
-	// as part of the VQF format.
-	*/
-	for(i = 8; i < nNumCodes; i <<= 1 )
+
+/*
+// AVX2 versions: all 16 components in one register
+*/
+__attribute__((target("avx2"), always_inline))
+static inline int HorizontalSumAVX2(__m256i Sum)
+{
+	__m128i Half;
+
+	Half = _mm_add_epi32(_mm256_castsi256_si128(Sum), _mm256_extracti128_si256(Sum, 1));
+	Half = _mm_add_epi32(Half, _mm_shuffle_epi32(Half, _MM_SHUFFLE(1, 0, 3, 2)));
+	Half = _mm_add_epi32(Half, _mm_shuffle_epi32(Half, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return _mm_cvtsi128_si32(Half);
+}
+
+__attribute__((target("avx2")))
+static int VectorDistanceAVX2(const short Vector[VECLEN], const U8 Rep[VECLEN])
+{
+	__m256i Diff;
+
+	Diff = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *) Vector),
+				_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) Rep)));
+
+	return HorizontalSumAVX2(_mm256_madd_epi16(Diff, Diff));
+}
+
+__attribute__((target("avx2")))
+static int VectorDotAVX2(const short Vector[VECLEN], const short Axis[VECLEN])
+{
+	return HorizontalSumAVX2(_mm256_madd_epi16(
+				_mm256_loadu_si256((const __m256i *) Vector),
+				_mm256_loadu_si256((const __m256i *) Axis)));
+}
+#endif /*X86_VECTOR_KERNELS*/
+
+
+/*
+// Pick the fastest kernels that the CPU we're running on supports
+*/
+static void SelectVectorKernels(int NumDims, VECTOR_KERNELS *pKernels)
+{
+#if X86_VECTOR_KERNELS
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2"))
 	{
-		/* keep doubling until we get enough codes */
+		pKernels->pfnDistance	= VectorDistanceAVX2;
+		pKernels->pfnDotProduct = VectorDotAVX2;
+		pKernels->pszName		= "AVX2";
+		return;
 	}
-	nNumCodes = i;
+	if(__builtin_cpu_supports("sse2"))
+	{
+		pKernels->pfnDistance	= VectorDistanceSSE2;
+		pKernels->pfnDotProduct = VectorDotSSE2;
+		pKernels->pszName		= "SSE2";
+		return;
+	}
+#endif
+
+	switch(NumDims)
+	{
+		case 8:
+			pKernels->pfnDistance	= VectorDistance8;
+			pKernels->pfnDotProduct = VectorDot8;
+			pKernels->pszName		= "scalar (8 dims)";
+			break;
+
+		case 12:
+			pKernels->pfnDistance	= VectorDistance12;
+			pKernels->pfnDotProduct = VectorDot12;
+			pKernels->pszName		= "scalar (12 dims)";
+			break;
+
+		default:
+			ASSERT(NumDims == VECLEN)
+			pKernels->pfnDistance	= VectorDistance16;
+			pKernels->pfnDotProduct = VectorDot16;
+			pKernels->pszName		= "scalar (16 dims)";
+			break;
+	}
+}
 
 
+#if TEST_VECTOR_KERNELS
+/*
+// Check every kernel we can run against the plain 16 wide scalar code, and
+// time them. The random test vectors follow the same rules as the real ones,
+// i.e. the components outside NumDims are the same in the vectors and reps.
+*/
+#define KERNEL_TEST_VECTORS (1024)
+#define KERNEL_TEST_PASSES	(2000)
+
+static void TestVectorKernels(void)
+{
+	static const int DimsList[3] = {8, 12, 16};
+
+	VECTOR_KERNELS Kernels[6];
+	int NumKernels;
+
+	static short Vectors[KERNEL_TEST_VECTORS][VECLEN];
+	static short Axes[KERNEL_TEST_VECTORS][VECLEN];
+	static U8	 Reps[KERNEL_TEST_VECTORS][VECLEN];
+
+	int d, k, i, j, Pass;
+	int Failures;
+	volatile int Sink;
 
 	/*
-	// if writing the header in VQF Format
+	// the scalar ones for every NumDims, plus whatever the CPU can do
 	*/
-	if(bWriteVQFHeader)
+	NumKernels = 0;
+	for(d = 0; d < 3; d++)
 	{
+		Kernels[NumKernels].pfnDistance	  = (d == 0) ? VectorDistance8 : (d == 1) ? VectorDistance12 : VectorDistance16;
+		Kernels[NumKernels].pfnDotProduct = (d == 0) ? VectorDot8	   : (d == 1) ? VectorDot12		 : VectorDot16;
+		Kernels[NumKernels].pszName		  = (d == 0) ? "scalar (8 dims)" : (d == 1) ? "scalar (12 dims)" : "scalar (16 dims)";
+		NumKernels++;
+	}
+#if X86_VECTOR_KERNELS
+	__builtin_cpu_init();
 
-		/* Two chars */
-		*ucPtr++ = 'P';
-		*ucPtr++ = 'V';
-			
-		/* map_type */
-		switch( nFormat) 
+	if(__builtin_cpu_supports("sse2"))
+	{
+		Kernels[NumKernels].pfnDistance	  = VectorDistanceSSE2;
+		Kernels[NumKernels].pfnDotProduct = VectorDotSSE2;
+		Kernels[NumKernels].pszName		  = "SSE2";
+		NumKernels++;
+	}
+	if(__builtin_cpu_supports("avx2"))
+	{
+		Kernels[NumKernels].pfnDistance	  = VectorDistanceAVX2;
+		Kernels[NumKernels].pfnDotProduct = VectorDotAVX2;
+		Kernels[NumKernels].pszName		  = "AVX2";
+		NumKernels++;
+	}
+#endif
+
+	for(d = 0; d < 3; d++)
+	{
+		/*
+		// Make up some test data, including the extremes
+		*/
+		srand(d + 1);
+		for(i = 0; i < KERNEL_TEST_VECTORS; i++)
 		{
-			case FORMAT_4444:
-				map = 9;
-				break;
-    
-			case FORMAT_1555:
-				if ( AlphaSupplied)
-					map = 8;
+			for(j = 0; j < VECLEN; j++)
+			{
+				int Comp = j & (MAX_COMPS_PER_PIXEL - 1);
+				int Used = (DimsList[d] == 16) || (Comp < DimsList[d] / 4);
+
+				if(i < 2)
+				{
+					Vectors[i][j] = (short) (i ? 255 : 0);
+					Reps[i][j]	  = (U8) (i ? 0 : 255);
+					Axes[i][j]	  = (short) (i ? -255 : 255);
+				}
 				else
-					map = 6;
-				break;
-    
+				{
+					Vectors[i][j] = (short) (rand() & 255);
+					Reps[i][j]	  = (U8) (rand() & 255);
+					Axes[i][j]	  = (short) ((rand() % 511) - 255);
+				}
+
+				if(!Used)
+				{
+					Vectors[i][j] = Reps[i][j];
+					Axes[i][j]	  = 0;
+				}
+			}
+		}
+
+		for(k = 0; k < NumKernels; k++)
+		{
+			clock_t Start, End;
+			double Seconds;
+
+			/*
+			// the scalar ones only work with their own NumDims (or wider)
+			*/
+			if((k < 3) && (k < d))
+			{
+				continue;
+			}
+
+			Failures = 0;
+			for(i = 0; i < KERNEL_TEST_VECTORS; i++)
+			{
+				if(Kernels[k].pfnDistance(Vectors[i], Reps[i]) !=
+						VectorDistance16(Vectors[i], Reps[i]))
+				{
+					Failures++;
+				}
+				if(Kernels[k].pfnDotProduct(Vectors[i], Axes[i]) !=
+						VectorDot16(Vectors[i], Axes[i]))
+				{
+					Failures++;
+				}
+			}
+
+			Sink  = 0;
+			Start = clock();
+			for(Pass = 0; Pass < KERNEL_TEST_PASSES; Pass++)
+			{
+				for(i = 0; i < KERNEL_TEST_VECTORS; i++)
+				{
+					Sink += Kernels[k].pfnDistance(Vectors[i], Reps[i]);
+				}
+			}
+			End = clock();
+
+			Seconds = (double) (End - Start) / CLOCKS_PER_SEC;
+			if(Seconds <= 0.0)
+			{
+				Seconds = 1.0 / CLOCKS_PER_SEC;
+			}
+
+			DEB_OUT "Kernel %-17s NumDims %2d: %s, %.1f million distances/sec\n",
+				Kernels[k].pszName, DimsList[d],
+				Failures ? "FAILED" : "ok",
+				(double) KERNEL_TEST_PASSES * KERNEL_TEST_VECTORS / Seconds / 1.0e6);
+
+			ASSERT(Failures == 0)
+		}
+	}
+}
+#endif /*TEST_VECTOR_KERNELS*/
+
+
+/*********************************************************
+* Find Closest Colour (using the Nearest Neighbour table)
+*********************************************************/
+
+
+/*
+// Acceleration structure used to stop retesting of the same codes
+*/
+#define SIZE_ALL_READY_TESTED_BLOCK ((MAX_CODES + 31) / 32)
+
+
+
+static int FindClosestVector(const int Vector[VECLEN],
+					const REP_SEARCH_STRUCT *pSearch,
+							  SEARCH_STATS *pStats,
+					   		   int *pDistance)
+{
+	int i, j;
+
+	const SearchTreeNode *pSearchRoot;
+	const PIXEL_VECT *pRepVectors;
+	int NumReps;
+	const NeighbInfo (*NeighbourArray)[MAX_CODES - 1];
+	const VECTOR_KERNELS *pKernels;
+
+	const PIXEL_VECT *pThisRep;
+	int BestDistance, BestIndex, Dist;
+	int CutoffDist;
+	int GuessIndex, NumCalcs;
+
+	unsigned int Done[SIZE_ALL_READY_TESTED_BLOCK];
+
+	short PackedVector[VECLEN];
+
+	pSearchRoot		= pSearch->pSearchRoot;
+	pRepVectors		= pSearch->pRepVectors;
+	NumReps			= pSearch->NumReps;
+	NeighbourArray	= pSearch->pNeighbours;
+	pKernels		= pSearch->pKernels;
+
+	/*
+	// pack the vector for the distance kernels
+	*/
+	for(i=0; i < VECLEN; i++)
+	{
+		PackedVector[i] = (short) Vector[i];
+	}
+
+	/*
+	// begin by using the tree structure to make an initial guess as to the
+	// best candidate
+	*/
+	NumCalcs = 0;
+	while(pSearchRoot->LeafRepIndex < 0)
+	{
+		int DotProd;
+		/*
+		// get the dot product with the splitting planes axis
+		*/
+		DotProd = pKernels->pfnDotProduct(PackedVector, pSearchRoot->SplittingAxis);
+
+		NumCalcs++; /*about equivalent to a distance calc*/
+
+		if(DotProd <= pSearchRoot->d)
+		{
+			pSearchRoot= pSearchRoot->pLess;
+		}
+		else
+		{
+			pSearchRoot= pSearchRoot->pMore;
+		}
+	}/*end while*/
+
+	
+	BestIndex  = pSearchRoot->LeafRepIndex;
+	GuessIndex = BestIndex;
+
+	ASSERT(pSearchRoot->LeafRepIndex < NumReps)
+	
+	
+	/*
+	//Setup which ones we've already done
+	*/
+	for(i = 0; i < SIZE_ALL_READY_TESTED_BLOCK; i++)
+	{ 
+		Done[i] = 0;
+	}
+
+	/*
+	// Mark off this one
+	*/
+	Done[BestIndex >> 5] |= (1 << (BestIndex &31));
+
+	/*
+	// measure the distance
+	*/
+	pThisRep = pRepVectors + BestIndex; 
+
+	BestDistance = pKernels->pfnDistance(PackedVector, pThisRep->v);
+	NumCalcs++;
+
+	/*
+	// Compute the Cutoff distance. This is the half-way point,
+	// but because we are using the squares of the distance, this
+	// is actually 4* rather than 2*.
+	*/
+	CutoffDist = BestDistance * 4;
+
+	/*
+	// Check that this IS the best representative vector
+	*/
+	for(j = 0; j < NumReps - 1; j++)
+	{
+		int ThisNeighbour;
+
+		/*
+		// Can we trivially reject the next nearest neighbour (and hence
+		// ALL other neighbours) 
+		*/
+		if(CutoffDist < NeighbourArray[BestIndex][j].Distance)
+		{
+			/*
+			// Eureka! we don't need to check any further
+			*/
+			break;
+		}
+
+
+		ThisNeighbour = NeighbourArray[BestIndex][j].OtherRep;
+
+		/*
+		// Right on the cutoff, the neighbour can be at most as near as our
+		// best, which only matters if it would win the tie (i.e. it's got a
+		// lower index, as the other searches pick)
+		*/
+		if((CutoffDist == NeighbourArray[BestIndex][j].Distance) && (ThisNeighbour > BestIndex))
+		{
+			continue;
+		}
+		/*
+		// if we've already done this one
+		*/
+		if(Done[ThisNeighbour >> 5] & (1 << (ThisNeighbour &31)))
+		{
+			continue;
+		}
+
+		/*
+		// Else see if we are actually closer to this neighbour
+		*/
+		pThisRep = pRepVectors + NeighbourArray[BestIndex][j].OtherRep;
+		Dist = pKernels->pfnDistance(PackedVector, pThisRep->v);
+		NumCalcs++;
+
+		/*
+		// if this distance is BETTER than our current best (or as good,
+		// with a lower index), then change our best
+		*/
+		if((Dist < BestDistance) || ((Dist == BestDistance) && (ThisNeighbour < BestIndex)))
+		{
+			BestDistance = Dist;
+			CutoffDist = BestDistance * 4;
+
+			BestIndex = ThisNeighbour;
+
+			/*
+			// restart the for loop
+			*/
+			j = -1;
+		}
+
+		/*
+		// else mark this one off as already done
+		*/
+		else
+		{
+			Done[ThisNeighbour >> 5] |= (1 << (ThisNeighbour &31));
+		} /*end if this other rep is closer*/
+	}/*end for testing the neighbours in order of distance*/
+
+	pStats->NumSearches		 += 1;
+	pStats->NumDistanceCalcs += NumCalcs;
+	pStats->TreeHits		 += (BestIndex == GuessIndex);
+
+	/*
+	// Return the error. The caller sums these up.
+	*/
+	*pDistance = BestDistance;
+
+	#if CHECK_FAST_LOOKUP
+	if(1)  /*this is the first value we actually try*/
+	{
+		BestDistance = 0;
+
+		for(j = 0; j < VECLEN; j++)
+		{
+			BestDistance += SQ(pRepVectors[BestIndex].v[j] - Vector[j]);
+		}
+
+
+		for(i = 0; i < NumReps; i++)
+		{
+			/*
+			// measure the distance
+			*/
+			Dist = 0;
+
+			for(j = 0; j < VECLEN; j++)
+			{
+				Dist += SQ(pRepVectors->v[j] - Vector[j]);
+			}
+
+			if(Dist < BestDistance)
+			{
+
+				DEB_OUT "Error! Best distance NOT obtained (%d vs %d)\n", Dist, BestDistance );
+
+				return i;
+			}
+
+			pRepVectors++;
+
+		}/*end for i*/
+	}
+	#endif
+	return BestIndex;
+}
+
+
+/*********************************************************
+* Find Closest Colour (using the k-d tree)
+*********************************************************/
+/*
+// A plain nearest first search of the tree, skipping any subtree whose
+// reps must all be further away than the best found so far. CellDistance
+// is a lower bound on the distance to any of the node's reps: the sum of
+// the squares of Offsets, the distance along each component from the
+// vector to the box its reps lie in.
+//
+// Of equally near reps, this finds the lowest numbered one, so it gives
+// exactly the same results as VQSearchExhaustive.
+*/
+typedef struct
+{
+	const REP_SEARCH_STRUCT *pSearch;
+	int NumCalcs;
+
+	short PackedVector[VECLEN];
+	int	  Offsets[VECLEN];
+
+	int BestDistance, BestIndex;
+}KD_SEARCH_STATE;
+
+static void SearchKdNode(KD_SEARCH_STATE *pState, int Node, int CellDistance)
+{
+	const KD_NODE *pNode;
+	int Near, Far, Value, OldOffset, FarOffset, FarDistance;
+	int i, Rep, Dist;
+
+	pNode = &pState->pSearch->pKdNodes[Node];
+
+	if(pNode->SplitDim < 0)
+	{
+		for(i = pNode->Less; i < pNode->Less + pNode->More; i++)
+		{
+			Rep	 = pState->pSearch->pKdReps[i];
+			Dist = pState->pSearch->pKernels->pfnDistance(pState->PackedVector,
+								pState->pSearch->pRepVectors[Rep].v);
+
+			pState->NumCalcs++;
+
+			if((Dist < pState->BestDistance) ||
+			   ((Dist == pState->BestDistance) && (Rep < pState->BestIndex)))
+			{
+				pState->BestDistance = Dist;
+				pState->BestIndex	 = Rep;
+			}
+		}
+		return;
+	}
+
+	/*
+	// Go down the side the vector's nearest first
+	*/
+	Value = pState->PackedVector[pNode->SplitDim];
+
+	if(2 * Value <= pNode->LessMax + pNode->MoreMin)
+	{
+		Near	  = pNode->Less;
+		Far		  = pNode->More;
+		FarOffset = pNode->MoreMin - Value;
+	}
+	else
+	{
+		Near	  = pNode->More;
+		Far		  = pNode->Less;
+		FarOffset = Value - pNode->LessMax;
+	}
+
+	SearchKdNode(pState, Near, CellDistance);
+
+	/*
+	// The far side's reps are in this node's box too, so it's at least
+	// as far away along this component as the box is
+	*/
+	OldOffset = pState->Offsets[pNode->SplitDim];
+	if(FarOffset < OldOffset)
+	{
+		FarOffset = OldOffset;
+	}
+
+	FarDistance = CellDistance - SQ(OldOffset) + SQ(FarOffset);
+
+	if(FarDistance <= pState->BestDistance)
+	{
+		pState->Offsets[pNode->SplitDim] = FarOffset;
+		SearchKdNode(pState, Far, FarDistance);
+		pState->Offsets[pNode->SplitDim] = OldOffset;
+	}
+}
+
+static int FindClosestKd(const int Vector[VECLEN],
+				const REP_SEARCH_STRUCT *pSearch,
+						  SEARCH_STATS *pStats,
+							   int *pDistance)
+{
+	KD_SEARCH_STATE State;
+	int i;
+
+	State.pSearch  = pSearch;
+	State.NumCalcs = 0;
+
+	for(i = 0; i < VECLEN; i++)
+	{
+		State.PackedVector[i] = (short) Vector[i];
+		State.Offsets[i]	  = 0;
+	}
+
+	State.BestDistance = INT_MAX;
+	State.BestIndex	   = INT_MAX;
+
+	SearchKdNode(&State, 0, 0);
+
+	pStats->NumSearches		 += 1;
+	pStats->NumDistanceCalcs += State.NumCalcs;
+
+	*pDistance = State.BestDistance;
+	return State.BestIndex;
+}
+
+
+/*********************************************************
+* Find Closest Colour (by trying all of them)
+*********************************************************/
+/*
+// This is the yardstick for the other searches. Of equally near reps, it
+// picks the lowest numbered one.
+*/
+static int FindClosestExhaustive(const int Vector[VECLEN],
+						const REP_SEARCH_STRUCT *pSearch,
+								  SEARCH_STATS *pStats,
+									   int *pDistance)
+{
+	short PackedVector[VECLEN];
+	int i, Dist, BestDistance, BestIndex;
+
+	for(i = 0; i < VECLEN; i++)
+	{
+		PackedVector[i] = (short) Vector[i];
+	}
+
+	BestDistance = INT_MAX;
+	BestIndex	 = 0;
+	for(i = 0; i < pSearch->NumReps; i++)
+	{
+		Dist = pSearch->pKernels->pfnDistance(PackedVector, pSearch->pRepVectors[i].v);
+
+		if(Dist < BestDistance)
+		{
+			BestDistance = Dist;
+			BestIndex	 = i;
+		}
+	}
+
+	pStats->NumSearches		 += 1;
+	pStats->NumDistanceCalcs += pSearch->NumReps;
+
+	*pDistance = BestDistance;
+	return BestIndex;
+}
+
+
+#if CHECK_SEARCH_INDEX
+/*
+// Runs the chosen search, and checks it against the exhaustive one
+*/
+static int FindClosestChecked(const int Vector[VECLEN],
+					  const REP_SEARCH_STRUCT *pSearch,
+								SEARCH_STATS *pStats,
+									 int *pDistance)
+{
+	SEARCH_STATS CheckStats;
+	int Code, CheckCode, CheckDistance;
+
+	Code = pSearch->pfnCheckedFind(Vector, pSearch, pStats, pDistance);
+
+	memset(&CheckStats, 0, sizeof(CheckStats));
+	CheckCode = FindClosestExhaustive(Vector, pSearch, &CheckStats, &CheckDistance);
+
+	ASSERT((Code == CheckCode) && (*pDistance == CheckDistance))
+
+	return Code;
+}
+#endif
+
+
+/*********************************************************
+* Set up the nearest rep search
+*********************************************************/
+static const char *SearchIndexName(int SearchIndex)
+{
+	switch(SearchIndex)
+	{
+		case VQSearchKdTree:	 return "k-d tree";
+		case VQSearchExhaustive: return "exhaustive";
+		default:				 return "neighbour lists";
+	}
+}
+
+/*
+// This has to be done each time the reps change, i.e. before each pass of
+// mapping the image to them.
+*/
+static void BuildSearchIndex(VQ_CONTEXT *pContext,
+					 const PIXEL_VECT *pRepVectors,
+								  int NumReps,
+				 const VECTOR_KERNELS *pKernels,
+					REP_SEARCH_STRUCT *pSearch)
+{
+	pSearch->pRepVectors = pRepVectors;
+	pSearch->NumReps	 = NumReps;
+	pSearch->pKernels	 = pKernels;
+	pSearch->pSearchRoot = NULL;
+	pSearch->pNeighbours = NULL;
+	pSearch->pKdNodes	 = NULL;
+	pSearch->pKdReps	 = NULL;
+
+	pContext->Stats.NumSearches		 = 0;
+	pContext->Stats.NumDistanceCalcs = 0;
+	pContext->Stats.SetupCalcs		 = 0;
+	pContext->Stats.TreeHits		 = 0;
+
+	switch(pContext->SearchIndex)
+	{
+		case VQSearchKdTree:
+			BuildKdTree(pRepVectors, NumReps, pContext->KdNodes, pContext->KdReps,
+						&pContext->Stats);
+
+			pSearch->pfnFindClosest = FindClosestKd;
+			pSearch->pKdNodes		= pContext->KdNodes;
+			pSearch->pKdReps		= pContext->KdReps;
+			break;
+
+		case VQSearchExhaustive:
+			pSearch->pfnFindClosest = FindClosestExhaustive;
+			break;
+
+		default:
+			/*
+			// Complete the search tree for the initial Guess
+			*/
+			BuildSearchTree(pRepVectors, &pContext->TreeNodes[0], &pContext->Stats);
+
+			/*
+			// create the NxN Nearest neighbour structure.
+			*/
+			BuildNeighbourList(pRepVectors, NumReps, pContext->NeighbourArray, &pContext->Stats);
+
+			pSearch->pfnFindClosest = FindClosestVector;
+			pSearch->pSearchRoot	= &pContext->TreeNodes[0];
+			pSearch->pNeighbours	= pContext->NeighbourArray;
+			break;
+	}
+
+#if CHECK_SEARCH_INDEX
+	pSearch->pfnCheckedFind = pSearch->pfnFindClosest;
+	pSearch->pfnFindClosest = FindClosestChecked;
+#endif
+}
+
+
+
+
+/*********************************************************
+* Special case for the 1x1 MIP map level
+*********************************************************/
+static int SinglePixelFind(PIXEL_VECT *pVector,
+							 const PIXEL_VECT *pRepVectors,
+					   		   int NumReps)
+{
+	int i, j;
+
+	int BestDistance, BestIndex, Dist;
+
+	BestDistance = INT_MAX;
+	BestIndex = INT_MAX; /*To stop compiler warnings and trap errors*/
+	/*
+	// Run through ALL of the reps. Since this is a "one off", it's not
+	// significant.
+	*/
+	for(j = 0; j < NumReps; j++)
+	{
+		/*
+		// measure the distance - BUT ONLY FOR THE FIRST PIXEL
+		*/
+		Dist = 0;
+		for(i=0; i < MAX_COMPS_PER_PIXEL; i++)
+		{
+			Dist += SQ(pVector->v[i] - pRepVectors->v[i]);
+		}
+		pRepVectors ++;
+
+
+		/*
+		// if this distance is better
+		*/
+		if(Dist < BestDistance)
+		{
+			BestDistance = Dist;
+
+			BestIndex = j;
+		}
+	}/*end for*/
+
+	return BestIndex;
+}
+
+
+/*********************************************************
+* Map one row of vectors to their closest representatives
+*********************************************************/
+/*
+// This is shared by the serial and the threaded mapping code so that they
+// give exactly the same results.
+//
+// pPreviousRow and pCurrentRow are the vertical errors for the row of pixels
+// above this row of vectors and for its bottom row of pixels. They are only
+// used when dithering. With bOrderedDither, the ordered dither offsets are
+// added instead (DiffusionLevel must be 0), for which y is the row's place
+// in the map.
+//
+// Rather than summing up the errors here, the distance to the chosen rep for
+// each vector is stored in pDistances. The caller must add them up in scan
+// order, as the float total depends on the order of the additions.
+//
+// When dithering in threads, pAboveDone counts how many vectors of the row
+// above have been completed (we can't start on a vector until the one above
+// it is done), and pThisDone is where we report our own progress. Otherwise
+// both are NULL.
+*/
+static void MapRowToIndices(PIXEL_VECT *pVector,
+							 	   int	xVDim,
+							 const int	*pPreviousRow,
+								   int	*pCurrentRow,
+			   const REP_SEARCH_STRUCT	*pSearch,
+					  SUM_USAGE_STRUCT	SumAndUsage[MAX_CODES],
+						  SEARCH_STATS	*pStats,
+								   int	DiffusionLevel,
+								   int	DiffusionLimit,
+								   int	bOrderedDither,
+								   int	y,
+								   int	*pDistances,
+				const ROW_PROGRESS_TYPE	*pAboveDone,
+					 ROW_PROGRESS_TYPE	*pThisDone)
+{
+	int HErr[PIXEL_BLOCK_SIZE][MAX_COMPS_PER_PIXEL];
+	int x, i;
+	int AboveDone;
+
+	AboveDone = 0;
+
+	if(DiffusionLevel > 0)
+	{
+		/*
+		// clear the horizontal error...
+		*/
+		for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
+		{
+			HErr[0][i] = 0;
+			HErr[1][i] = 0;
+		}
+
+		/*
+		// and reset the first output vertical error
+		*/
+		for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
+		{
+			pCurrentRow[i] = 0;
+		}
+	}
+
+
+	/*
+	// step through the row
+	*/
+	for(x = 0; x < xVDim; x++)
+	{
+		int NewVector[VECLEN];
+		int Code;
+
+
+		/*
+		// Put in the error from neighbouring vectors
+		//
+		// NEED TO DO SOME ASCII ART HERE
+		//
+		*/
+		if(DiffusionLevel > 0)
+		{
+		#if MULTI_THREADED
+			/*
+			// wait for the vector above to be finished with
+			*/
+			if(pAboveDone != NULL)
+			{
+				while(AboveDone <= x)
+				{
+					AboveDone = atomic_load_explicit(pAboveDone, memory_order_acquire);
+
+					if(AboveDone <= x)
+					{
+						thrd_yield();
+					}
+				}
+			}
+		#endif
+
+			/*
+			// do error diffusion on only the required components
+			*/
+			for(i = 0; i < DiffusionLimit; i++)
+			{
+				int index;
+
+				/*
+				// Top Left
+				*/
+				NewVector[i] = pVector->v[i] + HErr[0][i] + pPreviousRow[i];
+
+				CLAMP(NewVector[i], 0, 255);
+
+				/*
+				// Top Right
+				*/
+				index = i+MAX_COMPS_PER_PIXEL;
+				NewVector[index] = pVector->v[index] + pPreviousRow[index];
+
+				CLAMP(NewVector[index], 0, 255);
+
+				/*
+				// Bottom Left
+				*/
+				index += MAX_COMPS_PER_PIXEL;
+				NewVector[index] = pVector->v[index] + HErr[1][i];
+
+				CLAMP(NewVector[index], 0, 255);
+
+				/*
+				// Bottom Right (no error to accumulate)
+				*/
+				index += MAX_COMPS_PER_PIXEL;
+
+				NewVector[index] = pVector->v[index];
+
+			}/*end for*/
+
+
+			/*
+			// for any remaining components, just copy the values
+			*/
+			for(/*nil*/; i < MAX_COMPS_PER_PIXEL; i++)
+			{
+				NewVector[i] = pVector->v[i];
+				NewVector[i +   MAX_COMPS_PER_PIXEL] = pVector->v[i +   MAX_COMPS_PER_PIXEL];
+				NewVector[i + 2*MAX_COMPS_PER_PIXEL] = pVector->v[i + 2*MAX_COMPS_PER_PIXEL];
+				NewVector[i + 3*MAX_COMPS_PER_PIXEL] = pVector->v[i + 3*MAX_COMPS_PER_PIXEL];
+			}
+		}
+
+		/*
+		// Else no error diffusion
+		*/
+		else
+		{
+			for(i = 0; i < VECLEN; i++)
+			{
+				NewVector[i] = pVector->v[i];
+			}
+
+			/*
+			// but maybe ordered dithering, again on only the required
+			// components
+			*/
+			if(bOrderedDither)
+			{
+				int Pixel, Offset, index;
+
+				Offset = ((2 * OrderedDitherMatrix[y & 3][x & 3] - 15) * ORDERED_DITHER_RANGE) / 32;
+
+				for(Pixel = 0; Pixel < PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE; Pixel++)
+				{
+					for(i = 0; i < DiffusionLimit; i++)
+					{
+						index = Pixel * MAX_COMPS_PER_PIXEL + i;
+
+						NewVector[index] += Offset;
+
+						CLAMP(NewVector[index], 0, 255);
+					}
+				}
+			}
+		}
+
+
+		/*
+		// Find the closest match
+		*/
+		Code = pSearch->pfnFindClosest(NewVector, pSearch, pStats, &pDistances[x]);
+
+		pVector->wc.Code = Code;
+
+		/*
+		// keep track of the usage frequency, and sum of values
+		*/
+		SumAndUsage[Code].Usage++;
+
+		for(i = 0; i < VECLEN; i++)
+		{
+			SumAndUsage[Code].Sum[i] += NewVector[i];
+		}
+
+
+		if(DiffusionLevel > 0)
+		{
+			/*
+			// Compute the error
+			*/
+			for(i = 0; i < VECLEN; i++)
+			{
+				NewVector[i] =  NewVector[i] - pSearch->pRepVectors[Code].v[i];
+
+				/*
+				// Damp the error - trying to correct too large an error
+				// looks bad, so don't let it get out of hand.
+				*/
+				CLAMP(NewVector[i], -16, 16);
+
+				/*
+				// should we halve the error
+				*/
+				if(DiffusionLevel == 1)
+				{
+					NewVector[i] = HALF(NewVector[i]);
+				}
+			}/*end for i*/
+
+
+			/*
+			// Distribute the error
+			*/
+			for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
+			{
+				int ThreeEighths;
+				int OneQuarter;
+				int ThreeQuarters;
+				int index;
+	  		#if 0
+				/*
+				// NOTE: The following doesn't appear to improve anything -
+				//  In fact it seems to make things worse, so leave it out
+				// for the moment!
+				*/
+
+				/*
+				// Distribute the error from the top left to the errors
+				// of the other pixels
+				*/
+				ThreeEighths = NewVector[i];
+				OneQuarter =  NewVector[i] - 2 * ThreeEighths;
+
+				NewVector[i+MAX_COMPS_PER_PIXEL]   += ThreeEighths;
+				NewVector[i+2*MAX_COMPS_PER_PIXEL] += ThreeEighths;
+				NewVector[i+3*MAX_COMPS_PER_PIXEL] += OneQuarter;
+			#endif
+
+				/*
+				// Distribute top rights error
+				*/
+				index = i+MAX_COMPS_PER_PIXEL;
+
+				ThreeQuarters = THREE_4RS(NewVector[index]);
+				OneQuarter    = NewVector[index] - ThreeQuarters;
+
+				HErr[0][i] = ThreeQuarters;
+				HErr[1][i] = OneQuarter;
+
+				/*
+				// Distribute the bottom lefts error
+				*/
+				index = i+2*MAX_COMPS_PER_PIXEL;
+
+				ThreeQuarters = THREE_4RS(NewVector[index]);
+				OneQuarter = NewVector[index] - ThreeQuarters;
+
+				pCurrentRow[i] += ThreeQuarters;  /*NOTE addition here*/
+				pCurrentRow[i+MAX_COMPS_PER_PIXEL]  = OneQuarter;
+
+
+
+				/*
+				// Distribute the bottom rights error:
+				// i.e. to Right, Bottom, and Bottom Right.
+				*/
+				index = i+3*MAX_COMPS_PER_PIXEL;
+
+				ThreeEighths= THREE_8THS(NewVector[index]);
+				OneQuarter =  NewVector[index] - 2*ThreeEighths;
+
+				HErr[1][i] += ThreeEighths;			  /*NOTE addition here*/
+				pCurrentRow[i+MAX_COMPS_PER_PIXEL] += ThreeEighths;  /*NOTE addition here*/
+				pCurrentRow[i+2*MAX_COMPS_PER_PIXEL] = OneQuarter;
+			}/*end for i*/
+
+			/*
+			// Note that we are moving two pixels at a time
+			*/
+			pPreviousRow+= (2 * MAX_COMPS_PER_PIXEL);
+			pCurrentRow += (2 * MAX_COMPS_PER_PIXEL);
+
+		#if MULTI_THREADED
+			/*
+			// The two pixels of vertical error below this vector are now
+			// final, so the row below can have them.
+			*/
+			if(pThisDone != NULL)
+			{
+				atomic_store_explicit(pThisDone, x + 1, memory_order_release);
+			}
+		#endif
+		}/*end if error diffusion/dithering*/
+
+		/*
+		// move along
+		*/
+		pVector++;
+
+	}/*end for x*/
+}
+
+
+
+#if MULTI_THREADED
+/*********************************************************
+* Map a MIP level to indices using several threads
+*********************************************************/
+/*
+// Rows of vectors are handed out to the threads in order, each thread
+// taking the next unclaimed row as soon as it has finished its last one.
+// Each thread keeps its own usage counts and sums (and stats), which are
+// added together at the end (being integers, the order doesn't matter).
+//
+// Without dithering, or with ordered dithering, the rows are independent.
+// With error diffusion, a row needs the vertical errors from the row above,
+// so it runs (at least) one vector behind that row - i.e. a wavefront. Since
+// rows therefore can't finish out of order, when a thread claims row y, rows
+// y-NumThreads and before must have completed, so we only need a ring of
+// NumThreads+1 error rows.
+*/
+typedef struct
+{
+	IMAGE_VECTOR_STRUCT *pImage;
+	const REP_SEARCH_STRUCT *pSearch;
+	int DiffusionLevel;
+	int DiffusionLimit;
+	int bOrderedDither;
+
+	/*
+	// distance from each vector to its rep, in raster order
+	*/
+	int *pDistances;
+
+	/*
+	// the vertical error rows (only needed when dithering). The last
+	// one of the ring is left as zeroes for the top of the image.
+	*/
+	int *pErrRows;
+	int ErrRowSize;
+	int NumErrRows;
+
+	/*
+	// the number of vectors completed in each row, and the next row to do
+	*/
+	ROW_PROGRESS_TYPE *pRowsDone;
+	ROW_PROGRESS_TYPE NextRow;
+}MAP_LEVEL_JOB;
+
+typedef struct
+{
+	MAP_LEVEL_JOB *pJob;
+	thrd_t Thread;
+	SUM_USAGE_STRUCT SumAndUsage[MAX_CODES];
+	SEARCH_STATS Stats;
+}MAP_THREAD_STATE;
+
+
+static int MapLevelThread(void *pArg)
+{
+	MAP_THREAD_STATE *pState = (MAP_THREAD_STATE *) pArg;
+	MAP_LEVEL_JOB *pJob = pState->pJob;
+	int y;
+
+	while((y = atomic_fetch_add(&pJob->NextRow, 1)) < pJob->pImage->yVDim)
+	{
+		const int *pPreviousRow;
+		int *pCurrentRow;
+		const ROW_PROGRESS_TYPE *pAboveDone;
+		ROW_PROGRESS_TYPE *pThisDone;
+
+		pPreviousRow = NULL;
+		pCurrentRow  = NULL;
+		pAboveDone	 = NULL;
+		pThisDone	 = NULL;
+
+		if(pJob->DiffusionLevel > 0)
+		{
+			pCurrentRow = pJob->pErrRows + (y % (pJob->NumErrRows - 1)) * pJob->ErrRowSize;
+			pThisDone	= &pJob->pRowsDone[y];
+
+			if(y == 0)
+			{
+				pPreviousRow = pJob->pErrRows + (pJob->NumErrRows - 1) * pJob->ErrRowSize;
+			}
+			else
+			{
+				pPreviousRow = pJob->pErrRows + ((y-1) % (pJob->NumErrRows - 1)) * pJob->ErrRowSize;
+				pAboveDone	 = &pJob->pRowsDone[y-1];
+			}
+		}
+
+		MapRowToIndices(pJob->pImage->Rows[y], pJob->pImage->xVDim,
+				pPreviousRow, pCurrentRow,
+				pJob->pSearch, pState->SumAndUsage, &pState->Stats,
+				pJob->DiffusionLevel, pJob->DiffusionLimit,
+				pJob->bOrderedDither, y,
+				pJob->pDistances + y * pJob->pImage->xVDim,
+				pAboveDone, pThisDone);
+	}
+
+	return 0;
+}
+
+
+/*
+// Returns 0 if the level was mapped, or -1 if we couldn't get the memory,
+// in which case the caller should fall back to the serial code. The
+// buffers come from pArena, and are given back before it returns.
+*/
+static int MapLevelThreaded(		  VQ_ARENA	*pArena,
+						   IMAGE_VECTOR_STRUCT	*pImage,
+					   const REP_SEARCH_STRUCT	*pSearch,
+							  SUM_USAGE_STRUCT	SumAndUsage[MAX_CODES],
+								  SEARCH_STATS	*pStats,
+										   int	DiffusionLevel,
+										   int	DiffusionLimit,
+										   int	bOrderedDither,
+										   int	NumThreads,
+										 float	*pError)
+{
+	MAP_LEVEL_JOB Job;
+	MAP_THREAD_STATE *pStates;
+	int NumVectors, NumReps;
+	int i, j, t, Started;
+	ARENA_MARK Mark;
+
+	NumVectors = pImage->xVDim * pImage->yVDim;
+	NumReps	   = pSearch->NumReps;
+
+	Job.pImage		   = pImage;
+	Job.pSearch		   = pSearch;
+	Job.DiffusionLevel = DiffusionLevel;
+	Job.DiffusionLimit = DiffusionLimit;
+	Job.bOrderedDither = bOrderedDither;
+	Job.ErrRowSize	   = (pImage->xVDim * PIXEL_BLOCK_SIZE + 1) * MAX_COMPS_PER_PIXEL;
+	Job.NumErrRows	   = NumThreads + 2;
+	Job.pErrRows	   = NULL;
+	Job.pRowsDone	   = NULL;
+	atomic_init(&Job.NextRow, 0);
+
+	Mark = MarkArena(pArena);
+
+	Job.pDistances = (int *) AllocateFromArena(pArena, NumVectors * sizeof(int));
+	pStates = (MAP_THREAD_STATE *) AllocateFromArena(pArena, NumThreads * sizeof(MAP_THREAD_STATE));
+
+	if(DiffusionLevel > 0)
+	{
+		Job.pErrRows  = (int *) AllocateFromArena(pArena, Job.NumErrRows * Job.ErrRowSize * sizeof(int));
+		Job.pRowsDone = (ROW_PROGRESS_TYPE *) AllocateFromArena(pArena, pImage->yVDim * sizeof(ROW_PROGRESS_TYPE));
+	}
+
+	if((Job.pDistances == NULL) || (pStates == NULL) ||
+	   ((DiffusionLevel > 0) && ((Job.pErrRows == NULL) || (Job.pRowsDone == NULL))))
+	{
+		ReleaseArenaToMark(pArena, &Mark);
+		return -1;
+	}
+
+	if(DiffusionLevel > 0)
+	{
+		memset(Job.pErrRows, 0, Job.NumErrRows * Job.ErrRowSize * sizeof(int));
+
+		for(i = 0; i < pImage->yVDim; i++)
+		{
+			atomic_init(&Job.pRowsDone[i], 0);
+		}
+	}
+
+	for(t = 0; t < NumThreads; t++)
+	{
+		pStates[t].pJob = &Job;
+		pStates[t].Stats.NumSearches = 0;
+		pStates[t].Stats.NumDistanceCalcs = 0;
+		pStates[t].Stats.SetupCalcs = 0;
+		pStates[t].Stats.TreeHits = 0;
+
+		for(i = 0; i < NumReps; i++)
+		{
+			pStates[t].SumAndUsage[i].Usage = 0;
+			for(j = 0; j < VECLEN; j++)
+			{
+				pStates[t].SumAndUsage[i].Sum[j] = 0;
+			}
+		}
+	}
+
+	/*
+	// Start the helpers, and do our share on this thread. If a thread can't
+	// be started, we just carry on with fewer.
+	*/
+	for(Started = 1; Started < NumThreads; Started++)
+	{
+		if(thrd_create(&pStates[Started].Thread, MapLevelThread, &pStates[Started]) != thrd_success)
+		{
+			break;
+		}
+	}
+
+	MapLevelThread(&pStates[0]);
+
+	for(t = 1; t < Started; t++)
+	{
+		thrd_join(pStates[t].Thread, NULL);
+	}
+
+	/*
+	// Merge the usage counts and sums
+	*/
+	for(t = 0; t < Started; t++)
+	{
+		pStats->NumSearches		 += pStates[t].Stats.NumSearches;
+		pStats->NumDistanceCalcs += pStates[t].Stats.NumDistanceCalcs;
+		pStats->TreeHits		 += pStates[t].Stats.TreeHits;
+
+		for(i = 0; i < NumReps; i++)
+		{
+			SumAndUsage[i].Usage += pStates[t].SumAndUsage[i].Usage;
+			for(j = 0; j < VECLEN; j++)
+			{
+				SumAndUsage[i].Sum[j] += pStates[t].SumAndUsage[i].Sum[j];
+			}
+		}
+	}
+
+	/*
+	// and total up the error in the same order as the serial code
+	*/
+	for(i = 0; i < NumVectors; i++)
+	{
+		*pError += Job.pDistances[i];
+	}
+
+	ReleaseArenaToMark(pArena, &Mark);
+
+	return 0;
+}
+#endif
+
+
+#if MERGE_DUPLICATE_VECTORS
+/*********************************************************
+* Map just the distinct vectors to indices
+*********************************************************/
+/*
+// Without error diffusion, copies of a vector always get the same code, so
+// only the first of each set (see MergeDuplicateVectors) needs looking up.
+// The error is then totalled in the same order as the other mapping code, so
+// the result is the same whichever is used.
+*/
+static float MapUniqueVectors(VQ_CONTEXT *pContext,
+							  PIXEL_VECT *pVectors,
+					   const REP_SEARCH_STRUCT *pSearch)
+{
+	int i, k;
+	float Error;
+
+	/*
+	// (this leaves out the 1x1 level, which is done separately)
+	*/
+	for(i = 0; i < pContext->NumMergedVectors; i++)
+	{
+		PIXEL_VECT *pVec;
+		int Vector[VECLEN];
+		int Code, NumCopies;
+		SUM_USAGE_STRUCT *pSumAndUsage;
+
+		if(pContext->pFirstCopy[i] != i)
+		{
+			continue;
+		}
+
+		pVec = pVectors + i;
+
+		for(k = 0; k < VECLEN; k++)
+		{
+			Vector[k] = pVec->v[k];
+		}
+
+		Code = pSearch->pfnFindClosest(Vector, pSearch, &pContext->Stats,
+					&pContext->pDistances[i]);
+
+		pVec->wc.Code = Code;
+
+		/*
+		// keep track of the usage frequency, and sum of values, for all
+		// the copies
+		*/
+		NumCopies	 = pContext->pNumCopies[i];
+		pSumAndUsage = &pContext->SumAndUsage[Code];
+
+		pSumAndUsage->Usage += NumCopies;
+		for(k = 0; k < VECLEN; k++)
+		{
+			pSumAndUsage->Sum[k] += Vector[k] * NumCopies;
+		}
+	}/*end for i*/
+
+	/*
+	// Give the copies their codes, and sum up the errors
+	*/
+	Error = 0.0f;
+	for(i = 0; i < pContext->NumMergedVectors; i++)
+	{
+		int First;
+
+		First = pContext->pFirstCopy[i];
+
+		pVectors[i].wc.Code = pVectors[First].wc.Code;
+		Error += pContext->pDistances[First];
+	}
+
+	return Error;
+}
+#endif
+
+
+/*********************************************************/
+/*********************************************************/
+static float MapImageToIndices(VQ_CONTEXT *pContext,
+				IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+										int NumMaps,
+							 const PIXEL_VECT *pRepVectors,
+					   		              int NumReps,
+					   const VECTOR_KERNELS *pKernels,
+									  int 	DiffusionLevel,
+									  int	DitherJust1stComponent)
+{
+	IMAGE_VECTOR_STRUCT * pImage; /*current image*/
+
+	SUM_USAGE_STRUCT *SumAndUsage;
+	REP_SEARCH_STRUCT Search;
+
+	/*
+	// **Dithering**
+	// We maintain two rows of pixel error values. One is the
+	// errors from the previous row (i.e. the bottom pixel row of the
+	// previous vector), the other are the error from the bottom
+	// pixels of the "current" row of vectors.
+	//
+	// We alternate the error rows at each row of vectors.
+	*/
+	int VErrRow[2][MAX_X_PIXELS+1][MAX_COMPS_PER_PIXEL];
+	int PrevRowIndex;
+	int *pPreviousRow, *pCurrentRow;
+
+	/*
+	// distances from the vectors in a row to their reps
+	*/
+	int RowDistances[MAX_X_PIXELS / PIXEL_BLOCK_SIZE];
+
+	int x,y,i, Level;
+	int DiffusionLimit;
+	int bMappedUnique;
+	int bOrderedDither;
+
+	float Error;
+
+	Error = 0.0f;
+	bMappedUnique = 0;
+
+	/*
+	// Ordered dithering isn't error diffusion, so everything else sees a
+	// level of 0
+	*/
+	bOrderedDither = (DiffusionLevel == VQOrderedDither);
+	if(bOrderedDither)
+	{
+		DiffusionLevel = 0;
+	}
+
+	SumAndUsage = pContext->SumAndUsage;
+
+	/*
+	// the following code ONLY works with a 2x2 pixel block
+	*/
+	ASSERT(PIXEL_BLOCK_SIZE==2)
+
+	/*
+	// initialise the usage count
+	*/
+	for(i = 0; i < NumReps; i++)
+	{
+		SumAndUsage[i].Usage = 0;
+		for(x = 0; x < VECLEN; x++)
+		{
+		 	SumAndUsage[i].Sum[x] = 0;
+		}
+	}
+
+	/*
+	// Get ready to find the nearest reps
+	*/
+	BuildSearchIndex(pContext, pRepVectors, NumReps, pKernels, &Search);
+
+	/*
+	// if we only want to dither the first component, then set up the
+	// loop limit so that the others aren't touched
+	*/
+	if(DitherJust1stComponent)
+	{
+		DiffusionLimit = 1;
+	}
+	else
+	{
+		DiffusionLimit = MAX_COMPS_PER_PIXEL;
+	}
+
+
+#if MERGE_DUPLICATE_VECTORS
+	/*
+	// Without dithering, just map the distinct vectors, unless there are so
+	// many that sharing all of them out amongst the threads is quicker
+	*/
+	if((DiffusionLevel == 0) && !bOrderedDither && (pContext->NumMergedVectors > 0) &&
+	   ((pContext->NumUniqueVectors * pContext->NumThreads) <= pContext->NumMergedVectors))
+	{
+		Error = MapUniqueVectors(pContext, Maps[0]->pVectors, &Search);
+		bMappedUnique = 1;
+	}
+#endif
+
+	/*
+	// Step through each map level
+	*/
+	for(Level = 0; Level < NumMaps; Level++)
+	{
+		pImage = Maps[Level];
+
+
+		/*
+		// special case for the 1x1 Mip map levels, which are at the end.
+		// We are only interested in matching the top left pixel of the vector
+		*/
+		if((Level >= (NumMaps - pContext->NumSinglePixelMaps)) && pImage->xVDim == 1)
+		{
+			int Code;
+			/*
+			// Find the closest match
+			*/
+			Code = SinglePixelFind(pImage->Rows[0], pRepVectors, NumReps);
+
+			pImage->Rows[0][0].wc.Code = Code;
+
+
+
+			SumAndUsage[Code].Usage++;
+
+			for(i = 0; i < VECLEN; i++)
+			{
+				SumAndUsage[Code].Sum[i] += pImage->Rows[0][0].v[i];
+			}
+			continue;
+		}
+
+		/*
+		// if the distinct vectors were mapped above, there's nothing
+		// else to do
+		*/
+		if(bMappedUnique)
+		{
+			continue;
+		}
+
+	#if MULTI_THREADED
+		/*
+		// Share the bigger levels out amongst the threads
+		*/
+		if((pContext->NumThreads > 1) &&
+		   (pImage->xVDim * pImage->yVDim >= MIN_THREADED_MAP_VECTORS))
+		{
+			if(MapLevelThreaded(&pContext->Arena, pImage, &Search, SumAndUsage, &pContext->Stats,
+					DiffusionLevel, DiffusionLimit, bOrderedDither,
+					MIN(pContext->NumThreads, pImage->yVDim), &Error) == 0)
+			{
+				continue;
+			}
+		}
+	#endif
+
+
+		/*
+		// Intialise the error diffusion values for the 'previous row of pixels'
+		// to be zero
+		*/
+		PrevRowIndex = 0;
+
+		pPreviousRow = VErrRow[PrevRowIndex][0];
+		for(x = 0; x < pImage->xVDim*PIXEL_BLOCK_SIZE; x++)
+		{
+			for(i = 0; i < MAX_COMPS_PER_PIXEL; i++)
+			{
+				pPreviousRow[i] = 0;
+			}
+
+			pPreviousRow+= MAX_COMPS_PER_PIXEL;
+		}
+
+
+		/*
+		// Step through the image
+		*/
+		for(y = 0; y < pImage->yVDim; y++)
+		{
+			/*
+			// get easy access to the previous rows vertical errors, and
+			// the error for this row
+			*/
+			pPreviousRow = VErrRow[PrevRowIndex][0];
+			pCurrentRow  = VErrRow[PrevRowIndex^1][0];
+
+   	   		PrevRowIndex ^= 1;
+
+			MapRowToIndices(pImage->Rows[y], pImage->xVDim,
+					pPreviousRow, pCurrentRow,
+					&Search, SumAndUsage, &pContext->Stats,
+					DiffusionLevel, DiffusionLimit,
+					bOrderedDither, y,
+					RowDistances,
+					NULL, NULL);
+
+			/*
+			// Sum up the errors
+			*/
+			for(x = 0; x < pImage->xVDim; x++)
+			{
+				Error += RowDistances[x];
+			}
+		}/*end for y*/
+	}/*end for level*/
+	if(pContext->Stats.NumSearches > 0)
+	{
+		int NumSearches;
+		NumSearches = pContext->Stats.NumSearches;
+
+		DEB_OUT "Search statistics (%s): %d vectors, %.2f distance calcs per vector, %.2f with setup costs\n",
+			SearchIndexName(pContext->SearchIndex),
+			NumSearches,
+			(double) pContext->Stats.NumDistanceCalcs / NumSearches,
+			(double) (pContext->Stats.NumDistanceCalcs + pContext->Stats.SetupCalcs) / NumSearches);
+	}
+
+	return Error;
+
+}
+
+
+/*
+// Adds the squared error of each level with the codes it's mapped to, and
+// the number of components that counted, to LevelTotals and LevelComps, so
+// the RMS error (per component, as for the GLA passes) can be worked out
+// for one texture or several. The 1x1 level only uses its top left pixel.
+*/
+static void MeasureLevelErrors(IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+										int NumMaps,
+						   const PIXEL_VECT *pReps,
+										int bAlphaOn,
+									 double LevelTotals[],
+									 double LevelComps[])
+{
+	const IMAGE_VECTOR_STRUCT *pImage;
+	const PIXEL_VECT *pVec, *pRep;
+	int Level, x, y, k;
+	int NumVecComps, NumComps, Dist;
+	double Total;
+
+	for(Level = 0; Level < NumMaps; Level++)
+	{
+		pImage = Maps[Level];
+
+		NumVecComps = VECLEN;
+		if((Level == (NumMaps - 1)) && (pImage->xVDim == 1))
+		{
+			NumVecComps = MAX_COMPS_PER_PIXEL;
+		}
+
+		Total = 0.0;
+		for(y = 0; y < pImage->yVDim; y++)
+		{
+			for(x = 0; x < pImage->xVDim; x++)
+			{
+				pVec = &pImage->Rows[y][x];
+				pRep = pReps + pVec->wc.Code;
+
+				Dist = 0;
+				for(k = 0; k < NumVecComps; k++)
+				{
+					Dist += SQ(pVec->v[k] - pRep->v[k]);
+				}
+				Total += Dist;
+			}
+		}
+
+		/*
+		// without alpha, only 3 of each pixel's components count
+		*/
+		NumComps = pImage->xVDim * pImage->yVDim * NumVecComps;
+		if(!bAlphaOn)
+		{
+			NumComps = (NumComps * 3) / 4;
+		}
+
+		LevelTotals[Level] += Total;
+		LevelComps[Level]  += NumComps;
+	}
+}
+
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+/*
+//  MIP map generation, VQ file formatting, and Code order optimisation.
+*/
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+
+/*********************************************************/
+/*
+// 	Allocation and deallocation of image vector maps:
+*/
+/*********************************************************/
+
+
+/*
+// Vector dimension of a map. If the width is 1 (i.e. 1x1 map), then
+// it's doubled.
+*/
+static int VectorMapDim(int nWidth)
+{
+	if(nWidth == 1)
+	{
+		nWidth = 2;
+	}
+
+	return nWidth / PIXEL_BLOCK_SIZE;
+}
+
+/*
+// Sets up the context's maps for a set of textures, each with a top level
+// of Widths[t] and NumMaps[t]-1 MIP levels below it. The vectors for all of
+// them are in one block, so the quantizer can treat them as one array. The
+// widest levels come first (a texture at a time for each width), so the
+// smaller levels of all the textures are together at the end, where the
+// codes can be built from just them (see CoarseTrainingStart). That also
+// puts the 1x1 levels last, as they're matched differently. The block and
+// the maps come from the context's arena. Returns 0 on failure.
+*/
+static int AllocateVectorMaps(VQ_CONTEXT *pContext,
+							  const int Widths[],
+							  const int NumMaps[],
+							  int NumTextures)
+{
+	int i, t, Level, Map;
+	int Width, MaxWidth;
+	int TotalVecs, TotalMaps;
+	PIXEL_VECT *pBlock;
+	IMAGE_VECTOR_STRUCT *pMapStructs;
+
+	TotalVecs = 0;
+	TotalMaps = 0;
+	MaxWidth  = 0;
+	for(t = 0; t < NumTextures; t++)
+	{
+		if(Widths[t] > MaxWidth)
+		{
+			MaxWidth = Widths[t];
+		}
+
+		for(Level = 0; Level < NumMaps[t]; Level++)
+		{
+			TotalVecs += SQ(VectorMapDim(Widths[t] >> Level));
+		}
+		TotalMaps += NumMaps[t];
+	}
+
+	pBlock		= AllocateFromArena(&pContext->Arena, sizeof(PIXEL_VECT) * TotalVecs);
+	pMapStructs = AllocateFromArena(&pContext->Arena, sizeof(IMAGE_VECTOR_STRUCT) * TotalMaps);
+	if((pBlock == NULL) || (pMapStructs == NULL))
+	{
+		return 0;
+	}
+
+	/*
+	// The widest levels first, down to the 1x1 ones
+	*/
+	Map = 0;
+	pContext->NumSinglePixelMaps = 0;
+	for(Width = MaxWidth; Width > 0; Width >>= 1)
+	{
+		for(t = 0; t < NumTextures; t++)
+		{
+			for(Level = 0; Level < NumMaps[t]; Level++)
+			{
+				IMAGE_VECTOR_STRUCT *pImageVecs;
+				int VecsMax;
+
+				if((Widths[t] >> Level) != Width)
+				{
+					continue;
+				}
+
+				pImageVecs = &pMapStructs[Map];
+
+				/*
+				// Set up the dimensions, and point the rows into the block
+				*/
+				VecsMax = VectorMapDim(Widths[t] >> Level);
+
+				pImageVecs->xVDim = VecsMax;
+				pImageVecs->yVDim = VecsMax;
+
+				pImageVecs->pVectors	= pBlock;
+
+				for(i = 0; i < VecsMax; i++)
+				{
+					pImageVecs->Rows[i]	= pBlock;
+					pBlock += VecsMax;
+				}
+
+				pContext->Maps[Map++]			= pImageVecs;
+				pContext->TextureMaps[t][Level] = pImageVecs;
+				pContext->NumSinglePixelMaps   += (Width == 1);
+			}
+		}
+	}
+
+	return 1;
+}
+
+
+/*********************************************************/
+/*
+// 	ConvertBitMapToVectors:
+//
+// Converts the raw RBG and Alpha stream into our internal
+// vector format.
+*/
+/*********************************************************/
+
+static void ConvertBitMapToVectors(const U8 *pRGB,
+								   const U8 *pAlpha,
+
+								   int BGROrder,
+								   int bAlphaOn,
+								   int bInvertAlpha,
+
+							IMAGE_VECTOR_STRUCT *pImageVecs,
+							int PixelWeight)
+{
+	int i, j;
+	int xPos, yPos;
+	int VecsMaxX, VecsMaxY;
+	int PixelWidth;
+
+	PIXEL_VECT *pVect;
+
+	const U8 * pTmpRGB;
+
+
+	/*
+	// if we should invert the sense of the alpha, make it
+	// easy to do so....
+	*/
+	if(bInvertAlpha)
+	{
+		bInvertAlpha = 0xFF;
+	}
+
+
+	/*
+	//for convenience, get the dimensions
+	*/
+	VecsMaxX = 	pImageVecs->xVDim;
+	VecsMaxY = 	pImageVecs->yVDim;
+
+	PixelWidth = VecsMaxX * PIXEL_BLOCK_SIZE;
+
+	for(yPos = 0; yPos < VecsMaxY; yPos++)
+	{
+		int yLower = yPos * PIXEL_BLOCK_SIZE; 
+
+		/*
+		// get the pointer to the row
+		*/		
+		pVect = pImageVecs->Rows[yPos];
+	
+		for(xPos = 0; xPos < VecsMaxX; xPos++)
+		{
+			int k =0;
+			int xLower= xPos * PIXEL_BLOCK_SIZE;
+
+			/*
+			// Set the vectors weighting
+			*/
+			pVect->wc.Weight = PixelWeight;
+			/*
+			// Re-arrange the NxN pixels
+			*/
+			for(i = yLower; i < yLower + PIXEL_BLOCK_SIZE; i++)
+			{
+				for(j = xLower; j < xLower + PIXEL_BLOCK_SIZE; j++)
+				{
+					/*
+					// get a pointer to the RGB bits of the pixel
+					*/
+					pTmpRGB = pRGB + (i * PixelWidth + j) * 3;
+
+					if(BGROrder)
+					{
+						pVect->v[k]   =  pTmpRGB[2];
+						pVect->v[k+1] =  pTmpRGB[1];
+						pVect->v[k+2] =  pTmpRGB[0];
+					}
+					else
+					{
+						pVect->v[k]   =  pTmpRGB[0];
+						pVect->v[k+1] =  pTmpRGB[1];
+						pVect->v[k+2] =  pTmpRGB[2];
+					}
+
+					/*
+					// Do the alpha, IF ANY
+					*/
+					if(bAlphaOn)
+					{
+						pVect->v[k+3] = (U8) (pAlpha[i * PixelWidth + j] ^ bInvertAlpha);
+					}
+					else
+					{
+					 	pVect->v[k+3] = 0xFF; /*Fully opaque*/
+					}
+
+					k+=MAX_COMPS_PER_PIXEL;
+				}/*end for j*/
+			}/*end for i*/
+
+			/*
+			// Move on to the next vector
+			*/
+			pVect++;
+		}/*end for xPos*/ 
+	
+	}/*end for yPos*/ 
+
+}/*end ConvertBitMapToVectors */
+
+
+/*********************************************************/
+/*
+// 	ConvertMIPLevelToVectors
+//
+// As ConvertBitMapToVectors, but for a supplied MIP map level. The 1x1 level
+// is still stored as a whole vector, so its one pixel is copied to all four
+// places (as GenerateMIPMapLevel does).
+*/
+/*********************************************************/
+
+static void ConvertMIPLevelToVectors(const U8 *pRGB,
+									 const U8 *pAlpha,
+									 int nLevelWidth,
+
+									 int BGROrder,
+									 int bAlphaOn,
+									 int bInvertAlpha,
+
+							IMAGE_VECTOR_STRUCT *pImageVecs,
+							int PixelWeight)
+{
+	U8 BlockRGB[PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE * 3];
+	U8 BlockAlpha[PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE];
+	int i;
+
+	if(nLevelWidth == 1)
+	{
+		for(i = 0; i < PIXEL_BLOCK_SIZE * PIXEL_BLOCK_SIZE; i++)
+		{
+			BlockRGB[i*3]	= pRGB[0];
+			BlockRGB[i*3+1] = pRGB[1];
+			BlockRGB[i*3+2] = pRGB[2];
+
+			BlockAlpha[i] = bAlphaOn ? pAlpha[0] : 0;
+		}
+
+		pRGB   = BlockRGB;
+		pAlpha = BlockAlpha;
+	}
+
+	ConvertBitMapToVectors(pRGB, pAlpha, BGROrder, bAlphaOn, bInvertAlpha,
+						   pImageVecs, PixelWeight);
+}
+
+
+
+/*********************************************************/
+/*
+// 	GenerateMIPMapLevel
+//
+// Takes a map with defined vectors along with the next lower res map
+// with uninitialised vectors, and computes the vecs for the lower map.
+//
+// It just uses a simple 2x2 filter kernel. There seems little point
+// in using anything else because the compression is usually quite
+// lossy.
+*/
+/*********************************************************/
+
+static void GenerateMIPMapLevel(const IMAGE_VECTOR_STRUCT *pHigher,
+						       IMAGE_VECTOR_STRUCT *pLower,
+						       int	Weight)
+{
+	int k;
+	int xLowerPos, yLowerPos, xloc, yloc;
+	
+	int VecsMaxX, VecsMaxY;
+	PIXEL_VECT *pDstVect;
+	const PIXEL_VECT *pSrcVect;
+
+	int Av;
+
+	/*
+	// NOTE routine assumes blocksize is 2
+	*/
+	ASSERT(PIXEL_BLOCK_SIZE == 2)
+
+	/*
+	// Special case the lowest resolution map
+	*/
+	if(pHigher->xVDim == 1)
+	{
+		for(k = 0; k < MAX_COMPS_PER_PIXEL; k++ )
+		{
+			Av = pHigher->Rows[0][0].v[k] + 
+				 pHigher->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL] +
+				 pHigher->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*2] +
+				 pHigher->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*3];
+
+			/*
+			// divide with rounding
+			*/
+			Av = (Av + 2) >> 2;
+
+			/*
+			// write the average to ALL pixels in the vector;
+			*/
+			pLower->Rows[0][0].v[k] = (U8) Av;
+			pLower->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL] = 	 (U8) Av;
+			pLower->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*2] = (U8) Av;
+			pLower->Rows[0][0].v[k+MAX_COMPS_PER_PIXEL*3] = (U8) Av;
+
+		}/*end for k*/
+
+		/*
+		// intialise it's weight as well
+		*/
+		pLower->Rows[0][0].wc.Weight = Weight;
+		
+	}		
+	/*
+	// else it's of a more typical size
+	*/
+	else
+	{	
+		/*
+		// Check that the sizes match up
+		*/
+		ASSERT(pHigher->xVDim == pLower->xVDim * PIXEL_BLOCK_SIZE)
+
+		/*
+		// Step through all the lower res vectors
+		*/
+		VecsMaxX = pLower->xVDim;
+		VecsMaxY = pLower->xVDim;
+
+		for(yLowerPos = 0; yLowerPos < VecsMaxY; yLowerPos++)
+		{
+			int yHigher = yLowerPos * PIXEL_BLOCK_SIZE; 
+
+			/*
+			// get the pointer to the destiation row
+			*/		
+			pDstVect = pLower->Rows[yLowerPos];
+	
+
+			for(xLowerPos = 0; xLowerPos < VecsMaxX; xLowerPos++)
+			{
+				int xHigher= xLowerPos * PIXEL_BLOCK_SIZE;
+
+				U8 *pVecEnt;
+
+				/*
+				// get a pointer to the first vector value. This will be
+				// the red value of the first pixel. It's value will be derived
+				// from all the red components etc...
+				*/
+				pVecEnt = pDstVect->v;
+
+				/*
+				// step through the pixels inside the vector
+				*/
+				for(yloc = 0; yloc < PIXEL_BLOCK_SIZE; yloc++)
+				{
+					/*
+					// get access to the source vector for this
+					// destination pixel
+					*/
+					pSrcVect = &pHigher->Rows[yHigher+yloc][xHigher];
+
+					for(xloc = 0; xloc < PIXEL_BLOCK_SIZE; xloc++)
+					{
+						/*
+						// Step through the colour components
+						*/
+						for(k = 0; k < MAX_COMPS_PER_PIXEL; k++ )
+						{
+							Av = pSrcVect->v[k] + 
+				 				 pSrcVect->v[k+MAX_COMPS_PER_PIXEL] +
+				 				 pSrcVect->v[k+MAX_COMPS_PER_PIXEL*2] +
+				                 pSrcVect->v[k+MAX_COMPS_PER_PIXEL*3];
+
+							/*
+							// divide with rounding
+							*/
+							Av = (Av + 2) >> 2;
+
+							/*
+							// store it in the right place in the destination
+							*/
+							*pVecEnt = (U8) Av;
+
+							/*
+							// Move to the next value in the vector
+							*/
+							pVecEnt++;							
+						}/*end for k*/
+
+						/*
+						// Move to the next Source vector, which should ne the next one
+						// in the row.
+						*/
+						pSrcVect++;
+					}/*end for x: Stepping through the various source vectors*/
+
+				}/*end for y: Stepping through the various source vectors*/
+
+				/*
+				// Store the assigned weight for this map
+				*/
+				pDstVect->wc.Weight = Weight;
+
+				/*
+				// move to the next vector to generate
+				*/
+				pDstVect++;
+			}/*end for xpos*/
+
+		}/*end for ypos*/
+
+	}/*end if then else*/
+
+}
+
+/*********************************************************/
+/*
+// 	ConvertToYUV
+//
+// Converts an RGB map level to YUV. Note that we don't want to
+// use this routine on the 1x1 map, becaues that gets stored as
+// RGB 565.
+*/
+/*********************************************************/
+
+static void ConvertToYUV(IMAGE_VECTOR_STRUCT *pMap)
+{
+	int xPos, yPos;
+	
+	int VecsMaxX, VecsMaxY;
+	int yloc;
+	PIXEL_VECT *pVect;
+
+	/*
+	// NOTE routine assumes blocksize is 2
+	*/
+	ASSERT(PIXEL_BLOCK_SIZE == 2)
+
+
+	/*
+	// Step through all the vectors
+	*/
+	VecsMaxX = pMap->xVDim;
+	VecsMaxY = pMap->xVDim;
+
+	for(yPos = 0; yPos < VecsMaxY; yPos++)
+	{
+		/*
+		// get the pointer to the row
+		*/		
+		pVect = pMap->Rows[yPos];
+	
+
+		for(xPos = 0; xPos < VecsMaxX; xPos++)
+		{
+
+			U8 *pVecEnt;
+
+			float YUV[PIXEL_BLOCK_SIZE][3];
+
+			/*
+			// get a pointer to the first vector value.
+			*/
+			pVecEnt = pVect->v;
+
+			/*
+			// step through the 2 pairs of pixels in the vector
+			*/
+			for(yloc = 0; yloc < PIXEL_BLOCK_SIZE; yloc++)
+			{
+				float Scale = 1.0f / 187.0f;
+				int tmp;
+				/*
+				// Do the pixel pair:
+				// first compute raw YUV for both pixels
+				*/
+				YUV[0][0] = (pVecEnt[0] * 55.0f + pVecEnt[1] * 110.0f + pVecEnt[2] * 22.0f)* Scale;
+				YUV[0][1] = (pVecEnt[0] *-32.0f + pVecEnt[1] * -64.0f + pVecEnt[2] * 96.0f)* Scale;
+				YUV[0][2] = (pVecEnt[0] * 96.0f + pVecEnt[1] * -80.0f + pVecEnt[2] *-16.0f)* Scale;
+
+				YUV[1][0] = (pVecEnt[4] * 55.0f + pVecEnt[5] * 110.0f + pVecEnt[6] * 22.0f)* Scale;
+				YUV[1][1] = (pVecEnt[4] *-32.0f + pVecEnt[5] * -64.0f + pVecEnt[6] * 96.0f)* Scale;
+				YUV[1][2] = (pVecEnt[4] * 96.0f + pVecEnt[5] * -80.0f + pVecEnt[6] *-16.0f)* Scale;
+
+
+				/*
+				// pack these back into the bytes. The individual Y's a stored, but the U and V
+				// values are an average for the pixel pair.
+				//
+				// Note that we need to clamp U and V to the legal range
+				// for bytes because the values can overflow.
+				//
+				// Y0
+				*/
+				pVecEnt[0] = (U8)  (YUV[0][0] + 0.5f); 
+				
+				/*
+				// U average
+				*/
+				tmp = (int) ((YUV[0][1] + YUV[1][1]) * 0.5f + 128.0f);
+				CLAMP(tmp, 0, 255);
+				pVecEnt[1] = (U8) tmp;
+
+				
+				/*
+				// Y1 and V average
+				*/				
+				pVecEnt[4] = (U8)  (YUV[1][0] + 0.5f);
+
+				tmp = (int) ((YUV[0][2] + YUV[1][2]) * 0.5f + 128.0f);
+				CLAMP(tmp, 0, 255);
+				pVecEnt[5] = (U8) tmp;
+				
+				/*
+				// for safety and ease of debugging, zero the other entries
+				*/
+				pVecEnt[2] = 0;
+				pVecEnt[3] = 0;
+				pVecEnt[6] = 0;
+				pVecEnt[7] = 0;
+
+				/*
+				// Move to the next values in the vector
+				*/
+				pVecEnt+=8;							
+			}/*end for y: Stepping through the various source vectors*/
+
+			/*
+			// move to the next vector to process.
+			*/
+			pVect++;
+		}/*end for xpos*/
+
+	}/*end for ypos*/
+
+}
+
+
+/*************************************************
+//
+// Write out short in big or little endian
+//
+*************************************************/
+
+static void WriteShortMem( U8 *ucP, int nVal, int nEndian )
+{
+	if (nEndian == LITTLE_ENDIAN)
+	{
+		*ucP++ = (U8)( nVal & 0xff );
+		*ucP++ = (U8)( nVal >> 8 );
+	}
+	else
+	{
+		*ucP++ = (U8)( nVal >> 8 );
+		*ucP++ = (U8)( nVal & 0xff );
+	}
+}
+
+/*************************************************
+//
+// DeTwiddle
+//
+// The textures are stored in twiddled format, i.e. X and Y
+// index bits are alternated.
+//
+// This takes the linear position of a particular pixel in 
+// the twiddled texture, and works out what it's x an y coordinates 
+// are.
+//
+// This is not the most efficient way of doing it, but it's a
+// completely insignificant part of the overall runtime.
+//
+*************************************************/
+
+static void DeTwiddle( int addr, int *xparam, int *yparam )
+{
+	int p;
+	int x,y;
+
+
+	x = 0;
+	y = 0;
+
+	/*
+	// check the 16 positions
+	*/
+	for(p = 16; p!=0 ; p --)
+	{
+		y >>= 1;
+		x >>= 1;
+
+		/*
+		// distribute the next two MSBs to the y and x indices
+		*/
+		y = y | (addr & 1) << 15;
+		addr >>= 1;
+		x = x | (addr & 1) << 15;
+		addr >>= 1;
+	}
+
+	*xparam = x;
+	*yparam = y;
+}
+
+						
+/******************************************************************************
+ * From			: vqfmem.c
+ * Title		: Vector Quantisation Compression Code
+ * Author		: Julian Hodgson.
+ * Created		: 17/03/1997
+ * Modified		: 17/11/1999 Simon Fenney:
+ *							Adapted to new compression algorithm.
+ ******************************************************************************/
+int WriteVqfMemory(		void *MemoryOut, 
+						int nFormat,
+						int AlphaSupplied, 
+
+						int bWriteVQFHeader,
+
+						IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+						int NumMaps,
+
+						PIXEL_VECT Reps[MAX_CODES],
+						int	nNumCodes,
+						int Reorder[MAX_CODES])
+
+{
+	int			x=0, y=0, addr=0;
+	int			i, j, lev;
+	int			r, g, b, a;
+	int			nTemp=0;
+	PIXEL_VECT	*psVector;
+	int			nHt=0;
+	int			nWd=0;
+
+	int			nEndian=0;
+	int			map=0, size=0, code_book_size=0;
+	int			code_out=0;
+	U8 *ucPtr;
+
+	int InvReorder[MAX_CODES];
+
+ 
+#if HACK_SHOW_LOWER_MAPS
+ 	int Direction;
+#endif
+
+	/*
+	// Write as if machine is little endian 
+	*/
+	nEndian = LITTLE_ENDIAN;
+
+	ucPtr = ( U8 *) MemoryOut;
+
+
+	/*
+	// round the number of codes up to the next power 2 that we handle
+	// as part of the VQF format.
+	*/
+	for(i = 8; i < nNumCodes; i <<= 1 )
+	{
+		/* keep doubling until we get enough codes */
+	}
+	nNumCodes = i;
+
+
+
+	/*
+	// if writing the header in VQF Format
+	*/
+	if(bWriteVQFHeader)
+	{
+
+		/* Two chars */
+		*ucPtr++ = 'P';
+		*ucPtr++ = 'V';
+			
+		/* map_type */
+		switch( nFormat) 
+		{
+			case FORMAT_4444:
+				map = 9;
+				break;
+    
+			case FORMAT_1555:
+				if ( AlphaSupplied)
+					map = 8;
+				else
+					map = 6;
+				break;
+    
 			case FORMAT_565:
 				map = 7;
 				break;
 
-			case FORMAT_YUV:
-				map = 10;
-				break;
+			case FORMAT_YUV:
+				map = 10;
+				break;
+
+			//case FORMAT_BUMP:
+			//	map = 11;
+			//	break;
+    
+			default:
+				return VQ_INVALID_PARAMETER;
+		}
+    
+		if ( NumMaps > 1)
+			map += 64;
+		
+		*ucPtr++ = (U8) map;
+		
+		/* map_size */
+		switch ( Maps[0]->xVDim * PIXEL_BLOCK_SIZE) 
+		{
+		
+			case 32:
+				size = 0;
+				break;
+    
+			case 64:
+				size = 1;
+				break;
+    
+			case 128:
+				size = 2;
+				break;
+    
+			case 256:
+				size = 3;
+				break;
+    
+			case 8:
+				size = 4;
+				break;
+    
+			case 16:
+				size = 5;
+				break;
+    
+			case 512:
+				size = 6;
+				break;
+    
+			case 1024:
+				size = 7;
+				break;
+    
+			default:
+				return -1;
+		}
+		
+		/* x-dim */
+		*ucPtr++ = (U8) size;
+		
+		/* y-dim - x_dim ( bitwise) but since square, zero for now */
+		*ucPtr++ = 0;
+		
+		switch ( nNumCodes)
+		{
+			case 8:
+				code_book_size = 0;
+				break;
+    
+			case 16:
+				code_book_size = 1;
+				break;
+    
+			case 32:
+				code_book_size = 2;
+				break;
+    
+			case 64:
+				code_book_size = 3;
+				break;
+    
+			case 128:
+				code_book_size = 4;
+				break;
+    
+			case 256:
+				code_book_size = 5;
+				break;
+    
+			default:
+				return -2;
+		}
+    
+		*ucPtr++ = (U8) code_book_size;
+    
+		/* Empty part of header */
+		for(i = 0; i < 6; i++)
+		{
+			*ucPtr++ = 0;
+		}
+
+
+	}/*end if VQF format*/
+
+	/*
+	// write the codebook out 
+	*/
+	for(i = 0; i < nNumCodes; i++)
+	{
+		int t;
+		
+		/*
+		// special case for YUV textures. The 1x1 texture is always RGB 565. 
+		// For simplicity, the compressor has reserved the last code for this map level
+		*/
+		if((i == (nNumCodes-1)) && ( nFormat == FORMAT_YUV ) && (NumMaps > 1))
+		{
+			nFormat = FORMAT_565; 	
+		}
+
+		/*
+		// Get a pointer to the "ith" vector, and then
+		// allow for any reordering...
+		*/
+		psVector = Reps+Reorder[i];
+
+		t = 0;
+		
+		while (t < 4)
+		{
+			U8 *v =NULL;
+
+			switch (t)
+			{
+
+				/*
+				// Allow for the twiddled arrangement of the values within
+				// the code book entries
+				*/
+				case 0: 
+					v = &psVector->v[0];
+					break;
+				case 1:
+					v = &psVector->v[MAX_COMPS_PER_PIXEL*2];
+					break;
+				case 2:
+					v = &psVector->v[MAX_COMPS_PER_PIXEL];
+					break;
+
+				case 3:
+				default:
+					v = &psVector->v[MAX_COMPS_PER_PIXEL*3];
+					break;
+			}
+
+			r = v[0] >> (8 - BitDepths[nFormat][0]);
+			g = v[1] >> (8 - BitDepths[nFormat][1]);
+			b = v[2] >> (8 - BitDepths[nFormat][2]);
+			a = v[3] >> (8 - BitDepths[nFormat][3]);
+
+			switch (nFormat)
+			{
+				case FORMAT_4444:
+					nTemp = (a << 12) | (r << 8) | (g << 4) | b;
+					break;
+
+				case FORMAT_565:
+					nTemp = (r << 11) | (g << 5) | b;
+					break;
+
+				case FORMAT_1555:
+
+					nTemp = (a << 15) | (r << 10) | (g << 5) | b;
+					break;
+
+				case FORMAT_YUV:
+
+					nTemp = (r << 8) | g;
+					break;
+
+				default:
+					return VQ_INVALID_PARAMETER;
+			}
+
+			WriteShortMem( ucPtr, nTemp, nEndian );	
+			
+			/* Advance pointer */
+			ucPtr += 2;
+
+			++t;
+		}
+	}
+
+
+	/*
+	// Generate the Inverse of the reordering of codes so that we can remap the
+	// indices
+	*/
+	for(i = 0; i < nNumCodes; i++)
+	{
+		InvReorder[Reorder[i]] = i;
+	}
+
+
+	/*
+	// Write out indices: These are given in the order 1x1, 2x2 etc..
+	*/
+
+#if HACK_SHOW_LOWER_MAPS
+/*
+// This is a HORRIBLE hack to allow easy display of the lower level MIP maps
+// by copying them into the location where the higher map should be. 
+*/
+	Direction = -1;
+
+	for(lev = NumMaps - 1; lev < NumMaps; lev+= Direction)
+	{
+
+		if(lev == 0)
+		{
+			Direction = 1;
+			continue;	
+		}
+#else
+	for(lev = NumMaps - 1; lev>=0; lev--)
+	{
+#endif
+	 
+
+		nHt = Maps[lev]->yVDim;
+		nWd = Maps[lev]->xVDim;
+
+	#if 0	
+		if(nHt==0 || nWd==0)
+		{
+			nHt=1;
+		  	nWd=1;
+		}
+	#endif
+
+		addr = 0;
+		for(i = 0; i < nHt; i++)
+		{
+			for(j = 0; j < nWd; j++)
+			{
+				DeTwiddle( addr, &x, &y );
+
+				code_out = Maps[lev]->Rows[y][x].wc.Code;
+
+				/*
+				// Allow for the reordering
+				*/
+				code_out = InvReorder[code_out];
+
+				/*
+				// When we are using fewer than 256 codes, pack them all toward the top
+				*/				
+				code_out += 256 - nNumCodes;
+				
+				ASSERT( ( code_out >= 256 - nNumCodes) && ( code_out <= 255) );
+
+				*ucPtr++ = (U8) code_out;  
+				
+				addr ++;
+			}
+		}
+	}/*end for levels*/
+	
+
+	return VQ_OK;
+
+}
+
+/******************************************************************************/
+/******************************************************************************/
+
+
+/*************************************************
+//
+// OptimisePlacement
+//
+// This is possibly not necessary on Dreamcast/CLX but may be of use on other
+// VQ implementations.
+//
+// The basic idea of this function is to try to improve the locality of accesses
+// into the VQ code book for the particular image.
+//
+// The routine simply looks through the image indices, and counts the number of
+// times each code is adjacent to each other code. It then uses a simple greedy
+// algorithm to try to renumber the indices so that the most frequent pairings are
+// numerically close, and hence close  each other address space.
+//
+//
+// SPECIAL CASE NOTE: When we are doing YUV Mip mapped, the 1x1 texture is represented
+// by a 565 code. To simplify the compressor, it will be assigned code number (nNumCodes-1).
+// Luckily, because this particular doesn't get used anywhere but in the 1x1, it will always
+// end up still mapped to (nNumCodes-1).
+//
+*************************************************/
+static void OptimisePlacement(VQ_CONTEXT *pContext,
+					IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+					 	const	int NumMaps,
+					  	const 	int nNumCodes,
+								int Reorder[MAX_CODES])
+{
+	#define NC (pContext->NeighbCount)
+
+
+	const IMAGE_VECTOR_STRUCT *pThisMap;
+	int XDim, YDim;
+
+	int ThisCode, OtherCode;
+	PIXEL_VECT *pThisRow, *pRowAbove, *pRowBelow;
+
+	int i, j, k;
+
+	int BestPairCount;
+	int BestPairI, BestPairJ;
+
+
+	char InSet[MAX_CODES];
+	int  NumDone;
+
+	/*
+	// if there is ONLY one code, then there is no point in doing this and,
+	// furthermore, the later code will break.
+	*/
+	if(nNumCodes == 1)
+	{
+		Reorder[0] = 0;
+		return;
+	}
+
+	/*
+	// intialise the neighbour count structure
+	*/
+	for(i = 0; i < nNumCodes; i++)
+	{
+		for(j = 0; j < nNumCodes; j++)
+		{
+			NC[i][j] = 0;	
+		}
+
+		/*
+		// to make sure we get all the codes, and to make the coding easy,
+		// initialise each code to be a trivial neighbour of itself
+		*/
+		//NC[i][i] = 1;
+	}
+
+	/*
+	// step through the image levels  counting the neighbour pairings 
+	// in the up/down left/right directions
+	// We won't worry about the edges too much as it'll simplify the 
+	// algorithm a bit.
+	*/
+	for(k = 0; k < NumMaps; k++)
+	{
+		pThisMap = Maps[k];
+		XDim = pThisMap->xVDim;
+		YDim = pThisMap->yVDim;
+
+		/*
+		// step through this image
+		*/
+		for(i = 1; i < YDim-1; i++)
+		{
+			pThisRow = pThisMap->Rows[i];
+			pRowAbove= pThisMap->Rows[i-1];
+			pRowBelow= pThisMap->Rows[i+1];
+
+			for(j = 1; j < XDim-1; j++)
+			{
+				/*
+				// get the code here
+				*/
+				ThisCode = pThisRow[j].wc.Code;
+
+				/*
+				// look up, and count it
+				*/
+				OtherCode = pRowAbove[j].wc.Code;
+				if(OtherCode != ThisCode)
+				{
+					NC[OtherCode][ThisCode]++;
+					NC[ThisCode][OtherCode]++;
+				}
+
+				/*
+				// look down
+				*/
+				OtherCode = pRowBelow[j].wc.Code;
+				if(OtherCode != ThisCode)
+				{
+					NC[OtherCode][ThisCode]++;
+					NC[ThisCode][OtherCode]++;
+				}
+
+				/*
+				// look left
+				*/
+				OtherCode = pThisRow[j-1].wc.Code;
+				if(OtherCode != ThisCode)
+				{
+					NC[OtherCode][ThisCode]++;
+					NC[ThisCode][OtherCode]++;
+				}
+
+ 				/*
+				// look right
+				*/
+				OtherCode = pThisRow[j+1].wc.Code;
+				if(OtherCode != ThisCode)
+				{
+					NC[OtherCode][ThisCode]++;
+					NC[ThisCode][OtherCode]++;
+				}
+
+			}/*end for j*/
+		}/*end for i*/
+	}/*end for stepping through the maps*/
+
+
+	/*
+	// intialise the number of codes we've done
+	*/
+	for(k = 0; k < MAX_CODES; k++)
+	{
+		InSet[k] = 0;
+	}
+	NumDone = 0;
+
+
+	/*
+	// Find the most frequent pairing. Note that because of the symmetry of the
+	// matrix, we only have to check the upper triangle.
+	*/
+	BestPairCount = -1;
+	BestPairI =    INT_MIN;	/*intialise to something that'll pick up errors*/
+	BestPairJ =    INT_MIN;
+
+	for(i = 0; i < nNumCodes; i++)
+	{
+		for(j = i+1; j < nNumCodes; j++)
+		{
+			if(NC[i][j] > BestPairCount)
+			{
+				BestPairCount = NC[i][j];
+				BestPairI	= i;
+				BestPairJ	= j;
+			}
+		}
+	}/*end for i*/
+
+	/*
+	// assign these two codes to our list
+	*/
+	InSet[BestPairI] = 1;
+	InSet[BestPairJ] = 1;
+
+	Reorder[0] =BestPairI; 
+	Reorder[1] =BestPairJ; 
+	NumDone = 2;
+
+	/*
+	// now assign the remaing codes 1 at a time
+	*/
+	while(NumDone != nNumCodes)
+	{
+		BestPairCount = -1;
+		BestPairI =    INT_MIN;	/*intialise to something that'll pick up errors*/
+
+		/*
+		// step though the remaining codes to see which is the best one to add
+		*/
+		for(i = 0; i < nNumCodes; i++)
+		{
+			/*
+			// if i has not yet been done
+			*/
+			if(!InSet[i])
+			{
+				int LocalSum = 0;
+				/*
+				// Sum up this one's neighbours
+				*/
+				for(j = 0; j < nNumCodes; j++)
+				{
+					/*
+					// if J is in the done set, then add the stats
+					*/
+					if(InSet[j])
+					{
+						LocalSum += NC[i][j];
+					}
+				}/*end for j*/
+
+				/*
+				// is this more frequent?
+				*/
+				if(LocalSum > BestPairCount)
+				{
+					BestPairCount = LocalSum;
+					BestPairI = i;
+				}
+			}/*end if i not in the set*/
+		}/*end for i*/
+
+		/*
+		// add this one to our set
+		*/
+		InSet[BestPairI] = 1;
+		Reorder[NumDone] = BestPairI;
+
+		NumDone++;
+	}/*end while*/
+
+	#undef NC
+}
+						
+/******************************************************************************/
+/*
+//  Set the number of threads used to split the partitions and to map the
+//  image vectors to the codes. 1 (the default) does it all on the calling
+//  thread. The output is the same whatever the setting.
+*/
+/******************************************************************************/
+extern void SetVqThreadCount(int nThreads)
+{
+#if MULTI_THREADED
+	DefaultThreads = (nThreads < 1) ? 1 : nThreads;
+#endif
+}
+
+/******************************************************************************/
+/*
+//  Create and destroy a context for CreateVqWithContext. CreateVqContext
+//  returns NULL if it runs out of memory.
+*/
+/******************************************************************************/
+extern VQ_CONTEXT* CreateVqContext(void)
+{
+	VQ_CONTEXT *pContext;
+
+	pContext = NEW(VQ_CONTEXT);
+	if(pContext == NULL)
+	{
+		return NULL;
+	}
+
+	InitArena(&pContext->Arena);
+	pContext->pVectRefs		  = NULL;
+	pContext->pSortScratch	  = NULL;
+	pContext->pFirstCopy	  = NULL;
+	pContext->pNumCopies	  = NULL;
+	pContext->pDistances	  = NULL;
+	pContext->NumTreeNodes	  = 0;
+	pContext->SearchIndex	  = VQSearchNeighbours;
+	pContext->NumThreads	  = DefaultThreads;
+	pContext->Subsample		  = 1;
+	pContext->MaxExtraPasses  = EXTRA_GLA_ITS;
+	pContext->MinImprovement  = 0.0f;
+	pContext->TimeBudget	  = 0.0f;
+	pContext->NumPasses		  = 0;
+	pContext->NumSmallSizes	  = 0;
+	pContext->SmallMaxError	  = 0.0f;
+	pContext->NumSmallBooks	  = 0;
+	pContext->CodebookSize	  = 0;
+	pContext->NumWarmCodes	  = 0;
+	pContext->CoarseWidth	  = 0;
+
+	return pContext;
+}
+
+extern void DestroyVqContext(VQ_CONTEXT *pContext)
+{
+	if(pContext)
+	{
+		FreeArena(&pContext->Arena);
+		free(pContext);
+	}
+}
+
+/******************************************************************************/
+/*
+//  As SetVqThreadCount, but just for the one context.
+*/
+/******************************************************************************/
+extern void SetVqContextThreadCount(VQ_CONTEXT *pContext, int nThreads)
+{
+#if MULTI_THREADED
+	pContext->NumThreads = (nThreads < 1) ? 1 : nThreads;
+#endif
+}
+
+/******************************************************************************/
+/*
+//  Train the codes on only one in every nSubsample vectors (default 1, i.e.
+//  all of them). This is much quicker, for a small loss in quality, and the
+//  results are still the same every time. All the vectors are still mapped
+//  to the codes.
+*/
+/******************************************************************************/
+extern void SetVqContextSubsample(VQ_CONTEXT *pContext, int nSubsample)
+{
+	pContext->Subsample = (nSubsample < 1) ? 1 : nSubsample;
+}
+
+/******************************************************************************/
+/*
+//  Choose how the nearest code to each vector is found when mapping the
+//  image (default VQSearchNeighbours). Anything unknown gets the default.
+*/
+/******************************************************************************/
+extern void SetVqContextSearchIndex(VQ_CONTEXT *pContext, VQ_SEARCH_INDEX SearchIndex)
+{
+	switch(SearchIndex)
+	{
+		case VQSearchKdTree:
+		case VQSearchExhaustive:
+			pContext->SearchIndex = SearchIndex;
+			break;
+
+		default:
+			pContext->SearchIndex = VQSearchNeighbours;
+			break;
+	}
+}
+
+/******************************************************************************/
+/*
+//  After the first GLA pass, do up to nMaxExtraPasses more (default 0). Stop
+//  early when a pass doesn't improve the (RMS) error by at least
+//  fMinImprovement (as a fraction of the previous pass's error), or when the next pass would take
+//  the texture past fTimeBudget seconds (0 for no limit). With dithering on,
+//  there's always one more (dithered) pass after deciding to stop.
+//  The time budget makes the output depend on the speed of the machine.
+*/
+/******************************************************************************/
+extern void SetVqContextRefinement(VQ_CONTEXT *pContext,
+								   int nMaxExtraPasses,
+								   float fMinImprovement,
+								   float fTimeBudget)
+{
+	if(nMaxExtraPasses < 0)
+	{
+		nMaxExtraPasses = 0;
+	}
+	else if(nMaxExtraPasses > MAX_EXTRA_GLA_ITERATIONS)
+	{
+		nMaxExtraPasses = MAX_EXTRA_GLA_ITERATIONS;
+	}
+
+	pContext->MaxExtraPasses = nMaxExtraPasses;
+	pContext->MinImprovement = (fMinImprovement < 0.0f) ? 0.0f :
+							   (fMinImprovement > 1.0f) ? 1.0f : fMinImprovement;
+	pContext->TimeBudget	 = (fTimeBudget < 0.0f) ? 0.0f : fTimeBudget;
+}
+
+/******************************************************************************/
+/*
+//  Copies the RMS error (as returned by CreateVqWithContext) after each GLA
+//  pass of the last job into pfErrors, up to nMaxErrors of them. Returns the
+//  number of passes.
+*/
+/******************************************************************************/
+extern int GetVqContextPassErrors(const VQ_CONTEXT *pContext,
+								  float pfErrors[],
+								  int nMaxErrors)
+{
+	int i;
+
+	for(i = 0; (i < pContext->NumPasses) && (i < nMaxErrors); i++)
+	{
+		pfErrors[i] = pContext->PassErrors[i];
+	}
+
+	return pContext->NumPasses;
+}
+
+/******************************************************************************/
+/*
+//  Copies what the last job with the context (or on this thread) did, and
+//  how long it took. If the job failed, the stats are only filled in as far
+//  as it got.
+*/
+/******************************************************************************/
+extern void GetVqContextStats(const VQ_CONTEXT *pContext, VQ_STATS *pStats)
+{
+	*pStats = pContext->JobStats;
+}
+
+extern void GetLastVqStats(VQ_STATS *pStats)
+{
+	*pStats = LastJobStats;
+}
+
+/******************************************************************************/
+/*
+//  Keep the codebook of each size in nSizes as the codes are built, and
+//  write the smallest whose (RMS) error is at most fMaxError instead of the
+//  full one. Sizes that aren't a power of 2 from 8 to 128 are ignored, as
+//  are any not smaller than the job's nNumCodes. Each size tried costs its
+//  own GLA passes, but the codes are only built once.
+*/
+/******************************************************************************/
+extern void SetVqContextSmallCodebooks(VQ_CONTEXT *pContext,
+									   const int nSizes[],
+									   int nNumSizes,
+									   float fMaxError)
+{
+	int i, Size;
+
+	/*
+	// keep them in order, smallest first
+	*/
+	pContext->NumSmallSizes = 0;
+	for(Size = MIN_SMALL_CODES; Size <= MAX_SMALL_CODES; Size <<= 1)
+	{
+		for(i = 0; i < nNumSizes; i++)
+		{
+			if(nSizes[i] == Size)
+			{
+				pContext->SmallSizes[pContext->NumSmallSizes++] = Size;
+				break;
+			}
+		}
+	}
+
+	pContext->SmallMaxError = (fMaxError < 0.0f) ? 0.0f : fMaxError;
+}
+
+/*
+// The number of codes the last job wrote: nNumCodes, or one of the smaller
+// sizes
+*/
+extern int GetVqContextCodebookSize(const VQ_CONTEXT *pContext)
+{
+	return pContext->CodebookSize;
+}
+
+/******************************************************************************/
+/*
+//  Start from the given codebook, as written by an earlier job (nNumCodes
+//  codes of 8 bytes, without the VQF header), instead of building one. The
+//  codes are only refined by the GLA passes. It must be in the job's colour
+//  format. The job writes at most nNumCodes codes, and doesn't try any
+//  smaller codebooks. A NULL codebook (the default) turns this off.
+*/
+/******************************************************************************/
+extern void SetVqContextWarmStart(VQ_CONTEXT *pContext,
+								  const void *pCodebook,
+								  int nNumCodes)
+{
+	if((pCodebook == NULL) || (nNumCodes < 1))
+	{
+		nNumCodes = 0;
+	}
+	else if(nNumCodes > MAX_CODES)
+	{
+		nNumCodes = MAX_CODES;
+	}
+
+	pContext->NumWarmCodes = nNumCodes;
+	if(nNumCodes > 0)
+	{
+		memcpy(pContext->WarmCodebook, pCodebook, nNumCodes * 8);
+	}
+}
+
+/******************************************************************************/
+/*
+//  Coarse to fine training: build the codes from only the MIP levels at
+//  most nMaxWidth wide, which have a small fraction of the vectors, then do
+//  one GLA pass with each next wider level added, before the usual passes
+//  over all of them. The smaller levels are smoother, so the codes don't
+//  fit the top level as well. It only applies when MIP mapping, and wider
+//  levels are added to the training if there aren't enough vectors for the
+//  codes. 0 (the default) turns it off.
+*/
+/******************************************************************************/
+extern void SetVqContextCoarseTraining(VQ_CONTEXT *pContext, int nMaxWidth)
+{
+	pContext->CoarseWidth = (nMaxWidth < 0) ? 0 : nMaxWidth;
+}
+
+/*
+// Seconds since the given time
+*/
+static double SecondsSince(const struct timespec *pStart)
+{
+	struct timespec Now;
+
+	timespec_get(&Now, TIME_UTC);
+
+	return (double) (Now.tv_sec - pStart->tv_sec) +
+		   (double) (Now.tv_nsec - pStart->tv_nsec) * 1e-9;
+}
+
+
+/*
+// This is a full-blown GLA (Generalised Lloyd's Algorithm) as was used in
+// the old VQ compressor: each pass maps the vectors to the reps, then moves
+// the reps to the average of the vectors that mapped to them. We don't do
+// many passes as the gains rapidly become insignificant, and we stop early
+// if they do, or if the job runs out of time (see SetVqContextRefinement).
+// Only the last pass dithers.
+//
+// Returns the number of passes, with the total error after each in Errors.
+*/
+static int RefineCodes(VQ_CONTEXT *pContext,
+			IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
+							int NumMaps,
+					 PIXEL_VECT *pReps,
+							int NumReps,
+							int nColourFormat,
+		   const VECTOR_KERNELS *pKernels,
+				VQ_DITHER_TYPES DitherLevel,
+							int DitherJust1stComponent,
+		const struct timespec	*pStartTime,
+						  float Errors[MAX_EXTRA_GLA_ITERATIONS + 1])
+{
+	SUM_USAGE_STRUCT *SumAndUsage;
+	VQ_STATS *pJobStats;
+
+	int NumPasses;
+	int bLastPass, bStop;
+	float MaxErrorRatio;
+	double PassStart, PassEnd;
+
+	int i, j;
+
+	SumAndUsage = pContext->SumAndUsage;
+	pJobStats	= &pContext->JobStats;
+
+	MaxErrorRatio = (1.0f - pContext->MinImprovement) * (1.0f - pContext->MinImprovement);
+
+	NumPasses = 0;
+	bLastPass = (pContext->MaxExtraPasses == 0);
+	PassEnd	  = SecondsSince(pStartTime);
+	for(j = 0; ; j++)
+	{
+		int LocalDitherSetting;
+
+		/*
+		// Only use dithering on the last pass
+		*/
+		if(bLastPass)
+		{
+			LocalDitherSetting = DitherLevel;
+		}
+		else
+		{
+			LocalDitherSetting = 0;
+		}
+
+		/*
+		// Map the vectors to the representative set
+		*/
+		PassStart = PassEnd;
+		Errors[j] = MapImageToIndices(pContext,
+							Maps, 
+							NumMaps,
+							pReps,
+					  		NumReps,
+					  		pKernels,
+					  		LocalDitherSetting,
+					  		DitherJust1stComponent);
+
+		pJobStats->NumSearches		+= pContext->Stats.NumSearches;
+		pJobStats->NumDistanceCalcs += pContext->Stats.NumDistanceCalcs;
+		pJobStats->NumSetupCalcs	+= pContext->Stats.SetupCalcs;
+		pJobStats->NumTreeHits		+= pContext->Stats.TreeHits;
+
+
+		/*
+		// Recompute the reps based on the vectors which really map to them
+		//
+		// THE FOLLOWING TEST IS CURRENTLY DISABLED:
+		// Only do this when we aren't dithering, because I think the dithering
+		// phase tends to mess this up a bit.
+		*/
+		if(1)//!LocalDitherSetting)
+		{
+			for(i = 0; i < NumReps; i++)
+			{
+				if(SumAndUsage[i].Usage > 0)
+				{
+					SumToRep(SumAndUsage[i].Sum, SumAndUsage[i].Usage, 
+						nColourFormat, pReps+i);
+				}
+			}/*end for i*/
+		}
+		NumPasses++;
+
+		pJobStats->PassTimes[j] = SecondsSince(pStartTime) - PassStart;
+
+		if(bLastPass)
+		{
+			break;
+		}
+
+		/*
+		// Stop if that pass didn't help enough, or there isn't time for
+		// another. If we're dithering, that needs one more pass though.
+		*/
+		PassEnd = SecondsSince(pStartTime);
+
+		bStop = ((j > 0) &&
+				 (Errors[j] >= Errors[j - 1] * MaxErrorRatio)) ||
+				((pContext->TimeBudget > 0.0f) &&
+				 ((PassEnd + (PassEnd - PassStart)) > pContext->TimeBudget));
+
+		if(bStop && (DitherLevel == 0))
+		{
+			break;
+		}
+
+		bLastPass = bStop || (j + 1 == pContext->MaxExtraPasses);
+	}/*end for GLA passes*/
+
+	return NumPasses;
+}
+
+/*
+// The width of a map's level. The 2x2 and 1x1 levels are both one vector
+// wide, so they both count as 2.
+*/
+#define MAP_WIDTH(pMap) ((pMap)->xVDim * PIXEL_BLOCK_SIZE)
+
+/*
+// For coarse to fine training (see SetVqContextCoarseTraining), the first
+// of the maps (widest first) to build the codes from, or 0 for all of them.
+// If the levels up to the context's width don't have enough vectors for
+// the reps, wider ones are added.
+*/
+static int CoarseTrainingStart(const VQ_CONTEXT *pContext,
+			IMAGE_VECTOR_STRUCT *Maps[],
+							int NumMaps,
+							int NumReps)
+{
+	int Start;
+	int NumVectors;
+
+	if(pContext->CoarseWidth == 0)
+	{
+		return 0;
+	}
+
+	Start	   = NumMaps;
+	NumVectors = 0;
+	while((Start > 0) &&
+		  ((MAP_WIDTH(Maps[Start - 1]) <= pContext->CoarseWidth) ||
+		   (NumVectors < MIN_SUBSAMPLES_PER_REP * NumReps)))
+	{
+		Start--;
+		NumVectors += Maps[Start]->xVDim * Maps[Start]->yVDim;
+	}
+
+	return Start;
+}
+
+/*
+// The other half of coarse to fine training: the reps were built from the
+// maps from Maps[Start] on. Add the next wider level(s) and do a GLA pass
+// (without dithering), and so on up to, but not including, the widest,
+// which are left for RefineCodes. The merged duplicates cover all the maps,
+// so they can't be used to map some of them.
+*/
+static void StepUpCodes(VQ_CONTEXT *pContext,
+			IMAGE_VECTOR_STRUCT *Maps[],
+							int NumMaps,
+							int Start,
+					 PIXEL_VECT *pReps,
+							int NumReps,
+							int nColourFormat,
+		   const VECTOR_KERNELS *pKernels)
+{
+	SUM_USAGE_STRUCT *SumAndUsage;
+	VQ_STATS *pJobStats;
+
+	int Width;
+	int NumMergedVectors;
+	int i;
+
+	SumAndUsage = pContext->SumAndUsage;
+	pJobStats	= &pContext->JobStats;
+
+	NumMergedVectors		   = pContext->NumMergedVectors;
+	pContext->NumMergedVectors = 0;
+
+	while(Start > 0)
+	{
+		Width = MAP_WIDTH(Maps[Start - 1]);
+		while((Start > 0) && (MAP_WIDTH(Maps[Start - 1]) <= Width))
+		{
+			Start--;
+		}
+
+		if(Start == 0)
+		{
+			break;
+		}
+
+		MapImageToIndices(pContext, Maps + Start, NumMaps - Start, pReps, NumReps,
+						  pKernels, 0, 0);
+
+		pJobStats->NumSearches		+= pContext->Stats.NumSearches;
+		pJobStats->NumDistanceCalcs += pContext->Stats.NumDistanceCalcs;
+		pJobStats->NumSetupCalcs	+= pContext->Stats.SetupCalcs;
+		pJobStats->NumTreeHits		+= pContext->Stats.TreeHits;
+
+		for(i = 0; i < NumReps; i++)
+		{
+			if(SumAndUsage[i].Usage > 0)
+			{
+				SumToRep(SumAndUsage[i].Sum, SumAndUsage[i].Usage,
+					nColourFormat, pReps+i);
+			}
+		}
+
+		DEB_OUT "Stepped the codes up to the %dx%d levels\n", Width, Width);
+	}
+
+	pContext->NumMergedVectors = NumMergedVectors;
+}
+
+
+#if DEBUG_FILE
+/*
+// Only one job at a time writes Debug.txt - any others running at the same
+// time just don't get a debug file.
+*/
+#if MULTI_THREADED
+	static atomic_flag DebFileClaimed = ATOMIC_FLAG_INIT;
+
+	#define CLAIM_DEBUG_FILE()	 (!atomic_flag_test_and_set(&DebFileClaimed))
+	#define RELEASE_DEBUG_FILE() atomic_flag_clear(&DebFileClaimed)
+#else
+	static int DebFileClaimed = 0;
+
+	#define CLAIM_DEBUG_FILE()	 (DebFileClaimed ? 0 : (DebFileClaimed = 1))
+	#define RELEASE_DEBUG_FILE() (DebFileClaimed = 0)
+#endif
+
+static void OpenDebugFile(void)
+{
+	DebFile = NULL;
+
+	if(CLAIM_DEBUG_FILE())
+	{
+		DebFile = fopen("Debug.txt", "w");
+		if(!DebFile)
+		{
+			DebFile = stdout;
+		}
+	}
+}
+
+static void CloseDebugFile(void)
+{
+	if(DebFile)
+	{
+		if(DebFile != stdout)
+		{
+			fclose(DebFile);
+		}
+		DebFile = NULL;
+
+		RELEASE_DEBUG_FILE();
+	}
+}
+#endif
+
+/******************************************************************************/
+/*
+//  Check the texture width is one we can handle
+*/
+/******************************************************************************/
+static int IsValidWidth(int nWidth)
+{
+	switch(nWidth)
+	{
+		case 8:
+		case 16:
+		case 32:
+		case 64:
+		case 128:
+		case 256:
+		case 512:
+		case 1024:
+		{
+			/* These are all ok */
+			return 1;
+		}
+		default:
+		{
+			/*
+			// This is rubbish
+			*/
+			return 0;
+		}
+
+	}/*end switch*/
+}
+
+/******************************************************************************/
+/*
+//  The CreateVqSize Function:
+//
+//  Returns the number of bytes of output CreateVq will need. This needs none
+//  of the image data, so there's nothing to set up.
+*/
+/******************************************************************************/
+extern int CreateVqSize(int nWidth, int bMipMap, int bIncludeHeader, int nNumCodes)
+{
+	/* Work out memory needed */
+	int nMemoryNeeded = 0;
+	int i;
+
+	if(!IsValidWidth(nWidth))
+	{
+		return VQ_INVALID_SIZE;
+	}
+
+	if(bIncludeHeader)
+	{
+		nMemoryNeeded += 12;
+	}/*end switch*/
+
+
+	/* 
+	// Allow space for code book
+	*/
+	nMemoryNeeded += 8 * nNumCodes;
+
+	/*
+	// Indices 
+	//
+	// Count the number needed for the lower mipmap levels
+	// This is a lazy way to do it.... but it works :)
+	*/
+	if ( bMipMap)
+	{
+		/* Do 1x1 */
+		nMemoryNeeded++;
+		/* Start loop at 2x2 pix block = 1x1 code */
+		for ( i=1; i < nWidth/2; i*=2)
+		{
+			nMemoryNeeded+= i*i;
+		}
+	}
+	/* top one */
+	nMemoryNeeded+= nWidth * nWidth / 4;
+
+	return nMemoryNeeded;
+}
+
+/******************************************************************************/
+/*
+//  The CreateVq Function:
+//
+//  Kept for the original interface: the data is one packed image, and any
+//  MIP map levels are generated from it.
+*/
+/******************************************************************************/
+extern int CreateVq(const void*	InputArrayRGB,
+					const void*	InputArrayAlpha,
+						  void*	OutputMemory, 
+
+						int		BGROrder,		/*if data is BGR not RGB*/
+						int		nWidth, 		/*Square textures only*/
+						int 	Reserved0,
+						int		bMipMap, 		/*Generate MIP map. RECOMMENDED!*/
+						int		bAlphaOn, 		/*Is Alpha supplied?*/
+
+						int 	bIncludeHeader,
+
+				VQ_DITHER_TYPES	DitherLevel,	/* Level of dithering required */
+				
+						int		nNumCodes,		/*max number of codes requested*/
+						int		nColourFormat,
+										
+						int		bInvertAlpha,	/*To support Old PVR1 files that had odd alpha */
+
+						int 	Metric,			/*how to estimate colour differences*/
+						int 	Reserved1,		/*Reserved. Set it to 0 */
+
+						float	*pfErrorFound)
+{
+	/* Has the App malloced the memory yet? */
+	if ( OutputMemory == NULL)
+	{
+		/*
+		// Exit function with number of bytes to allocate before coming
+		// here again!
+		*/
+		return CreateVqSize(nWidth, bMipMap, bIncludeHeader, nNumCodes);
+	}
+
+	return CreateVqFromLevels(&InputArrayRGB,
+							  &InputArrayAlpha,
+							  1,
+							  OutputMemory,
+
+							  BGROrder,
+							  nWidth,
+							  bMipMap,
+							  bAlphaOn,
+							  bIncludeHeader,
+							  DitherLevel,
+							  nNumCodes,
+							  nColourFormat,
+							  bInvertAlpha,
+							  Metric,
+
+							  pfErrorFound);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+/*
+//  The CreateVqFromLevels Function:
+//
+//  The MIP map levels are passed as separate pointers, largest first. Levels
+//  beyond nLevels are generated from the smallest level supplied. This uses
+//  a context just for the one job.
+*/
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+extern int CreateVqFromLevels(const void* const	LevelsRGB[],
+							  const void* const	LevelsAlpha[],
+									int			nLevels,
+									void*		OutputMemory,
+
+									int			BGROrder,
+									int			nWidth,
+									int			bMipMap,
+									int			bAlphaOn,
+									int			bIncludeHeader,
+							VQ_DITHER_TYPES		DitherLevel,
+									int			nNumCodes,
+									int			nColourFormat,
+									int			bInvertAlpha,
+									int			Metric,
+
+									float		*pfErrorFound)
+{
+	VQ_CONTEXT *pContext;
+	int nReturnValue;
+
+	pContext = CreateVqContext();
+	if(pContext == NULL)
+	{
+		return VQ_OUTOFMEMORY;
+	}
+
+	nReturnValue = CreateVqWithContext(pContext,
+							LevelsRGB, LevelsAlpha, nLevels, OutputMemory,
+							BGROrder, nWidth, bMipMap, bAlphaOn, bIncludeHeader,
+							DitherLevel, nNumCodes, nColourFormat, bInvertAlpha,
+							Metric, pfErrorFound);
+
+	DestroyVqContext(pContext);
+
+	return nReturnValue;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+/*
+//  The CreateVqWithContext Function:
+//
+//  A set of one texture, using the context's memory. Jobs with different
+//  contexts can run at the same time.
+*/
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+extern int CreateVqWithContext(VQ_CONTEXT		*pContext,
+							  const void* const	LevelsRGB[],
+							  const void* const	LevelsAlpha[],
+									int			nLevels,
+									void*		OutputMemory,
+
+									int			BGROrder,
+									int			nWidth,
+									int			bMipMap,
+									int			bAlphaOn,
+									int			bIncludeHeader,
+							VQ_DITHER_TYPES		DitherLevel,
+									int			nNumCodes,
+									int			nColourFormat,
+									int			bInvertAlpha,
+									int			Metric,
+
+									float		*pfErrorFound)
+{
+	VQ_SET_TEXTURE Texture;
+
+	Texture.LevelsRGB	 = LevelsRGB;
+	Texture.LevelsAlpha	 = LevelsAlpha;
+	Texture.nLevels		 = nLevels;
+	Texture.nWidth		 = nWidth;
+	Texture.OutputMemory = OutputMemory;
+
+	return CreateVqSetWithContext(pContext,
+							&Texture, 1,
+							BGROrder, bMipMap, bAlphaOn, bIncludeHeader,
+							DitherLevel, nNumCodes, nColourFormat, bInvertAlpha,
+							Metric, pfErrorFound);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+/*
+//  The CreateVqSetWithContext Function:
+//
+//  Does the real work, for one texture or a set sharing a codebook. The
+//  vectors of all the textures are trained on and refined together, and
+//  then each texture is written with its own indices.
+*/
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+extern int CreateVqSetWithContext(VQ_CONTEXT		*pContext,
+								  VQ_SET_TEXTURE	Textures[],
+										int			nNumTextures,
+
+										int			BGROrder,
+										int			bMipMap,
+										int			bAlphaOn,
+										int			bIncludeHeader,
+								VQ_DITHER_TYPES		DitherLevel,
+										int			nNumCodes,
+										int			nColourFormat,
+										int			bInvertAlpha,
+										int			Metric,
+
+										float		*pfErrorFound)
+{
+
+
+	IMAGE_VECTOR_STRUCT **Maps;
+
+	int NumRepsNeeded = -1; /*initialise to rubbish to stop compiler warnings*/
+	int NumMaps;
+
+	/*
+	// each texture's width, number of levels supplied, and number of maps
+	*/
+	int Widths[VQ_MAX_SET_TEXTURES];
+	int NumLevels[VQ_MAX_SET_TEXTURES];
+	int TextureNumMaps[VQ_MAX_SET_TEXTURES];
+
+	/*
+	// the squared errors and component counts of each level, for the set
+	// and for one texture
+	*/
+	double LevelTotals[MAX_MIP_LEVELS], LevelComps[MAX_MIP_LEVELS];
+	double TexTotals[MAX_MIP_LEVELS], TexComps[MAX_MIP_LEVELS];
+	double TexTotal, TexComp;
+
+	int ReservedCodes;
+	int SkipMaps;
+	int DitherJust1stComponent;
+
+	/*
+	// the first map the codes are built from (see CoarseTrainingStart)
+	*/
+	int CoarseStart;
+
+	PIXEL_VECT *Reps;
+	SUM_USAGE_STRUCT *SumAndUsage;
+
+	VECTOR_KERNELS Kernels;
+	QUANTIZER_FUNCS QuantFuncs;
+
+	float Errors[MAX_EXTRA_GLA_ITERATIONS + 1]; /*the errors from the GLA passes*/
+	int NumPasses;
+	int ErrorDivisor;
+	float Error;
+
+	/*
+	// the smaller codebooks, and the codebook that's written in the end
+	*/
+	SMALL_CODEBOOK *pBook;
+	PIXEL_VECT *pFinalReps;
+	int NumFinalReps;
+	int CodebookSize;
+
+	struct timespec StartTime;
+	double StageStart;
+	VQ_STATS *pJobStats;
+	
+	int VectorCount;
+
+	int		i, j, t;
+	int		nReturnValue = VQ_OK;
+
+	/*
+	// the following is for optimising the order of codes for nearness in memory
+	*/
+	int Reorder[MAX_CODES];
+
+
+#if DEBUG
+	const U8 *bPtr;
+	unsigned int CheckSum;
+#endif
+
+
+/*
+// check that we've got the endianess #define correct
+*/
+#if DEBUG
+	union
+	{
+		long i;
+		char c;
+	}CheckEndian;
+#endif
+
+	timespec_get(&StartTime, TIME_UTC);
+
+	/*
+	// A warm start can't have more codes than it starts with
+	*/
+	if((pContext->NumWarmCodes > 0) && (nNumCodes > pContext->NumWarmCodes))
+	{
+		nNumCodes = pContext->NumWarmCodes;
+	}
+
+	pContext->NumPasses	   = 0;
+	pContext->CodebookSize = nNumCodes;
+
+	if((nNumTextures < 1) || (nNumTextures > VQ_MAX_SET_TEXTURES))
+	{
+		return VQ_INVALID_PARAMETER;
+	}
+
+	pJobStats = &pContext->JobStats;
+	memset(pJobStats, 0, sizeof(VQ_STATS));
+	pJobStats->Width	   = Textures[0].nWidth;
+	pJobStats->NumCodes	   = nNumCodes;
+	pJobStats->SearchIndex = (VQ_SEARCH_INDEX) pContext->SearchIndex;
+	LastJobStats = *pJobStats;
+
+#if DEBUG
+	CheckEndian.i = 1;
+
+#if LITTLE_ENDIAN
+	ASSERT(CheckEndian.c == 1);
+#else
+	ASSERT(CheckEndian.c == 0);
+#endif
+
+#endif
 
-			//case FORMAT_BUMP:
-			//	map = 11;
-			//	break;
-    
-			default:
-				return VQ_INVALID_PARAMETER;
+
+	/*
+	// If 565 or YUV has been requested, then forcibly switch off alpha. No point
+	// in wasting our time now, is there?
+	*/
+	if((nColourFormat == FORMAT_565) || (nColourFormat == FORMAT_YUV))
+	{
+		bAlphaOn = 0;
+	}
+
+	/*
+	// Each 1x1 YUV level needs a code of its own
+	*/
+	if((nColourFormat == FORMAT_YUV) && bMipMap && (nNumTextures > 1))
+	{
+		return VQ_INVALID_PARAMETER;
+	}
+
+	for(t = 0; t < nNumTextures; t++)
+	{
+		const void* const *LevelsRGB;
+		const void* const *LevelsAlpha;
+		int nWidth;
+
+		LevelsRGB	= Textures[t].LevelsRGB;
+		LevelsAlpha = Textures[t].LevelsAlpha;
+		nWidth		= Textures[t].nWidth;
+
+		/*
+		// Check the size of the texture
+		*/
+		if(!IsValidWidth(nWidth))
+		{
+			return VQ_INVALID_SIZE;
 		}
-    
-		if ( NumMaps > 1)
-			map += 64;
-		
-		*ucPtr++ = (U8) map;
-		
-		/* map_size */
-		switch ( Maps[0]->xVDim * PIXEL_BLOCK_SIZE) 
+
+		/*
+		// Check we've got the data for each of the supplied levels. If we're
+		// not MIP mapping we only want the top one.
+		*/
+		NumLevels[t] = bMipMap ? Textures[t].nLevels : 1;
+
+		if((Textures[t].OutputMemory == NULL) || (NumLevels[t] < 1) ||
+		   ((nWidth >> (NumLevels[t] - 1)) == 0))
 		{
-		
-			case 32:
-				size = 0;
-				break;
-    
-			case 64:
-				size = 1;
-				break;
-    
-			case 128:
-				size = 2;
-				break;
-    
-			case 256:
-				size = 3;
-				break;
-    
-			case 8:
-				size = 4;
-				break;
-    
-			case 16:
-				size = 5;
-				break;
-    
-			case 512:
-				size = 6;
-				break;
-    
-			case 1024:
-				size = 7;
-				break;
-    
-			default:
-				return -1;
+			return VQ_INVALID_PARAMETER;
 		}
-		
-		/* x-dim */
-		*ucPtr++ = (U8) size;
-		
-		/* y-dim - x_dim ( bitwise) but since square, zero for now */
-		*ucPtr++ = 0;
-		
-		switch ( nNumCodes)
+
+		for(i = 0; i < NumLevels[t]; i++)
 		{
-			case 8:
-				code_book_size = 0;
-				break;
-    
-			case 16:
-				code_book_size = 1;
-				break;
-    
-			case 32:
-				code_book_size = 2;
-				break;
-    
-			case 64:
-				code_book_size = 3;
-				break;
-    
-			case 128:
-				code_book_size = 4;
-				break;
-    
-			case 256:
-				code_book_size = 5;
-				break;
-    
-			default:
-				return -2;
+			if((LevelsRGB[i] == NULL) || (bAlphaOn && ((LevelsAlpha == NULL) || (LevelsAlpha[i] == NULL))))
+			{
+				return VQ_INVALID_PARAMETER;
+			}
 		}
-    
-		*ucPtr++ = (U8) code_book_size;
-    
-		/* Empty part of header */
-		for(i = 0; i < 6; i++)
+
+		/*
+		// The top level map, and the MIP levels (down to 1x1) if the user
+		// _wisely_ chose to do MIP mapping
+		*/
+		Widths[t]		  = nWidth;
+		TextureNumMaps[t] = 1;
+		if(bMipMap)
 		{
-			*ucPtr++ = 0;
+			while((nWidth >> TextureNumMaps[t]) > 0)
+			{
+				TextureNumMaps[t]++;
+			}
 		}
+	}
 
 
-	}/*end if VQF format*/
+	/*
+	// Give back the last job's working memory
+	*/
+	ResetArena(&pContext->Arena);
+
+	Maps		= pContext->Maps;
+	Reps		= pContext->Reps;
+	SumAndUsage	= pContext->SumAndUsage;
 
 	/*
-	// write the codebook out 
+	// The codes a job doesn't build (when there are fewer distinct vectors
+	// than codes) are still written out, so they mustn't be what the last
+	// job left behind
 	*/
-	for(i = 0; i < nNumCodes; i++)
+	memset(Reps, 0, sizeof(pContext->Reps));
+
+#if DEBUG
+	pContext->FlatCount = 0;
+#endif		
+
+
+
+#if DEBUG_FILE
+	OpenDebugFile();
+#endif
+
+#if TEST_VECTOR_KERNELS
+	TestVectorKernels();
+#endif
+#if TEST_QUANTIZER_FUNCS
+	TestQuantizerFuncs();
+#endif
+#if TEST_SORT_ALONG_AXIS
+	TestSortAlongAxis();
+#endif
+
+#if DEBUG
+	CheckSum = 0;
+	bPtr = Textures[0].LevelsRGB[0];
+
+	for(i = Textures[0].nWidth * Textures[0].nWidth * 3; i!= 0; i--)
 	{
-		int t;
-		
 		/*
-		// special case for YUV textures. The 1x1 texture is always RGB 565. 
-		// For simplicity, the compressor has reserved the last code for this map level
+		// Do a rotate and flip a few bits
 		*/
-		if((i == (nNumCodes-1)) && ( nFormat == FORMAT_YUV ) && (NumMaps > 1))
+		CheckSum = ((CheckSum << 3) | (CheckSum >> (32-3))) ^ 0x101010;
+
+		/*
+		// Add in the current byte
+		*/
+		CheckSum += *bPtr;
+
+		bPtr++;
+	}
+
+#endif
+
+
+
+	/************************
+	// We now assume that OutputMemory points to valid memory for "vqf" file (in memory)
+	************************/
+
+	/*
+	// Initialise default number of reserved codes, and whether we should ignore 
+	// particular maps to start with.
+	*/
+	ReservedCodes 	= 0;
+	SkipMaps		= 0;
+	DitherJust1stComponent = 0;
+
+
+	/*
+	// Create the vector maps of all the textures
+	*/
+	NumMaps = 0;
+	for(t = 0; t < nNumTextures; t++)
+	{
+		NumMaps += TextureNumMaps[t];
+	}
+
+	if(!AllocateVectorMaps(pContext, Widths, TextureNumMaps, nNumTextures))
+	{
+		nReturnValue = VQ_OUTOFMEMORY;	
+		goto cleanup_and_exit;
+	}
+
+	for(t = 0; t < nNumTextures; t++)
+	{
+		const void* const *LevelsRGB;
+		const void* const *LevelsAlpha;
+		IMAGE_VECTOR_STRUCT **TexMaps;
+
+		LevelsRGB	= Textures[t].LevelsRGB;
+		LevelsAlpha = Textures[t].LevelsAlpha;
+		TexMaps		= pContext->TextureMaps[t];
+
+		/*
+		// Slap in the data
+		*/
+		StageStart = SecondsSince(&StartTime);
+		ConvertBitMapToVectors( LevelsRGB[0],
+								bAlphaOn ? LevelsAlpha[0] : NULL,
+
+								BGROrder,
+								bAlphaOn,
+								bInvertAlpha,
+
+								TexMaps[0],
+								Weights[0]);
+		pJobStats->VectoriseTime += SecondsSince(&StartTime) - StageStart;
+
+		/*
+		// If the user _wisely_ chose to do MIP mapping...
+		*/
+		for(i = 1; i < TextureNumMaps[t]; i++)
+		{
+			StageStart = SecondsSince(&StartTime);
+
+			/*
+			// Use the level supplied, if there is one...
+			*/
+			if(i < NumLevels[t])
+			{
+				ConvertMIPLevelToVectors(LevelsRGB[i],
+										 bAlphaOn ? LevelsAlpha[i] : NULL,
+										 Widths[t] >> i,
+
+										 BGROrder,
+										 bAlphaOn,
+										 bInvertAlpha,
+
+										 TexMaps[i],
+										 Weights[i]);
+
+				pJobStats->VectoriseTime += SecondsSince(&StartTime) - StageStart;
+			}
+			/*
+			// else convert the higher level map into the lower one
+			*/
+			else
+			{
+				GenerateMIPMapLevel(TexMaps[i-1], TexMaps[i], Weights[i]);
+
+				pJobStats->MipMapTime += SecondsSince(&StartTime) - StageStart;
+			}
+
+		}/*end for i*/
+	}/*end for t*/
+
+
+
+
+
+
+	/*
+	// if we are doing YUV, convert the format for all but the 1x1 texture from
+	// RGB to YUV.
+	// The 1x1 map is stored as RGB. To make life easy,we reserve a special code
+	// for it.
+	*/
+	if(nColourFormat == FORMAT_YUV)
+	{
+		int FreqFlag;
+
+		StageStart = SecondsSince(&StartTime);
+		for(t = 0; t < nNumTextures; t++)
+		{
+			ConvertToYUV(pContext->TextureMaps[t][0]);
+		}
+
+		/*
+		// If the weighted colour space metric was chosen, change to the equivalent
+		// for YUV
+		//
+		// If we want frequency based weighting, then limit this to just the
+		// Y component.
+		*/		
+		FreqFlag = Metric & VQMETRIC_FREQUENCY_FLAG;
+
+		if((Metric & VQ_BASE_METRIC_MASK) != VQMetricEqual)
+		{
+			Metric = VQMetricWeightedYUV;
+		}
+		else
+		{ 
+			Metric = VQMetricEqual;
+		}
+
+		if(FreqFlag)
 		{
-			nFormat = FORMAT_565; 	
+			Metric |= VQMETRIC_FREQUENCY_FLAG_JUST_FIRST;
 		}
 
 		/*
-		// Get a pointer to the "ith" vector, and then
-		// allow for any reordering...
-		*/
-		psVector = Reps+Reorder[i];
+		// only permit dithering/diffusion on the Y component
+		*/ 
+		DitherJust1stComponent = 1;
 
-		t = 0;
-		
-		while (t < 4)
+		/*
+		// if we are mip mapping, then convert all bar the 1x1 map to
+		// YUV. The 1x1 map gets its own code.
+		*/
+		if(bMipMap)
 		{
-			U8 *v =NULL;
-
-			switch (t)
+			int Sum[VECLEN];
+			for(i = 1; i < NumMaps - 1; i++)
 			{
-
-				/*
-				// Allow for the twiddled arrangement of the values within
-				// the code book entries
-				*/
-				case 0: 
-					v = &psVector->v[0];
-					break;
-				case 1:
-					v = &psVector->v[MAX_COMPS_PER_PIXEL*2];
-					break;
-				case 2:
-					v = &psVector->v[MAX_COMPS_PER_PIXEL];
-					break;
-
-				case 3:
-				default:
-					v = &psVector->v[MAX_COMPS_PER_PIXEL*3];
-					break;
+				ConvertToYUV(Maps[i]);
 			}
 
-			r = v[0] >> (8 - BitDepths[nFormat][0]);
-			g = v[1] >> (8 - BitDepths[nFormat][1]);
-			b = v[2] >> (8 - BitDepths[nFormat][2]);
-			a = v[3] >> (8 - BitDepths[nFormat][3]);
+			/*
+			// reserve the extra code for the 1x1 case.
+			*/
+			ReservedCodes = 1;
+			SkipMaps = 1;
 
-			switch (nFormat)
+			/*
+			// Set up the reserved code...
+			*/
+			for(i = 0; i < VECLEN; i++)
 			{
-				case FORMAT_4444:
-					nTemp = (a << 12) | (r << 8) | (g << 4) | b;
-					break;
-
-				case FORMAT_565:
-					nTemp = (r << 11) | (g << 5) | b;
-					break;
-
-				case FORMAT_1555:
-
-					nTemp = (a << 15) | (r << 10) | (g << 5) | b;
-					break;
+				Sum[i] = Maps[NumMaps-1]->Rows[0][0].v[i];
+			}
+			SumToRep(Sum, 1, FORMAT_565, Reps + (nNumCodes-1));
 
-				case FORMAT_YUV:
+			/*
+			// and point the vector at that code
+			*/
+			Maps[NumMaps-1]->Rows[0][0].wc.Code =  nNumCodes - 1;
+		}/*end if MIP mapped*/
 
-					nTemp = (r << 8) | g;
-					break;
+		pJobStats->YUVTime = SecondsSince(&StartTime) - StageStart;
+	}/*end if YUV format*/
+	
 
-				default:
-					return VQ_INVALID_PARAMETER;
-			}
+	/*
+	// Choose the partitioning and distance routines for the number of
+	// components we actually use
+	*/
+	SelectQuantizerFuncs(GetNumDims(nColourFormat, bAlphaOn), &QuantFuncs);
+	SelectVectorKernels(QuantFuncs.NumDims, &Kernels);
 
-			WriteShortMem( ucPtr, nTemp, nEndian );	
-			
-			/* Advance pointer */
-			ucPtr += 2;
+	DEB_OUT "Using %d dimensions, %s distance kernels, %s search\n", QuantFuncs.NumDims, Kernels.pszName,
+		SearchIndexName(pContext->SearchIndex));
 
-			++t;
+	/*
+	// Which smaller codebooks to keep on the way to the full one. They
+	// need the reserved code too. A warm start doesn't build its codes,
+	// so there aren't any.
+	*/
+	pContext->NumSmallBooks = 0;
+	for(i = 0; (i < pContext->NumSmallSizes) && (pContext->NumWarmCodes == 0); i++)
+	{
+		if(pContext->SmallSizes[i] < nNumCodes)
+		{
+			pBook = &pContext->SmallBooks[pContext->NumSmallBooks++];
+			pBook->NumCodes = pContext->SmallSizes[i];
+			pBook->NumParts = pBook->NumCodes - ReservedCodes;
 		}
 	}
 
-
 	/*
-	// Generate the Inverse of the reordering of codes so that we can remap the
-	// indices
+	// Coarse to fine training builds the codes from just the smaller MIP
+	// levels. A warm start has its codes already.
 	*/
-	for(i = 0; i < nNumCodes; i++)
+	CoarseStart = 0;
+	if(bMipMap && (pContext->NumWarmCodes == 0))
 	{
-		InvReorder[Reorder[i]] = i;
+		CoarseStart = CoarseTrainingStart(pContext, Maps, NumMaps - SkipMaps,
+										  nNumCodes - ReservedCodes);
 	}
 
-
 	/*
-	// Write out indices: These are given in the order 1x1, 2x2 etc..
+	// Create the Representative Vectors
 	*/
+	StageStart = SecondsSince(&StartTime);
+	NumRepsNeeded = VectorQuantizer(pContext,
+							Maps, 
+							NumMaps   - SkipMaps,
+							CoarseStart,
+							nNumCodes - ReservedCodes,
+							nColourFormat,
+							&QuantFuncs,
+							Metric,
+							Reps,
+							&VectorCount);
 
-#if HACK_SHOW_LOWER_MAPS
-/*
-// This is a HORRIBLE hack to allow easy display of the lower level MIP maps
-// by copying them into the location where the higher map should be. 
-*/
-	Direction = -1;
 
-	for(lev = NumMaps - 1; lev < NumMaps; lev+= Direction)
+	if(NumRepsNeeded < 0)
 	{
+		nReturnValue = VQ_OUTOFMEMORY;	
+		goto cleanup_and_exit;
+	}
 
-		if(lev == 0)
-		{
-			Direction = 1;
-			continue;	
-		}
-#else
-	for(lev = NumMaps - 1; lev>=0; lev--)
-	{
-#endif
-	 
+	pJobStats->TrainTime = SecondsSince(&StartTime) - StageStart;
 
-		nHt = Maps[lev]->yVDim;
-		nWd = Maps[lev]->xVDim;
+	DEB_OUT "Built %d codes in %f seconds\n", NumRepsNeeded, SecondsSince(&StartTime));
 
-	#if 0	
-		if(nHt==0 || nWd==0)
-		{
-			nHt=1;
-		  	nWd=1;
-		}
-	#endif
 
-		addr = 0;
-		for(i = 0; i < nHt; i++)
-		{
-			for(j = 0; j < nWd; j++)
-			{
-				DeTwiddle( addr, &x, &y );
+	/*
+	// The total errors get turned into per-component averages
+	*/
+	if(bAlphaOn)
+	{
+		ErrorDivisor = VectorCount * VECLEN;
+	}
+	else
+	{
+		ErrorDivisor = VectorCount * 12;
+	}
 
-				code_out = Maps[lev]->Rows[y][x].wc.Code;
+	/*
+	// Refine the smaller codebooks, smallest first, and use the first one
+	// that's good enough. Otherwise it's the full one.
+	*/
+	pFinalReps	 = Reps;
+	NumFinalReps = NumRepsNeeded;
+	CodebookSize = nNumCodes;
+	NumPasses	 = 0;
 
-				/*
-				// Allow for the reordering
-				*/
-				code_out = InvReorder[code_out];
+	for(i = 0; i < pContext->NumSmallBooks; i++)
+	{
+		PIXEL_VECT *SmallReps;
 
-				/*
-				// When we are using fewer than 256 codes, pack them all toward the top
-				*/				
-				code_out += 256 - nNumCodes;
-				
-				ASSERT( ( code_out >= 256 - nNumCodes) && ( code_out <= 255) );
+		pBook	  = &pContext->SmallBooks[i];
+		SmallReps = pContext->SmallReps;
 
-				*ucPtr++ = (U8) code_out;  
-				
-				addr ++;
-			}
+		memset(SmallReps, 0, sizeof(PIXEL_VECT) * pBook->NumCodes);
+		for(j = 0; j < pBook->NumParts; j++)
+		{
+			PartitionToRep(pContext, Maps[0]->pVectors, pBook->Start[j], pBook->Length[j],
+						   nColourFormat, SmallReps + j);
 		}
-	}/*end for levels*/
-	
 
-	return VQ_OK;
+		if(ReservedCodes)
+		{
+			SmallReps[pBook->NumCodes - 1] = Reps[nNumCodes - 1];
+			Maps[NumMaps-1]->Rows[0][0].wc.Code = pBook->NumCodes - 1;
+		}
 
-}
+		SwapSmallCodebookLeaves(pContext, pBook);
+		if(CoarseStart > 0)
+		{
+			StageStart = SecondsSince(&StartTime);
+			StepUpCodes(pContext, Maps, NumMaps - SkipMaps, CoarseStart, SmallReps,
+						pBook->NumParts, nColourFormat, &Kernels);
+			pJobStats->TrainTime += SecondsSince(&StartTime) - StageStart;
+		}
+		NumPasses = RefineCodes(pContext, Maps, NumMaps - SkipMaps, SmallReps, pBook->NumParts,
+								nColourFormat, &Kernels, DitherLevel, DitherJust1stComponent,
+								&StartTime, Errors);
+		SwapSmallCodebookLeaves(pContext, pBook);
 
-/******************************************************************************/
-/******************************************************************************/
+		Error = (float) sqrt((float) Errors[NumPasses - 1] / ErrorDivisor);
 
+		pJobStats->TriedCodes[i]  = pBook->NumCodes;
+		pJobStats->TriedErrors[i] = Error;
+		pJobStats->NumCodebooksTried++;
 
-/*************************************************
-//
-// OptimisePlacement
-//
-// This is possibly not necessary on Dreamcast/CLX but may be of use on other
-// VQ implementations.
-//
-// The basic idea of this function is to try to improve the locality of accesses
-// into the VQ code book for the particular image.
-//
-// The routine simply looks through the image indices, and counts the number of
-// times each code is adjacent to each other code. It then uses a simple greedy
-// algorithm to try to renumber the indices so that the most frequent pairings are
-// numerically close, and hence close  each other address space.
-//
-//
-// SPECIAL CASE NOTE: When we are doing YUV Mip mapped, the 1x1 texture is represented
-// by a 565 code. To simplify the compressor, it will be assigned code number (nNumCodes-1).
-// Luckily, because this particular doesn't get used anywhere but in the 1x1, it will always
-// end up still mapped to (nNumCodes-1).
-//
-*************************************************/
-typedef int NeighbCountType[MAX_CODES][MAX_CODES];
+		DEB_OUT "%d codes: %f error, after %f seconds\n", pBook->NumCodes, Error, SecondsSince(&StartTime));
 
-static void OptimisePlacement(IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS],
-					 	const	int NumMaps,
-					  	const 	int nNumCodes,
-								int Reorder[MAX_CODES])
-{
-	NeighbCountType *pNeighbCount;
-	#define NC (*pNeighbCount)
+		if(Error <= pContext->SmallMaxError)
+		{
+			pFinalReps	 = SmallReps;
+			NumFinalReps = pBook->NumParts;
+			CodebookSize = pBook->NumCodes;
+			break;
+		}
+	}
 
+	if(CodebookSize == nNumCodes)
+	{
+		if(ReservedCodes)
+		{
+			Maps[NumMaps-1]->Rows[0][0].wc.Code = nNumCodes - 1;
+		}
 
-	const IMAGE_VECTOR_STRUCT *pThisMap;
-	int XDim, YDim;
+		if(CoarseStart > 0)
+		{
+			StageStart = SecondsSince(&StartTime);
+			StepUpCodes(pContext, Maps, NumMaps - SkipMaps, CoarseStart, Reps,
+						NumRepsNeeded, nColourFormat, &Kernels);
+			pJobStats->TrainTime += SecondsSince(&StartTime) - StageStart;
+		}
 
-	int ThisCode, OtherCode;
-	PIXEL_VECT *pThisRow, *pRowAbove, *pRowBelow;
+		NumPasses = RefineCodes(pContext, Maps, NumMaps - SkipMaps, Reps, NumRepsNeeded,
+								nColourFormat, &Kernels, DitherLevel, DitherJust1stComponent,
+								&StartTime, Errors);
+	}
 
-	int i, j, k;
+	pContext->CodebookSize = CodebookSize;
+	pJobStats->NumCodes	   = CodebookSize;
 
-	int BestPairCount;
-	int BestPairI, BestPairJ;
+	for(j = 0; j < NumPasses; j++)
+	{
+		pContext->PassErrors[j] = (float) sqrt((float) Errors[j] / ErrorDivisor);
+	}
+	pContext->NumPasses = NumPasses;
 
+	*pfErrorFound = pContext->PassErrors[NumPasses - 1];
 
-	char InSet[MAX_CODES];
-	int  NumDone;
+	DEB_OUT "%d GLA passes in %f seconds\n", NumPasses, SecondsSince(&StartTime));
 
 	/*
-	// if there is ONLY one code, then there is no point in doing this and,
-	// furthermore, the later code will break.
+	// Fill in the rest of the stats
 	*/
-	if(nNumCodes == 1)
+	pJobStats->NumPasses = NumPasses;
+	for(j = 0; j < NumPasses; j++)
 	{
-		Reorder[0] = 0;
-		return;
+		pJobStats->PassErrors[j] = pContext->PassErrors[j];
 	}
 
-	/*
-	// malloc the neighbour count structure
-	*/
-	pNeighbCount = NEW(NeighbCountType);
+	pJobStats->NumCodesUsed = ReservedCodes;
+	for(i = 0; i < NumFinalReps; i++)
+	{
+		if(SumAndUsage[i].Usage > 0)
+		{
+			pJobStats->NumCodesUsed++;
+		}
+	}
 
 	/*
-	// just in case our memory allocation fails, set up a default reordering
+	// The error of each level over the whole set, and of each texture
 	*/
-	if(!pNeighbCount)
+	for(j = 0; j < MAX_MIP_LEVELS; j++)
 	{
-		for(i = 0; i < nNumCodes; i++)
-		{
-			Reorder[i] = i;	
-		}
-		return;
+		LevelTotals[j] = 0.0;
+		LevelComps[j]  = 0.0;
 	}
 
+	for(t = 0; t < nNumTextures; t++)
+	{
+		for(j = 0; j < TextureNumMaps[t]; j++)
+		{
+			TexTotals[j] = 0.0;
+			TexComps[j]	 = 0.0;
+		}
+		MeasureLevelErrors(pContext->TextureMaps[t], TextureNumMaps[t], pFinalReps, bAlphaOn,
+						   TexTotals, TexComps);
+
+		TexTotal = 0.0;
+		TexComp	 = 0.0;
+		for(j = 0; j < TextureNumMaps[t]; j++)
+		{
+			LevelTotals[j] += TexTotals[j];
+			LevelComps[j]  += TexComps[j];
 
+			TexTotal += TexTotals[j];
+			TexComp	 += TexComps[j];
+		}
+		Textures[t].fErrorFound = (float) sqrt(TexTotal / TexComp);
 
-	/*
-	// intialise the neighbour count structure
-	*/
-	for(i = 0; i < nNumCodes; i++)
-	{
-		for(j = 0; j < nNumCodes; j++)
+		if(TextureNumMaps[t] > pJobStats->NumLevels)
 		{
-			NC[i][j] = 0;	
+			pJobStats->NumLevels = TextureNumMaps[t];
 		}
+	}
 
-		/*
-		// to make sure we get all the codes, and to make the coding easy,
-		// initialise each code to be a trivial neighbour of itself
-		*/
-		//NC[i][i] = 1;
+	for(j = 0; j < pJobStats->NumLevels; j++)
+	{
+		pJobStats->LevelErrors[j] = (float) sqrt(LevelTotals[j] / LevelComps[j]);
 	}
 
+	pJobStats->NumAllocs	   = pContext->Arena.NumAllocs;
+	pJobStats->NumSystemAllocs = pContext->Arena.NumSystemAllocs;
+	pJobStats->PeakMemoryKB	   = (int) (pContext->Arena.Peak >> 10);
+
+	DEB_OUT "Working memory: %d allocations, %d from the system, %d KB at most\n",
+		pJobStats->NumAllocs, pJobStats->NumSystemAllocs, pJobStats->PeakMemoryKB);
+
+
+
+#if DEBUG
 	/*
-	// step through the image levels  counting the neighbour pairings 
-	// in the up/down left/right directions
-	// We won't worry about the edges too much as it'll simplify the 
-	// algorithm a bit.
+	// Output summary file: if you're running with VQGen, this gets written
+	// to the source file's directory.						   ,
+	// Like Debug.txt, only one job at a time writes it.
 	*/
-	for(k = 0; k < NumMaps; k++)
+	if(DebFile)
 	{
-		pThisMap = Maps[k];
-		XDim = pThisMap->xVDim;
-		YDim = pThisMap->yVDim;
+		FILE *Summary;
+		int i, j;
+		Summary = fopen("CodeSummary.txt", "w");
 
-		/*
-		// step through this image
-		*/
-		for(i = 1; i < YDim-1; i++)
+		if(Summary)
 		{
-			pThisRow = pThisMap->Rows[i];
-			pRowAbove= pThisMap->Rows[i-1];
-			pRowBelow= pThisMap->Rows[i+1];
+			fprintf(Summary, "Format:%3d Alpha:%3d  Dither:%3d\n\n", 
+				nColourFormat, bAlphaOn, DitherLevel);
+			//fprintf(Summary, "FlatCount = %d\n", FlatCount); 
 
-			for(j = 1; j < XDim-1; j++)
-			{
-				/*
-				// get the code here
-				*/
-				ThisCode = pThisRow[j].wc.Code;
+			//fprintf(Summary, "RGB Data CheckSum: %x\n", CheckSum);
 
-				/*
-				// look up, and count it
-				*/
-				OtherCode = pRowAbove[j].wc.Code;
-				if(OtherCode != ThisCode)
-				{
-					NC[OtherCode][ThisCode]++;
-					NC[ThisCode][OtherCode]++;
-				}
 
-				/*
-				// look down
-				*/
-				OtherCode = pRowBelow[j].wc.Code;
-				if(OtherCode != ThisCode)
-				{
-					NC[OtherCode][ThisCode]++;
-					NC[ThisCode][OtherCode]++;
-				}
+			fprintf(Summary, "GLA Errors:"); 
+			for(j = 0; j < NumPasses; j++)
+			{
+				fprintf(Summary, "Pass %d:%f  ", j, Errors[j]); 
+			} 
+			fprintf(Summary, "\n"); 
 
-				/*
-				// look left
-				*/
-				OtherCode = pThisRow[j-1].wc.Code;
-				if(OtherCode != ThisCode)
-				{
-					NC[OtherCode][ThisCode]++;
-					NC[ThisCode][OtherCode]++;
-				}
 
- 				/*
-				// look right
-				*/
-				OtherCode = pThisRow[j+1].wc.Code;
-				if(OtherCode != ThisCode)
+			for(i = 0; i< NumFinalReps; i++)
+			{
+				fprintf(Summary, "Code:%4d Usage:%6d  ", i, SumAndUsage[i].Usage);
+				for(j = 0; j < VECLEN; j++)
 				{
-					NC[OtherCode][ThisCode]++;
-					NC[ThisCode][OtherCode]++;
-				}
+					if((j%4)==0)
+					{
+						fprintf(Summary, "   ");
+					}
+					fprintf(Summary, "%3d ", pFinalReps[i].v[j]);
+				} 
+				fprintf(Summary, "\n");
+			} 
+
+			fclose(Summary);
+		}
+	}
+#endif
 
-			}/*end for j*/
-		}/*end for i*/
-	}/*end for stepping through the maps*/
 
 
 	/*
-	// intialise the number of codes we've done
+	// On some architectures, jumping willy nilly about in the code book MIGHT introduce
+	// page breaks or thrash a texture codebook cache. This routine attempts to reorder
+	// the assignment of codes so that frequently occuring pairings are more likely
+	// to be adjacent in memory
+	//
+	// On Dreamcast/CLX this routine is completely unnecessary, but it doesn't hurt
+	// anyway.
 	*/
-	for(k = 0; k < MAX_CODES; k++)
-	{
-		InSet[k] = 0;
-	}
-	NumDone = 0;
+	StageStart = SecondsSince(&StartTime);
+	OptimisePlacement( 	pContext,
+						Maps,
+						NumMaps,
+					  	CodebookSize,
+						Reorder);
+	pJobStats->PlacementTime = SecondsSince(&StartTime) - StageStart;
 
 
+#if DEBUG
 	/*
-	// Find the most frequent pairing. Note that because of the symmetry of the
-	// matrix, we only have to check the upper triangle.
+	// The unused codes must be the same whatever ran before, i.e. zero
 	*/
-	BestPairCount = -1;
-	BestPairI =    INT_MIN;	/*intialise to something that'll pick up errors*/
-	BestPairJ =    INT_MIN;
-
-	for(i = 0; i < nNumCodes; i++)
+	for(i = NumFinalReps; i < CodebookSize - ReservedCodes; i++)
 	{
-		for(j = i+1; j < nNumCodes; j++)
+		for(j = 0; j < VECLEN; j++)
 		{
-			if(NC[i][j] > BestPairCount)
-			{
-				BestPairCount = NC[i][j];
-				BestPairI	= i;
-				BestPairJ	= j;
-			}
+			ASSERT(pFinalReps[i].v[j] == 0)
 		}
-	}/*end for i*/
+	}
+#endif
 
 	/*
-	// assign these two codes to our list
+	// Write the results into the VQ memory format, the same codebook for
+	// each texture
 	*/
-	InSet[BestPairI] = 1;
-	InSet[BestPairJ] = 1;
-
-	Reorder[0] =BestPairI; 
-	Reorder[1] =BestPairJ; 
-	NumDone = 2;
+	StageStart = SecondsSince(&StartTime);
 
-	/*
-	// now assign the remaing codes 1 at a time
-	*/
-	while(NumDone != nNumCodes)
+	for(t = 0; (t < nNumTextures) && (nReturnValue == VQ_OK); t++)
 	{
-		BestPairCount = -1;
-		BestPairI =    INT_MIN;	/*intialise to something that'll pick up errors*/
+		nReturnValue =  WriteVqfMemory(Textures[t].OutputMemory,
+									nColourFormat,
+									bAlphaOn, 
+									bIncludeHeader,
+
+									pContext->TextureMaps[t],
+									TextureNumMaps[t],
+									pFinalReps,
+									CodebookSize,
+									Reorder);
+	}
 
-		/*
-		// step though the remaining codes to see which is the best one to add
-		*/
-		for(i = 0; i < nNumCodes; i++)
-		{
-			/*
-			// if i has not yet been done
-			*/
-			if(!InSet[i])
-			{
-				int LocalSum = 0;
-				/*
-				// Sum up this one's neighbours
-				*/
-				for(j = 0; j < nNumCodes; j++)
-				{
-					/*
-					// if J is in the done set, then add the stats
-					*/
-					if(InSet[j])
-					{
-						LocalSum += NC[i][j];
-					}
-				}/*end for j*/
+	pJobStats->WriteTime = SecondsSince(&StartTime) - StageStart;
 
-				/*
-				// is this more frequent?
-				*/
-				if(LocalSum > BestPairCount)
-				{
-					BestPairCount = LocalSum;
-					BestPairI = i;
-				}
-			}/*end if i not in the set*/
-		}/*end for i*/
 
-		/*
-		// add this one to our set
-		*/
-		InSet[BestPairI] = 1;
-		Reorder[NumDone] = BestPairI;
 
-		NumDone++;
-	}/*end while*/
+/*
+// Exit and Emergency exit point
+*/
+cleanup_and_exit:
+
+	pJobStats->TotalTime = SecondsSince(&StartTime);
+	LastJobStats = *pJobStats;
+
+#if DEBUG_FILE
+	CloseDebugFile();
+#endif
+
+
 	/*
-	// release the temporary memory
+	// if we had an error, report it
 	*/
-	free(pNeighbCount);
-
+	if(nReturnValue < 0)
+	{ 
+		return nReturnValue;
+	}
+	/*
+	// else return the number of codes we actually needed. This might allow
+	// the user to recompress with fewer codes, if they want
+	*/
+	else
+	{
+		return  NumFinalReps + ReservedCodes;
+	}
 }
-						
+
+
 /******************************************************************************/
 /******************************************************************************/
 /******************************************************************************/
 /*
-//  The CreateVq Function:
+//  PALETTE GENERATION
+//
+//  This is the same problem as the vector quantisation, but for single
+//  pixels, so it's done in much the same way: the distinct colours of all
+//  the MIP map levels are split into groups (a median cut, except that each
+//  split is placed where it minimises the error along the component with
+//  the greatest spread), the group averages are refined with a few GLA
+//  passes, and each pixel is then given the index of its nearest entry.
+//
+//  Distances are measured in the same perception space as the VQ, and the
+//  lower MIP levels get the same extra weighting.
 */
 /******************************************************************************/
-/******************************************************************************/
-/******************************************************************************/
-extern int CreateVq(const void*	InputArrayRGB,
-					const void*	InputArrayAlpha,
-						  void*	OutputMemory, 
-
-						int		BGROrder,		/*if data is BGR not RGB*/
-						int		nWidth, 		/*Square textures only*/
-						int 	Reserved0,
-						int		bMipMap, 		/*Generate MIP map. RECOMMENDED!*/
-						int		bAlphaOn, 		/*Is Alpha supplied?*/
-
-						int 	bIncludeHeader,
-
-				VQ_DITHER_TYPES	DitherLevel,	/* Level of dithering required */
-				
-						int		nNumCodes,		/*max number of codes requested*/
-						int		nColourFormat,
-										
-						int		bInvertAlpha,	/*To support Old PVR1 files that had odd alpha */
-
-						int 	Metric,			/*how to estimate colour differences*/
-						int 	Reserved1,		/*Reserved. Set it to 0 */
-
-						float	*pfErrorFound)
-{
-
-
-	IMAGE_VECTOR_STRUCT *Maps[MAX_MIP_LEVELS];
-	SearchTreeNode * pSearchTree;
+/******************************************************************************/
+/******************************************************************************/
 
-	int NumRepsNeeded = -1; /*initialise to rubbish to stop compiler warnings*/
-	int NumMaps;
+#define MAX_PALETTE_COLOURS (256)
 
-	int ReservedCodes;
-	int SkipMaps;
-	int DitherJust1stComponent;
+/*
+// Max number of refinement passes. They stop early once only a small
+// fraction (1 in PALETTE_GLA_SETTLED) of the colours change entry, as by
+// then the palette barely moves.
+*/
+#define PALETTE_GLA_ITERATIONS (4)
+#define PALETTE_GLA_SETTLED (64)
 
-	PIXEL_VECT Reps[MAX_CODES];
-	SUM_USAGE_STRUCT SumAndUsage[MAX_CODES];
+/*
+// One distinct colour from the image
+*/
+typedef struct
+{
+	U8	c[4];	/*R, G, B, A*/
+	int p[4];	/*the colour in perception space*/
 
-	float Errors[MAX_EXTRA_GLA_ITERATIONS]; /*the errors from the GLA passes*/
-	
-	int VectorCount;
+	int Weight;	/*the summed weights of all the pixels of this colour*/
+	int Index;	/*the palette entry it's currently assigned to*/
+} PALETTE_COLOUR;
 
-	int		i, j;
-	int		nReturnValue = VQ_OK;
+/*
+// Weighted sums of a set of colours, in perception space
+*/
+typedef struct
+{
+	double Weight;
+	double Sum[4];
+	double SumSq[4];
+} PALETTE_STATS;
 
-	/*
-	// the following is for optimising the order of codes for nearness in memory
-	*/
-	int Reorder[MAX_CODES];
+/*
+// A group of colours, i.e. a run of the sorted colour array, during
+// the median cut
+*/
+typedef struct
+{
+	int Start;
+	int Count;
 
+	PALETTE_STATS Stats;
+	double Error;
+} PALETTE_BOX;
 
-#if DEBUG
-	const U8 *bPtr;
-	unsigned int CheckSum;
-#endif
+/*
+// Used to sort the palette entries by distance from each other
+*/
+typedef struct
+{
+	int Dist;
+	int Index;
+} PALETTE_NEIGHBOUR;
 
 
+/*********************************************************/
 /*
-// check that we've got the endianess #define correct
+// PixelToPerceptionSpace
+//
+// Maps one pixel into the quantiser's colour space by feeding
+// RawToPerceptionSpace a vector that's all the same pixel. The
+// frequency options are dropped - they mean nothing for one pixel.
 */
-#if DEBUG
-	static union
-	{
-		long i;
-		char c;
-	}CheckEndian;
-	
-	CheckEndian.i = 1;
+/*********************************************************/
 
-#if LITTLE_ENDIAN
-	ASSERT(CheckEndian.c == 1);
-#else
-	ASSERT(CheckEndian.c == 0);
-#endif
+static void PixelToPerceptionSpace(const int Metric, const U8 c[4], int p[4])
+{
+	U8		VecIn[VECLEN];
+	PV_TYPE VecOut[VECLEN];
+	int j;
 
-#endif
+	for(j = 0; j < VECLEN; j++)
+	{
+		VecIn[j] = c[j & 3];
+	}
 
+	RawToPerceptionSpace(Metric & VQ_BASE_METRIC_MASK, VecIn, VecOut);
 
-#if DEBUG
-	FlatCount = 0;
-#endif		
+	for(j = 0; j < 4; j++)
+	{
+		p[j] = (int) VecOut[j * 4];
+	}
+}
 
 
+static void AddColourToStats(PALETTE_STATS *pStats, const PALETTE_COLOUR *pColour)
+{
+	int j;
 
-#if DEBUG_FILE
-	DebFile = fopen("Debug.txt", "w");
-	if(!DebFile)
+	pStats->Weight += pColour->Weight;
+	for(j = 0; j < 4; j++)
 	{
-		DebFile = stdout;
+		double Val = pColour->p[j];
+
+		pStats->Sum[j]	 += pColour->Weight * Val;
+		pStats->SumSq[j] += pColour->Weight * Val * Val;
 	}
-#endif
+}
 
-#if DEBUG
-	CheckSum = 0;
-	bPtr = InputArrayRGB;
+static void AddStats(PALETTE_STATS *pStats, const PALETTE_STATS *pOther)
+{
+	int j;
 
-	for(i = nWidth * nWidth * 3; i!= 0; i--)
+	pStats->Weight += pOther->Weight;
+	for(j = 0; j < 4; j++)
 	{
-		/*
-		// Do a rotate and flip a few bits
-		*/
-		CheckSum = ((CheckSum << 3) | (CheckSum >> (32-3))) ^ 0x101010;
+		pStats->Sum[j]	 += pOther->Sum[j];
+		pStats->SumSq[j] += pOther->SumSq[j];
+	}
+}
 
-		/*
-		// Add in the current byte
-		*/
-		CheckSum += *bPtr;
+/*
+// The weighted squared error of the set about its mean
+*/
+static double StatsError(const PALETTE_STATS *pStats)
+{
+	double Error = 0.0;
+	int j;
 
-		bPtr++;
+	if(pStats->Weight <= 0.0)
+	{
+		return 0.0;
 	}
 
-#endif
+	for(j = 0; j < 4; j++)
+	{
+		Error += pStats->SumSq[j] - pStats->Sum[j] * pStats->Sum[j] / pStats->Weight;
+	}
+
+	return Error;
+}
+
 
+/*********************************************************/
+/*
+// SplitPaletteBox
+//
+// Splits the box in two along the component with the greatest
+// variance. The colours are bucket sorted on that component, which
+// only has 256 possible values, and the split goes at the bucket
+// boundary which gives the least total error. Returns 0 if the box
+// can't be split (all its colours look the same).
+*/
+/*********************************************************/
+
+static int SplitPaletteBox(PALETTE_COLOUR *pColours,
+						   PALETTE_COLOUR *pTemp,
+						   PALETTE_BOX	  *pBox,
+						   PALETTE_BOX	  *pNewBox)
+{
+	PALETTE_STATS Buckets[256];
+	PALETTE_STATS Left, Right;
+	int Counts[256];
+	int Starts[256];
 
+	int Axis, BestSplit, LeftCount;
+	double BestVar, BestError;
+	int i, j;
 
 	/*
-	// If 565 or YUV has been requested, then forcibly switch off alpha. No point
-	// in wasting our time now, is there?
+	// Pick the component with the most spread
 	*/
-	if((nColourFormat == FORMAT_565) || (nColourFormat == FORMAT_YUV))
+	Axis = 0;
+	BestVar = -1.0;
+	for(j = 0; j < 4; j++)
 	{
-		bAlphaOn = 0;
+		double Var;
+
+		Var = pBox->Stats.SumSq[j] -
+			  pBox->Stats.Sum[j] * pBox->Stats.Sum[j] / pBox->Stats.Weight;
+		if(Var > BestVar)
+		{
+			BestVar = Var;
+			Axis	= j;
+		}
 	}
 
 	/*
-	// Check the size of the texture
+	// Gather the colours into buckets along it
 	*/
-	switch(nWidth)
-	{
-		case 8:
-		case 16:
-		case 32:
-		case 64:
-		case 128:
-		case 256:
-		case 512:
-		case 1024:
-		{
-			/* These are all ok */
-			break;
-		}
-		default:
-		{
-			/*
-			// This is rubbish
-			*/
-			return VQ_INVALID_SIZE;
-		}
+	memset(Buckets, 0, sizeof(Buckets));
+	memset(Counts, 0, sizeof(Counts));
 
-	}/*end switch*/
+	for(i = pBox->Start; i < pBox->Start + pBox->Count; i++)
+	{
+		int b = pColours[i].p[Axis];
 
+		CLAMP(b, 0, 255);
+		Counts[b]++;
+		AddColourToStats(&Buckets[b], &pColours[i]);
+	}
 
-	/* Has the App malloced the memory yet? */
-	if ( OutputMemory == NULL)
-	{	
-		/* Work out memory needed */
-		int nMemoryNeeded = 0;
+	/*
+	// Find the boundary with the least error on either side
+	*/
+	memset(&Left, 0, sizeof(Left));
+	BestSplit = -1;
+	BestError = 0.0;
 
+	for(i = 0; i < 255; i++)
+	{
+		double Error;
 
-		if(bIncludeHeader)
+		AddStats(&Left, &Buckets[i]);
+		if(Left.Weight <= 0.0)
 		{
-			nMemoryNeeded += 12;
-		}/*end switch*/
-
-
-		/* 
-		// Allow space for code book
-		*/
-		nMemoryNeeded += 8 * nNumCodes;
+			continue;
+		}
 
-		/*
-		// Indices 
-		//
-		// Count the number needed for the lower mipmap levels
-		// This is a lazy way to do it.... but it works :)
-		*/
-		if ( bMipMap)
+		Right.Weight = pBox->Stats.Weight - Left.Weight;
+		for(j = 0; j < 4; j++)
 		{
-			/* Do 1x1 */
-			nMemoryNeeded++;
-			/* Start loop at 2x2 pix block = 1x1 code */
-			for ( i=1; i < nWidth/2; i*=2)
-			{
-				nMemoryNeeded+= i*i;
-			}
+			Right.Sum[j]   = pBox->Stats.Sum[j]   - Left.Sum[j];
+			Right.SumSq[j] = pBox->Stats.SumSq[j] - Left.SumSq[j];
+		}
+		if(Right.Weight <= 0.0)
+		{
+			break;
 		}
-		/* top one */
-		nMemoryNeeded+= nWidth * nWidth / 4;
 
-		/*
-		// Exit function with number of bytes to allocate before coming
-		// here again!
-		*/
-		return nMemoryNeeded;
+		Error = StatsError(&Left) + StatsError(&Right);
+		if((BestSplit < 0) || (Error < BestError))
+		{
+			BestSplit = i;
+			BestError = Error;
+		}
 	}
 
-
-	/************************
-	// We now assume that OutputMemory points to valid memory for "vqf" file (in memory)
-	************************/
-
-	/*
-	// Initialise default number of reserved codes, and whether we should ignore 
-	// particular maps to start with.
-	*/
-	ReservedCodes 	= 0;
-	SkipMaps		= 0;
-	DitherJust1stComponent = 0;
-
+	if(BestSplit < 0)
+	{
+		return 0;
+	}
 
 	/*
-	// Allocate the memory for our vectorized data
-	//
-	// To make deallocation in an emergency easy, initialise everything to NULL
+	// Bucket sort the colours, and split the box at the chosen boundary
 	*/
-	for(i = 0; i < MAX_MIP_LEVELS; i++)
+	Starts[0] = 0;
+	for(i = 1; i < 256; i++)
 	{
-		Maps[i] = NULL;
+		Starts[i] = Starts[i - 1] + Counts[i - 1];
 	}
 
-	/*
-	// initialise the tree structure to NULL as well
-	*/
-	pSearchTree = NULL;
+	for(i = pBox->Start; i < pBox->Start + pBox->Count; i++)
+	{
+		int b = pColours[i].p[Axis];
 
-	/*
-	// Create the top level vectors map
-	*/
-	Maps[0] = AllocateVectorMap(nWidth);
-	NumMaps = 1;
+		CLAMP(b, 0, 255);
+		pTemp[Starts[b]++] = pColours[i];
+	}
+	memcpy(pColours + pBox->Start, pTemp, pBox->Count * sizeof(PALETTE_COLOUR));
 
-	if(Maps[0] == NULL)
+	memset(&Left, 0, sizeof(Left));
+	memset(&Right, 0, sizeof(Right));
+	for(i = 0; i < 256; i++)
 	{
-		nReturnValue = VQ_OUTOFMEMORY;	
-		goto cleanup_and_exit;
+		AddStats((i <= BestSplit) ? &Left : &Right, &Buckets[i]);
 	}
 
-	/*
-	// Slap in the data
-	*/
-	ConvertBitMapToVectors( InputArrayRGB,
-							InputArrayAlpha,
+	LeftCount = Starts[BestSplit]; /*now the end of the split bucket*/
 
-							BGROrder,
-							bAlphaOn,
-							bInvertAlpha,
+	pNewBox->Start = pBox->Start + LeftCount;
+	pNewBox->Count = pBox->Count - LeftCount;
+	pNewBox->Stats = Right;
+	pNewBox->Error = StatsError(&Right);
 
-							Maps[0],
-							Weights[0]);
-	/*
-	// If the user _wisely_ chose to do MIP mapping...
-	*/
-	if(bMipMap)
+	pBox->Count = LeftCount;
+	pBox->Stats = Left;
+	pBox->Error  = StatsError(&Left);
+
+	return 1;
+}
+
+
+/*********************************************************/
+/*
+// UpdatePaletteEntries
+//
+// Sets each palette entry to the weighted average of the colours
+// assigned to it, converted to the output bit depth. Entries with
+// no colours are left alone.
+*/
+/*********************************************************/
+
+static void UpdatePaletteEntries(const PALETTE_COLOUR *pColours,
+								 int				   NumColours,
+								 int				   NumEntries,
+								 int				   nColourFormat,
+								 int				   Metric,
+
+								 U8					   Palette[][4],
+								 int				   Perception[][4])
+{
+	double Sums[MAX_PALETTE_COLOURS][5];
+	int i, j;
+
+	memset(Sums, 0, sizeof(Sums));
+
+	for(i = 0; i < NumColours; i++)
+	{
+		double *pSum = Sums[pColours[i].Index];
+
+		for(j = 0; j < 4; j++)
+		{
+			pSum[j] += (double) pColours[i].Weight * pColours[i].c[j];
+		}
+		pSum[4] += pColours[i].Weight;
+	}
+
+	for(i = 0; i < NumEntries; i++)
 	{
-		for(i = 1; (nWidth >> i) > 0; i++)
+		if(Sums[i][4] <= 0.0)
+		{
+			continue;
+		}
+
+		for(j = 0; j < 4; j++)
 		{
-			Maps[i] = AllocateVectorMap(nWidth >> i);
+			int Val = (int) (Sums[i][j] / Sums[i][4] + 0.5);
 
-			if(Maps[i] == NULL)
+			if((nColourFormat >= FORMAT_4444) && (nColourFormat <= FORMAT_565))
 			{
-				nReturnValue = VQ_OUTOFMEMORY;	
-				goto cleanup_and_exit;
+				Val = ConvertBitDepth(BitDepths[nColourFormat][j], Val);
 			}
+			CLAMP(Val, 0, 255);
+			Palette[i][j] = (U8) Val;
+		}
 
+		PixelToPerceptionSpace(Metric, Palette[i], Perception[i]);
+	}
+}
 
-			NumMaps ++;
 
-			/*
-			// Convert the higher level map into the lower one
-			*/
-			GenerateMIPMapLevel(Maps[i-1], Maps[i], Weights[i]);
+static FORCE_INLINE int PaletteDistance(const int p[4], const int q[4])
+{
+	int Dist = 0;
+	int j;
+
+	for(j = 0; j < 4; j++)
+	{
+		int Diff = p[j] - q[j];
+
+		Dist += Diff * Diff;
+	}
+
+	return Dist;
+}
 
-		}/*end for i*/
-	}/*end if need Mip maps*/
 
+/*
+// qsort callback for ordering an entry's neighbours, nearest first
+*/
+static int ComparePaletteNeighbours(const void *pA, const void *pB)
+{
+	const PALETTE_NEIGHBOUR *pNA = (const PALETTE_NEIGHBOUR *) pA;
+	const PALETTE_NEIGHBOUR *pNB = (const PALETTE_NEIGHBOUR *) pB;
 
+	if(pNA->Dist != pNB->Dist)
+	{
+		return (pNA->Dist < pNB->Dist) ? -1 : 1;
+	}
+	return pNA->Index - pNB->Index;
+}
 
 
+/*********************************************************/
+/*
+// AssignNearestEntries
+//
+// Moves every colour to its nearest palette entry and returns how
+// many moved. This uses the same trick as the VQ's neighbour array:
+// each entry has a list of the others sorted by distance, and since
+// an entry more than twice as far from the colour's current entry as
+// the colour is can't be any nearer, only the start of the list needs
+// checking. Usually that's none of it.
+//
+// pNeighbours is workspace for NumEntries * NumEntries neighbours.
+*/
+/*********************************************************/
 
+static int AssignNearestEntries(PALETTE_COLOUR	  *pColours,
+								int				   NumColours,
+								int				   NumEntries,
+								int				   Perception[][4],
+								PALETTE_NEIGHBOUR *pNeighbours)
+{
+	int NumChanged = 0;
+	int i, j;
 
 	/*
-	// if we are doing YUV, convert the format for all but the 1x1 texture from
-	// RGB to YUV.
-	// The 1x1 map is stored as RGB. To make life easy,we reserve a special code
-	// for it.
+	// Build the sorted neighbour lists. Each entry is first in its
+	// own list, so skip that one when searching.
 	*/
-	if(nColourFormat == FORMAT_YUV)
+	for(i = 0; i < NumEntries; i++)
+	{
+		PALETTE_NEIGHBOUR *pList = pNeighbours + i * NumEntries;
+
+		for(j = 0; j < NumEntries; j++)
+		{
+			pList[j].Dist  = PaletteDistance(Perception[i], Perception[j]);
+			pList[j].Index = j;
+		}
+		qsort(pList, NumEntries, sizeof(PALETTE_NEIGHBOUR), ComparePaletteNeighbours);
+	}
+
+	for(i = 0; i < NumColours; i++)
 	{
-		int FreqFlag;
+		PALETTE_COLOUR			*pColour = &pColours[i];
+		const PALETTE_NEIGHBOUR *pList	 = pNeighbours + pColour->Index * NumEntries;
+		int BestIndex, BestDist, Limit;
 
-		ConvertToYUV(Maps[0]);
+		BestIndex = pColour->Index;
+		BestDist  = PaletteDistance(pColour->p, Perception[BestIndex]);
 
 		/*
-		// If the weighted colour space metric was chosen, change to the equivalent
-		// for YUV
-		//
-		// If we want frequency based weighting, then limit this to just the
-		// Y component.
-		*/		
-		FreqFlag = Metric & VQMETRIC_FREQUENCY_FLAG;
+		// (2d)^2 in squared distances
+		*/
+		Limit = 4 * BestDist;
 
-		if((Metric & VQ_BASE_METRIC_MASK) != VQMetricEqual)
+		for(j = 1; (j < NumEntries) && (pList[j].Dist < Limit); j++)
 		{
-			Metric = VQMetricWeightedYUV;
-		}
-		else
-		{ 
-			Metric = VQMetricEqual;
+			int Dist = PaletteDistance(pColour->p, Perception[pList[j].Index]);
+
+			if(Dist < BestDist)
+			{
+				BestDist  = Dist;
+				BestIndex = pList[j].Index;
+			}
 		}
 
-		if(FreqFlag)
+		if(BestIndex != pColour->Index)
 		{
-			Metric |= VQMETRIC_FREQUENCY_FLAG_JUST_FIRST;
+			pColour->Index = BestIndex;
+			NumChanged++;
 		}
+	}
 
-		/*
-		// only permit dithering/diffusion on the Y component
-		*/ 
-		DitherJust1stComponent = 1;
+	return NumChanged;
+}
 
-		/*
-		// if we are mip mapping, then convert all bar the 1x1 map to
-		// YUV. The 1x1 map gets its own code.
-		*/
-		if(bMipMap)
-		{
-			int Sum[VECLEN];
-			for(i = 1; i < NumMaps - 1; i++)
-			{
-				ConvertToYUV(Maps[i]);
-			}
 
-			/*
-			// reserve the extra code for the 1x1 case.
-			*/
-			ReservedCodes = 1;
-			SkipMaps = 1;
+/*********************************************************/
+/*
+// PackPaletteKey
+//
+// Packs a pixel into the 32 bit value used to sort and look up
+// the distinct colours.
+*/
+/*********************************************************/
 
-			/*
-			// Set up the reserved code...
-			*/
-			for(i = 0; i < VECLEN; i++)
-			{
-				Sum[i] = Maps[NumMaps-1]->Rows[0][0].v[i];
-			}
-			SumToRep(Sum, 1, FORMAT_565, Reps + (nNumCodes-1));
+static unsigned int PackPaletteKey(const U8 *pRGB, const U8 *pAlpha, int BGROrder)
+{
+	unsigned int R, G, B, A;
 
-			/*
-			// and point the vector at that code
-			*/
-			Maps[NumMaps-1]->Rows[0][0].wc.Code =  nNumCodes - 1;
-		}/*end if MIP mapped*/
+	if(BGROrder)
+	{
+		R = pRGB[2];
+		G = pRGB[1];
+		B = pRGB[0];
+	}
+	else
+	{
+		R = pRGB[0];
+		G = pRGB[1];
+		B = pRGB[2];
+	}
 
-	}/*end if YUV format*/
-	
+	A = pAlpha ? *pAlpha : 255;
+
+	return R | (G << 8) | (B << 16) | (A << 24);
+}
+
+
+/******************************************************************************/
+/*
+//  The CreatePalette Function:
+//
+//  Builds a palette of up to nNumColours entries for the given MIP map
+//  levels, and fills in each level's indices.
+*/
+/******************************************************************************/
+extern int CreatePalette(const void* const	LevelsRGB[],
+						 const void* const	LevelsAlpha[],
+							   int			nLevels,
+
+							   int			BGROrder,
+							   int			nWidth,
+							   int			nHeight,
+							   int			bAlphaOn,
+
+							   int			nNumColours,
+							   int			nColourFormat,
+							   int			Metric,
+
+							   unsigned char *pPalette,
+							   unsigned char * const Indices[])
+{
+	unsigned long long *pKeys = NULL, *pKeysTemp = NULL;
+	int				   *pPixelColours = NULL;
+	PALETTE_COLOUR	   *pColours = NULL, *pCutColours = NULL, *pSortTemp = NULL;
+	PALETTE_NEIGHBOUR  *pNeighbours = NULL;
+
+	PALETTE_BOX Boxes[MAX_PALETTE_COLOURS];
+	U8	Palette[MAX_PALETTE_COLOURS][4];
+	int Perception[MAX_PALETTE_COLOURS][4];
+
+	int LevelStarts[MAX_MIP_LEVELS + 1];
+	int NumPixels, NumColours, NumBoxes, NumChanged;
+	int nReturnValue;
+	int Level, Pass, i, j;
 
 	/*
-	// Create the Representative Vectors
+	// 565 has no alpha to put in the palette
 	*/
-	NumRepsNeeded = VectorQuantizer(Maps, 
-							NumMaps   - SkipMaps,
-							nNumCodes - ReservedCodes,
-							nColourFormat,
-							bAlphaOn,
-							Metric,
-							&pSearchTree,		
-							Reps,
-							&VectorCount);
+	if(nColourFormat == FORMAT_565)
+	{
+		bAlphaOn = 0;
+	}
+
+	if((LevelsRGB == NULL) || (bAlphaOn && (LevelsAlpha == NULL)) ||
+	   (pPalette == NULL) || (Indices == NULL) ||
+	   (nLevels < 1) || (nLevels > MAX_MIP_LEVELS) ||
+	   (nNumColours < 2) || (nNumColours > MAX_PALETTE_COLOURS))
+	{
+		return VQ_INVALID_PARAMETER;
+	}
 
+	if((nWidth < 1) || (nHeight < 1) ||
+	   ((nWidth >> (nLevels - 1)) == 0) || ((nHeight >> (nLevels - 1)) == 0))
+	{
+		return VQ_INVALID_SIZE;
+	}
 
-	if(NumRepsNeeded < 0)
+	NumPixels = 0;
+	for(Level = 0; Level < nLevels; Level++)
 	{
-		nReturnValue = VQ_OUTOFMEMORY;	
-		goto cleanup_and_exit;
+		if((LevelsRGB[Level] == NULL) || (bAlphaOn && (LevelsAlpha[Level] == NULL)) ||
+		   (Indices[Level] == NULL))
+		{
+			return VQ_INVALID_PARAMETER;
+		}
+		LevelStarts[Level] = NumPixels;
+		NumPixels += (nWidth >> Level) * (nHeight >> Level);
 	}
+	LevelStarts[nLevels] = NumPixels;
 
+	pKeys		  = (unsigned long long *) malloc(NumPixels * sizeof(unsigned long long));
+	pKeysTemp	  = (unsigned long long *) malloc(NumPixels * sizeof(unsigned long long));
+	pPixelColours = (int *) malloc(NumPixels * sizeof(int));
+	if((pKeys == NULL) || (pKeysTemp == NULL) || (pPixelColours == NULL))
+	{
+		nReturnValue = VQ_OUTOFMEMORY;
+		goto cleanup_and_exit;
+	}
 
 	/*
-	// At this point we launch into a full-blown GLA (Generalised Lloyd's
-	// Algorithm) as was used in the old VQ compressor. We don't do many
-	// iterations as the gains rapidly become insignificant.
+	// Get every pixel as a colour in the top 32 bits and its position
+	// in the bottom, and radix sort on the colour
 	*/
-	for(j = EXTRA_GLA_ITS; j >= 0; j--)
+	i = 0;
+	for(Level = 0; Level < nLevels; Level++)
 	{
-		int LocalDitherSetting;
+		const U8 *pRGB	 = (const U8 *) LevelsRGB[Level];
+		const U8 *pAlpha = bAlphaOn ? (const U8 *) LevelsAlpha[Level] : NULL;
+		int LevelPixels  = (nWidth >> Level) * (nHeight >> Level);
 
-		/*
-		// Only use dithering on the last pass
-		*/
-		if(j == 0)
+		for(j = 0; j < LevelPixels; j++)
 		{
-			LocalDitherSetting = DitherLevel;
+			unsigned int Key;
+
+			Key = PackPaletteKey(pRGB + j * 3, pAlpha ? (pAlpha + j) : NULL, BGROrder);
+			pKeys[i] = ((unsigned long long) Key << 32) | (unsigned int) i;
+			i++;
 		}
-		else
+	}
+
+	for(Pass = 32; Pass < 64; Pass += 8)
+	{
+		int Starts[256];
+		unsigned long long *pSwap;
+
+		memset(Starts, 0, sizeof(Starts));
+		for(i = 0; i < NumPixels; i++)
 		{
-			LocalDitherSetting = 0;
+			Starts[(pKeys[i] >> Pass) & 0xFF]++;
 		}
 
 		/*
-		// Map the vectors to the representative set
+		// nothing to do if it's the same for all of them, e.g. the alpha
+		// of an opaque image
 		*/
-		Errors[j] = MapImageToIndices(Maps, 
-							NumMaps - SkipMaps,
-					  		pSearchTree,
-					  		Reps,
-					  		NumRepsNeeded,
-					  		SumAndUsage,
-					  		LocalDitherSetting,
-					  		DitherJust1stComponent);
+		if(Starts[(pKeys[0] >> Pass) & 0xFF] == NumPixels)
+		{
+			continue;
+		}
 
+		for(i = 0, j = 0; i < 256; i++)
+		{
+			int Count = Starts[i];
 
-		/*
-		// Recompute the reps based on the vectors which really map to them
-		//
-		// THE FOLLOWING TEST IS CURRENTLY DISABLED:
-		// Only do this when we aren't dithering, because I think the dithering
-		// phase tends to mess this up a bit.
-		*/
-		if(1)//!LocalDitherSetting)
+			Starts[i] = j;
+			j += Count;
+		}
+		for(i = 0; i < NumPixels; i++)
 		{
-			for(i = 0; i < NumRepsNeeded; i++)
-			{
-				if(SumAndUsage[i].Usage > 0)
-				{
-					SumToRep(SumAndUsage[i].Sum, SumAndUsage[i].Usage, 
-						nColourFormat, Reps+i);
-				}
-			}/*end for i*/
+			pKeysTemp[Starts[(pKeys[i] >> Pass) & 0xFF]++] = pKeys[i];
 		}
-	}/*end for final GLA passes*/
 
-	
+		pSwap	  = pKeys;
+		pKeys	  = pKeysTemp;
+		pKeysTemp = pSwap;
+	}
+
 	/*
-	// Convert the total error into a per-component average
+	// Merge the runs of the same colour, noting which one each pixel is
 	*/
-	if(bAlphaOn)
+	NumColours = 0;
+	for(i = 0; i < NumPixels; i++)
 	{
-		*pfErrorFound = (float) sqrt((float) Errors[0] / (VectorCount * VECLEN));
+		if((i == 0) || ((pKeys[i] >> 32) != (pKeys[i - 1] >> 32)))
+		{
+			NumColours++;
+		}
 	}
-	else
+
+	pColours = (PALETTE_COLOUR *) malloc(NumColours * sizeof(PALETTE_COLOUR));
+	if(pColours == NULL)
 	{
-		*pfErrorFound = (float) sqrt((float) Errors[0] / (VectorCount * 12 ));
+		nReturnValue = VQ_OUTOFMEMORY;
+		goto cleanup_and_exit;
 	}
 
-
-
-#if DEBUG
-	/*
-	// Output summary file: if you're running with VQGen, this gets written
-	// to the source file's directory.						   ,
-	*/
+	j = -1;
+	for(i = 0; i < NumPixels; i++)
 	{
-		FILE *Summary;
-		int i, j;
-		Summary = fopen("CodeSummary.txt", "w");
+		unsigned int Key = (unsigned int) (pKeys[i] >> 32);
+		int Pos			 = (int) (pKeys[i] & 0xFFFFFFFF);
 
-		if(Summary)
+		if((i == 0) || ((pKeys[i] >> 32) != (pKeys[i - 1] >> 32)))
 		{
-			fprintf(Summary, "Format:%3d Alpha:%3d  Dither:%3d\n\n", 
-				nColourFormat, bAlphaOn, DitherLevel);
-			//fprintf(Summary, "FlatCount = %d\n", FlatCount); 
-
-			//fprintf(Summary, "RGB Data CheckSum: %x\n", CheckSum);
-
-
-			fprintf(Summary, "GLA Errors:"); 
-			for(j = EXTRA_GLA_ITS; j >= 0; j--)
-			{
-				fprintf(Summary, "Pass %d:%f  ", EXTRA_GLA_ITS - j, Errors[j]); 
-			} 
-			fprintf(Summary, "\n"); 
+			j++;
 
+			pColours[j].c[0] = (U8) Key;
+			pColours[j].c[1] = (U8) (Key >> 8);
+			pColours[j].c[2] = (U8) (Key >> 16);
+			pColours[j].c[3] = (U8) (Key >> 24);
+			PixelToPerceptionSpace(Metric, pColours[j].c, pColours[j].p);
 
-			for(i = 0; i< NumRepsNeeded; i++)
-			{
-				fprintf(Summary, "Code:%4d Usage:%6d  ", i, SumAndUsage[i].Usage);
-				for(j = 0; j < VECLEN; j++)
-				{
-					if((j%4)==0)
-					{
-						fprintf(Summary, "   ");
-					}
-					fprintf(Summary, "%3d ", Reps[i].v[j]);
-				} 
-				fprintf(Summary, "\n");
-			} 
+			pColours[j].Weight = 0;
+			pColours[j].Index  = 0;
+		}
 
-			fclose(Summary);
+		for(Level = 0; Pos >= LevelStarts[Level + 1]; Level++)
+		{
+			/*find the level*/
 		}
+		pColours[j].Weight += Weights[Level];
+		pPixelColours[Pos] = j;
 	}
-#endif
-
 
+	free(pKeys);
+	free(pKeysTemp);
+	pKeys = pKeysTemp = NULL;
 
 	/*
-	// On some architectures, jumping willy nilly about in the code book MIGHT introduce
-	// page breaks or thrash a texture codebook cache. This routine attempts to reorder
-	// the assignment of codes so that frequently occuring pairings are more likely
-	// to be adjacent in memory
-	//
-	// On Dreamcast/CLX this routine is completely unnecessary, but it doesn't hurt
-	// anyway.
+	// The colour array has to stay in order for the look ups at the
+	// end, so do the median cut on a copy
 	*/
-	OptimisePlacement( 	Maps,
-						NumMaps,
-					  	nNumCodes,
-						Reorder);
+	pCutColours = (PALETTE_COLOUR *) malloc(NumColours * sizeof(PALETTE_COLOUR));
+	pSortTemp	= (PALETTE_COLOUR *) malloc(NumColours * sizeof(PALETTE_COLOUR));
+	if((pCutColours == NULL) || (pSortTemp == NULL))
+	{
+		nReturnValue = VQ_OUTOFMEMORY;
+		goto cleanup_and_exit;
+	}
 
+	memcpy(pCutColours, pColours, NumColours * sizeof(PALETTE_COLOUR));
+	for(i = 0; i < NumColours; i++)
+	{
+		pCutColours[i].Index = i;
+	}
 
 	/*
-	// Write the results into the VQ memory format
+	// Median cut. Repeatedly split the box with the largest error
 	*/
+	NumBoxes = 1;
+	Boxes[0].Start = 0;
+	Boxes[0].Count = NumColours;
+	memset(&Boxes[0].Stats, 0, sizeof(PALETTE_STATS));
+	for(i = 0; i < NumColours; i++)
+	{
+		AddColourToStats(&Boxes[0].Stats, &pCutColours[i]);
+	}
+	Boxes[0].Error = StatsError(&Boxes[0].Stats);
 
-	nReturnValue =  WriteVqfMemory(OutputMemory,
-								nColourFormat,
-								bAlphaOn, 
-								bIncludeHeader,
-
-								Maps,
-								NumMaps,
-								Reps,
-								nNumCodes,
-								Reorder);
-
-
+	while(NumBoxes < nNumColours)
+	{
+		int Worst = -1;
 
+		for(i = 0; i < NumBoxes; i++)
+		{
+			if((Boxes[i].Count > 1) && (Boxes[i].Error > 0.0) &&
+			   ((Worst < 0) || (Boxes[i].Error > Boxes[Worst].Error)))
+			{
+				Worst = i;
+			}
+		}
 
-/*
-// Exit and Emergency exit point
-*/
-cleanup_and_exit:
+		if(Worst < 0)
+		{
+			break;
+		}
 
-#if DEBUG_FILE
-	if(DebFile && (DebFile != stdout))
-	{
-		fclose(DebFile);
+		if(SplitPaletteBox(pCutColours, pSortTemp, &Boxes[Worst], &Boxes[NumBoxes]))
+		{
+			NumBoxes++;
+		}
+		else
+		{
+			Boxes[Worst].Error = 0.0;
+		}
 	}
-#endif
-
 
-
-   	/*
-	// Release the image vector structures
+	/*
+	// Start each colour off on its box's entry
 	*/
-	for(i = 0; i < MAX_MIP_LEVELS; i++)
+	for(i = 0; i < NumBoxes; i++)
 	{
-		FreeVectorMap(Maps[i]);
+		for(j = Boxes[i].Start; j < Boxes[i].Start + Boxes[i].Count; j++)
+		{
+			pColours[pCutColours[j].Index].Index = i;
+		}
 	}
 
 	/*
-	// release the search tree
+	// Refine with the GLA.
 	*/
-	FreeSearchTree(pSearchTree);
+	pNeighbours = (PALETTE_NEIGHBOUR *) malloc(NumBoxes * NumBoxes * sizeof(PALETTE_NEIGHBOUR));
+	if(pNeighbours == NULL)
+	{
+		nReturnValue = VQ_OUTOFMEMORY;
+		goto cleanup_and_exit;
+	}
 
+	memset(Palette, 0, sizeof(Palette));
+	for(Pass = 0; ; Pass++)
+	{
+		UpdatePaletteEntries(pColours, NumColours, NumBoxes, nColourFormat, Metric,
+							 Palette, Perception);
 
-	/*
-	// if we had an error, report it
-	*/
-	if(nReturnValue < 0)
-	{ 
-		return nReturnValue;
+		NumChanged = AssignNearestEntries(pColours, NumColours, NumBoxes, Perception, pNeighbours);
+		if((NumChanged <= NumColours / PALETTE_GLA_SETTLED) ||
+		   (Pass == PALETTE_GLA_ITERATIONS))
+		{
+			break;
+		}
 	}
+
 	/*
-	// else return the number of codes we actually needed. This might allow
-	// the user to recompress with fewer codes, if they want
+	// Write out the palette, and each pixel's colour's index
 	*/
-	else
+	memset(pPalette, 0, nNumColours * 4);
+	memcpy(pPalette, Palette, NumBoxes * 4);
+
+	for(Level = 0; Level < nLevels; Level++)
 	{
-		return  NumRepsNeeded + ReservedCodes;
+		const int *pLevelColours = pPixelColours + LevelStarts[Level];
+		int LevelPixels = LevelStarts[Level + 1] - LevelStarts[Level];
+
+		for(j = 0; j < LevelPixels; j++)
+		{
+			Indices[Level][j] = (U8) pColours[pLevelColours[j]].Index;
+		}
 	}
+
+	nReturnValue = NumBoxes;
+
+cleanup_and_exit:
+	free(pKeys);
+	free(pKeysTemp);
+	free(pColours);
+	free(pCutColours);
+	free(pSortTemp);
+	free(pPixelColours);
+	free(pNeighbours);
+
+	return nReturnValue;
 }
 
 
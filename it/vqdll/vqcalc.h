@@ -156,13 +156,103 @@ typedef enum
 {
  	VQNoDither = 0,
         VQSubtleDither,
-	VQFullDither
+	VQFullDither,
+	VQOrderedDither		/*a fixed pattern, not error diffusion*/
 } VQ_DITHER_TYPES;
 
+/*
+// How the nearest code to each vector is found (see SetVqContextSearchIndex).
+// They all find a nearest code, and when two codes are equally near they
+// all choose the lower numbered one, so the output is the same whichever is
+// used.
+*/
+typedef enum
+{
+	VQSearchNeighbours = 0,	/*guess with a BSP tree, then check the guess's nearest neighbours*/
+	VQSearchKdTree,			/*search a k-d tree over the codes*/
+	VQSearchExhaustive		/*try every code*/
+} VQ_SEARCH_INDEX;
+
+/*
+// What a job did, and how long each stage took (see GetVqContextStats).
+// The times are wall clock seconds, and the errors are RMS per component,
+// as for fErrorFound.
+*/
+#define VQ_STATS_MAX_PASSES (16)
+#define VQ_STATS_MAX_LEVELS (11)
+#define VQ_STATS_MAX_CODEBOOKS (5)
+
+typedef struct
+{
+	int		Width;
+	int		NumCodes;			/*codes in the codebook written*/
+	int		NumCodesUsed;		/*codes that some vector maps to*/
+
+	/*
+	// The 2x2 vectors of all the levels, how many are distinct, and how
+	// many the codes were trained on
+	*/
+	int		NumVectors;
+	int		NumUniqueVectors;
+	int		NumTrainingVectors;
+
+	/*
+	// Time taken by each stage
+	*/
+	double	VectoriseTime;		/*turning the supplied levels into vectors*/
+	double	MipMapTime;			/*generating the levels that weren't supplied*/
+	double	YUVTime;			/*converting to YUV*/
+	double	TrainTime;			/*building the codes*/
+	double	PlacementTime;		/*ordering the codes*/
+	double	WriteTime;			/*writing the VQF data*/
+	double	TotalTime;
+
+	/*
+	// The GLA passes: the time each took, and the error after it
+	*/
+	int		NumPasses;
+	double	PassTimes[VQ_STATS_MAX_PASSES];
+	float	PassErrors[VQ_STATS_MAX_PASSES];
+
+	/*
+	// Finding the nearest codes, over all the passes: the vectors looked
+	// up, the distance calcs for them and for setting up the search, and
+	// how often the tree's first guess was the nearest code (only for
+	// VQSearchNeighbours)
+	*/
+	VQ_SEARCH_INDEX SearchIndex;
+	long long NumSearches;
+	long long NumDistanceCalcs;
+	long long NumSetupCalcs;
+	long long NumTreeHits;
+
+	/*
+	// The error of each MIP level with the finished codebook, top first
+	*/
+	int		NumLevels;
+	float	LevelErrors[VQ_STATS_MAX_LEVELS];
+
+	/*
+	// The smaller codebooks tried (see SetVqContextSmallCodebooks), smallest
+	// first, and the error each gave
+	*/
+	int		NumCodebooksTried;
+	int		TriedCodes[VQ_STATS_MAX_CODEBOOKS];
+	float	TriedErrors[VQ_STATS_MAX_CODEBOOKS];
+
+	/*
+	// Working memory: allocations, how many of those went to malloc, and
+	// the most in use at once
+	*/
+	int		NumAllocs;
+	int		NumSystemAllocs;
+	int		PeakMemoryKB;
+} VQ_STATS;
+
 
 
 /******************************************************************************/
-/*  THE ONLY EXTERN FUNTION                                                   */
+/*  THE EXTERN FUNCTIONS                                                      */
 /******************************************************************************/
 extern int CreateVq(const void*	InputArrayRGB,
 					const void*	InputArrayAlpha,
@@ -189,8 +279,176 @@ extern int CreateVq(const void*	InputArrayRGB,
 
 						float	*fErrorFound);
 
+/*
+// Size in bytes of the output CreateVq would produce, or VQ_INVALID_SIZE
+*/
+extern int CreateVqSize(int nWidth, int bMipMap, int IncludeHeader, int nNumCodes);
+
+/*
+// As CreateVq, but takes each MIP map level as a separate pointer, largest
+// first. Levels beyond nLevels are generated. OutputMemory must be allocated
+// (use CreateVqSize).
+*/
+extern int CreateVqFromLevels(const void* const	LevelsRGB[],
+							  const void* const	LevelsAlpha[],	/*may be NULL if !bAlphaOn*/
+									int			nLevels,
+									void*		OutputMemory,
+
+									int			BGROrder,
+									int			nWidth,
+									int			bMipMap,
+									int			bAlphaOn,
+									int			IncludeHeader,
+							VQ_DITHER_TYPES		DitherLevel,
+									int			nNumCodes,
+									int			nColourFormat,
+									int			bInvertAlpha,
+									int			Metric,
+
+									float		*fErrorFound);
+
+/*
+// Builds a palette of up to nNumColours RGBA entries (4 bytes each) for the
+// given MIP map levels, and writes each level's pixel indices. nColourFormat
+// is the format the entries will be stored in, or -1 for 8 bits per component.
+// Returns the number of entries used.
+*/
+extern int CreatePalette(const void* const	LevelsRGB[],
+						 const void* const	LevelsAlpha[],	/*may be NULL if !bAlphaOn*/
+							   int			nLevels,
+
+							   int			BGROrder,
+							   int			nWidth,
+							   int			nHeight,
+							   int			bAlphaOn,
+
+							   int			nNumColours,
+							   int			nColourFormat,
+							   int			Metric,
+
+							   unsigned char *pPalette,
+							   unsigned char * const Indices[]);
+
+/*
+// Number of threads to use when building the codes and mapping the image to
+// them (default 1). This doesn't change the results. Contexts pick this up
+// when created.
+*/
+extern void SetVqThreadCount(int nThreads);
+
+/*
+// A context holds all the working memory for a VQ job. Jobs with different
+// contexts can run at the same time on different threads, and a context
+// keeps its memory between jobs. CreateVqContext returns NULL if it runs
+// out of memory.
+*/
+typedef struct VQ_CONTEXT_TAG VQ_CONTEXT;
+
+extern VQ_CONTEXT* CreateVqContext(void);
+extern void DestroyVqContext(VQ_CONTEXT *pContext);
+extern void SetVqContextThreadCount(VQ_CONTEXT *pContext, int nThreads);
+extern void SetVqContextSubsample(VQ_CONTEXT *pContext, int nSubsample);
+extern void SetVqContextSearchIndex(VQ_CONTEXT *pContext, VQ_SEARCH_INDEX SearchIndex);
+extern void SetVqContextRefinement(VQ_CONTEXT *pContext, int nMaxExtraPasses,
+								   float fMinImprovement, float fTimeBudget);
+extern int GetVqContextPassErrors(const VQ_CONTEXT *pContext, float pfErrors[],
+								  int nMaxErrors);
+extern void GetVqContextStats(const VQ_CONTEXT *pContext, VQ_STATS *pStats);
 
+/*
+// As well as the nNumCodes codebook, build the codebook of each size in
+// nSizes (powers of 2 from 8 to 128) on the way to it, and write the
+// smallest whose error is at most fMaxError instead. nNumSizes 0 (the
+// default) turns this off. GetVqContextCodebookSize gives the size the
+// last job wrote.
+*/
+extern void SetVqContextSmallCodebooks(VQ_CONTEXT *pContext, const int nSizes[],
+									   int nNumSizes, float fMaxError);
+extern int GetVqContextCodebookSize(const VQ_CONTEXT *pContext);
+
+/*
+// Start from a codebook an earlier job wrote (nNumCodes codes of 8 bytes,
+// in the job's colour format) instead of building one: only the GLA passes
+// are run. NULL (the default) turns this off.
+*/
+extern void SetVqContextWarmStart(VQ_CONTEXT *pContext, const void *pCodebook,
+								  int nNumCodes);
 
+/*
+// Build the codes from only the MIP levels at most nMaxWidth wide, then do
+// a GLA pass with each wider level added in turn before the usual passes.
+// Only applies when MIP mapping. 0 (the default) turns it off.
+*/
+extern void SetVqContextCoarseTraining(VQ_CONTEXT *pContext, int nMaxWidth);
+
+/*
+// The stats of the last job on this thread, whichever function ran it
+*/
+extern void GetLastVqStats(VQ_STATS *pStats);
+
+/*
+// As CreateVqFromLevels, but using the given context
+*/
+extern int CreateVqWithContext(VQ_CONTEXT		*pContext,
+							  const void* const	LevelsRGB[],
+							  const void* const	LevelsAlpha[],	/*may be NULL if !bAlphaOn*/
+									int			nLevels,
+									void*		OutputMemory,
+
+									int			BGROrder,
+									int			nWidth,
+									int			bMipMap,
+									int			bAlphaOn,
+									int			IncludeHeader,
+							VQ_DITHER_TYPES		DitherLevel,
+									int			nNumCodes,
+									int			nColourFormat,
+									int			bInvertAlpha,
+									int			Metric,
+
+									float		*fErrorFound);
+
+/*
+// One texture of a set that shares a codebook (see CreateVqSetWithContext).
+// The levels are as for CreateVqFromLevels.
+*/
+#define VQ_MAX_SET_TEXTURES (64)
+
+typedef struct
+{
+	const void* const	*LevelsRGB;
+	const void* const	*LevelsAlpha;	/*may be NULL if !bAlphaOn*/
+	int					nLevels;
+	int					nWidth;
+
+	void*				OutputMemory;	/*CreateVqSize bytes for nWidth*/
+	float				fErrorFound;	/*set to this texture's RMS error*/
+} VQ_SET_TEXTURE;
+
+/*
+// Trains one codebook on all the vectors of up to VQ_MAX_SET_TEXTURES
+// textures, and maps each of them to it. Each texture's OutputMemory gets
+// the same codebook followed by its own indices, as the hardware wants the
+// codebook in front of the indices. The options apply to all of them, and
+// YUV can't be MIP mapped in a set of more than one, as each 1x1 level
+// would need its own code. Returns as CreateVqWithContext, and the stats
+// are for the whole set.
+*/
+extern int CreateVqSetWithContext(VQ_CONTEXT		*pContext,
+								  VQ_SET_TEXTURE	Textures[],
+										int			nNumTextures,
+
+										int			BGROrder,
+										int			bMipMap,
+										int			bAlphaOn,
+										int			IncludeHeader,
+								VQ_DITHER_TYPES		DitherLevel,
+										int			nNumCodes,
+										int			nColourFormat,
+										int			bInvertAlpha,
+										int			Metric,
+
+										float		*fErrorFound);
 
 
 
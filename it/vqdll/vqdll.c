@@ -137,6 +137,251 @@ MyDllExport int VqCalc(	void*	InputArrayRGB,
 }
 
 
+/*
+// Threading control. See header file (vqdll.h) for more details.
+*/
+MyDllExport void VqSetThreadCount( int nThreads )
+{
+	SetVqThreadCount(nThreads);
+}
+
+
+/*
+// Size query and per-level entry point. See header file (vqdll.h) for more details.
+*/
+MyDllExport int VqCalcSize( int nWidth, int MipMapMode, int bIncludeHeader, int nNumCodes )
+{
+	return CreateVqSize(nWidth, MipMapMode, bIncludeHeader, nNumCodes);
+}
+
+MyDllExport int VqCalcLevels(const void* const	LevelsRGB[],
+							 const void* const	LevelsAlpha[],
+								   int			nLevels,
+								   void*		OutputMemory,
+
+								   int			BGROrder,
+								   int			nWidth,
+								   int			MipMapMode,
+								   int			bAlphaOn,
+								   int			bIncludeHeader,
+
+						   VQ_DITHER_TYPES		DitherLevel,
+
+								   int			nNumCodes,
+								   int			nColourFormat,
+								   int			bInvertAlpha,
+
+						  VQ_COLOUR_METRIC		Metric,
+
+								   float		*fErrorFound)
+{
+	return CreateVqFromLevels(LevelsRGB,
+							  LevelsAlpha,
+							  nLevels,
+							  OutputMemory,
+
+							  BGROrder,
+							  nWidth,
+							  MipMapMode,
+							  bAlphaOn,
+							  bIncludeHeader,
+							  DitherLevel,
+							  nNumCodes,
+							  nColourFormat,
+							  bInvertAlpha,
+							  Metric,
+
+							  fErrorFound);
+}
+
+
+/*
+// Contexts, for running several compressions at once. See header file (vqdll.h)
+// for more details.
+*/
+MyDllExport VQ_CONTEXT* VqCreateContext( void )
+{
+	return CreateVqContext();
+}
+
+MyDllExport void VqDestroyContext( VQ_CONTEXT* pContext )
+{
+	DestroyVqContext(pContext);
+}
+
+MyDllExport void VqContextSetThreadCount( VQ_CONTEXT* pContext, int nThreads )
+{
+	SetVqContextThreadCount(pContext, nThreads);
+}
+
+MyDllExport void VqContextSetSubsample( VQ_CONTEXT* pContext, int nSubsample )
+{
+	SetVqContextSubsample(pContext, nSubsample);
+}
+
+MyDllExport void VqContextSetSearchIndex( VQ_CONTEXT* pContext, VQ_SEARCH_INDEX SearchIndex )
+{
+	SetVqContextSearchIndex(pContext, SearchIndex);
+}
+
+MyDllExport void VqContextSetRefinement( VQ_CONTEXT* pContext, int nMaxExtraPasses, float fMinImprovement, float fTimeBudget )
+{
+	SetVqContextRefinement(pContext, nMaxExtraPasses, fMinImprovement, fTimeBudget);
+}
+
+MyDllExport int VqContextGetPassErrors( const VQ_CONTEXT* pContext, float pfErrors[], int nMaxErrors )
+{
+	return GetVqContextPassErrors(pContext, pfErrors, nMaxErrors);
+}
+
+MyDllExport void VqContextGetStats( const VQ_CONTEXT* pContext, VQ_STATS* pStats )
+{
+	GetVqContextStats(pContext, pStats);
+}
+
+MyDllExport void VqGetLastStats( VQ_STATS* pStats )
+{
+	GetLastVqStats(pStats);
+}
+
+MyDllExport void VqContextSetSmallCodebooks( VQ_CONTEXT* pContext, const int nSizes[], int nNumSizes, float fMaxError )
+{
+	SetVqContextSmallCodebooks(pContext, nSizes, nNumSizes, fMaxError);
+}
+
+MyDllExport int VqContextGetCodebookSize( const VQ_CONTEXT* pContext )
+{
+	return GetVqContextCodebookSize(pContext);
+}
+
+MyDllExport void VqContextSetWarmStart( VQ_CONTEXT* pContext, const void* pCodebook, int nNumCodes )
+{
+	SetVqContextWarmStart(pContext, pCodebook, nNumCodes);
+}
+
+MyDllExport void VqContextSetCoarseTraining( VQ_CONTEXT* pContext, int nMaxWidth )
+{
+	SetVqContextCoarseTraining(pContext, nMaxWidth);
+}
+
+MyDllExport int VqCalcLevelsContext(VQ_CONTEXT*		pContext,
+							 const void* const	LevelsRGB[],
+							 const void* const	LevelsAlpha[],
+								   int			nLevels,
+								   void*		OutputMemory,
+
+								   int			BGROrder,
+								   int			nWidth,
+								   int			MipMapMode,
+								   int			bAlphaOn,
+								   int			bIncludeHeader,
+
+						   VQ_DITHER_TYPES		DitherLevel,
+
+								   int			nNumCodes,
+								   int			nColourFormat,
+								   int			bInvertAlpha,
+
+						  VQ_COLOUR_METRIC		Metric,
+
+								   float		*fErrorFound)
+{
+	return CreateVqWithContext(pContext,
+							  LevelsRGB,
+							  LevelsAlpha,
+							  nLevels,
+							  OutputMemory,
+
+							  BGROrder,
+							  nWidth,
+							  MipMapMode,
+							  bAlphaOn,
+							  bIncludeHeader,
+							  DitherLevel,
+							  nNumCodes,
+							  nColourFormat,
+							  bInvertAlpha,
+							  Metric,
+
+							  fErrorFound);
+}
+
+
+MyDllExport int VqCalcSetContext(VQ_CONTEXT*		pContext,
+								 VQ_SET_TEXTURE		Textures[],
+									   int			nNumTextures,
+
+									   int			BGROrder,
+									   int			MipMapMode,
+									   int			bAlphaOn,
+									   int			bIncludeHeader,
+
+							   VQ_DITHER_TYPES		DitherLevel,
+
+									   int			nNumCodes,
+									   int			nColourFormat,
+									   int			bInvertAlpha,
+
+							  VQ_COLOUR_METRIC		Metric,
+
+									   float		*fErrorFound)
+{
+	return CreateVqSetWithContext(pContext,
+								  Textures,
+								  nNumTextures,
+
+								  BGROrder,
+								  MipMapMode,
+								  bAlphaOn,
+								  bIncludeHeader,
+								  DitherLevel,
+								  nNumCodes,
+								  nColourFormat,
+								  bInvertAlpha,
+								  Metric,
+
+								  fErrorFound);
+}
+
+
+/*
+// Palette generation. See header file (vqdll.h) for more details.
+*/
+MyDllExport int VqCalcPalette(const void* const	LevelsRGB[],
+							  const void* const	LevelsAlpha[],
+									int			nLevels,
+
+									int			BGROrder,
+									int			nWidth,
+									int			nHeight,
+									int			bAlphaOn,
+
+									int			nNumColours,
+									int			nColourFormat,
+
+						   VQ_COLOUR_METRIC		Metric,
+
+							  unsigned char*	pPalette,
+							  unsigned char* const Indices[])
+{
+	return CreatePalette(LevelsRGB,
+						 LevelsAlpha,
+						 nLevels,
+
+						 BGROrder,
+						 nWidth,
+						 nHeight,
+						 bAlphaOn,
+
+						 nNumColours,
+						 nColourFormat,
+						 Metric,
+
+						 pPalette,
+						 Indices);
+}
+
+
 /*
 // VERSION information. Added at the request of Sega Europe
 */
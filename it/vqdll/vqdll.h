@@ -87,7 +87,10 @@
 //								header data.
 //
 //				DitherLevel		Controls error diffusion. Ranges from none, 1/2, and full
-//								(see defines above)
+//								(see defines above). VQOrderedDither adds a fixed
+//								(Bayer) pattern instead, so the vectors don't depend
+//								on each other and the dithered pass can be shared out
+//								amongst threads like the others.
 //
 //				NumCodes		The maximum number of Vector codes to allocate
 //								Note that the routine will round this value up to a
@@ -252,6 +255,389 @@ MyDllExport int VqCalcGrouped(const void*	InputArrayRGB,
 MyDllExport void VqGetVersionInfoString( char* pszVersionInfoString, const char* pszKey );
 
 
+/******************************************************************************/
+/*
+// Function: 	VqSetThreadCount
+//
+// Description: Sets the number of threads VqCalc2 uses to build the code
+//				book and map the image to it. The default is 1, i.e. all the
+//				work is done on the calling thread. The compressed data is
+//				identical whatever the setting.
+*/
+/******************************************************************************/
+
+MyDllExport void VqSetThreadCount( int nThreads );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqCalcSize
+//
+// Description: Returns the size of output data (in bytes) VqCalc2 or
+//				VqCalcLevels would produce for the given parameters, or
+//				VQ_INVALID_SIZE. Same as calling VqCalc2 with a NULL
+//				OutputMemory, but needs no image data.
+*/
+/******************************************************************************/
+
+MyDllExport int VqCalcSize( int nWidth, int MipMapMode, int bIncludeHeader, int nNumCodes );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqCalcLevels
+//
+// Description: As VqCalc2, but each MIP map level is passed as a separate
+//				pointer rather than packed into one array, so the caller
+//				doesn't need to copy them.
+//
+// Inputs:		LevelsRGB		Array of nLevels pointers to the 24 bit data for
+//								each level, largest first
+//				LevelsAlpha		Matching array of alpha data. May be NULL if
+//								bAlphaOn is 0
+//				nLevels			Number of levels supplied. Any smaller levels
+//								are generated from the last one. Only the first
+//								level is used if MipMapMode is VQ_NO_MIPMAP.
+//				OutputMemory	Must be allocated (see VqCalcSize)
+//
+//				The rest are as for VqCalc2.
+//
+// Returned Val: As for VqCalc2
+*/
+/******************************************************************************/
+
+MyDllExport int VqCalcLevels(const void* const	LevelsRGB[],
+							 const void* const	LevelsAlpha[],
+								   int			nLevels,
+								   void*		OutputMemory,
+
+								   int			BGROrder,
+								   int			nWidth,
+								   int			MipMapMode,
+								   int			bAlphaOn,
+								   int			bIncludeHeader,
+
+						   VQ_DITHER_TYPES		DitherLevel,
+
+								   int			nNumCodes,
+								   int			nColourFormat,
+								   int			bInvertAlpha,
+
+						  VQ_COLOUR_METRIC		Metric,
+
+								   float		*fErrorFound);
+
+
+/******************************************************************************/
+/*
+// Function: 	VqCreateContext / VqDestroyContext / VqContextSetThreadCount
+//
+// Description: A context holds all the working memory of a compression.
+//				VqCalcLevelsContext calls with different contexts can run at
+//				the same time on different threads. A context keeps its
+//				memory from one call to the next, so reuse one for a batch
+//				of textures. New contexts use the VqSetThreadCount setting;
+//				VqContextSetThreadCount changes it for just that context.
+//
+// Returned Val: VqCreateContext returns NULL if it runs out of memory
+*/
+/******************************************************************************/
+
+typedef struct VQ_CONTEXT_TAG VQ_CONTEXT;
+
+MyDllExport VQ_CONTEXT* VqCreateContext( void );
+MyDllExport void VqDestroyContext( VQ_CONTEXT* pContext );
+MyDllExport void VqContextSetThreadCount( VQ_CONTEXT* pContext, int nThreads );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqContextSetSubsample
+//
+// Description: Trains the codebook on only one in every nSubsample of the
+//				2x2 vectors (1, the default, uses all of them). The vectors
+//				are picked at random, but with a fixed seed, so the same
+//				input always gives the same output. Every vector is still
+//				mapped to the finished codebook. Small textures use more
+//				vectors than asked for, so there are enough to train all
+//				the codes.
+*/
+/******************************************************************************/
+
+MyDllExport void VqContextSetSubsample( VQ_CONTEXT* pContext, int nSubsample );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqContextSetSearchIndex
+//
+// Description: Chooses how the nearest code to each vector is found while
+//				mapping the image to the codebook:
+//
+//				VQSearchNeighbours (the default) guesses with a tree built
+//				while making the codes, then checks the codes nearest to
+//				the guess.
+//				VQSearchKdTree searches a k-d tree over the codes.
+//				VQSearchExhaustive tries every code.
+//
+//				They all find a nearest code, and of equally near codes
+//				they all choose the lowest numbered one, so the output is
+//				the same whichever is used. Only the speed differs.
+*/
+/******************************************************************************/
+
+MyDllExport void VqContextSetSearchIndex( VQ_CONTEXT* pContext, VQ_SEARCH_INDEX SearchIndex );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqContextSetRefinement / VqContextGetPassErrors
+//
+// Description: After mapping the image to the codebook, the codebook can be
+//				refined by more passes of the GLA, each remapping the image.
+//				Up to nMaxExtraPasses are done (0, the default, for none;
+//				at most 15). It stops early when a pass doesn't improve the
+//				error by at least fMinImprovement (a fraction of the
+//				previous pass's error, e.g. 0.01), or when the next pass would take
+//				the texture over fTimeBudget seconds (0 for no limit). With
+//				dithering, one more pass is always done after stopping.
+//				A time budget makes the output depend on the machine.
+//
+//				VqContextGetPassErrors copies the RMS error of each pass of
+//				the last compression, as for fErrorFound, into pfErrors (up
+//				to nMaxErrors of them).
+//
+// Returned Val: VqContextGetPassErrors returns the number of passes
+*/
+/******************************************************************************/
+
+MyDllExport void VqContextSetRefinement( VQ_CONTEXT* pContext, int nMaxExtraPasses, float fMinImprovement, float fTimeBudget );
+MyDllExport int VqContextGetPassErrors( const VQ_CONTEXT* pContext, float pfErrors[], int nMaxErrors );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqContextGetStats / VqGetLastStats
+//
+// Description: Every compression fills in a VQ_STATS (see vqcalc.h): the
+//				time taken by each stage and each GLA pass, how much work
+//				finding the nearest codes took, how many codes were used,
+//				the RMS error of each MIP level, and the working memory.
+//				VqContextGetStats copies the stats of the context's last
+//				compression. VqGetLastStats copies those of the last one on
+//				the calling thread, whichever function did it, so it also
+//				works for VqCalc2 and VqCalcLevels.
+//
+//				If a compression fails, its stats are only filled in as far
+//				as it got.
+*/
+/******************************************************************************/
+
+MyDllExport void VqContextGetStats( const VQ_CONTEXT* pContext, VQ_STATS* pStats );
+MyDllExport void VqGetLastStats( VQ_STATS* pStats );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqContextSetSmallCodebooks / VqContextGetCodebookSize
+//
+// Description: The codebook is built up by splitting, so on the way to
+//				nNumCodes it passes through every smaller size. With this
+//				set, the codebook is also kept at each size in nSizes
+//				(16, 32, 64 or 128; also 8), each of those is refined with
+//				its own GLA passes, smallest first, and the first whose RMS
+//				error (as for fErrorFound) is at most fMaxError is written
+//				instead of the full codebook. If none is, it's the full one.
+//				nNumSizes 0 (the default) turns this off.
+//
+//				The smaller codebook is written as for a smaller nNumCodes,
+//				so the output is smaller too (see VqCalcSize).
+//
+// Returned Val: VqContextGetCodebookSize returns the number of codes the
+//				last compression wrote
+*/
+/******************************************************************************/
+
+MyDllExport void VqContextSetSmallCodebooks( VQ_CONTEXT* pContext, const int nSizes[], int nNumSizes, float fMaxError );
+MyDllExport int VqContextGetCodebookSize( const VQ_CONTEXT* pContext );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqContextSetWarmStart
+//
+// Description: Re-encodes starting from the codebook of an earlier
+//				compression, e.g. of the same texture before it was touched
+//				up, instead of building the codes from scratch. pCodebook is
+//				the nNumCodes codes (8 bytes each) at the start of the VQ
+//				data, after any VQF or PVR header, and must be in the colour
+//				format being compressed to. The codes are only refined by the
+//				GLA passes (see VqContextSetRefinement), so it's much quicker,
+//				and for a lightly edited texture the error is about the same.
+//
+//				At most nNumCodes codes are written, and no smaller codebooks
+//				are tried (see VqContextSetSmallCodebooks). A NULL pCodebook
+//				(the default) turns this off.
+*/
+/******************************************************************************/
+
+MyDllExport void VqContextSetWarmStart( VQ_CONTEXT* pContext, const void* pCodebook, int nNumCodes );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqContextSetCoarseTraining
+//
+// Description: Coarse to fine training for big MIP mapped textures. The
+//				codes are built from only the MIP levels at most nMaxWidth
+//				wide (e.g. 256 for a 1024x1024 texture), which have a small
+//				fraction of the vectors. Then they get one GLA pass with the
+//				next wider level added, and so on, before the usual passes
+//				over all the levels (see VqContextSetRefinement).
+//
+//				This cuts the time taken to build the codes by several
+//				times, but the smaller levels are smoother than the top one,
+//				so the codes don't fit it as well and the error goes up,
+//				noticeably for detailed textures. Training on a subset of
+//				all the levels (see VqContextSetSubsample) usually loses
+//				less. Wider levels are added to the ones the codes are built
+//				from if there aren't enough vectors for nNumCodes. Without
+//				MIP mapping there are no smaller levels, so it has no
+//				effect. 0 (the default) turns it off.
+*/
+/******************************************************************************/
+
+MyDllExport void VqContextSetCoarseTraining( VQ_CONTEXT* pContext, int nMaxWidth );
+
+
+/******************************************************************************/
+/*
+// Function: 	VqCalcLevelsContext
+//
+// Description: As VqCalcLevels, but using the given context.
+*/
+/******************************************************************************/
+
+MyDllExport int VqCalcLevelsContext(VQ_CONTEXT*		pContext,
+							 const void* const	LevelsRGB[],
+							 const void* const	LevelsAlpha[],
+								   int			nLevels,
+								   void*		OutputMemory,
+
+								   int			BGROrder,
+								   int			nWidth,
+								   int			MipMapMode,
+								   int			bAlphaOn,
+								   int			bIncludeHeader,
+
+						   VQ_DITHER_TYPES		DitherLevel,
+
+								   int			nNumCodes,
+								   int			nColourFormat,
+								   int			bInvertAlpha,
+
+						  VQ_COLOUR_METRIC		Metric,
+
+								   float		*fErrorFound);
+
+
+/******************************************************************************/
+/*
+// Function: 	VqCalcSetContext
+//
+// Description: Compresses a set of up to VQ_MAX_SET_TEXTURES textures with
+//				one codebook, trained on the vectors of all of them. It's
+//				one training run for the set rather than one per texture.
+//
+//				Each VQ_SET_TEXTURE gives a texture's levels and width as
+//				for VqCalcLevels, and the OutputMemory for it (VqCalcSize
+//				bytes). Each gets the same codebook followed by its own
+//				indices, as the hardware reads the codebook from in front
+//				of the indices. The indices are the last VqCalcSize(nWidth,
+//				MipMapMode, 0, 0) bytes.
+//
+//				The other options apply to every texture. The colour format
+//				must suit all of them, and a set of more than one can't be
+//				MIP mapped YUV. The smaller codebooks are tried as usual.
+//
+// Outputs:		Each texture's fErrorFound is set to its own RMS error.
+//
+// Returned Val: As VqCalcLevels. The context's stats and pass errors are
+//				for the whole set.
+*/
+/******************************************************************************/
+
+MyDllExport int VqCalcSetContext(VQ_CONTEXT*		pContext,
+								 VQ_SET_TEXTURE		Textures[],
+									   int			nNumTextures,
+
+									   int			BGROrder,
+									   int			MipMapMode,
+									   int			bAlphaOn,
+									   int			bIncludeHeader,
+
+							   VQ_DITHER_TYPES		DitherLevel,
+
+									   int			nNumCodes,
+									   int			nColourFormat,
+									   int			bInvertAlpha,
+
+							  VQ_COLOUR_METRIC		Metric,
+
+									   float		*fErrorFound);
+
+
+
+/******************************************************************************/
+/*
+// Function: 	VqCalcPalette
+//
+// Description: Builds a 16 or 256 colour palette for an image and maps each
+//				of its pixels to a palette index. The colours of all the MIP
+//				map levels are quantised together, measuring distances with
+//				the same colour metrics as the VQ.
+//
+// Inputs:		LevelsRGB		Array of nLevels pointers to the 24 bit data for
+//								each level, largest first
+//				LevelsAlpha		Matching array of alpha data. May be NULL if
+//								bAlphaOn is 0, in which case the colours are opaque
+//				nLevels			Number of levels
+//				BGROrder		Set if the data is BGR rather than RGB
+//				nWidth, nHeight	Size of the top level
+//				bAlphaOn		Is Alpha supplied?
+//				nNumColours		Max number of palette entries, 2 to 256
+//				nColourFormat	FORMAT_4444, FORMAT_1555 or FORMAT_565 if the
+//								palette entries will be stored in that format,
+//								or -1 to keep 8 bits per component
+//				Metric			As for VqCalc2. The frequency flag is ignored.
+//
+// Outputs:		pPalette		nNumColours RGBA entries, 4 bytes each. Unused
+//								entries are set to zero.
+//				Indices			Array of nLevels pointers to the index data for
+//								each level, one byte per pixel
+//
+// Returned Val: The number of palette entries used, or an error code
+*/
+/******************************************************************************/
+
+MyDllExport int VqCalcPalette(const void* const	LevelsRGB[],
+							  const void* const	LevelsAlpha[],
+									int			nLevels,
+
+									int			BGROrder,
+									int			nWidth,
+									int			nHeight,
+									int			bAlphaOn,
+
+									int			nNumColours,
+									int			nColourFormat,
+
+						   VQ_COLOUR_METRIC		Metric,
+
+							  unsigned char*	pPalette,
+							  unsigned char* const Indices[]);
+
+
 
 
 
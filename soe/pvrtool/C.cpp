@@ -95,25 +95,24 @@ bool WriteCFromPVR( const char* _pszFilename, unsigned char* pPVR, int nSize )
     //see if there's a codebook
     PVRHeader* pHeader = (PVRHeader*)pPtr;
     int nTextureType = pHeader->nTextureType;
-    bool bCodebook = false;
+    int nCodeBookSize = 0;
     switch( nTextureType & 0xFF00 )
     {
         case KM_TEXTURE_VQ:
-        case KM_TEXTURE_VQ_MM:
-        case KM_TEXTURE_SMALLVQ:
-        case KM_TEXTURE_SMALLVQ_MM:
-            bCodebook = true;
+        case KM_TEXTURE_VQ_MM:         nCodeBookSize = 256; break;
+        case KM_TEXTURE_SMALLVQ:       nCodeBookSize = GetSmallVQCodeBookSize( pHeader->nWidth, false ); break;
+        case KM_TEXTURE_SMALLVQ_MM:    nCodeBookSize = GetSmallVQCodeBookSize( pHeader->nWidth, true ); break;
     }
 
     //move pointer over header
     pPtr += sizeof(PVRHeader);
 
     //write out codebook
-    if( bCodebook )
+    if( nCodeBookSize )
     {
         fprintf( file, "\n\t/*codebook*/\n" );
-        WriteBytes( file, pPtr, 256 * sizeof(VQFCodeBookEntry) );
-        pPtr += (256 * sizeof(VQFCodeBookEntry));
+        WriteBytes( file, pPtr, nCodeBookSize * sizeof(VQFCodeBookEntry) );
+        pPtr += (nCodeBookSize * sizeof(VQFCodeBookEntry));
     }
 
     //write out image data
@@ -143,7 +142,8 @@ bool WriteCFromPVR( const char* _pszFilename, unsigned char* pPVR, int nSize )
 bool SaveC( const char* pszFilename, MMRGBA &mmrgba, SaveOptions* pSaveOptions )
 {
     //create a temporary file name
-    char* pszTempName = tmpnam( NULL );
+    char szTempName[L_tmpnam];
+    char* pszTempName = tmpnam( szTempName );
     if( pszTempName == NULL ) return ReturnError( "Failed to create a temporary file for: ", pszFilename );
 
     //create the PVR file into this temporary file
@@ -6,15 +6,46 @@
    
   Note: The YUV conversion method requires two
   texels worth of data, so the pointers are stored
-  and only written to every other texel.
+  in the caller's YUVPairState and only written to
+  every other texel.
+
+  PackTexelRow and UnpackTexelRow do a whole row at
+  a time, 8 texels at once where the CPU has SSSE3.
+  They give exactly the same results as the per
+  texel functions.
 
 **************************************************/
 
 #include <assert.h>
+#include <stdlib.h>
 
 #include "Util.h"
 #include "Colour.h"
 
+/*
+// SSSE3 versions of the row conversions, chosen at run time. This needs
+// the GCC/Clang target attributes.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define X86_TEXEL_KERNELS (1)
+    #include <immintrin.h>
+#else
+    #define X86_TEXEL_KERNELS (0)
+#endif
+
+/*
+// check the SSSE3 row conversions against the per texel ones, and time
+// them (the results go to stdout)
+*/
+#define TEST_TEXEL_ROWS (0)
+
+#if TEST_TEXEL_ROWS
+    #include <stdio.h>
+    #include <string.h>
+    #include <time.h>
+    static void TestTexelRows();
+#endif
+
 
 unsigned char g_nOpaqueAlpha = 0xFF;
 
@@ -24,7 +55,7 @@ unsigned char g_nOpaqueAlpha = 0xFF;
 // it takes a pointer to the texel because the YUV conversion sets
 // two texels at once.
 //////////////////////////////////////////////////////////////////////
-void ComputeTexel( int x, int y, unsigned short int* texel, unsigned char a, unsigned char r, unsigned char g, unsigned char b, ImageColourFormat icf )
+void ComputeTexel( int x, int y, unsigned short int* texel, unsigned char a, unsigned char r, unsigned char g, unsigned char b, ImageColourFormat icf, YUVPairState* pYUV /*NULL*/ )
 {
     switch( icf )
     {
@@ -34,33 +65,30 @@ void ComputeTexel( int x, int y, unsigned short int* texel, unsigned char a, uns
         case ICF_4444:  *texel = MAKE_4444( a, r, g, b ); break;
         case ICF_YUV422:
         {
-            static unsigned short int* _texel;
-            static unsigned char _r;
-            static unsigned char _g;
-            static unsigned char _b;
+            assert( pYUV );
 
 			if( !(x&1) ) //even pixel
 			{
-                _texel = texel;
-                _r = r;
-                _g = g;
-                _b = b;
+                pYUV->pTexel = texel;
+                pYUV->r = r;
+                pYUV->g = g;
+                pYUV->b = b;
 			}
 			else //odd pixel
 			{
                 //compute each pixel's Y
-			    unsigned Y0 = (unsigned)(0.299*_r + 0.587*_g + 0.114*_b);
+			    unsigned Y0 = (unsigned)(0.299*pYUV->r + 0.587*pYUV->g + 0.114*pYUV->b);
                 unsigned Y1 = (unsigned)(0.299*r + 0.587*g + 0.114*b);
 
                 //average both pixel's rgb values
-                r = ( r + _r ) / 2;
-                g = ( g + _g ) / 2;
-                b = ( b + _b ) / 2;
+                r = ( r + pYUV->r ) / 2;
+                g = ( g + pYUV->g ) / 2;
+                b = ( b + pYUV->b ) / 2;
 
                 //compute UV
 				unsigned U = (unsigned)(128.0f - 0.14*r - 0.29*g + 0.43*b);
 				unsigned V = (unsigned)(128.0f + 0.36*r - 0.29*g - 0.07*b);
-                *_texel = (Y0<<8) | U;
+                *pYUV->pTexel = (Y0<<8) | U;
                 *texel = (Y1<<8) | V;
 			}
 			break;
@@ -77,7 +105,7 @@ void ComputeTexel( int x, int y, unsigned short int* texel, unsigned char a, uns
 // reference because two sets of rgb values are changed at once by
 // the YUV conversion
 //////////////////////////////////////////////////////////////////////
-void UnpackTexel( int x, int y, unsigned short int texel, unsigned char* a, unsigned char* r, unsigned char* g, unsigned char* b, ImageColourFormat icf )
+void UnpackTexel( int x, int y, unsigned short int texel, unsigned char* a, unsigned char* r, unsigned char* g, unsigned char* b, ImageColourFormat icf, YUVPairState* pYUV /*NULL*/ )
 {
     switch( icf )
     {
@@ -111,28 +139,27 @@ void UnpackTexel( int x, int y, unsigned short int texel, unsigned char* a, unsi
 
         case ICF_YUV422:
         {
+            assert( pYUV );
             if(a) *a = g_nOpaqueAlpha;
-            static unsigned char* _r, * _g, * _b;
-            static unsigned short int _texel;
 
             if( !(x&1) ) //even pixel
             {
-                _texel = texel;
-                _r = r;
-                _g = g;
-                _b = b;
+                pYUV->texel = texel;
+                pYUV->pr = r;
+                pYUV->pg = g;
+                pYUV->pb = b;
             }
             else //odd pixel
             {
                 //note: these must be declared as signed otherwise we have to spend
                 //several days trying to get the YUV->RGB conversion to work and
                 //wondering why it isn't. :-)
-                signed int Y0 = ( _texel & 0xFF00 ) >> 8, U = ( _texel & 0x00FF );
+                signed int Y0 = ( pYUV->texel & 0xFF00 ) >> 8, U = ( pYUV->texel & 0x00FF );
                 signed int Y1 = (  texel & 0xFF00 ) >> 8, V = (  texel & 0x00FF );
 
-                *_r = Limit255(int(Y0 + 1.375*(V-128)));
-                *_g = Limit255(int(Y0 - 0.6875*(V-128)-0.34375*(U-128)));
-                *_b = Limit255(int(Y0 + 1.71875*(U-128)));
+                *pYUV->pr = Limit255(int(Y0 + 1.375*(V-128)));
+                *pYUV->pg = Limit255(int(Y0 - 0.6875*(V-128)-0.34375*(U-128)));
+                *pYUV->pb = Limit255(int(Y0 + 1.71875*(U-128)));
 
                 *r =  Limit255(int(Y1 + 1.375*(V-128)));
                 *g =  Limit255(int(Y1 - 0.6875*(V-128)-0.34375*(U-128)));
@@ -193,3 +220,378 @@ void UnpackPalettisedTexel( int x, int y, unsigned char indexbyte, unsigned char
             break;
     }
 }
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Plain row conversions - also used for the ends of rows the SSSE3
+// versions don't cover, which always start on an even texel
+//////////////////////////////////////////////////////////////////////
+static void PackTexelRowScalar( unsigned short int* pTexels, const unsigned char* pBGR, const unsigned char* pAlpha, int nWidth, ImageColourFormat icf )
+{
+    YUVPairState yuv;
+    for( int x = 0; x < nWidth; x++, pBGR += 3 )
+        ComputeTexel( x, 0, &pTexels[x], pAlpha ? pAlpha[x] : g_nOpaqueAlpha, pBGR[2], pBGR[1], pBGR[0], icf, &yuv );
+}
+
+static void UnpackTexelRowScalar( const unsigned short int* pTexels, unsigned char* pBGR, unsigned char* pAlpha, int nWidth, ImageColourFormat icf )
+{
+    YUVPairState yuv;
+    for( int x = 0; x < nWidth; x++, pBGR += 3 )
+        UnpackTexel( x, 0, pTexels[x], pAlpha ? &pAlpha[x] : NULL, &pBGR[2], &pBGR[1], &pBGR[0], icf, &yuv );
+}
+
+
+#if X86_TEXEL_KERNELS
+//////////////////////////////////////////////////////////////////////
+// Splits 8 BGR pixels (24 bytes) into 16-bit channel lanes
+//////////////////////////////////////////////////////////////////////
+__attribute__((target("ssse3"), always_inline))
+static inline void LoadBGR8( const unsigned char* pBGR, __m128i& b, __m128i& g, __m128i& r )
+{
+    __m128i Lo = _mm_loadu_si128( (const __m128i*)pBGR );
+    __m128i Hi = _mm_loadl_epi64( (const __m128i*)(pBGR + 16) );
+
+    b = _mm_or_si128( _mm_shuffle_epi8( Lo, _mm_setr_epi8(  0,-1,  3,-1,  6,-1,  9,-1, 12,-1, 15,-1, -1,-1, -1,-1 ) ),
+                      _mm_shuffle_epi8( Hi, _mm_setr_epi8( -1,-1, -1,-1, -1,-1, -1,-1, -1,-1, -1,-1,  2,-1,  5,-1 ) ) );
+    g = _mm_or_si128( _mm_shuffle_epi8( Lo, _mm_setr_epi8(  1,-1,  4,-1,  7,-1, 10,-1, 13,-1, -1,-1, -1,-1, -1,-1 ) ),
+                      _mm_shuffle_epi8( Hi, _mm_setr_epi8( -1,-1, -1,-1, -1,-1, -1,-1, -1,-1,  0,-1,  3,-1,  6,-1 ) ) );
+    r = _mm_or_si128( _mm_shuffle_epi8( Lo, _mm_setr_epi8(  2,-1,  5,-1,  8,-1, 11,-1, 14,-1, -1,-1, -1,-1, -1,-1 ) ),
+                      _mm_shuffle_epi8( Hi, _mm_setr_epi8( -1,-1, -1,-1, -1,-1, -1,-1, -1,-1,  1,-1,  4,-1,  7,-1 ) ) );
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Joins 16-bit channel lanes back into 8 BGR pixels, clamping each
+// channel to 0..255
+//////////////////////////////////////////////////////////////////////
+__attribute__((target("ssse3"), always_inline))
+static inline void StoreBGR8( unsigned char* pBGR, __m128i b, __m128i g, __m128i r )
+{
+    __m128i BG = _mm_packus_epi16( b, g ); //b0..b7 g0..g7
+    __m128i RR = _mm_packus_epi16( r, r ); //r0..r7 r0..r7
+
+    __m128i Lo = _mm_or_si128( _mm_shuffle_epi8( BG, _mm_setr_epi8(  0, 8,-1,  1, 9,-1,  2,10,-1,  3,11,-1,  4,12,-1,  5 ) ),
+                               _mm_shuffle_epi8( RR, _mm_setr_epi8( -1,-1, 0, -1,-1, 1, -1,-1, 2, -1,-1, 3, -1,-1, 4, -1 ) ) );
+    __m128i Hi = _mm_or_si128( _mm_shuffle_epi8( BG, _mm_setr_epi8( 13,-1, 6, 14,-1, 7, 15,-1, -1,-1,-1,-1,-1,-1,-1,-1 ) ),
+                               _mm_shuffle_epi8( RR, _mm_setr_epi8( -1, 5,-1, -1, 6,-1, -1, 7, -1,-1,-1,-1,-1,-1,-1,-1 ) ) );
+
+    _mm_storeu_si128( (__m128i*)pBGR, Lo );
+    _mm_storel_epi64( (__m128i*)(pBGR + 16), Hi );
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// YUV422 packing of 4 pairs. This is done in doubles, in the same order
+// as ComputeTexel, so that the rounding is identical
+//////////////////////////////////////////////////////////////////////
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i PackYUV8( __m128i b, __m128i g, __m128i r )
+{
+    const __m128i Zero = _mm_setzero_si128();
+
+    //each pixel's Y - each double vector holds one pair
+    __m128i r32[2] = { _mm_unpacklo_epi16( r, Zero ), _mm_unpackhi_epi16( r, Zero ) };
+    __m128i g32[2] = { _mm_unpacklo_epi16( g, Zero ), _mm_unpackhi_epi16( g, Zero ) };
+    __m128i b32[2] = { _mm_unpacklo_epi16( b, Zero ), _mm_unpackhi_epi16( b, Zero ) };
+    __m128i Y[4];
+    for( int iPair = 0; iPair < 4; iPair++ )
+    {
+        __m128d rd = _mm_cvtepi32_pd( ( iPair & 1 ) ? _mm_srli_si128( r32[iPair >> 1], 8 ) : r32[iPair >> 1] );
+        __m128d gd = _mm_cvtepi32_pd( ( iPair & 1 ) ? _mm_srli_si128( g32[iPair >> 1], 8 ) : g32[iPair >> 1] );
+        __m128d bd = _mm_cvtepi32_pd( ( iPair & 1 ) ? _mm_srli_si128( b32[iPair >> 1], 8 ) : b32[iPair >> 1] );
+        Y[iPair] = _mm_cvttpd_epi32( _mm_add_pd( _mm_add_pd( _mm_mul_pd( _mm_set1_pd( 0.299 ), rd ), _mm_mul_pd( _mm_set1_pd( 0.587 ), gd ) ), _mm_mul_pd( _mm_set1_pd( 0.114 ), bd ) ) );
+    }
+    __m128i Y16 = _mm_packs_epi32( _mm_unpacklo_epi64( Y[0], Y[1] ), _mm_unpacklo_epi64( Y[2], Y[3] ) );
+
+    //average both pixel's rgb values
+    const __m128i LowHalf = _mm_set1_epi32( 0xFFFF );
+    __m128i rAvg = _mm_srli_epi32( _mm_add_epi32( _mm_and_si128( r, LowHalf ), _mm_srli_epi32( r, 16 ) ), 1 );
+    __m128i gAvg = _mm_srli_epi32( _mm_add_epi32( _mm_and_si128( g, LowHalf ), _mm_srli_epi32( g, 16 ) ), 1 );
+    __m128i bAvg = _mm_srli_epi32( _mm_add_epi32( _mm_and_si128( b, LowHalf ), _mm_srli_epi32( b, 16 ) ), 1 );
+
+    //compute UV, two pairs at a time
+    __m128i U[2], V[2];
+    for( int iHalf = 0; iHalf < 2; iHalf++ )
+    {
+        __m128d rd = _mm_cvtepi32_pd( iHalf ? _mm_srli_si128( rAvg, 8 ) : rAvg );
+        __m128d gd = _mm_cvtepi32_pd( iHalf ? _mm_srli_si128( gAvg, 8 ) : gAvg );
+        __m128d bd = _mm_cvtepi32_pd( iHalf ? _mm_srli_si128( bAvg, 8 ) : bAvg );
+        U[iHalf] = _mm_cvttpd_epi32( _mm_add_pd( _mm_sub_pd( _mm_sub_pd( _mm_set1_pd( 128.0 ), _mm_mul_pd( _mm_set1_pd( 0.14 ), rd ) ), _mm_mul_pd( _mm_set1_pd( 0.29 ), gd ) ), _mm_mul_pd( _mm_set1_pd( 0.43 ), bd ) ) );
+        V[iHalf] = _mm_cvttpd_epi32( _mm_sub_pd( _mm_sub_pd( _mm_add_pd( _mm_set1_pd( 128.0 ), _mm_mul_pd( _mm_set1_pd( 0.36 ), rd ) ), _mm_mul_pd( _mm_set1_pd( 0.29 ), gd ) ), _mm_mul_pd( _mm_set1_pd( 0.07 ), bd ) ) );
+    }
+    __m128i U32 = _mm_unpacklo_epi64( U[0], U[1] ), V32 = _mm_unpacklo_epi64( V[0], V[1] );
+    __m128i UV16 = _mm_packs_epi32( _mm_unpacklo_epi32( U32, V32 ), _mm_unpackhi_epi32( U32, V32 ) );
+
+    //even texels are Y0 U, odd texels are Y1 V
+    return _mm_or_si128( _mm_slli_epi16( Y16, 8 ), UV16 );
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// YUV422 unpacking of 4 pairs. The conversion factors are all
+// multiples of 1/32, so this is exact in 16-bit integers
+//////////////////////////////////////////////////////////////////////
+__attribute__((target("ssse3"), always_inline))
+static inline void UnpackYUV8( __m128i t, __m128i& b, __m128i& g, __m128i& r )
+{
+    __m128i Y = _mm_srli_epi16( t, 8 );
+    __m128i UV = _mm_and_si128( t, _mm_set1_epi16( 0x00FF ) );
+
+    //spread each pair's U (even texel) and V (odd texel) over both texels
+    __m128i U = _mm_and_si128( UV, _mm_set1_epi32( 0xFFFF ) );
+    __m128i V = _mm_srli_epi32( UV, 16 );
+    U = _mm_sub_epi16( _mm_or_si128( U, _mm_slli_epi32( U, 16 ) ), _mm_set1_epi16( 128 ) );
+    V = _mm_sub_epi16( _mm_or_si128( V, _mm_slli_epi32( V, 16 ) ), _mm_set1_epi16( 128 ) );
+
+    //rounding down rather than towards zero only differs below 0, which is clamped anyway
+    r = _mm_srai_epi16( _mm_add_epi16( _mm_slli_epi16( Y, 3 ), _mm_mullo_epi16( V, _mm_set1_epi16( 11 ) ) ), 3 );
+    g = _mm_srai_epi16( _mm_sub_epi16( _mm_sub_epi16( _mm_slli_epi16( Y, 5 ), _mm_mullo_epi16( V, _mm_set1_epi16( 22 ) ) ), _mm_mullo_epi16( U, _mm_set1_epi16( 11 ) ) ), 5 );
+    b = _mm_srai_epi16( _mm_add_epi16( _mm_slli_epi16( Y, 5 ), _mm_mullo_epi16( U, _mm_set1_epi16( 55 ) ) ), 5 );
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// SSSE3 row packing, 8 texels at a time
+//////////////////////////////////////////////////////////////////////
+__attribute__((target("ssse3")))
+static void PackTexelRowSSSE3( unsigned short int* pTexels, const unsigned char* pBGR, const unsigned char* pAlpha, int nWidth, ImageColourFormat icf )
+{
+    if( icf != ICF_565 && icf != ICF_555 && icf != ICF_1555 && icf != ICF_4444 && icf != ICF_YUV422 )
+    {
+        PackTexelRowScalar( pTexels, pBGR, pAlpha, nWidth, icf );
+        return;
+    }
+
+    const __m128i Opaque = _mm_set1_epi16( g_nOpaqueAlpha );
+    int x = 0;
+    for( ; x + 8 <= nWidth; x += 8, pBGR += 24 )
+    {
+        __m128i b, g, r, t;
+        LoadBGR8( pBGR, b, g, r );
+        __m128i a = pAlpha ? _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*)(pAlpha + x) ), _mm_setzero_si128() ) : Opaque;
+
+        switch( icf )
+        {
+            case ICF_565:
+                t = _mm_or_si128( _mm_or_si128( _mm_and_si128( _mm_slli_epi16( r, 8 ), _mm_set1_epi16( (short)0xF800 ) ),
+                                                _mm_and_si128( _mm_slli_epi16( g, 3 ), _mm_set1_epi16( 0x07E0 ) ) ),
+                                  _mm_srli_epi16( b, 3 ) );
+                break;
+
+            case ICF_555:
+            case ICF_1555:
+                t = _mm_or_si128( _mm_or_si128( _mm_and_si128( _mm_slli_epi16( r, 7 ), _mm_set1_epi16( 0x7C00 ) ),
+                                                _mm_and_si128( _mm_slli_epi16( g, 2 ), _mm_set1_epi16( 0x03E0 ) ) ),
+                                  _mm_srli_epi16( b, 3 ) );
+                if( icf == ICF_1555 ) t = _mm_or_si128( t, _mm_and_si128( _mm_slli_epi16( a, 8 ), _mm_set1_epi16( (short)0x8000 ) ) );
+                break;
+
+            case ICF_4444:
+                t = _mm_or_si128( _mm_or_si128( _mm_and_si128( _mm_slli_epi16( a, 8 ), _mm_set1_epi16( (short)0xF000 ) ),
+                                                _mm_and_si128( _mm_slli_epi16( r, 4 ), _mm_set1_epi16( 0x0F00 ) ) ),
+                                  _mm_or_si128( _mm_and_si128( g, _mm_set1_epi16( 0x00F0 ) ), _mm_srli_epi16( b, 4 ) ) );
+                break;
+
+            default: //ICF_YUV422
+                t = PackYUV8( b, g, r );
+                break;
+        }
+        _mm_storeu_si128( (__m128i*)(pTexels + x), t );
+    }
+
+    PackTexelRowScalar( pTexels + x, pBGR, pAlpha ? pAlpha + x : NULL, nWidth - x, icf );
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// SSSE3 row unpacking, 8 texels at a time
+//////////////////////////////////////////////////////////////////////
+__attribute__((target("ssse3")))
+static void UnpackTexelRowSSSE3( const unsigned short int* pTexels, unsigned char* pBGR, unsigned char* pAlpha, int nWidth, ImageColourFormat icf )
+{
+    if( icf != ICF_565 && icf != ICF_555 && icf != ICF_1555 && icf != ICF_4444 && icf != ICF_YUV422 )
+    {
+        UnpackTexelRowScalar( pTexels, pBGR, pAlpha, nWidth, icf );
+        return;
+    }
+
+    const __m128i Opaque = _mm_set1_epi16( g_nOpaqueAlpha );
+    int x = 0;
+    for( ; x + 8 <= nWidth; x += 8, pBGR += 24 )
+    {
+        __m128i t = _mm_loadu_si128( (const __m128i*)(pTexels + x) ), a = Opaque, b, g, r;
+
+        switch( icf )
+        {
+            case ICF_565:
+                r = _mm_srli_epi16( _mm_and_si128( t, _mm_set1_epi16( (short)0xF800 ) ), 8 );
+                g = _mm_srli_epi16( _mm_and_si128( t, _mm_set1_epi16( 0x07E0 ) ), 3 );
+                b = _mm_slli_epi16( _mm_and_si128( t, _mm_set1_epi16( 0x001F ) ), 3 );
+                break;
+
+            case ICF_555:
+            case ICF_1555:
+                r = _mm_srli_epi16( _mm_and_si128( t, _mm_set1_epi16( 0x7C00 ) ), 7 );
+                g = _mm_srli_epi16( _mm_and_si128( t, _mm_set1_epi16( 0x03E0 ) ), 2 );
+                b = _mm_slli_epi16( _mm_and_si128( t, _mm_set1_epi16( 0x001F ) ), 3 );
+                if( icf == ICF_1555 ) a = _mm_and_si128( _mm_srai_epi16( t, 15 ), _mm_set1_epi16( 0x00FF ) );
+                break;
+
+            case ICF_4444:
+                a = _mm_srli_epi16( _mm_and_si128( t, _mm_set1_epi16( (short)0xF000 ) ), 8 );
+                r = _mm_srli_epi16( _mm_and_si128( t, _mm_set1_epi16( 0x0F00 ) ), 4 );
+                g = _mm_and_si128( t, _mm_set1_epi16( 0x00F0 ) );
+                b = _mm_slli_epi16( _mm_and_si128( t, _mm_set1_epi16( 0x000F ) ), 4 );
+                break;
+
+            default: //ICF_YUV422
+                UnpackYUV8( t, b, g, r );
+                break;
+        }
+
+        StoreBGR8( pBGR, b, g, r );
+        if( pAlpha ) _mm_storel_epi64( (__m128i*)(pAlpha + x), _mm_packus_epi16( a, a ) );
+    }
+
+    UnpackTexelRowScalar( pTexels + x, pBGR, pAlpha ? pAlpha + x : NULL, nWidth - x, icf );
+}
+#endif //X86_TEXEL_KERNELS
+
+
+//////////////////////////////////////////////////////////////////////
+// Picks the fastest row conversions that the CPU supports. This is
+// done once, the first time a row is converted
+//////////////////////////////////////////////////////////////////////
+struct TexelRowKernels
+{
+    void (*pfnPack)( unsigned short int* pTexels, const unsigned char* pBGR, const unsigned char* pAlpha, int nWidth, ImageColourFormat icf );
+    void (*pfnUnpack)( const unsigned short int* pTexels, unsigned char* pBGR, unsigned char* pAlpha, int nWidth, ImageColourFormat icf );
+};
+
+static TexelRowKernels SelectTexelRowKernels()
+{
+#if TEST_TEXEL_ROWS
+    TestTexelRows();
+#endif
+
+#if X86_TEXEL_KERNELS
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "ssse3" ) ) return { PackTexelRowSSSE3, UnpackTexelRowSSSE3 };
+#endif
+
+    return { PackTexelRowScalar, UnpackTexelRowScalar };
+}
+
+static const TexelRowKernels& GetTexelRowKernels()
+{
+    static const TexelRowKernels Kernels = SelectTexelRowKernels();
+    return Kernels;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Packs a row of BGR (and optional alpha) pixels into 16-bit texels
+//////////////////////////////////////////////////////////////////////
+void PackTexelRow( unsigned short int* pTexels, const unsigned char* pBGR, const unsigned char* pAlpha, int nWidth, ImageColourFormat icf )
+{
+    //a YUV texel without a partner is left blank
+    if( icf == ICF_YUV422 && ( nWidth & 1 ) ) pTexels[nWidth - 1] = 0;
+
+    GetTexelRowKernels().pfnPack( pTexels, pBGR, pAlpha, nWidth, icf );
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Unpacks a row of 16-bit texels into BGR (and optional alpha) pixels
+//////////////////////////////////////////////////////////////////////
+void UnpackTexelRow( const unsigned short int* pTexels, unsigned char* pBGR, unsigned char* pAlpha, int nWidth, ImageColourFormat icf )
+{
+    GetTexelRowKernels().pfnUnpack( pTexels, pBGR, pAlpha, nWidth, icf );
+}
+
+
+
+#if TEST_TEXEL_ROWS
+//////////////////////////////////////////////////////////////////////
+// Checks the selected row conversions against the per texel ones
+//////////////////////////////////////////////////////////////////////
+static void TestTexelRows()
+{
+#if X86_TEXEL_KERNELS
+    static const ImageColourFormat Formats[] = { ICF_565, ICF_555, ICF_1555, ICF_4444, ICF_YUV422 };
+    static const char* FormatNames[] = { "565", "555", "1555", "4444", "YUV422" };
+    static const int Widths[] = { 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 64, 1023 };
+    const int nMaxWidth = 65536;
+
+    unsigned char* pBGR = (unsigned char*)malloc( nMaxWidth * 3 );
+    unsigned char* pAlpha = (unsigned char*)malloc( nMaxWidth );
+    unsigned char* pBGRRef = (unsigned char*)malloc( nMaxWidth * 3 );
+    unsigned char* pAlphaRef = (unsigned char*)malloc( nMaxWidth );
+    unsigned short int* pTexels = (unsigned short int*)malloc( nMaxWidth * 2 );
+    unsigned short int* pTexelsRef = (unsigned short int*)malloc( nMaxWidth * 2 );
+
+    int nFailures = 0;
+    for( int iFormat = 0; iFormat < 5; iFormat++ )
+    {
+        ImageColourFormat icf = Formats[iFormat];
+
+        //packing random rows, with and without alpha
+        for( size_t iWidth = 0; iWidth < sizeof(Widths) / sizeof(Widths[0]); iWidth++ )
+            for( int bAlpha = 0; bAlpha < 2; bAlpha++ )
+            {
+                int nWidth = Widths[iWidth];
+                for( int i = 0; i < nWidth * 3; i++ ) pBGR[i] = (unsigned char)rand();
+                for( int i = 0; i < nWidth; i++ ) pAlpha[i] = (unsigned char)rand();
+
+                memset( pTexels, 0xCD, nWidth * 2 ); memset( pTexelsRef, 0xCD, nWidth * 2 );
+                if( icf == ICF_YUV422 && ( nWidth & 1 ) ) pTexelsRef[nWidth - 1] = 0;
+                PackTexelRowSSSE3( pTexels, pBGR, bAlpha ? pAlpha : NULL, nWidth, icf );
+                if( icf == ICF_YUV422 && ( nWidth & 1 ) ) pTexels[nWidth - 1] = 0;
+                PackTexelRowScalar( pTexelsRef, pBGR, bAlpha ? pAlpha : NULL, nWidth, icf );
+                if( memcmp( pTexels, pTexelsRef, nWidth * 2 ) != 0 ) { printf( "PackTexelRow %s width %d FAILED\n", FormatNames[iFormat], nWidth ); nFailures++; }
+            }
+
+        //unpacking every texel value, paired with random partners for YUV
+        for( int i = 0; i < nMaxWidth; i++ ) pTexels[i] = (unsigned short int)( ( icf == ICF_YUV422 && ( i & 1 ) ) ? rand() : ( i * 0x9E37 ) );
+        memset( pBGR, 0xCD, nMaxWidth * 3 ); memset( pBGRRef, 0xCD, nMaxWidth * 3 );
+        UnpackTexelRowSSSE3( pTexels, pBGR, pAlpha, nMaxWidth, icf );
+        UnpackTexelRowScalar( pTexels, pBGRRef, pAlphaRef, nMaxWidth, icf );
+        if( memcmp( pBGR, pBGRRef, nMaxWidth * 3 ) != 0 || memcmp( pAlpha, pAlphaRef, nMaxWidth ) != 0 ) { printf( "UnpackTexelRow %s FAILED\n", FormatNames[iFormat] ); nFailures++; }
+    }
+    printf( "Texel row test: %d failures\n", nFailures );
+
+    //time a 1024x1024 image each way
+    const int nPasses = 20;
+    for( int iFormat = 0; iFormat < 5; iFormat++ )
+    {
+        ImageColourFormat icf = Formats[iFormat];
+        double fMB = ( 1024.0 * 1024.0 * 2.0 ) * nPasses / ( 1024.0 * 1024.0 );
+        double fTimes[4];
+        for( int iKernel = 0; iKernel < 4; iKernel++ )
+        {
+            clock_t Start = clock();
+            for( int i = 0; i < nPasses * 16; i++ )
+                switch( iKernel )
+                {
+                    case 0: PackTexelRowScalar( pTexels, pBGR, pAlpha, nMaxWidth, icf ); break;
+                    case 1: PackTexelRowSSSE3( pTexels, pBGR, pAlpha, nMaxWidth, icf ); break;
+                    case 2: UnpackTexelRowScalar( pTexels, pBGR, pAlpha, nMaxWidth, icf ); break;
+                    case 3: UnpackTexelRowSSSE3( pTexels, pBGR, pAlpha, nMaxWidth, icf ); break;
+                }
+            fTimes[iKernel] = double( clock() - Start ) / CLOCKS_PER_SEC;
+            if( fTimes[iKernel] < 1e-6 ) fTimes[iKernel] = 1e-6;
+        }
+        printf( "%6s: pack %.0f -> %.0f MB/s, unpack %.0f -> %.0f MB/s\n", FormatNames[iFormat],
+                fMB / fTimes[0], fMB / fTimes[1], fMB / fTimes[2], fMB / fTimes[3] );
+    }
+
+    free( pBGR );
+    free( pAlpha );
+    free( pBGRRef );
+    free( pAlphaRef );
+    free( pTexels );
+    free( pTexelsRef );
+#endif
+}
+#endif //TEST_TEXEL_ROWS
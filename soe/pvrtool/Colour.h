@@ -7,11 +7,28 @@ extern unsigned char g_nOpaqueAlpha;
 //internal representation of colour formats
 enum ImageColourFormat { ICF_NONE, ICF_SMART, ICF_555, ICF_1555, ICF_4444, ICF_565, ICF_SMARTYUV, ICF_YUV422, ICF_8888, ICF_PALETTE4, ICF_PALETTE8 };
 
+//state carried from the even to the odd texel of a YUV422 pair. Each conversion
+//loop owns one of these so that several images can be converted at once
+struct YUVPairState
+{
+    unsigned short int* pTexel;     //ComputeTexel: even texel waiting for its partner
+    unsigned char r, g, b;          //ComputeTexel: even texel colour
+
+    unsigned short int texel;       //UnpackTexel: even texel value
+    unsigned char *pr, *pg, *pb;    //UnpackTexel: where the even texel colour goes
+};
+
 //colour format conversion
-void ComputeTexel( int x, int y, unsigned short int* texel, unsigned char a, unsigned char r, unsigned char g, unsigned char b, ImageColourFormat icf );
-void UnpackTexel( int x, int y, unsigned short int texel, unsigned char* a, unsigned char* r, unsigned char* g, unsigned char* b, ImageColourFormat icf );
+void ComputeTexel( int x, int y, unsigned short int* texel, unsigned char a, unsigned char r, unsigned char g, unsigned char b, ImageColourFormat icf, YUVPairState* pYUV = NULL );
+void UnpackTexel( int x, int y, unsigned short int texel, unsigned char* a, unsigned char* r, unsigned char* g, unsigned char* b, ImageColourFormat icf, YUVPairState* pYUV = NULL );
 void UnpackPalettisedTexel( int x, int y, unsigned char indexbyte, unsigned char* a, unsigned char* r, unsigned char* g, unsigned char* b, ImageColourFormat icfPalette, int nPaletteDepth, void* pPalette );
 
+//whole row conversion between 16-bit texels and BGR (3 bytes per pixel) + alpha.
+//pAlpha may be NULL, in which case packing uses g_nOpaqueAlpha and unpacking
+//doesn't write any alpha. For YUV422 the row starts on the even texel of a pair
+void PackTexelRow( unsigned short int* pTexels, const unsigned char* pBGR, const unsigned char* pAlpha, int nWidth, ImageColourFormat icf );
+void UnpackTexelRow( const unsigned short int* pTexels, unsigned char* pBGR, unsigned char* pAlpha, int nWidth, ImageColourFormat icf );
+
 //16-bit colour packing macros
 #define MAKE_565(r,g,b)    (unsigned short)((((unsigned short)(r)<<8)&0xF800) | (((unsigned short)(g)<<3)&0x07E0) | (((unsigned short)(b)>>3)&0x001F))
 #define MAKE_4444(a,r,g,b) (unsigned short)((((unsigned short)(a)<<8)&0xF000) | (((unsigned short)(r)<<4)&0x0F00) | (((unsigned short)(g)   )&0x00F0) | (((unsigned short)(b)>>4)&0x000F))
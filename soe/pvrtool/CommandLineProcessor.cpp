@@ -16,6 +16,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include "max_path.h"
 #include "stricmp.h"
 #include "findfirst.h"
@@ -37,6 +40,8 @@ CCommandLineProcessor::CCommandLineProcessor( int argc, char** argv )
     m_pCommandLineOptionListEnd = NULL;
     m_pFileSpecs = NULL;
     m_szErrorMessage[0] = '\0';
+    m_nFilesSucceeded = 0;
+    m_nFilesFailed = 0;
     m_argc = argc;
     m_argv = argv;
     m_pStringList = NULL;
@@ -537,8 +542,18 @@ bool CCommandLineProcessor::ProcessResponseFile(const char *pszFilename)
 
 //////////////////////////////////////////////////////////////////////
 // Passes each file (or matching files) specified on the command line to the given function
+//
+// With nJobs > 1 the files are shared out between that many worker threads
+// (nJobs == 0 uses one per processor). Each file keeps the index it would
+// have had when processed serially, and its messages are captured and
+// written out in that same order once it is finished.
+//
+// A file's output must depend only on the file and its index, never on which
+// thread ran it or what that thread ran before, so anything the processing
+// function keeps per thread (such as the VQ context) has to be reset for
+// each file.
 //////////////////////////////////////////////////////////////////////
-bool CCommandLineProcessor::ProcessAllFiles( FILEPROCESSINGFUNC pfnProcessFile )
+bool CCommandLineProcessor::ProcessAllFiles( FILEPROCESSINGFUNC pfnProcessFile, void* pContext /*NULL*/, int nJobs /*1*/ )
 {
     //validate parameters
     if( pfnProcessFile == NULL ) return false;
@@ -550,8 +565,9 @@ bool CCommandLineProcessor::ProcessAllFiles( FILEPROCESSINGFUNC pfnProcessFile )
         return false;
     }
 
-    //process all filespecs
-    int nFilesProcessed = 0;
+    //build the list of files matching all filespecs
+    char** ppszFilenames = NULL;
+    int nFiles = 0, nMaxFiles = 0;
     for( StringList* pFileSpec = m_pFileSpecs; pFileSpec != NULL; pFileSpec = pFileSpec->next )
     {
         //build the current path
@@ -566,25 +582,22 @@ bool CCommandLineProcessor::ProcessAllFiles( FILEPROCESSINGFUNC pfnProcessFile )
         long hFind = _findfirst( pFileSpec->pszString, &finddata );
         if( hFind != -1 )
         {
-            //process all matching files
+            //add all matching files
             do
             {
-                //build this filename in full
-                char szFilename[MAX_PATH+1];
-                //strcpy( szFilename, szPath );
-                //strcat( szFilename, finddata.name );
-		strcpy( szFilename, finddata.name );
-
-                //process this file
-                if( pfnProcessFile( szFilename ) == false )
+                //grow the list if needed
+                if( nFiles == nMaxFiles )
                 {
-                    //the callback returned false - stop processing
-                    _findclose( hFind );
-                    return false;
+                    nMaxFiles = nMaxFiles ? nMaxFiles * 2 : 64;
+                    ppszFilenames = (char**)realloc( ppszFilenames, nMaxFiles * sizeof(char*) );
                 }
 
-                //increment file processed counter
-                nFilesProcessed++;
+                //build this filename in full
+                //strcpy( szFilename, szPath );
+                //strcat( szFilename, finddata.name );
+                char* pszFilename = new char[ strlen(finddata.name) + 1 ];
+                strcpy( pszFilename, finddata.name );
+                ppszFilenames[nFiles++] = pszFilename;
 
             } while( _findnext( hFind, &finddata ) != -1 );
         }
@@ -597,17 +610,92 @@ bool CCommandLineProcessor::ProcessAllFiles( FILEPROCESSINGFUNC pfnProcessFile )
         _findclose( hFind );
     }
 
-    //see if we managed to process anything
-    if( nFilesProcessed == 0 )
+    //see if we managed to find anything
+    if( nFiles == 0 )
     {
+        free( ppszFilenames );
         strcpy( m_szErrorMessage, "No matching files were found" );
         return false;
     }
 
+    //process them
+    if( nJobs == 0 ) nJobs = std::thread::hardware_concurrency();
+    if( nJobs > nFiles ) nJobs = nFiles;
+    if( nJobs > 1 )
+    {
+        ProcessFilesInParallel( ppszFilenames, nFiles, pfnProcessFile, pContext, nJobs );
+    }
+    else
+    {
+        for( int iFile = 0; iFile < nFiles; iFile++ )
+        {
+            if( pfnProcessFile( ppszFilenames[iFile], iFile, pContext ) ) m_nFilesSucceeded++; else m_nFilesFailed++;
+        }
+    }
+
+    //clean up
+    for( int iFile = 0; iFile < nFiles; iFile++ ) delete[] ppszFilenames[iFile];
+    free( ppszFilenames );
+
     return true;
 }
 
 
+//////////////////////////////////////////////////////////////////////
+// Runs the file processing function over the given files on a pool of worker threads
+//////////////////////////////////////////////////////////////////////
+void CCommandLineProcessor::ProcessFilesInParallel( char** ppszFilenames, int nFiles, FILEPROCESSINGFUNC pfnProcessFile, void* pContext, int nJobs )
+{
+    //per-file captured output, written out in file order as soon as possible
+    MessageCapture** ppCaptures = (MessageCapture**)calloc( nFiles, sizeof(MessageCapture*) );
+    bool* pbDone = (bool*)calloc( nFiles, sizeof(bool) );
+    int nNextToFlush = 0;
+
+    std::atomic<int> nNextFile( 0 );
+    std::mutex Lock;
+
+    //fflush stdout first so nothing already buffered gets mixed in later
+    fflush( stdout );
+
+    auto Worker = [&]()
+    {
+        for(;;)
+        {
+            //grab the next file
+            int iFile = nNextFile++;
+            if( iFile >= nFiles ) break;
+
+            //process it, holding back any messages
+            BeginMessageCapture();
+            bool bSucceeded = pfnProcessFile( ppszFilenames[iFile], iFile, pContext );
+            MessageCapture* pCapture = EndMessageCapture();
+
+            //record the result and write out everything that's now in order
+            std::lock_guard<std::mutex> Guard( Lock );
+            if( bSucceeded ) m_nFilesSucceeded++; else m_nFilesFailed++;
+            ppCaptures[iFile] = pCapture;
+            pbDone[iFile] = true;
+            while( nNextToFlush < nFiles && pbDone[nNextToFlush] )
+            {
+                FlushMessageCapture( ppCaptures[nNextToFlush] );
+                ppCaptures[nNextToFlush] = NULL;
+                nNextToFlush++;
+            }
+        }
+    };
+
+    //start the workers and wait for them to finish
+    std::thread* pThreads = new std::thread[nJobs];
+    for( int i = 0; i < nJobs; i++ ) pThreads[i] = std::thread( Worker );
+    for( int i = 0; i < nJobs; i++ ) pThreads[i].join();
+    delete[] pThreads;
+
+    free( ppCaptures );
+    free( pbDone );
+}
+
+
+
 //////////////////////////////////////////////////////////////////////
 // Gets a pointer to the application's filename, without the path
 //////////////////////////////////////////////////////////////////////
@@ -10,8 +10,10 @@
 #endif // _MSC_VER > 1000
 
 
-//file processing callback function type
-typedef bool (*FILEPROCESSINGFUNC)(const char* pszFilename);
+//file processing callback function type. nFileIndex is the file's position in the
+//list of matched files and the return value is whether the file was processed OK.
+//The callback may be called from several threads at once (see ProcessAllFiles)
+typedef bool (*FILEPROCESSINGFUNC)(const char* pszFilename, int nFileIndex, void* pContext);
 
 //flags for RegisterCommandLineOption
 #define CLF_NONE    (0)
@@ -35,13 +37,16 @@ public:
 
     char m_szErrorMessage[256];
 
-    bool ProcessAllFiles( FILEPROCESSINGFUNC pfnProcessFile );
+    bool ProcessAllFiles( FILEPROCESSINGFUNC pfnProcessFile, void* pContext = NULL, int nJobs = 1 );
+    int m_nFilesSucceeded;
+    int m_nFilesFailed;
 
     const char* GetAppFilename();
 
 protected:
 	char* CopyString( const char* pszString );
 	bool ProcessResponseFile( const char* pszFilename );
+	void ProcessFilesInParallel( char** ppszFilenames, int nFiles, FILEPROCESSINGFUNC pfnProcessFile, void* pContext, int nJobs );
 
     //command line option structure
     struct CommandLineOption
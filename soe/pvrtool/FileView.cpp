@@ -0,0 +1,165 @@
+/*************************************************
+ Read only file view
+
+   Maps a file into memory so that it can be
+   parsed in place. If the file can't be
+   mapped (e.g. it's a pipe) it's read into a
+   buffer instead, so callers don't need to
+   care which happened.
+
+**************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "FileView.h"
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+CFileView::CFileView()
+{
+    m_pData = NULL;
+    m_nSize = 0;
+    m_bMapped = false;
+#ifdef _WIN32
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hMapping = NULL;
+#endif
+}
+
+CFileView::~CFileView()
+{
+    Close();
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Opens the file and maps it in
+//////////////////////////////////////////////////////////////////////
+bool CFileView::Open( const char* pszFilename )
+{
+    Close();
+
+#ifdef _WIN32
+    m_hFile = CreateFileA( pszFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if( m_hFile == INVALID_HANDLE_VALUE ) return false;
+
+    LARGE_INTEGER nFileSize;
+    if( !GetFileSizeEx( (HANDLE)m_hFile, &nFileSize ) ) { Close(); return false; }
+    m_nSize = (size_t)nFileSize.QuadPart;
+
+    //an empty file can't be mapped, but it's still a valid (empty) view
+    if( m_nSize == 0 ) return true;
+
+    m_hMapping = CreateFileMappingA( (HANDLE)m_hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+    if( m_hMapping )
+    {
+        m_pData = (const unsigned char*)MapViewOfFile( (HANDLE)m_hMapping, FILE_MAP_READ, 0, 0, 0 );
+        if( m_pData ) { m_bMapped = true; return true; }
+    }
+#else
+    int fd = open( pszFilename, O_RDONLY );
+    if( fd < 0 ) return false;
+
+    struct stat st;
+    if( fstat( fd, &st ) != 0 ) { close( fd ); return false; }
+    m_nSize = (size_t)st.st_size;
+
+    if( S_ISREG( st.st_mode ) )
+    {
+        //an empty file can't be mapped, but it's still a valid (empty) view
+        if( m_nSize == 0 ) { close( fd ); return true; }
+
+        void* pMap = mmap( NULL, m_nSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( pMap != MAP_FAILED )
+        {
+            close( fd );
+            m_pData = (const unsigned char*)pMap;
+            m_bMapped = true;
+            return true;
+        }
+    }
+    close( fd );
+#endif
+
+    //couldn't map it - read it into a buffer instead
+    FILE* file = fopen( pszFilename, "rb" );
+    if( file == NULL ) { Close(); return false; }
+
+    size_t nAllocated = 0, nRead = 0;
+    unsigned char* pBuffer = NULL;
+    for( ;; )
+    {
+        if( nRead == nAllocated )
+        {
+            nAllocated = nAllocated ? nAllocated * 2 : 65536;
+            unsigned char* pNew = (unsigned char*)realloc( pBuffer, nAllocated );
+            if( pNew == NULL ) { free( pBuffer ); fclose( file ); Close(); return false; }
+            pBuffer = pNew;
+        }
+
+        size_t n = fread( pBuffer + nRead, 1, nAllocated - nRead, file );
+        if( n == 0 ) break;
+        nRead += n;
+    }
+    fclose( file );
+
+    m_pData = pBuffer;
+    m_nSize = nRead;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Releases the view
+//////////////////////////////////////////////////////////////////////
+void CFileView::Close()
+{
+    if( m_pData )
+    {
+        if( m_bMapped )
+        {
+#ifdef _WIN32
+            UnmapViewOfFile( m_pData );
+#else
+            munmap( (void*)m_pData, m_nSize );
+#endif
+        }
+        else
+            free( (void*)m_pData );
+    }
+
+#ifdef _WIN32
+    if( m_hMapping ) CloseHandle( (HANDLE)m_hMapping );
+    if( m_hFile != INVALID_HANDLE_VALUE ) CloseHandle( (HANDLE)m_hFile );
+    m_hMapping = NULL;
+    m_hFile = INVALID_HANDLE_VALUE;
+#endif
+
+    m_pData = NULL;
+    m_nSize = 0;
+    m_bMapped = false;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Bounds check. Done with offsets so a huge nBytes can't wrap around
+//////////////////////////////////////////////////////////////////////
+bool CFileView::Contains( const void* p, size_t nBytes ) const
+{
+    const unsigned char* pByte = (const unsigned char*)p;
+    if( m_pData == NULL || pByte < m_pData || pByte > m_pData + m_nSize ) return false;
+
+    size_t nOffset = (size_t)(pByte - m_pData);
+    return nBytes <= m_nSize - nOffset;
+}
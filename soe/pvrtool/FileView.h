@@ -0,0 +1,41 @@
+#ifndef _FILEVIEW_H
+#define _FILEVIEW_H
+
+#include <stddef.h>
+
+//////////////////////////////////////////////////////////////////////
+// Read only view of a whole file. The file is memory mapped where
+// possible, so the loaders can parse it in place rather than reading
+// it into a buffer first. Use Contains to check that a header or
+// block of texel data is actually in the file before touching it.
+//////////////////////////////////////////////////////////////////////
+class CFileView
+{
+public:
+    CFileView();
+    ~CFileView();
+
+    bool Open( const char* pszFilename );
+    void Close();
+
+    const unsigned char* GetData() const { return m_pData; }
+    size_t GetSize() const { return m_nSize; }
+
+    //true if the nBytes starting at p are all within the file
+    bool Contains( const void* p, size_t nBytes ) const;
+
+private:
+    CFileView( const CFileView& );
+    CFileView& operator=( const CFileView& );
+
+    const unsigned char* m_pData;
+    size_t m_nSize;
+    bool m_bMapped;       //false if the data had to be read into a buffer
+
+#ifdef _WIN32
+    void* m_hFile;
+    void* m_hMapping;
+#endif
+};
+
+#endif //_FILEVIEW_H
@@ -13,6 +13,7 @@
 #include "PIC.h"
 #include "Image.h"
 #include "Util.h"
+#include "FileView.h"
 
 
 //////////////////////////////////////////////////////////////////////
@@ -20,23 +21,18 @@
 //////////////////////////////////////////////////////////////////////
 bool LoadPIC( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags )
 {
-    /* load the image file into a buffer */
+    /* map the image file */
+    CFileView view;
+    if( !view.Open( pszFilename ) ) return false;
 
-    //open the file
-    FILE* file = fopen( pszFilename, "rb" );
-    if( file == NULL ) return false;
+    const unsigned char* pPtr = view.GetData();
 
-    //load the file into a buffer
-    fseek( file, 0, SEEK_END ); int nFileLength = ftell( file ); fseek( file, 0, SEEK_SET );
-    unsigned char* pBuffer = (unsigned char*)malloc( nFileLength );
-    if( (int)fread( pBuffer, 1, nFileLength, file ) < nFileLength ) { fclose(file); free(pBuffer); return false; };
-    fclose(file);
 
-    unsigned char* pPtr = pBuffer;
-
-
-    /* read, translate and validate header */
-    PICHeader* pHeader = (PICHeader*)pPtr;
+    /* read, translate and validate header - the view is read only so swap a copy */
+    if( !view.Contains( pPtr, sizeof(PICHeader) ) ) { ShowErrorMessage( "Invalid SoftImage PIC file" ); return false; }
+    PICHeader header;
+    memcpy( &header, pPtr, sizeof(PICHeader) );
+    PICHeader* pHeader = &header;
     pPtr += sizeof(PICHeader);
 
     ByteSwap( pHeader->nWidth );
@@ -46,22 +42,23 @@ bool LoadPIC( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags
     if( pHeader->magic != 0x34f68053 || memcmp( pHeader->PICT, "PICT", 4 ) != 0 )
     {
         ShowErrorMessage( "Invalid SoftImage PIC file" );
-        free( pBuffer );
         return false;
     }
     if( pHeader->nFields != PIC_FIELD_FULLFRAME )
     {
         ShowErrorMessage( "Unsupported file type - Full Frame only" );
-        free( pBuffer );
         return false;
     }
 
 
     /* count and store channels */
-    PICChannelInfo* pChannels = (PICChannelInfo*)pPtr;
-    pPtr += sizeof(PICChannelInfo);
+    const PICChannelInfo* pChannels = (const PICChannelInfo*)pPtr;
     int nChannels = 0;
-    while( pChannels[nChannels++].isChained == 1 ) pPtr += sizeof(PICChannelInfo);
+    do
+    {
+        if( !view.Contains( pPtr, sizeof(PICChannelInfo) ) ) { ShowErrorMessage( "Truncated SoftImage PIC file" ); return false; }
+        pPtr += sizeof(PICChannelInfo);
+    } while( pChannels[nChannels++].isChained == 1 );
 
     /* see if we've got an alpha channel */
     bool bAlpha = false;
@@ -71,22 +68,29 @@ bool LoadPIC( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags
     /* allocate the image */
     mmrgba.Init( MMINIT_ALLOCATE|MMINIT_RGB|(( bAlpha && (dwFlags & LPF_LOADALPHA) )?MMINIT_ALPHA:0), pHeader->nWidth, pHeader->nHeight );
 
-    /* decompress */
+    /* decompress - every packet is checked against the end of the file and the end of the row */
 	for( int y = 0; y < pHeader->nHeight; y++ )
 	{
 		for( int iChannel = 0; iChannel < nChannels; iChannel++ )
 		{
+            int nChannel = pChannels[iChannel].channel;
+            int nPixelSize = ((nChannel & PIC_CHANNELCODE_RED)?1:0) + ((nChannel & PIC_CHANNELCODE_GREEN)?1:0) +
+                             ((nChannel & PIC_CHANNELCODE_BLUE)?1:0) + ((nChannel & PIC_CHANNELCODE_ALPHA)?1:0);
+
             if( pChannels[iChannel].type & PIC_CHANNELTYPE_MIXED_RUN_LENGTH )
 			{
                 for( int x = 0; x < pHeader->nWidth; )
                 {
+                    if( !view.Contains( pPtr, 1 ) ) { ShowErrorMessage( "Truncated SoftImage PIC file" ); return false; }
+
                     if( *pPtr < 128 )
                     {
                         //one byte count
                         int nCount = (*pPtr++) + 1;
+                        if( x + nCount > pHeader->nWidth || !view.Contains( pPtr, nCount * nPixelSize ) ) { ShowErrorMessage( "Corrupt SoftImage PIC file" ); return false; }
+
                         for( int iRun = 0; iRun < nCount; iRun++ )
                         {
-                            int nChannel = pChannels[iChannel].channel;
                             if( nChannel & PIC_CHANNELCODE_RED )    mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)+2 ] = *pPtr++;
                             if( nChannel & PIC_CHANNELCODE_GREEN )  mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)+1 ] = *pPtr++;
                             if( nChannel & PIC_CHANNELCODE_BLUE )   mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)   ] = *pPtr++;
@@ -103,6 +107,7 @@ bool LoadPIC( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags
                         if( *pPtr == 128 )
                         {
                             pPtr++;
+                            if( !view.Contains( pPtr, 2 ) ) { ShowErrorMessage( "Truncated SoftImage PIC file" ); return false; }
                             nCount = *pPtr++;
                             nCount = (nCount*256) + *pPtr++;
                         }
@@ -110,12 +115,12 @@ bool LoadPIC( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags
                         {
                             nCount = (*pPtr++) - 127;
                         }
+                        if( x + nCount > pHeader->nWidth || !view.Contains( pPtr, nPixelSize ) ) { ShowErrorMessage( "Corrupt SoftImage PIC file" ); return false; }
 
                         int iOff = 0;
                         for( int i = 0; i < nCount; i++ )
                         {
                             iOff = 0;
-                            int nChannel = pChannels[iChannel].channel;
                             if( nChannel & PIC_CHANNELCODE_RED )    mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)+2 ] = pPtr[iOff++];
                             if( nChannel & PIC_CHANNELCODE_GREEN )  mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)+1 ] = pPtr[iOff++];
                             if( nChannel & PIC_CHANNELCODE_BLUE )   mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)   ] = pPtr[iOff++];
@@ -131,9 +136,10 @@ bool LoadPIC( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags
 			}
 			else
 			{
+                if( !view.Contains( pPtr, pHeader->nWidth * nPixelSize ) ) { ShowErrorMessage( "Truncated SoftImage PIC file" ); return false; }
+
 				for( int x = 0; x < pHeader->nWidth; x++)
 				{
-                    int nChannel = pChannels[iChannel].channel;
                     if( nChannel & PIC_CHANNELCODE_RED )    mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)+2 ] = *pPtr++;
                     if( nChannel & PIC_CHANNELCODE_GREEN )  mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)+1 ] = *pPtr++;
                     if( nChannel & PIC_CHANNELCODE_BLUE )   mmrgba.pRGB[0][ ((x + (y*pHeader->nWidth)) * 3)   ] = *pPtr++;
@@ -147,10 +153,8 @@ bool LoadPIC( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags
 	}
 
     //set description
-    sprintf( mmrgba.szDescription, "SoftImage PIC %dx%d %s", pHeader->nWidth, pHeader->nHeight, pHeader->szComment );
+    sprintf( mmrgba.szDescription, "SoftImage PIC %dx%d %.*s", pHeader->nWidth, pHeader->nHeight, (int)sizeof(pHeader->szComment), pHeader->szComment );
 
-    //free the image data and return
-    free( pBuffer );
     return true;
 }
 
@@ -2,19 +2,20 @@
 #define _PIC_H_
 #pragma pack( push, 1 )
 
+#include <stdint.h>
 #include "Picture.h"
 
 
 
 struct PICHeader
 {
-    unsigned long int magic;
+    uint32_t magic;
     float version;
     unsigned char szComment[80];
     unsigned char PICT[4];
     unsigned short int nWidth;
     unsigned short int nHeight;
-    unsigned long int nAspectRatio;
+    uint32_t nAspectRatio;
     unsigned short int nFields;
     unsigned short int _pad;
 };
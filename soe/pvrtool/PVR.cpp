@@ -37,6 +37,7 @@
 #include "Image.h"
 #include "VQF.h"
 #include "Twiddle.h"
+#include "FileView.h"
 
 extern unsigned char g_nOpaqueAlpha;
 
@@ -118,7 +119,7 @@ bool SavePVRPalette( const char* pszFilename, unsigned short int nPaletteDepth,
         {
             case ICF_8888:
             {
-                unsigned long int Pal32 = MAKE_8888( pPalette[i].a, pPalette[i].r, pPalette[i].g, pPalette[i].b );
+                uint32_t Pal32 = MAKE_8888( pPalette[i].a, pPalette[i].r, pPalette[i].g, pPalette[i].b );
                 fwrite( &Pal32, 1, 4, file );
                 break;
             }
@@ -167,40 +168,49 @@ bool SavePVRPalette( const char* pszFilename, unsigned short int nPaletteDepth,
 
 
 
+//////////////////////////////////////////////////////////////////////
+// Codebook size of a SMALLVQ texture. The hardware goes by the width, and
+// there's no smaller codebook for the larger textures
+//////////////////////////////////////////////////////////////////////
+int GetSmallVQCodeBookSize( int nWidth, bool bMipMaps )
+{
+    if( nWidth <= 16 ) return 16;
+    if( nWidth == 32 ) return bMipMaps ? 64 : 32;
+    if( nWidth == 64 && !bMipMaps ) return 128;
+    return 256;
+}
+
+
+
 //////////////////////////////////////////////////////////////////////
 // Loads the given PVR file into the mmrgba object
 //////////////////////////////////////////////////////////////////////
 bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags )
 {
-    //open the file
-    FILE* file = fopen( pszFilename, "rb" );
-    if( file == NULL ) return ReturnError( "File open failed: ", pszFilename  );
-
-    //load the file into a buffer
-    fseek( file, 0, SEEK_END ); int nFileLength = ftell( file ); fseek( file, 0, SEEK_SET );
-    unsigned char* pBuffer = (unsigned char*)malloc( nFileLength );
-    if( (int)fread( pBuffer, 1, nFileLength, file ) < nFileLength ) { fclose(file); free(pBuffer); return ReturnError("Unexpected EOF: ", pszFilename ); };
-    fclose(file);
+    //map the file
+    CFileView view;
+    if( !view.Open( pszFilename ) ) return ReturnError( "File open failed: ", pszFilename  );
 
-    unsigned char* pPtr = pBuffer;
+    const unsigned char* pPtr = view.GetData();
 
     //see if we've got a GBIX or not
-    GlobalIndexHeader* pGBIX = (GlobalIndexHeader*)pPtr;
-    if( memcmp( pGBIX->GBIX, "GBIX", 4 ) == 0 )
+    const GlobalIndexHeader* pGBIX = (const GlobalIndexHeader*)pPtr;
+    if( view.Contains( pGBIX, sizeof(GlobalIndexHeader) ) && memcmp( pGBIX->GBIX, "GBIX", 4 ) == 0 )
     {
+        //the offset is from the end of the tag, which includes the global index
+        if( pGBIX->nByteOffsetToNextTag < 4 || !view.Contains( pPtr, sizeof(GlobalIndexHeader) + (pGBIX->nByteOffsetToNextTag-4) ) ) return ReturnError("Unexpected EOF: ", pszFilename );
         pPtr += sizeof(GlobalIndexHeader) + (pGBIX->nByteOffsetToNextTag-4);
     }
     else
         pGBIX = NULL;
 
     //read header
-    PVRHeader* pHeader = (PVRHeader*)pPtr;
-    pPtr += sizeof(PVRHeader);
-    if( memcmp( pHeader->PVRT, "PVRT", 4 ) != 0 )
+    const PVRHeader* pHeader = (const PVRHeader*)pPtr;
+    if( !view.Contains( pHeader, sizeof(PVRHeader) ) || memcmp( pHeader->PVRT, "PVRT", 4 ) != 0 )
     {
-        free(pBuffer);
         return ReturnError( "Not a PVR file:", pszFilename  );
     }
+    pPtr += sizeof(PVRHeader);
 
     //determine colour format and set masks etc.
     ImageColourFormat icf = ICF_565;
@@ -212,8 +222,8 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         case KM_TEXTURE_RGB565:   icf = ICF_565; break;
         case KM_TEXTURE_ARGB4444: icf = ICF_4444; bAlpha = true; break;
         case KM_TEXTURE_YUV422:   icf = ICF_YUV422; break;
-        case KM_TEXTURE_BUMP:   free( pBuffer ); return ReturnError( "Bump not supported:", pszFilename  ); //fixme: not supported
-        default: free( pBuffer ); return ReturnError( "Unsupported colour format:", pszFilename  );
+        case KM_TEXTURE_BUMP:   return ReturnError( "Bump not supported:", pszFilename  ); //fixme: not supported
+        default: return ReturnError( "Unsupported colour format:", pszFilename  );
     }
 
     //determine storage method
@@ -228,8 +238,8 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         case KM_TEXTURE_TWIDDLED_RECTANGLE: bTwiddled = true; bRectangle = true; break;
         case KM_TEXTURE_VQ:                 bTwiddled = true; bVQ = true; nCodeBookSize = 256; break;
         case KM_TEXTURE_VQ_MM:              bTwiddled = true; bVQ = true; nCodeBookSize = 256; bMipMaps = true; break;
-        case KM_TEXTURE_SMALLVQ:            bTwiddled = true; bVQ = true;                     if( pHeader->nWidth <= 16 ) nCodeBookSize = 16;  else if( pHeader->nWidth == 32 ) nCodeBookSize = 32; else if( pHeader->nWidth == 64 ) nCodeBookSize = 128; else nCodeBookSize = 256; break;
-        case KM_TEXTURE_SMALLVQ_MM:         bTwiddled = true; bVQ = true; bMipMaps = true; if( pHeader->nWidth <= 16 ) nCodeBookSize = 16;  else if( pHeader->nWidth == 32 ) nCodeBookSize = 64; else nCodeBookSize = 256; break;
+        case KM_TEXTURE_SMALLVQ:            bTwiddled = true; bVQ = true;                  nCodeBookSize = GetSmallVQCodeBookSize( pHeader->nWidth, false ); break;
+        case KM_TEXTURE_SMALLVQ_MM:         bTwiddled = true; bVQ = true; bMipMaps = true; nCodeBookSize = GetSmallVQCodeBookSize( pHeader->nWidth, true ); break;
         case KM_TEXTURE_STRIDE:             //drop through...
         case KM_TEXTURE_RECTANGLE:          bRectangle = true; break;
 
@@ -244,7 +254,7 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         case KM_TEXTURE_PALETTIZE8_MM:      bTwiddled = true; nPaletteDepth = 8; bMipMaps = true; break;
 
         case KM_TEXTURE_BMP:                //input only (??) [drop through to unsupported]
-        default:                            free( pBuffer ); return ReturnError( "Unsupported texture type:", pszFilename  );
+        default:                            return ReturnError( "Unsupported texture type:", pszFilename  );
     }
 
 
@@ -269,7 +279,7 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
             pPalette = malloc( 4 * nPaletteSize );
             for( int i = 0; i < nPaletteSize; i++ )
             {
-                unsigned long int* pEntry = (unsigned long int*)pPalette;
+                uint32_t* pEntry = (uint32_t*)pPalette;
                 unsigned char v = (unsigned char)((256.0 / double(nPaletteSize) ) * i);
                 pEntry[i] = MAKE_8888( g_nOpaqueAlpha, v, v, v );
             }
@@ -291,10 +301,11 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
     mmrgba.nPaletteDepth = nPaletteDepth;
 
     //get texture data
-    VQFCodeBookEntry* pCodeBook = NULL;
+    const VQFCodeBookEntry* pCodeBook = NULL;
     if( bVQ )
     {
-        pCodeBook = (VQFCodeBookEntry*)pPtr;
+        if( !view.Contains( pPtr, sizeof(VQFCodeBookEntry) * nCodeBookSize ) ) { free( pPalette ); return ReturnError("Unexpected EOF: ", pszFilename ); }
+        pCodeBook = (const VQFCodeBookEntry*)pPtr;
         pPtr += sizeof(VQFCodeBookEntry) * nCodeBookSize;
     }
 
@@ -313,6 +324,14 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
     //unpack image
     if( bVQ )
     {
+        //unpack the codebook. A small VQ codebook takes the top of the index range
+        int nFirstCode = 256 - nCodeBookSize;
+        unsigned char CodeBGR[ 256 * 12 ], CodeAlpha[ 256 * 4 ];
+        UnpackCodeBook( pCodeBook, nCodeBookSize, icf, &CodeBGR[ nFirstCode * 12 ], &CodeAlpha[ nFirstCode * 4 ] );
+
+        //buffer for the untwiddled indices of the largest level
+        unsigned char* pIndices = (unsigned char*)malloc( __max( 1, (mmrgba.nWidth / 2) * (mmrgba.nWidth / 2) ) );
+
         //unpack image
         int iMipMap = bMipMaps ? mmrgba.nMipMaps - 1 : 0;
         int nTempWidth = bMipMaps ? 1 : mmrgba.nWidth;
@@ -322,54 +341,20 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
             unsigned char* pRGB = mmrgba.pRGB ? mmrgba.pRGB[iMipMap] : NULL;
             unsigned char* pAlpha = mmrgba.pAlpha ? mmrgba.pAlpha[iMipMap] : NULL;
 
-            //compute twiddle bit values
-            unsigned long int mask, shift;
-            ComputeMaskShift( nTempWidth / 2, nTempHeight / 2, mask, shift );
-
             //read the image
-            int nWrite = 0, nMax = (nTempWidth == 1) ? 1 : (nTempWidth / 2) * (nTempHeight / 2);
-            int x = 0, y = 0;
-            while( nWrite < nMax )
-            {
-                int iPos = CalcUntwiddledPos( x / 2, y / 2, mask, shift );
+            int nMax = (nTempWidth == 1) ? 1 : (nTempWidth / 2) * (nTempHeight / 2);
+            if( !view.Contains( pPtr, nMax ) ) { free( pIndices ); return ReturnError("Unexpected EOF: ", pszFilename ); }
 
-                if( nTempWidth == 1 ) //special case: 1x1 vq mipmap is stored as 565 and index 0 is used
-                {
-                    //unpack and write the valies into the buffer
-                    UnpackTexel( 0, 0, pCodeBook[ pPtr[iPos] ].Texel[0], ( pAlpha && bAlpha ) ? &pAlpha[0] : NULL, &pRGB[2], &pRGB[1], &pRGB[0], ICF_565 );
-                }
-                else
-                {
-                    //unpack the twiddled 2x2 block
-                    int xoff = 0, yoff = 0;
-                    int iLinear[] = { 0, 2, 1, 3 }; //this is needed so that YUV can be unpacked properly
-                    for( int iTexel = 0; iTexel < 4; iTexel++ )
-                    {
-                        //get the texel
-                        unsigned short int Texel = pCodeBook[ pPtr[iPos] ].Texel[iLinear[iTexel]];
-
-                        //determine where to write
-                        int iAlphaWrite = (x + xoff + ( (y + yoff) * nTempWidth));
-                        int iWrite = iAlphaWrite * 3;
-
-                        //unpack and write the valies into the buffer
-                        unsigned char *pa, *pr, *pg, *pb;
-                        pa = ( pAlpha && bAlpha ) ? &pAlpha[ iAlphaWrite ] : NULL;
-                        pb = &pRGB[iWrite++];
-                        pg = &pRGB[iWrite++];
-                        pr = &pRGB[iWrite++];
-                        UnpackTexel( x + xoff, y + yoff, Texel, pa, pr, pg, pb, icf );
-
-                        //adjust x & y
-                        xoff++;
-                        if( xoff == 2 ) { xoff = 0; yoff++; }
-                    }
-                }
-
-                //update write position
-                nWrite++;
-                x += 2;
-                if( x >= nTempWidth ) { x = 0; y += 2; }
+            if( nTempWidth == 1 ) //special case: 1x1 vq mipmap is stored as 565 and index 0 is used
+            {
+                if( pPtr[0] < nFirstCode ) { free( pIndices ); return ReturnError("Unexpected EOF: ", pszFilename ); }
+                UnpackTexel( 0, 0, pCodeBook[ pPtr[0] - nFirstCode ].Texel[0], ( pAlpha && bAlpha ) ? &pAlpha[0] : NULL, &pRGB[2], &pRGB[1], &pRGB[0], ICF_565 );
+            }
+            else
+            {
+                //untwiddle the indices so the blocks can be read in order
+                Untwiddle( pPtr, pIndices, nTempWidth / 2, nTempHeight / 2, 8 );
+                if( !WriteCodeBlocks( pIndices, nTempWidth, nTempHeight, CodeBGR, CodeAlpha, nFirstCode, pRGB, bAlpha ? pAlpha : NULL ) ) { free( pIndices ); return ReturnError("Unexpected EOF: ", pszFilename ); }
             }
 
             //move pointer over the mipmap we just unpacked
@@ -380,6 +365,8 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
             nTempWidth *= 2;
             nTempHeight *= 2;
         }
+
+        free( pIndices );
     }
     else
     {
@@ -396,40 +383,21 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
             //unpack the image
             if( bTwiddled )
             {
-                //compute twiddle bit values
-                unsigned long int mask, shift;
-                ComputeMaskShift( nTempWidth, nTempHeight, mask, shift );
-
                 //prepare read values
                 int nWrite = 0, nMax = nTempWidth*nTempHeight;
-                int x = 0, y = 0;
 
                 //special non-VQ twiddled case: paletteised
                 if( nPaletteDepth == 0 )
                 {
-                    //read the 16 bit image
-                    while( nWrite < nMax )
-                    {
-                        int iPos = CalcUntwiddledPos( x, y, mask, shift );
-
-                        //get texel and update read index
-                        unsigned short int* p = (unsigned short int*)pPtr;
-                        unsigned short int Texel = p[iPos];
-
-                        //determine where to write
-                        int iAlphaWrite = (x + (y * nTempWidth));
-                        int iWrite = iAlphaWrite * 3;
+                    if( !view.Contains( pPtr, 2 * nMax ) ) { free( pPalette ); return ReturnError("Unexpected EOF: ", pszFilename ); }
 
-                        unsigned char *pa, *pr, *pg, *pb;
-                        pa = ( pAlpha && bAlpha ) ? &pAlpha[ iAlphaWrite ] : NULL;
-                        pb = &pRGB[iWrite++];
-                        pg = &pRGB[iWrite++];
-                        pr = &pRGB[iWrite++];
-                        UnpackTexel( x, y, Texel, pa, pr, pg, pb, icf );
+                    //untwiddle the whole level, then read the 16 bit image
+                    unsigned short int* pTexels = (unsigned short int*)malloc( 2 * nMax );
+                    Untwiddle( pPtr, pTexels, nTempWidth, nTempHeight, 16 );
 
-                        nWrite++;
-                        if( ++x >= nTempWidth ) { x = 0; y++; }
-                    }
+                    for( int y = 0; y < nTempHeight; y++ )
+                        UnpackTexelRow( &pTexels[ y * nTempWidth ], &pRGB[ y * nTempWidth * 3 ], ( pAlpha && bAlpha ) ? &pAlpha[ y * nTempWidth ] : NULL, nTempWidth, icf );
+                    free( pTexels );
 
                     //move pointer over the mipmap we just unpacked
                     pPtr += 2 * nMax;
@@ -437,23 +405,17 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
                 else
                 {
                     //read the paletteised image
-                    while( nWrite < nMax )
-                    {
-                        int iPos = CalcUntwiddledPos( x, y, mask, shift );
-                        if( nPaletteDepth == 4 ) iPos /= 2;
-
-                        //get palette index
-                        unsigned char indexbyte = pPtr[iPos];
-                        if( nPaletteDepth == 4 )
-                        {
-                            if( y & 1 ) indexbyte = (indexbyte >> 4); else indexbyte = indexbyte & 0x0F;
-                        }
-
-                        //determine where to write
-                        pPaletteIndices[ (x + (y * nTempWidth)) ] = indexbyte;
+                    if( !view.Contains( pPtr, ( nPaletteDepth == 4 ) ? (nMax + 1) / 2 : nMax ) ) { free( pPalette ); return ReturnError("Unexpected EOF: ", pszFilename ); }
 
-                        nWrite++;
-                        if( ++x >= nTempWidth ) { x = 0; y++; }
+                    if( nPaletteDepth == 8 )
+                        Untwiddle( pPtr, pPaletteIndices, nTempWidth, nTempHeight, 8 );
+                    else
+                    {
+                        //untwiddle into packed 4 bit indices (after the space they'll unpack into), then unpack them
+                        unsigned char* pPacked = pPaletteIndices + nMax - ((nMax + 1) / 2);
+                        Untwiddle( pPtr, pPacked, nTempWidth, nTempHeight, 4 );
+                        for( nWrite = 0; nWrite < nMax; nWrite++ )
+                            pPaletteIndices[nWrite] = ( pPacked[nWrite >> 1] >> ( (nWrite & 1) << 2 ) ) & 0x0F;
                     }
 
                     //move pointer over the mipmap we just unpacked
@@ -466,28 +428,12 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
             else
             {
                 //read the image
-                int nWrite = 0, nMax = nTempWidth*nTempHeight;
-                int x = 0, y = 0;
-                while( nWrite < nMax )
+                int nMax = nTempWidth*nTempHeight;
+                if( !view.Contains( pPtr, 2 * nMax ) ) { free( pPalette ); return ReturnError("Unexpected EOF: ", pszFilename ); }
+                for( int y = 0; y < nTempHeight; y++ )
                 {
-                    //determine where to write
-                    int iAlphaWrite = (x + (y * nTempWidth));
-                    int iWrite = iAlphaWrite * 3;
-
-                    //get texel
-                    unsigned short int Texel = *((unsigned short int*)pPtr);
-                    pPtr += 2;
-
-                    unsigned char *pa, *pr, *pg, *pb;
-                    pa = ( pAlpha && bAlpha ) ? &pAlpha[ iAlphaWrite ] : NULL;
-                    pb = &pRGB[iWrite++];
-                    pg = &pRGB[iWrite++];
-                    pr = &pRGB[iWrite++];
-                    UnpackTexel( x, y, Texel, pa, pr, pg, pb, icf );
-
-                    //advance write positions
-                    nWrite++;
-                    if( ++x >= nTempWidth ) { x = 0; y++; }
+                    UnpackTexelRow( (const unsigned short int*)pPtr, &pRGB[ y * nTempWidth * 3 ], ( pAlpha && bAlpha ) ? &pAlpha[ y * nTempWidth ] : NULL, nTempWidth, icf );
+                    pPtr += 2 * nTempWidth;
                 }
             }
 
@@ -520,7 +466,7 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
 
                 case ICF_8888:
                 {
-                    unsigned long int* pPal32 = (unsigned long int*)pPalette;
+                    uint32_t* pPal32 = (uint32_t*)pPalette;
                     a = (unsigned char)(( pPal32[i] & 0xFF000000 ) >> 0x18);
                     r = (unsigned char)(( pPal32[i] & 0x00FF0000 ) >> 0x10);
                     g = (unsigned char)(( pPal32[i] & 0x0000FF00 ) >> 0x08);
@@ -576,7 +522,6 @@ bool LoadPVR( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
 
     //clean up
     if( pPalette ) free( pPalette );
-    free( pBuffer );
     
     return true;
 }
@@ -611,17 +556,18 @@ bool SavePVR( const char* pszFilename, MMRGBA &mmrgba, SaveOptions* pSaveOptions
     }
     else
     {
-        if( !mmrgbasave.bPalette )
+        if( !mmrgbasave.bPalette || mmrgbasave.nPaletteDepth > nPaletteDepth )
         {
-            //FIXME!
-            ShowErrorMessage( "Automatic palettisation is not supported (yet). In order to save a palettised image, you have to load one in" );
-            return false;
-            //DisplayStatusMessage( "Warning: this program only uses a primitive palettisation algorithm. The palette might not be ideal" );
-            //mmrgbasave.ConvertToPalettised( nPaletteDepth );
+            //build the mipmaps first so each level gets its own indices
+            if( bMipmaps && !mmrgbasave.bPalette && mmrgbasave.nMipMaps <= 1 )
+            {
+                mmrgbasave.GenerateMipMaps();
+                mmrgbasave.GenerateAlphaMipMaps();
+            }
+
+            mmrgbasave.ConvertToPalettised( nPaletteDepth, pSaveOptions->ColourFormat );
+            if( !mmrgbasave.bPalette || mmrgbasave.nPaletteDepth != nPaletteDepth ) return ReturnError( "Error: failed to palettise image: ", pszFilename );
         }
-        else
-            if( mmrgbasave.nPaletteDepth > nPaletteDepth )
-                DisplayStatusMessage( "Warning: source image has 8bpp palette and output format is 4bpp: ***automatic downsampling is not implemented***" );
     }
 
 
@@ -773,13 +719,13 @@ bool SavePVR( const char* pszFilename, MMRGBA &mmrgba, SaveOptions* pSaveOptions
     if( file == NULL ) return ReturnError("Failed to open file for output: ", pszFilename );
 
     //write out globalindex
-    if( g_bEnableGlobalIndex )
+    if( pSaveOptions->bGlobalIndex )
     {
         GlobalIndexHeader gbix;
         memcpy( gbix.GBIX, "GBIX", 4 );
         gbix.nByteOffsetToNextTag = 8;
-        gbix.nGlobalIndex = g_nGlobalIndex;
-        unsigned long int zero = 0;
+        gbix.nGlobalIndex = pSaveOptions->nGlobalIndex;
+        uint32_t zero = 0;
         if( fwrite( &gbix, 1, sizeof(GlobalIndexHeader), file ) < sizeof(GlobalIndexHeader) || fwrite( &zero, 1, sizeof(zero), file ) < sizeof(zero) )
         {
             fclose( file );
@@ -805,8 +751,9 @@ bool SavePVR( const char* pszFilename, MMRGBA &mmrgba, SaveOptions* pSaveOptions
         iMipMap = mmrgbasave.nMipMaps - 1;
         if( mmrgbasave.nMipMaps != mmrgbasave.nAlphaMipMaps ) mmrgbasave.GenerateAlphaMipMaps();
 
-        const unsigned short int zero = 0;
-        fwrite( &zero, 1, sizeof(zero), file );
+        //dummy placeholders - 3 bytes for 8 bit palettes, as counted in nTextureDataSize and skipped by LoadPVR
+        const unsigned char zero[3] = { 0, 0, 0 };
+        fwrite( zero, 1, ( nPaletteDepth == 8 ) ? 3 : 2, file );
     }
 
 
@@ -816,36 +763,26 @@ bool SavePVR( const char* pszFilename, MMRGBA &mmrgba, SaveOptions* pSaveOptions
     {
         if( nPaletteDepth == 0 )
         {
-            //compute twiddle bit values
-            unsigned long int mask, shift;
-            if( bTwiddled ) ComputeMaskShift( nTempWidth, nTempHeight, mask, shift );
-
-            //allocate a buffer to write into
-            unsigned short int* pFileBuffer = (unsigned short int*)malloc( nTempWidth*nTempHeight*2 );
+            //allocate a buffer to write into, and one to twiddle it into if needed
+            unsigned short int* pFileBuffer = (unsigned short int*)malloc( nTempWidth*nTempHeight*2 * ( bTwiddled ? 2 : 1 ) );
             memset( pFileBuffer, 0, nTempWidth*nTempHeight*2 );
 
-            //write each texel into the buffer
-            int iRead = 0, iAlphaRead = 0, iWrite = 0, iMax = nTempWidth * nTempHeight;
-            int x = 0, y = 0;
-            while( iWrite < iMax )
+            //write each row of texels into the buffer
+            int iMax = nTempWidth * nTempHeight;
+            const unsigned char* pAlpha = (mmrgbasave.pAlpha && mmrgbasave.pAlpha[0]) ? mmrgbasave.pAlpha[iMipMap] : NULL;
+            for( int y = 0; y < nTempHeight; y++ )
+                PackTexelRow( &pFileBuffer[ y * nTempWidth ], &mmrgbasave.pRGB[iMipMap][ y * nTempWidth * 3 ], pAlpha ? &pAlpha[ y * nTempWidth ] : NULL, nTempWidth, pSaveOptions->ColourFormat );
+
+            //twiddle the whole level in one go
+            unsigned short int* pOutput = pFileBuffer;
+            if( bTwiddled )
             {
-                //get RGB & A
-                unsigned char b = mmrgbasave.pRGB[iMipMap][iRead++];
-                unsigned char g = mmrgbasave.pRGB[iMipMap][iRead++];
-                unsigned char r = mmrgbasave.pRGB[iMipMap][iRead++];
-                unsigned char a = (mmrgbasave.pAlpha && mmrgbasave.pAlpha[0]) ? mmrgbasave.pAlpha[iMipMap][iAlphaRead++]: g_nOpaqueAlpha;
-
-                //calculate position and write computed texel
-                int iPos = ( bTwiddled ) ? CalcUntwiddledPos( x, y, mask, shift ) : iWrite;
-                ComputeTexel( x, y, &pFileBuffer[ iPos ], a, r, g, b, pSaveOptions->ColourFormat );
-
-                //update position
-                iWrite++;
-                x++; if( x >= nTempWidth ) { x = 0; y++; }
+                pOutput = pFileBuffer + iMax;
+                Twiddle( pFileBuffer, pOutput, nTempWidth, nTempHeight, 16 );
             }
 
             //write the buffer to the file
-            if( (int)fwrite( pFileBuffer, 1, iMax*2, file ) < (iMax*2) )
+            if( (int)fwrite( pOutput, 1, iMax*2, file ) < (iMax*2) )
             {
                 free( pFileBuffer );
                 fclose( file );
@@ -857,51 +794,22 @@ bool SavePVR( const char* pszFilename, MMRGBA &mmrgba, SaveOptions* pSaveOptions
         }
         else
         {
-            //compute twiddle bit values
-            unsigned long int mask, shift;
-            ComputeMaskShift( nTempWidth, nTempHeight, mask, shift );
-
-            //allocate a buffer to write into
+            //allocate a buffer to write into, with room to pack 4 bit indices after it
             int iMax = (nTempWidth * nTempHeight);
             if( nPaletteDepth == 4 ) iMax >>= 1;
-            unsigned char* pFileBuffer = (unsigned char*)malloc( iMax );
-            memset( pFileBuffer, 0, iMax );
+            unsigned char* pFileBuffer = (unsigned char*)malloc( (iMax * 2) + 1 );
 
-            //write each texel into the buffer
-            int iRead = 0, iAlphaRead = 0, iWrite = 0;
-            int x = 0, y = 0;
+            //twiddle the indices into the buffer. 4 bit ones are packed two to a byte first
+            //(the 1x1 level has no room in the file so it's left out)
+            const unsigned char* pIndices = mmrgbasave.pPaletteIndices[iMipMap];
             if( nPaletteDepth == 4 )
             {
-                while( iWrite < iMax )
-                {
-                    //get index
-                    unsigned char index = mmrgbasave.pPaletteIndices[iMipMap][iRead++];
-                    if( y & 1 ) { index <<= 4; iWrite++; } else index &= 0x0F;
-
-                    //calculate position and write computed texel
-                    int iPos = CalcUntwiddledPos( x, y, mask, shift );
-                    iPos >>= 1;
-                    pFileBuffer[iPos] |= index;
-
-                    //update position
-                    x++; if( x >= nTempWidth ) { x = 0; y++; }
-                }
+                unsigned char* pPacked = pFileBuffer + iMax;
+                for( int i = 0; i < iMax; i++ ) pPacked[i] = (unsigned char)( ( pIndices[i * 2] & 0x0F ) | ( pIndices[(i * 2) + 1] << 4 ) );
+                if( iMax ) Twiddle( pPacked, pFileBuffer, nTempWidth, nTempHeight, 4 );
             }
             else
-            {
-                while( iWrite < iMax )
-                {
-                    //get index
-                    unsigned char index = mmrgbasave.pPaletteIndices[iMipMap][iRead++];
-
-                    //calculate position and write computed texel
-                    pFileBuffer[ CalcUntwiddledPos( x, y, mask, shift ) ] = index;
-
-                    //update position
-                    iWrite++;
-                    x++; if( x >= nTempWidth ) { x = 0; y++; }
-                }
-            }
+                Twiddle( pIndices, pFileBuffer, nTempWidth, nTempHeight, 8 );
 
             //write the buffer to the file
             if( (int)fwrite( pFileBuffer, 1, iMax, file ) < iMax )
@@ -5,11 +5,6 @@
 #include <stdint.h>
 #include "Picture.h"
 
-//externals
-extern unsigned long int g_nGlobalIndex ;
-extern bool g_bEnableGlobalIndex;
-
-
 //category code
 #define KM_TEXTURE_TWIDDLED	            (0x0100)
 #define KM_TEXTURE_TWIDDLED_MM	        (0x0200)
@@ -74,6 +69,7 @@ static_assert((sizeof (struct PVRPaletteHeader)) == 16);
 
 extern bool SavePVR( const char* pszFilename, MMRGBA &mmrgba, SaveOptions* pSaveOptions );
 extern bool LoadPVR( const char* pszFilename, MMRGBA &mmrgba, unsigned long int dwFlags );
+extern int GetSmallVQCodeBookSize( int nWidth, bool bMipMaps );
 
 #pragma pack( pop )
 #endif //_PVR_H_
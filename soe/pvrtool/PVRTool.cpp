@@ -8,6 +8,9 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
+#include <memory>
+#include <mutex>
 #include "max_path.h"
 #include "stricmp.h"
 #include "Picture.h"
@@ -40,11 +43,11 @@ const char * g_pszAlphaFilename;
 const char * g_pszAlphaPrefix;
 const char * g_pszOutputExtension;
 const char * g_pszOutputPath;
-CImage g_Image;
-CVQCompressor g_VQCompressor;
+const char * g_pszVQSetCodebook = "";
 
-unsigned long int g_nGlobalIndex = 1;
+unsigned long int g_nFirstGlobalIndex = 1;
 bool g_bEnableGlobalIndex = false;
+int g_nJobs = 1;
 
 bool g_bVQCompress = false;
 bool g_bBatchMipmap = false;
@@ -53,25 +56,24 @@ bool g_bHFlip = false, g_bVFlip = false;
 bool g_bHalfSize = false;
 bool g_bMakeSquare = false;
 bool g_bPagedMipmap = false;
+bool g_bVQStats = false;
+bool g_bVQWarmStart = false;
 
 SaveOptions g_SaveOptions;
 
-int g_nFailed = 0;
-int g_nSucceeded = 0;
-
-
 
 
 //////////////////////////////////////////////////////////////////////
 // Displays the current program options
 //////////////////////////////////////////////////////////////////////
-void DisplayParameters()
+void DisplayParameters( const CVQCompressor& VQCompressor )
 {
     if( *g_pszOutputPath ) printf( "Output path: %s\n", g_pszOutputPath );
     if( *g_pszAlphaFilename ) printf( "Alpha filename: %s\n", g_pszAlphaFilename );
     printf( "Twiddle %s\n", g_SaveOptions.bTwiddled ? "on" : "off" );
     printf( "Mipmaps %s\n", g_SaveOptions.bMipmaps ? "on" : "off" );
-    if( g_bEnableGlobalIndex ) printf( "Global Index starting at %ld\n", g_nGlobalIndex ); else printf( "Global Index disabled\n" );
+    if( g_bEnableGlobalIndex ) printf( "Global Index starting at %ld\n", g_nFirstGlobalIndex ); else printf( "Global Index disabled\n" );
+    if( g_nJobs != 1 ) printf( "Jobs: %d\n", g_nJobs );
     printf( "Colour format: " );
     switch( g_SaveOptions.ColourFormat )
     {
@@ -90,17 +92,34 @@ void DisplayParameters()
     {
         printf( "VQ Compression on\n" );
 
-        switch( g_VQCompressor.m_Dither )
+        switch( VQCompressor.m_Dither )
         {
             case VQNoDither:     printf( "VQ: no dither\n" ); break;
             case VQSubtleDither: printf( "VQ: half dither\n" ); break;
             case VQFullDither:   printf( "VQ: full dither\n" ); break;
+            case VQOrderedDither: printf( "VQ: ordered dither\n" ); break;
         }
-        switch( g_VQCompressor.m_Metric )
+        switch( VQCompressor.m_Metric )
         {
             case VQMetricEqual:    printf( "VQ: no weighting\n" ); break;
             case VQMetricWeighted: printf( "VQ: eye-weighting\n" ); break;
         }
+        switch( VQCompressor.m_Search )
+        {
+            case VQSearchNeighbours: break;
+            case VQSearchKdTree:     printf( "VQ: k-d tree search\n" ); break;
+            case VQSearchExhaustive: printf( "VQ: exhaustive search\n" ); break;
+        }
+        if( VQCompressor.m_nThreads != 1 ) printf( "VQ: %d threads\n", VQCompressor.m_nThreads );
+        if( VQCompressor.m_nSubsample != 1 ) printf( "VQ: training on 1 in %d vectors\n", VQCompressor.m_nSubsample );
+        if( VQCompressor.m_nCoarseWidth > 0 && VQCompressor.m_bMipmap ) printf( "VQ: codes built from the MIP levels up to %d wide\n", VQCompressor.m_nCoarseWidth );
+        if( VQCompressor.m_nExtraPasses > 0 ) printf( "VQ: up to %d extra passes\n", VQCompressor.m_nExtraPasses );
+        if( VQCompressor.m_fMinImprovement > 0.0f ) printf( "VQ: passes stop below %g improvement\n", VQCompressor.m_fMinImprovement );
+        if( VQCompressor.m_fTimeBudget > 0.0f ) printf( "VQ: %g seconds per texture\n", VQCompressor.m_fTimeBudget );
+        if( VQCompressor.m_fSmallVQError > 0.0f ) printf( "VQ: smaller codebook if error is at most %g\n", VQCompressor.m_fSmallVQError );
+        if( g_bVQStats ) printf( "VQ: writing stats\n" );
+        if( g_bVQWarmStart ) printf( "VQ: starting from the codebook in the old output file\n" );
+        if( *g_pszVQSetCodebook ) printf( "VQ: one codebook for all files, saved to %s\n", g_pszVQSetCodebook );
     }
     printf( "\n" );
 }
@@ -121,7 +140,7 @@ bool LoadAlpha( CImage& Image, const char* pszFilename )
         PrefixFileName( szAlphaFilename, pszFilename, g_pszAlphaPrefix );
 
         //load it
-        printf( "Alpha: %s ...", szAlphaFilename );
+        DisplayMessage( "Alpha: %s ...", szAlphaFilename );
         if( !Image.Load( szAlphaFilename, true ) ) *szAlphaFilename = '\0'; else bChanged = true;
     }
 
@@ -129,7 +148,7 @@ bool LoadAlpha( CImage& Image, const char* pszFilename )
     if( *szAlphaFilename == '\0' && *g_pszAlphaFilename != '\0' )
     {
         strcpy( szAlphaFilename, g_pszAlphaFilename );
-        printf( "Alpha: %s ...", szAlphaFilename );
+        DisplayMessage( "Alpha: %s ...", szAlphaFilename );
         bChanged = Image.Load( szAlphaFilename, true );
     }
 
@@ -163,7 +182,7 @@ bool BatchLoadMipmap( CImage& Image, const char* pszFilename )
     if( bAlpha ) { mmrgba.pAlpha[0] = pRGBA->pAlpha[0];pRGBA->pAlpha[0] = NULL; }
 
     //load all mipmap levels
-    printf( "Loading batch...\n" );
+    DisplayMessage( "Loading batch...\n" );
     for( int iMipMap = 1; iMipMap < nMipMaps; iMipMap++ )
     {
         //build filename
@@ -174,7 +193,7 @@ bool BatchLoadMipmap( CImage& Image, const char* pszFilename )
         //load the image
         CImage MMImage;
         char szDimension[24]; snprintf( szDimension, (sizeof (szDimension)), "%dx%d", (pRGBA->nWidth >> iMipMap), (pRGBA->nHeight >> iMipMap) );
-        printf( "%10s Image: %s ...", szDimension, szMMFilename );
+        DisplayMessage( "%10s Image: %s ...", szDimension, szMMFilename );
         if( MMImage.Load( szMMFilename ) )
         {
             MMRGBA* pMMRGBA = MMImage.GetMMRGBA();
@@ -202,7 +221,7 @@ bool BatchLoadMipmap( CImage& Image, const char* pszFilename )
                 }
             }
 
-            printf( "Done.\n" );
+            DisplayMessage( "Done.\n" );
         }
         else
         {
@@ -212,7 +231,7 @@ bool BatchLoadMipmap( CImage& Image, const char* pszFilename )
             if( pRGBA->nMipMaps > 1 && pRGBA->pRGB[iMipMap] == NULL ) return ReturnError( "Batch failed: No mipmap" );
             else
             {
-                printf( "Failed, using image's.\n" );
+                DisplayMessage( "Failed, using image's.\n" );
                 mmrgba.pAlpha[iMipMap] = pRGBA->pRGB[iMipMap];
                 pRGBA->pRGB[iMipMap] = NULL;
             }
@@ -222,127 +241,241 @@ bool BatchLoadMipmap( CImage& Image, const char* pszFilename )
 
     //replace it and return
     pRGBA->ReplaceWith( &mmrgba );
-    printf( "\n" );
+    DisplayMessage( "\n" );
     return true;
 }
 
 
 
 //////////////////////////////////////////////////////////////////////
-// Called by CCommandLineProcessor::ProcessAllFiles
+// VQ set (-VG). The images are kept until all the files have been loaded,
+// then compressed together so they share one codebook
 //////////////////////////////////////////////////////////////////////
-bool ProcessFile( const char* pszFilename )
+struct VQSetEntry
 {
-    /* load image */
+    int nFileIndex;
+    CImage* pImage;
+    char szSourceFilename[MAX_PATH];
+    char szSaveFilename[MAX_PATH];
+};
 
-    //load image and alpha channel
-    printf( "\nLoading: %s ...", pszFilename );
-    CImage Image;
-    if( Image.Load( pszFilename ) )
-    {
-        /* load alpha prefix file */
-        LoadAlpha( Image, pszFilename );
+static VQSetEntry g_VQSet[VQ_MAX_SET_TEXTURES];
+static int g_nVQSetSize = 0;
+static std::mutex g_VQSetLock;
 
+bool AddToVQSet( CImage* pImage, int nFileIndex, const char* pszFilename, const char* pszSaveFilename )
+{
+    std::lock_guard<std::mutex> Guard( g_VQSetLock );
+    if( g_nVQSetSize >= VQ_MAX_SET_TEXTURES ) return ReturnError( "Too many files for one VQ codebook", pszFilename );
+
+    VQSetEntry& Entry = g_VQSet[g_nVQSetSize++];
+    Entry.nFileIndex = nFileIndex;
+    Entry.pImage = pImage;
+    strcpy( Entry.szSourceFilename, pszFilename );
+    strcpy( Entry.szSaveFilename, pszSaveFilename );
+    return true;
+}
 
-        /* load/build all mipmap levels */
-        if( g_bBatchMipmap ) if( !BatchLoadMipmap( Image, pszFilename ) )
+static int CompareVQSetEntries( const void* p1, const void* p2 )
+{
+    return ((const VQSetEntry*)p1)->nFileIndex - ((const VQSetEntry*)p2)->nFileIndex;
+}
+
+//saves the codebook the set shares, exactly as it is in front of each texture's indices
+bool SaveVQCodebook( const char* pszFilename, CVQImage* pVQImage )
+{
+    FILE* file = fopen( pszFilename, "wb" );
+    if( file == NULL ) return ReturnError( "Could not open file for output", pszFilename );
+
+    bool bOK = fwrite( pVQImage->GetVQ(), 8, pVQImage->GetCodebookSize(), file ) == (size_t)pVQImage->GetCodebookSize();
+    if( fclose( file ) != 0 ) bOK = false;
+    if( !bOK ) return ReturnError( "Could not write file", pszFilename );
+    return true;
+}
+
+//compresses the set once all the files are in, and saves each texture and the codebook.
+//Returns the number of files in the set that failed
+int ProcessVQSet( const CVQCompressor& VQCompressor )
+{
+    int nImages = g_nVQSetSize;
+    if( nImages == 0 ) return 0;
+
+    //keep the files in the order they were given, whatever order the jobs finished in
+    qsort( g_VQSet, nImages, sizeof(VQSetEntry), CompareVQSetEntries );
+
+    CImage* pImages[VQ_MAX_SET_TEXTURES];
+    CVQImage* pVQImages[VQ_MAX_SET_TEXTURES];
+    float fErrors[VQ_MAX_SET_TEXTURES];
+    for( int i = 0; i < nImages; i++ ) pImages[i] = g_VQSet[i].pImage;
+
+    DisplayMessage( "\nVQ compressing %d files with one codebook...", nImages );
+    VQ_STATS Stats;
+    int nFailed = nImages;
+    if( VQCompressor.GenerateVQSet( pImages, nImages, pVQImages, fErrors, g_bVQStats ? &Stats : NULL ) )
+    {
+        nFailed = 0;
+        for( int i = 0; i < nImages; i++ )
         {
-            g_nGlobalIndex++;
-            g_nFailed++;
-            return true;
+            DisplayMessage( "\nSaving: %s (%s) ... %.03f average error", g_VQSet[i].szSaveFilename, g_VQSet[i].szSourceFilename, fErrors[i] );
+            pVQImages[i]->SetGlobalIndex( g_bEnableGlobalIndex, g_nFirstGlobalIndex + g_VQSet[i].nFileIndex );
+            if( !pVQImages[i]->ExportFile( g_VQSet[i].szSaveFilename ) ) nFailed++;
         }
-        if( g_bPagedMipmap )
+
+        //the codebook is the same in all of them
+        DisplayMessage( "\nSaving codebook: %s ...", g_pszVQSetCodebook );
+        if( !SaveVQCodebook( g_pszVQSetCodebook, pVQImages[0] ) ) nFailed = nImages;
+
+        //save the stats for the set alongside the codebook
+        if( g_bVQStats && nFailed == 0 )
         {
-            //convert paged mipmaps to mipmaps
-            DisplayStatusMessage( "Creating mipmaps from mipmap page..." );
-            Image.PageToMipmaps();
+            char szStatsFilename[MAX_PATH], szSource[64];
+            strcpy( szStatsFilename, g_pszVQSetCodebook );
+            strcpy( (char*)GetFileExtension(szStatsFilename), "json" );
+            sprintf( szSource, "%d files", nImages );
+            if( !CVQCompressor::SaveStats( szStatsFilename, szSource, Stats ) ) nFailed = nImages;
         }
 
-        /* apply before-processing image manipulation functions */
+        for( int i = 0; i < nImages; i++ ) delete pVQImages[i];
+    }
+
+    for( int i = 0; i < nImages; i++ ) delete pImages[i];
+    g_nVQSetSize = 0;
+    return nFailed;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Called by CCommandLineProcessor::ProcessAllFiles
+//
+// This may be running on several threads at once, so it must only read
+// the global options. The file's global index comes from its position in
+// the file list, and pContext is the (shared, read-only) VQ compressor
+//////////////////////////////////////////////////////////////////////
+bool ProcessFile( const char* pszFilename, int nFileIndex, void* pContext )
+{
+    const CVQCompressor* pVQCompressor = (const CVQCompressor*)pContext;
+
+    //this file's save options
+    SaveOptions Options = g_SaveOptions;
+    Options.bGlobalIndex = g_bEnableGlobalIndex;
+    Options.nGlobalIndex = g_nFirstGlobalIndex + nFileIndex;
+
+    /* load image */
+
+    //load image and alpha channel
+    DisplayMessage( "\nLoading: %s ...", pszFilename );
+    std::unique_ptr<CImage> pImage( new CImage );
+    CImage& Image = *pImage;
+    if( !Image.Load( pszFilename ) ) return false;
+
+    /* load alpha prefix file */
+    LoadAlpha( Image, pszFilename );
+
+
+    /* load/build all mipmap levels */
+    if( g_bBatchMipmap ) if( !BatchLoadMipmap( Image, pszFilename ) ) return false;
+    if( g_bPagedMipmap )
+    {
+        //convert paged mipmaps to mipmaps
+        DisplayStatusMessage( "Creating mipmaps from mipmap page..." );
+        Image.PageToMipmaps();
+    }
+
+    /* apply before-processing image manipulation functions */
+
+    //apply flips
+    Image.Flip( g_bHFlip, g_bVFlip );
 
-        //apply flips
-        Image.Flip( g_bHFlip, g_bVFlip );
+    //enlarge the image to a power of 2 if requested
+    if( g_bEnlargeToPow2 ) { DisplayStatusMessage( "Enlarging to power of 2..." ); Image.EnlargeToPow2(); }
 
-        //enlarge the image to a power of 2 if requested
-        if( g_bEnlargeToPow2 ) { DisplayStatusMessage( "Enlarging to power of 2..." ); Image.EnlargeToPow2(); }
+    //resize the image so it is square
+    if( g_bMakeSquare ) { DisplayStatusMessage( "Making image square..." ); Image.MakeSquare(); }
 
-        //resize the image so it is square
-        if( g_bMakeSquare ) { DisplayStatusMessage( "Making image square..." ); Image.MakeSquare(); }
+    //shrink the image if requested
+    if( g_bHalfSize ) { DisplayStatusMessage( "Shrinking..." ); Image.ScaleHalfSize(); }
 
-        //shrink the image if requested
-        if( g_bHalfSize ) { DisplayStatusMessage( "Shrinking..." ); Image.ScaleHalfSize(); }
 
+    //display Ninja-friendly warning
+    if( Options.nGlobalIndex > MAX_GBIX ) DisplayMessage( "\nWarning: Global index > 0x%X - this may cause problems if you're using Ninja\n", MAX_GBIX );
 
-        //display Ninja-friendly warning
-        if( g_nGlobalIndex > MAX_GBIX ) printf( "\nWarning: Global index > 0x%X - this may cause problems if you're using Ninja\n", MAX_GBIX );
+    //we can only have a .vqf file if we're doing vq compressing
+    const char* pszPreferredExtension = g_bVQCompress ? g_pszOutputExtension : "PVR";
 
-        //we can only have a .vqf file if we're doing vq compressing
-        const char* pszPreferredExtension = g_bVQCompress ? g_pszOutputExtension : "PVR";
 
+    //build save file name
+    char szSaveFilename[MAX_PATH];
+    strcpy( szSaveFilename, g_pszOutputPath );
+    if( *g_pszOutputPath != '\0' )
+    {
+        //ensure there's a trailing \ on the file
+        char cLastChar = szSaveFilename[strlen(szSaveFilename)-1];
+        if( cLastChar != '\\' && cLastChar != '/' ) strcat( szSaveFilename, "\\" );
+    }
+    strcat( szSaveFilename, GetFileNameNoPath(pszFilename) );
+    strcpy( (char*)GetFileExtension(szSaveFilename), pszPreferredExtension );
 
-        //build save file name
-        char szSaveFilename[MAX_PATH];
-        strcpy( szSaveFilename, g_pszOutputPath );
-        if( *g_pszOutputPath != '\0' )
+
+    //VQ compress the image if the user asked for it and we can
+    if( g_bVQCompress && Image.CanVQ()  )
+    {
+        //VQ sets are compressed once all the files are loaded
+        if( *g_pszVQSetCodebook )
         {
-            //ensure there's a trailing \ on the file
-            char cLastChar = szSaveFilename[strlen(szSaveFilename)-1];
-            if( cLastChar != '\\' && cLastChar != '/' ) strcat( szSaveFilename, "\\" );
+            if( !AddToVQSet( pImage.get(), nFileIndex, pszFilename, szSaveFilename ) ) return false;
+            pImage.release();
+            return true;
         }
-        strcat( szSaveFilename, GetFileNameNoPath(pszFilename) );
-        strcpy( (char*)GetFileExtension(szSaveFilename), pszPreferredExtension );
 
+        //generate the VQ image etc.
+        DisplayMessage( "VQ compressing..." );
 
-        //VQ compress the image if the user asked for it and we can
-        if( g_bVQCompress && Image.CanVQ()  )
-        {
-            //generate the VQ image etc.
-            printf( "VQ compressing..." );
+        //start from the codebook in the last output for the file, if there is one
+        VQCodebook WarmStart;
+        bool bWarmStart = g_bVQWarmStart && CVQCompressor::LoadCodebook( szSaveFilename, WarmStart );
+        if( bWarmStart ) DisplayMessage( "from old codebook..." );
 
-            CVQImage* pVQImage = g_VQCompressor.GenerateVQ( &Image );
+        VQ_STATS Stats;
+        CVQImage* pVQImage = pVQCompressor->GenerateVQ( &Image, g_bVQStats ? &Stats : NULL, bWarmStart ? &WarmStart : NULL );
+        if( pVQImage == NULL ) return false;
 
-            if( pVQImage != NULL )
-            {
-                //export it
-                pVQImage->ExportFile( szSaveFilename );
-                delete pVQImage;
-                g_nSucceeded++;
-            }
-            else
-                g_nFailed++;
-        }
-        else
+        //export it
+        pVQImage->SetGlobalIndex( Options.bGlobalIndex, Options.nGlobalIndex );
+        pVQImage->ExportFile( szSaveFilename );
+        delete pVQImage;
+
+        //save the stats alongside it
+        if( g_bVQStats )
         {
-            //display a message indicating that VQ compression won't be done on this image
-            if( g_bVQCompress ) printf( "Can't VQ...doing non-VQ..." );
+            char szStatsFilename[MAX_PATH];
+            strcpy( szStatsFilename, szSaveFilename );
+            strcpy( (char*)GetFileExtension(szStatsFilename), "json" );
+            if( !CVQCompressor::SaveStats( szStatsFilename, pszFilename, Stats ) ) return false;
+        }
+        return true;
+    }
 
-            //generate mipmaps if the image doesn't have any
-            if( Image.GetNumMipMaps() <= 1 && g_SaveOptions.bMipmaps )
-            {
-                printf( "Building mipmaps..." );
-                Image.GenerateMipMaps();
-                printf( "done. " );
-            }
+    //display a message indicating that VQ compression won't be done on this image
+    if( g_bVQCompress ) DisplayMessage( "Can't VQ...doing non-VQ..." );
 
-            //export it
-            printf( "Saving: %s ...", szSaveFilename );
-            if( Image.Save( szSaveFilename, &g_SaveOptions ) )
-            {
-                g_nSucceeded++;
-                printf( "done.\n" );
-            }
-            else
-            {
-                printf( "failed.\n" );
-                g_nFailed++;
-            }
-        }
+    //generate mipmaps if the image doesn't have any
+    if( Image.GetNumMipMaps() <= 1 && Options.bMipmaps )
+    {
+        DisplayMessage( "Building mipmaps..." );
+        Image.GenerateMipMaps();
+        DisplayMessage( "done. " );
+    }
+
+    //export it
+    DisplayMessage( "Saving: %s ...", szSaveFilename );
+    if( !Image.Save( szSaveFilename, &Options ) )
+    {
+        DisplayMessage( "failed.\n" );
+        return false;
     }
-    else
-        g_nFailed++;
 
-    //increment global index
-    g_nGlobalIndex++;
+    DisplayMessage( "done.\n" );
     return true;
 }
 
@@ -352,7 +485,8 @@ bool ProcessFile( const char* pszFilename )
 //////////////////////////////////////////////////////////////////////
 int main( int argc, char* argv[] )
 {
-    clock_t start = clock();
+    timespec start;
+    timespec_get( &start, TIME_UTC );
 
     /* track memory leaks on exit */
 #ifdef _DEBUG
@@ -360,6 +494,7 @@ int main( int argc, char* argv[] )
 #endif
 
     /* set defaults */
+    CVQCompressor VQCompressor;
     g_SaveOptions.bMipmaps = false;
     g_SaveOptions.bTwiddled = false;
     g_SaveOptions.bPad = false;
@@ -376,7 +511,7 @@ int main( int argc, char* argv[] )
     g_pszOutputExtension = "PVR";
     g_pszOutputPath = "";
 
-    int nVQDither = 0, nVQWeighting = 0;
+    int nVQDither = 0, nVQWeighting = 0, nVQSearch = 0;
 
     //add all command line switches to the command line processor
     CommandLine.RegisterCommandLineOption( "HELP",           "?",  0, "displays help",                                           CLF_NONE,    &bShowHelp );
@@ -384,6 +519,7 @@ int main( int argc, char* argv[] )
     CommandLine.RegisterCommandLineOption( "SHOWPARAMS",     "SP", 0, "displays an overview of the parameters selected",         CLF_NONE,    &bShowParameters );
     CommandLine.RegisterCommandLineOption( "QUIET",          "Q",  0, "does not display output (except errors)",                 CLF_NONE,    &bQuiet );
     CommandLine.RegisterCommandLineOption( "TIMETASK",       "TT", 0, "display the time taken to complete the task",             CLF_NONE,    &bTimeTask );
+    CommandLine.RegisterCommandLineOption( "JOBS",           "J",  1, "[n] number of files to process at once (0 = one per CPU)", CLF_SHOWDEF, &g_nJobs );
     CommandLine.AddGap();
 
     CommandLine.RegisterCommandLineOption( "OUTPATH",        "OP", 1, "[path] output path",                                      CLF_NONE,    &g_pszOutputPath );
@@ -394,7 +530,7 @@ int main( int argc, char* argv[] )
     CommandLine.RegisterCommandLineOption( "MIPMAP",         "MM", 0, "generate/save mipmaps",                                   CLF_NONE,    &g_SaveOptions.bMipmaps );
     CommandLine.RegisterCommandLineOption( "COLOURFORMAT",   "CF", 1, "[format] SMART 4444 1555 565 555 SMARTYUV YUV422 8888",   CLF_SHOWDEF, &pszColourFormat );
     CommandLine.RegisterCommandLineOption( "PALETTEDEPTH",   "PD", 1, "[n] 0 = no palette (default), 4 = 4bpp, 8 = 8bpp",        CLF_NONE,    &g_SaveOptions.nPaletteDepth );
-    CommandLine.RegisterCommandLineOption( "GBIX",           "GI", 1, "[n] initial global index. Incremented for each file",     CLF_NONE,    &g_nGlobalIndex, &g_bEnableGlobalIndex );
+    CommandLine.RegisterCommandLineOption( "GBIX",           "GI", 1, "[n] initial global index. Incremented for each file",     CLF_NONE,    &g_nFirstGlobalIndex, &g_bEnableGlobalIndex );
     CommandLine.AddGap();
 
     CommandLine.RegisterCommandLineOption( "ALPHAPREFIX",    "AP", 1, "[prefix] load alpha from file with this prefix",          CLF_NONE,    &g_pszAlphaPrefix );
@@ -413,9 +549,20 @@ int main( int argc, char* argv[] )
     CommandLine.AddGap();
 
     CommandLine.RegisterCommandLineOption( "VQCOMPRESS",     "VQ", 0, "enables VQ compression",                                  CLF_NONE,    &g_bVQCompress );
-    CommandLine.RegisterCommandLineOption( "VQDITHER",       "VD", 1, "VQ dither option: 0 = none, 1 = half, 2 = full",          CLF_SHOWDEF, &nVQDither, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQDITHER",       "VD", 1, "VQ dither: 0 = none, 1 = half, 2 = full, 3 = ordered",    CLF_SHOWDEF, &nVQDither, &g_bVQCompress );
     CommandLine.RegisterCommandLineOption( "VQWEIGHTING",    "VW", 1, "VQ weighting option: 0 = none, 1 = eye-weighted",         CLF_SHOWDEF, &nVQWeighting, &g_bVQCompress );
-    CommandLine.RegisterCommandLineOption( "VQHFREQTOL",     "VT", 0, "compressor tolerates more inacuracy in high freq. changes",CLF_NONE,    &g_VQCompressor.m_bTolerateHigherFrequency, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQHFREQTOL",     "VT", 0, "compressor tolerates more inacuracy in high freq. changes",CLF_NONE,    &VQCompressor.m_bTolerateHigherFrequency, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQTHREADS",      "VJ", 1, "[n] threads used by VQ compression (0 = one per CPU)",   CLF_SHOWDEF, &VQCompressor.m_nThreads, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQSUBSAMPLE",    "VS", 1, "[n] VQ trains on 1 in n vectors (quicker, 1 = all)",     CLF_SHOWDEF, &VQCompressor.m_nSubsample, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQCOARSE",       "VL", 1, "[w] VQ builds codes from MIP levels up to w wide (quicker, 0 = all)",CLF_SHOWDEF, &VQCompressor.m_nCoarseWidth, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQPASSES",       "VP", 1, "[n] extra VQ refinement passes (0 - 15)",                 CLF_SHOWDEF, &VQCompressor.m_nExtraPasses, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQCONVERGE",     "VC", 1, "[f] stop VQ passes when the error improves by less than f",CLF_SHOWDEF, &VQCompressor.m_fMinImprovement, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQSEARCH",       "VN", 1, "VQ code search: 0 = neighbours, 1 = k-d tree, 2 = all",   CLF_SHOWDEF, &nVQSearch, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQBUDGET",       "VB", 1, "[s] stop VQ passes after s seconds per texture (0 = none)",CLF_SHOWDEF, &VQCompressor.m_fTimeBudget, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQSMALL",        "VM", 1, "[f] use a smaller VQ codebook with error at most f (0 = off)",CLF_SHOWDEF, &VQCompressor.m_fSmallVQError, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQSET",          "VG", 1, "[file] one VQ codebook for all the files, also saved to file",CLF_NONE,  &g_pszVQSetCodebook, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQREUSE",        "VR", 0, "starts VQ from the codebook in the old output file, if any",CLF_NONE,    &g_bVQWarmStart, &g_bVQCompress );
+    CommandLine.RegisterCommandLineOption( "VQSTATS",        "VX", 0, "writes VQ statistics for each texture to a .json file",  CLF_NONE,    &g_bVQStats, &g_bVQCompress );
 
 
     /* parse the command line */
@@ -484,33 +631,41 @@ int main( int argc, char* argv[] )
         if( bReverseAlpha ) g_nOpaqueAlpha = 0x00;
 
         //set other parameters
-        if( stricmp( pszColourFormat, "SMART" ) == 0 )      { g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_SMART;  } else
-        if( stricmp( pszColourFormat, "4444" ) == 0 )       { g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_4444;   } else
-        if( stricmp( pszColourFormat, "1555" ) == 0 )       { g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_1555;   } else
-        if( stricmp( pszColourFormat, "565" ) == 0 )        { g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_565;    } else
-        if( stricmp( pszColourFormat, "555" ) == 0 )        { g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_555;    } else
-        if( stricmp( pszColourFormat, "SMARTYUV" ) == 0 )   { g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_SMARTYUV;  } else
-        if( stricmp( pszColourFormat, "YUV422" ) == 0 )     { g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_YUV422; } else
+        if( stricmp( pszColourFormat, "SMART" ) == 0 )      { g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_SMART;  } else
+        if( stricmp( pszColourFormat, "4444" ) == 0 )       { g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_4444;   } else
+        if( stricmp( pszColourFormat, "1555" ) == 0 )       { g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_1555;   } else
+        if( stricmp( pszColourFormat, "565" ) == 0 )        { g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_565;    } else
+        if( stricmp( pszColourFormat, "555" ) == 0 )        { g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_555;    } else
+        if( stricmp( pszColourFormat, "SMARTYUV" ) == 0 )   { g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_SMARTYUV;  } else
+        if( stricmp( pszColourFormat, "YUV422" ) == 0 )     { g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_YUV422; } else
         if( stricmp( pszColourFormat, "8888" ) == 0 )
         {
             if( g_SaveOptions.nPaletteDepth == 0 ) { DisplayStatusMessage( "8888 specified with no palette depth - assuming a depth of 8bpp" ); g_SaveOptions.nPaletteDepth = 8; }
-            g_SaveOptions.ColourFormat = g_VQCompressor.m_icf = ICF_8888;
+            g_SaveOptions.ColourFormat = VQCompressor.m_icf = ICF_8888;
         }
         else
         { ShowErrorMessage( "%s - unknown colour format", pszColourFormat ); return -1; }
         switch( nVQDither )
         {
-            case 0: g_VQCompressor.m_Dither = VQNoDither; break;
-            case 1: g_VQCompressor.m_Dither = VQSubtleDither; break;
-            case 2: g_VQCompressor.m_Dither = VQFullDither; break;
+            case 0: VQCompressor.m_Dither = VQNoDither; break;
+            case 1: VQCompressor.m_Dither = VQSubtleDither; break;
+            case 2: VQCompressor.m_Dither = VQFullDither; break;
+            case 3: VQCompressor.m_Dither = VQOrderedDither; break;
             default: ShowErrorMessage( "%d - unknown dither option", nVQDither ); return -1;
         }
         switch( nVQWeighting )
         {
-            case 0: g_VQCompressor.m_Metric = VQMetricEqual; break;
-            case 1: g_VQCompressor.m_Metric = VQMetricWeighted; break;
+            case 0: VQCompressor.m_Metric = VQMetricEqual; break;
+            case 1: VQCompressor.m_Metric = VQMetricWeighted; break;
             default: ShowErrorMessage( "%d - unknown weighting option", nVQWeighting ); return -1;
         }
+        switch( nVQSearch )
+        {
+            case 0: VQCompressor.m_Search = VQSearchNeighbours; break;
+            case 1: VQCompressor.m_Search = VQSearchKdTree; break;
+            case 2: VQCompressor.m_Search = VQSearchExhaustive; break;
+            default: ShowErrorMessage( "%d - unknown VQ search option", nVQSearch ); return -1;
+        }
         if( g_SaveOptions.nPaletteDepth )
         {
             if( g_SaveOptions.nPaletteDepth != 4 && g_SaveOptions.nPaletteDepth != 8 )
@@ -528,31 +683,73 @@ int main( int argc, char* argv[] )
             return -1;
 
         }
-        g_VQCompressor.m_bMipmap = g_SaveOptions.bMipmaps;
+        VQCompressor.m_bMipmap = g_SaveOptions.bMipmaps;
+        VQCompressor.m_bAnySmallVQSize = ( stricmp( g_pszOutputExtension, "VQF" ) == 0 );
 
         /* display the parameters before we start processing files */
-        if( bShowParameters ) DisplayParameters();
+        if( bShowParameters ) DisplayParameters( VQCompressor );
 
         /* build the twiddle table */
         BuildTwiddleTable();
 
         /* process all pictures */
-        if( CommandLine.ProcessAllFiles( ProcessFile ) == false )
+        if( g_nJobs < 0 )
+        {
+            ShowErrorMessage( "%d - invalid number of jobs", g_nJobs );
+            return -1;
+        }
+        if( VQCompressor.m_nThreads < 0 )
+        {
+            ShowErrorMessage( "%d - invalid number of VQ threads", VQCompressor.m_nThreads );
+            return -1;
+        }
+        if( VQCompressor.m_nSubsample < 1 )
+        {
+            ShowErrorMessage( "%d - invalid VQ subsampling", VQCompressor.m_nSubsample );
+            return -1;
+        }
+        if( VQCompressor.m_nCoarseWidth < 0 )
+        {
+            ShowErrorMessage( "%d - invalid VQ training width", VQCompressor.m_nCoarseWidth );
+            return -1;
+        }
+        if( VQCompressor.m_nExtraPasses < 0 || VQCompressor.m_nExtraPasses > 15 )
+        {
+            ShowErrorMessage( "%d - invalid number of VQ passes", VQCompressor.m_nExtraPasses );
+            return -1;
+        }
+        if( VQCompressor.m_fMinImprovement < 0.0f || VQCompressor.m_fTimeBudget < 0.0f )
+        {
+            ShowErrorMessage( "invalid VQ pass limits" );
+            return -1;
+        }
+        if( CommandLine.ProcessAllFiles( ProcessFile, &VQCompressor, g_nJobs ) == false )
         {
             ShowErrorMessage( CommandLine.m_szErrorMessage );
             return -1;
         }
 
+        //the files in a VQ set only count as done once the set has been compressed
+        int nSetFailed = ProcessVQSet( VQCompressor );
+        CommandLine.m_nFilesSucceeded -= nSetFailed;
+        CommandLine.m_nFilesFailed += nSetFailed;
+
 
         /* display the length the task took to complete, if requested */
         if( bQuiet )
         {
-            if( g_nFailed ) ShowErrorMessage( "\n%d files failed", g_nFailed );
+            if( CommandLine.m_nFilesFailed ) ShowErrorMessage( "\n%d files failed", CommandLine.m_nFilesFailed );
         }
         else
         {
-            DisplayStatusMessage( "\nAll done: %d files failed. %d files created OK. ", g_nFailed, g_nSucceeded );
-            if( bTimeTask ) DisplayStatusMessage( "Total time: %.2f seconds", (double)(clock() - start) / CLOCKS_PER_SEC );
+            DisplayStatusMessage( "\nAll done: %d files failed. %d files created OK. ", CommandLine.m_nFilesFailed, CommandLine.m_nFilesSucceeded );
+            if( bTimeTask )
+            {
+                //wall clock time, as the files may have been processed on several threads
+                timespec end;
+                timespec_get( &end, TIME_UTC );
+                DisplayStatusMessage( "Total time: %.2f seconds", (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9 );
+            }
         }
     }
 
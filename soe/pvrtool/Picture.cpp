@@ -19,6 +19,10 @@
 #include "VQF.h"
 #include "C.h"
 #include "PIC.h"
+
+extern "C" {
+#include "vqdll.h"
+}
 //#include "paintlib/paintlib.h"
 #include "stb_image.h"
 
@@ -697,11 +701,84 @@ void MMRGBA::ConvertTo32Bit()
 }
 
 //////////////////////////////////////////////////////////////////////
-// Converts the MMRGBA object to the requested palette depth
+// Converts the MMRGBA object to the requested palette depth. The
+// palette is built by the VQ library; icfPalette is the format it will
+// be saved in, so the entries are chosen at that precision
 //////////////////////////////////////////////////////////////////////
-void MMRGBA::ConvertToPalettised(int nNewDepth)
+void MMRGBA::ConvertToPalettised( int nNewDepth, ImageColourFormat icfPalette )
 {
     if( bPalette && nNewDepth == nPaletteDepth ) return;
 
-    ShowErrorMessage( "This is not implemented yet: FIXME!" );
+    if( nNewDepth != 4 && nNewDepth != 8 )
+    {
+        ShowErrorMessage( "%d - unknown palette depth", nNewDepth );
+        return;
+    }
+
+    //requantise palettised images from their colours
+    if( bPalette ) ConvertTo32Bit();
+    if( pRGB == NULL ) return;
+
+    DisplayStatusMessage( "Converting image to %dbpp palettised...", nNewDepth );
+
+    //back up the current image into a temporary object
+    MMRGBA other;
+    other.ReplaceWith( this );
+    strcpy( szDescription, other.szDescription );
+
+    //get image options
+    bool bMipMaps = ( other.nMipMaps > 1);
+    bool bAlpha = (other.pAlpha != NULL);
+    if( bAlpha && other.nAlphaMipMaps < other.nMipMaps ) other.GenerateAlphaMipMaps();
+
+    //initialise the new image
+    Init( MMINIT_PALETTE|MMINIT_ALLOCATE|(bMipMaps?MMINIT_MIPMAP:0), other.nWidth, other.nHeight );
+    nPaletteDepth = nNewDepth;
+    icfOrig = (nNewDepth == 4) ? ICF_PALETTE4 : ICF_PALETTE8;
+
+    //levels the source doesn't have are resampled from the indices below
+    int nLevels = (other.nMipMaps < nMipMaps) ? other.nMipMaps : nMipMaps;
+    if( bAlpha && other.nAlphaMipMaps < nLevels ) nLevels = other.nAlphaMipMaps;
+
+    int nFormat;
+    switch( icfPalette )
+    {
+        case ICF_4444:  nFormat = FORMAT_4444; break;
+        case ICF_555:
+        case ICF_1555:  nFormat = FORMAT_1555; break;
+        case ICF_565:   nFormat = FORMAT_565; break;
+        default:        nFormat = -1; break;
+    }
+
+    const void* LevelsRGB[11];
+    const void* LevelsAlpha[11];
+    unsigned char* LevelsIndices[11];
+    if( nLevels > 11 ) nLevels = 11;
+    for( int i = 0; i < nLevels; i++ )
+    {
+        LevelsRGB[i] = other.pRGB[i];
+        LevelsAlpha[i] = bAlpha ? other.pAlpha[i] : NULL;
+        LevelsIndices[i] = pPaletteIndices[i];
+    }
+
+    unsigned char PaletteRGBA[256][4];
+    int nResult = VqCalcPalette( LevelsRGB, bAlpha ? LevelsAlpha : NULL, nLevels, 1 /*BGR*/, nWidth, nHeight, bAlpha,
+                                 1 << nNewDepth, nFormat, VQMetricWeighted, &PaletteRGBA[0][0], LevelsIndices );
+    if( nResult < 0 )
+    {
+        ShowErrorMessage( "Palettisation failed (error %d)", nResult );
+        ReplaceWith( &other );
+        return;
+    }
+
+    for( int i = 0; i < (1 << nNewDepth); i++ )
+    {
+        Palette[i].r = PaletteRGBA[i][0];
+        Palette[i].g = PaletteRGBA[i][1];
+        Palette[i].b = PaletteRGBA[i][2];
+        Palette[i].a = PaletteRGBA[i][3];
+    }
+
+    for( int i = nLevels; i < nMipMaps; i++ )
+        ResamplePalette( pPaletteIndices[i], pPaletteIndices[i-1], nWidth >> (i-1), nHeight >> (i-1), Palette );
 }
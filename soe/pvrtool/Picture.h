@@ -10,11 +10,15 @@
 //save options
 struct SaveOptions
 {
+    SaveOptions() { ColourFormat = ICF_SMART; bTwiddled = bMipmaps = bPad = false; nPaletteDepth = 0; bGlobalIndex = false; nGlobalIndex = 0; }
+
     ImageColourFormat ColourFormat;
     bool bTwiddled;
     bool bMipmaps;
     bool bPad;
     int nPaletteDepth;
+    bool bGlobalIndex;                  //write a GBIX header...
+    unsigned long int nGlobalIndex;     //...with this index
 };
 
 struct MMRGBAPAL {
@@ -56,7 +60,7 @@ public:
     void GenerateMipMaps();
     void GenerateAlphaMipMaps();
 
-	void ConvertToPalettised( int nNewDepth );
+    void ConvertToPalettised( int nNewDepth, ImageColourFormat icfPalette = ICF_8888 );
     void ConvertTo32Bit();
 
     int nWidth, nHeight;
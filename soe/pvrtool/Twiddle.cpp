@@ -7,11 +7,30 @@
   
     Don't forget to call BuildTwiddleTable!
 
+   Twiddle and Untwiddle convert whole images
+   a 4x4 tile at a time - each tile is 16
+   consecutive texels in the twiddled data, so
+   the address only needs working out once per
+   tile rather than once per texel
+
 **************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 #include "minmax.h"
 
+/*
+// check Twiddle & Untwiddle against CalcUntwiddledPos for all the
+// texel sizes, and time them (the results go to stdout)
+*/
+#define TEST_TWIDDLE (0)
+
+#if TEST_TWIDDLE
+    #include <stdio.h>
+    #include <time.h>
+    static void TestTwiddle();
+#endif
+
 #define TWIDDLE_TABLE_SIZE 1024
 unsigned long int g_nTwiddleTable[TWIDDLE_TABLE_SIZE];
 
@@ -43,6 +62,10 @@ inline unsigned long int GetTwiddleValue( unsigned long int i )
 void BuildTwiddleTable()
 {
     for( unsigned long int i = 0; i < TWIDDLE_TABLE_SIZE; i++ ) g_nTwiddleTable[i] = GetTwiddleValue( i );
+
+#if TEST_TWIDDLE
+    TestTwiddle();
+#endif
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -71,3 +94,248 @@ unsigned long int CalcUntwiddledPos( unsigned long int x, unsigned long int y, u
     else
         return g_nTwiddleTable[ y & mask ]  |  g_nTwiddleTable[ x & mask ] << 1  |  (( (y|x) & ~mask ) << shift );
 }
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Inline version of CalcUntwiddledPos for the bulk routines
+//////////////////////////////////////////////////////////////////////
+static inline unsigned long int TwiddledOffset( unsigned long int x, unsigned long int y, unsigned long int mask, unsigned long int shift )
+{
+    if( mask >= TWIDDLE_TABLE_SIZE )
+        return GetTwiddleValue( y & mask )  |  GetTwiddleValue( x & mask ) << 1  |  (( (y|x) & ~mask ) << shift );
+    else
+        return g_nTwiddleTable[ y & mask ]  |  g_nTwiddleTable[ x & mask ] << 1  |  (( (y|x) & ~mask ) << shift );
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Position of each texel of a 4x4 tile within its 16 twiddled texels,
+// indexed by [y][x]
+//////////////////////////////////////////////////////////////////////
+static const unsigned char s_TileOrder[4][4] =
+{
+    { 0, 2,  8, 10 },
+    { 1, 3,  9, 11 },
+    { 4, 6, 12, 14 },
+    { 5, 7, 13, 15 },
+};
+
+
+//////////////////////////////////////////////////////////////////////
+// 8 and 16 bit conversions, in whichever direction bTwiddle says (the
+// source is only read). Images smaller than a tile in either direction
+// are done a texel at a time
+//////////////////////////////////////////////////////////////////////
+template<typename T> static void TwiddleTexels( T* pLinear, T* pTwiddled, unsigned long int w, unsigned long int h, bool bTwiddle )
+{
+    unsigned long int mask, shift;
+    ComputeMaskShift( w, h, mask, shift );
+
+    if( w < 4 || h < 4 )
+    {
+        for( unsigned long int y = 0; y < h; y++ )
+            for( unsigned long int x = 0; x < w; x++ )
+            {
+                if( bTwiddle )
+                    pTwiddled[ TwiddledOffset( x, y, mask, shift ) ] = pLinear[ x + (y * w) ];
+                else
+                    pLinear[ x + (y * w) ] = pTwiddled[ TwiddledOffset( x, y, mask, shift ) ];
+            }
+        return;
+    }
+
+    for( unsigned long int y = 0; y < h; y += 4 )
+        for( unsigned long int x = 0; x < w; x += 4 )
+        {
+            T* pTile = pTwiddled + TwiddledOffset( x, y, mask, shift );
+            T* pRow = pLinear + x + (y * w);
+
+            for( int iRow = 0; iRow < 4; iRow++, pRow += w )
+            {
+                const unsigned char* pOrder = s_TileOrder[iRow];
+                if( bTwiddle )
+                {
+                    pTile[ pOrder[0] ] = pRow[0]; pTile[ pOrder[1] ] = pRow[1];
+                    pTile[ pOrder[2] ] = pRow[2]; pTile[ pOrder[3] ] = pRow[3];
+                }
+                else
+                {
+                    pRow[0] = pTile[ pOrder[0] ]; pRow[1] = pTile[ pOrder[1] ];
+                    pRow[2] = pTile[ pOrder[2] ]; pRow[3] = pTile[ pOrder[3] ];
+                }
+            }
+        }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// 4 bit conversions. A tile is 8 bytes of twiddled data, and each of
+// its rows is 2 bytes of linear data
+//////////////////////////////////////////////////////////////////////
+#define GetNibble( p, i )    ( ( (p)[(i) >> 1] >> ( ((i) & 1) << 2 ) ) & 0x0F )
+#define SetNibble( p, i, v ) ( (p)[(i) >> 1] = (unsigned char)( ( (p)[(i) >> 1] & ( 0xF0 >> ( ((i) & 1) << 2 ) ) ) | ( (v) << ( ((i) & 1) << 2 ) ) ) )
+
+static void TwiddleNibbles( unsigned char* pLinear, unsigned char* pTwiddled, unsigned long int w, unsigned long int h, bool bTwiddle )
+{
+    unsigned long int mask, shift;
+    ComputeMaskShift( w, h, mask, shift );
+
+    if( w < 4 || h < 4 )
+    {
+        for( unsigned long int y = 0; y < h; y++ )
+            for( unsigned long int x = 0; x < w; x++ )
+            {
+                unsigned long int iLinear = x + (y * w), iTwiddled = TwiddledOffset( x, y, mask, shift );
+                if( bTwiddle )
+                    SetNibble( pTwiddled, iTwiddled, GetNibble( pLinear, iLinear ) );
+                else
+                    SetNibble( pLinear, iLinear, GetNibble( pTwiddled, iTwiddled ) );
+            }
+        return;
+    }
+
+    for( unsigned long int y = 0; y < h; y += 4 )
+        for( unsigned long int x = 0; x < w; x += 4 )
+        {
+            unsigned char* pTile = pTwiddled + ( TwiddledOffset( x, y, mask, shift ) >> 1 );
+            unsigned char* pRow = pLinear + ( ( x + (y * w) ) >> 1 );
+
+            unsigned char Nibbles[16];
+            if( bTwiddle )
+            {
+                for( int iRow = 0; iRow < 4; iRow++, pRow += w >> 1 )
+                {
+                    const unsigned char* pOrder = s_TileOrder[iRow];
+                    Nibbles[ pOrder[0] ] = pRow[0] & 0x0F; Nibbles[ pOrder[1] ] = pRow[0] >> 4;
+                    Nibbles[ pOrder[2] ] = pRow[1] & 0x0F; Nibbles[ pOrder[3] ] = pRow[1] >> 4;
+                }
+                for( int i = 0; i < 8; i++ ) pTile[i] = (unsigned char)( Nibbles[ i * 2 ] | ( Nibbles[ (i * 2) + 1 ] << 4 ) );
+            }
+            else
+            {
+                for( int i = 0; i < 8; i++ ) { Nibbles[ i * 2 ] = pTile[i] & 0x0F; Nibbles[ (i * 2) + 1 ] = pTile[i] >> 4; }
+                for( int iRow = 0; iRow < 4; iRow++, pRow += w >> 1 )
+                {
+                    const unsigned char* pOrder = s_TileOrder[iRow];
+                    pRow[0] = (unsigned char)( Nibbles[ pOrder[0] ] | ( Nibbles[ pOrder[1] ] << 4 ) );
+                    pRow[1] = (unsigned char)( Nibbles[ pOrder[2] ] | ( Nibbles[ pOrder[3] ] << 4 ) );
+                }
+            }
+        }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Twiddles a whole image
+//////////////////////////////////////////////////////////////////////
+void Twiddle( const void* pLinear, void* pTwiddled, unsigned long int w, unsigned long int h, int nBitsPerTexel )
+{
+    switch( nBitsPerTexel )
+    {
+        case 4:  TwiddleNibbles( (unsigned char*)pLinear, (unsigned char*)pTwiddled, w, h, true ); break;
+        case 8:  TwiddleTexels( (unsigned char*)pLinear, (unsigned char*)pTwiddled, w, h, true ); break;
+        case 16: TwiddleTexels( (unsigned short int*)pLinear, (unsigned short int*)pTwiddled, w, h, true ); break;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Untwiddles a whole image
+//////////////////////////////////////////////////////////////////////
+void Untwiddle( const void* pTwiddled, void* pLinear, unsigned long int w, unsigned long int h, int nBitsPerTexel )
+{
+    switch( nBitsPerTexel )
+    {
+        case 4:  TwiddleNibbles( (unsigned char*)pLinear, (unsigned char*)pTwiddled, w, h, false ); break;
+        case 8:  TwiddleTexels( (unsigned char*)pLinear, (unsigned char*)pTwiddled, w, h, false ); break;
+        case 16: TwiddleTexels( (unsigned short int*)pLinear, (unsigned short int*)pTwiddled, w, h, false ); break;
+    }
+}
+
+
+
+#if TEST_TWIDDLE
+//////////////////////////////////////////////////////////////////////
+// Per texel reference versions, as SavePVR & LoadPVR used to do it
+//////////////////////////////////////////////////////////////////////
+static void ReferenceTwiddle( const unsigned char* pSrc, unsigned char* pDst, unsigned long int w, unsigned long int h, int nBitsPerTexel, bool bTwiddle )
+{
+    unsigned long int mask, shift;
+    ComputeMaskShift( w, h, mask, shift );
+    for( unsigned long int y = 0; y < h; y++ )
+        for( unsigned long int x = 0; x < w; x++ )
+        {
+            unsigned long int iLinear = x + (y * w), iTwiddled = CalcUntwiddledPos( x, y, mask, shift );
+            unsigned long int iRead = bTwiddle ? iLinear : iTwiddled, iWrite = bTwiddle ? iTwiddled : iLinear;
+            switch( nBitsPerTexel )
+            {
+                case 4:  SetNibble( pDst, iWrite, GetNibble( pSrc, iRead ) ); break;
+                case 8:  pDst[iWrite] = pSrc[iRead]; break;
+                case 16: ((unsigned short int*)pDst)[iWrite] = ((const unsigned short int*)pSrc)[iRead]; break;
+            }
+        }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Checks the bulk routines against the per texel ones and times both
+//////////////////////////////////////////////////////////////////////
+static void TestTwiddle()
+{
+    static const unsigned long int Sizes[][2] = { {1,1}, {2,2}, {4,4}, {8,2}, {2,8}, {4,32}, {64,16}, {16,64}, {256,256}, {1024,1024}, {2048,512} };
+    static const int BitsPerTexel[] = { 4, 8, 16 };
+
+    size_t nMaxBytes = 2048 * 2048 * 2;
+    unsigned char* pLinear    = (unsigned char*)malloc( nMaxBytes );
+    unsigned char* pTwiddled  = (unsigned char*)malloc( nMaxBytes );
+    unsigned char* pReference = (unsigned char*)malloc( nMaxBytes );
+
+    int nFailures = 0;
+    for( int iBits = 0; iBits < 3; iBits++ )
+        for( size_t iSize = 0; iSize < sizeof(Sizes) / sizeof(Sizes[0]); iSize++ )
+        {
+            unsigned long int w = Sizes[iSize][0], h = Sizes[iSize][1];
+            size_t nBytes = ( ( w * h * BitsPerTexel[iBits] ) + 7 ) / 8;
+            for( size_t i = 0; i < nBytes; i++ ) pLinear[i] = (unsigned char)rand();
+            if( ( w * h * BitsPerTexel[iBits] ) & 7 ) pLinear[nBytes - 1] &= 0x0F; //odd number of 4 bit texels
+
+            memset( pTwiddled, 0, nBytes ); memset( pReference, 0, nBytes );
+            Twiddle( pLinear, pTwiddled, w, h, BitsPerTexel[iBits] );
+            ReferenceTwiddle( pLinear, pReference, w, h, BitsPerTexel[iBits], true );
+            if( memcmp( pTwiddled, pReference, nBytes ) != 0 ) { printf( "Twiddle %lux%lu %dbpp FAILED\n", w, h, BitsPerTexel[iBits] ); nFailures++; }
+
+            memset( pReference, 0, nBytes );
+            Untwiddle( pTwiddled, pReference, w, h, BitsPerTexel[iBits] );
+            if( memcmp( pLinear, pReference, nBytes ) != 0 ) { printf( "Untwiddle %lux%lu %dbpp FAILED\n", w, h, BitsPerTexel[iBits] ); nFailures++; }
+        }
+    printf( "Twiddle test: %d failures\n", nFailures );
+
+    //time a 1024x1024 image each way
+    const int nPasses = 20;
+    for( int iBits = 0; iBits < 3; iBits++ )
+    {
+        double fMB = ( 1024.0 * 1024.0 * BitsPerTexel[iBits] / 8.0 ) * nPasses / ( 1024.0 * 1024.0 );
+        clock_t Start;
+
+        Start = clock();
+        for( int i = 0; i < nPasses; i++ ) ReferenceTwiddle( pLinear, pTwiddled, 1024, 1024, BitsPerTexel[iBits], false );
+        double fReference = double( clock() - Start ) / CLOCKS_PER_SEC;
+
+        Start = clock();
+        for( int i = 0; i < nPasses; i++ ) Untwiddle( pTwiddled, pLinear, 1024, 1024, BitsPerTexel[iBits] );
+        double fUntwiddle = double( clock() - Start ) / CLOCKS_PER_SEC;
+
+        Start = clock();
+        for( int i = 0; i < nPasses; i++ ) Twiddle( pLinear, pTwiddled, 1024, 1024, BitsPerTexel[iBits] );
+        double fTwiddle = double( clock() - Start ) / CLOCKS_PER_SEC;
+
+        printf( "%2dbpp: per texel %.0f MB/s, Untwiddle %.0f MB/s, Twiddle %.0f MB/s\n", BitsPerTexel[iBits],
+                fMB / __max( fReference, 1e-6 ), fMB / __max( fUntwiddle, 1e-6 ), fMB / __max( fTwiddle, 1e-6 ) );
+    }
+
+    free( pLinear );
+    free( pTwiddled );
+    free( pReference );
+}
+#endif //TEST_TWIDDLE
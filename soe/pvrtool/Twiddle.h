@@ -6,6 +6,11 @@ extern void BuildTwiddleTable();
 extern void ComputeMaskShift( unsigned long int w, unsigned long int h, unsigned long int& mask, unsigned long int& shift);
 extern unsigned long int CalcUntwiddledPos( unsigned long int x, unsigned long int y, unsigned long int mask, unsigned long int shift );
 
+//whole image conversions between linear and twiddled data (w & h must be powers of 2).
+//nBitsPerTexel is 4, 8 or 16 - 4 bit texels are packed two to a byte, low nibble first
+extern void Twiddle( const void* pLinear, void* pTwiddled, unsigned long int w, unsigned long int h, int nBitsPerTexel );
+extern void Untwiddle( const void* pTwiddled, void* pLinear, unsigned long int w, unsigned long int h, int nBitsPerTexel );
+
 
 
 
@@ -20,6 +20,87 @@
 #endif
 
 
+//captured message list
+struct MessageCapture
+{
+    struct Message
+    {
+        FILE* stream;
+        char* pszText;
+        Message* next;
+    };
+
+    Message* pFirst;
+    Message* pLast;
+};
+
+//the capture for the current thread, or NULL if messages go straight out
+static thread_local MessageCapture* t_pCapture = NULL;
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Writes the message to the stream, or holds it back if this thread is capturing
+//////////////////////////////////////////////////////////////////////
+static void OutputMessage( FILE* stream, const char* pszText )
+{
+    if( t_pCapture == NULL )
+    {
+        fputs( pszText, stream );
+        return;
+    }
+
+    //add it to the end of the capture list
+    MessageCapture::Message* pNew = new MessageCapture::Message;
+    pNew->stream = stream;
+    pNew->pszText = new char[ strlen(pszText) + 1 ];
+    strcpy( pNew->pszText, pszText );
+    pNew->next = NULL;
+
+    if( t_pCapture->pLast ) t_pCapture->pLast->next = pNew; else t_pCapture->pFirst = pNew;
+    t_pCapture->pLast = pNew;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Message capture
+//////////////////////////////////////////////////////////////////////
+void BeginMessageCapture()
+{
+    if( t_pCapture ) return;
+
+    t_pCapture = new MessageCapture;
+    t_pCapture->pFirst = t_pCapture->pLast = NULL;
+}
+
+MessageCapture* EndMessageCapture()
+{
+    MessageCapture* pCapture = t_pCapture;
+    t_pCapture = NULL;
+    return pCapture;
+}
+
+void FlushMessageCapture( MessageCapture* pCapture )
+{
+    if( pCapture == NULL ) return;
+
+    //write out and delete all messages
+    while( pCapture->pFirst )
+    {
+        MessageCapture::Message* temp = pCapture->pFirst;
+        pCapture->pFirst = pCapture->pFirst->next;
+
+        fputs( temp->pszText, temp->stream );
+        delete[] temp->pszText;
+        delete temp;
+    }
+
+    fflush( stdout );
+    delete pCapture;
+}
+
+
 //////////////////////////////////////////////////////////////////////
 // Limit function
 //////////////////////////////////////////////////////////////////////
@@ -88,7 +169,8 @@ void ShowErrorMessage( const char* pszErrorMessageFormat, ... )
     if( hWndActive == NULL ) hWndActive = GetActiveWindow();
     SendDlgItemMessage( hWndActive, IDC_STATUSBAR, SB_SETTEXT, 0, (LPARAM)"" );
 #else
-    fprintf( stderr, "%s\n", szBuffer );
+    strcat( szBuffer, "\n" );
+    OutputMessage( stderr, szBuffer );
 #endif
 
 }
@@ -113,13 +195,30 @@ void DisplayStatusMessage( const char* pszMessageFormat, ... )
     Log( szBuffer );
 
 #else
-    printf( "%s\n", szBuffer );
+    strcat( szBuffer, "\n" );
+    OutputMessage( stdout, szBuffer );
 #endif
 
 }
 
 
 
+//////////////////////////////////////////////////////////////////////
+// Console output - as printf, but honours message capture
+//////////////////////////////////////////////////////////////////////
+void DisplayMessage( const char* pszMessageFormat, ... )
+{
+    char szBuffer[4096];
+    va_list params;
+    va_start( params, pszMessageFormat );
+    vsnprintf( szBuffer, sizeof(szBuffer), pszMessageFormat, params );
+    va_end( params );
+
+    OutputMessage( stdout, szBuffer );
+}
+
+
+
 //////////////////////////////////////////////////////////////////////
 // Error message display & return helper function - always returns false
 //////////////////////////////////////////////////////////////////////
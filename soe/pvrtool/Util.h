@@ -16,6 +16,7 @@
 extern void IndicateLongOperation( bool bTurnOn );
 extern void ShowErrorMessage( const char* pszErrorMessageFormat, ... );
 extern void DisplayStatusMessage( const char* pszMessageFormat, ... );
+extern void DisplayMessage( const char* pszMessageFormat, ... );
 extern void BackupFile( const char* pszFilename );
 extern bool ReturnError( const char* pszMessage, const char* pszFilename = NULL );
 extern const char* GetFileExtension( const char* pszFilename );
@@ -35,6 +36,14 @@ extern BOOL WritePrivateProfileInt( const char* pszAppName, const char* pszKeyNa
 extern BOOL WritePrivateProfileFloat( const char* pszAppName, const char* pszKeyName, float fValue, const char* pszINIFile );
 #endif
 
+//per-thread message capture. Messages displayed between Begin and End are held
+//back and written out in one go by FlushMessageCapture, so that the output of
+//files processed in parallel doesn't get interleaved
+struct MessageCapture;
+extern void BeginMessageCapture();
+extern MessageCapture* EndMessageCapture();
+extern void FlushMessageCapture( MessageCapture* pCapture );
+
 //cheezy macros 
 #define SWAP(x,y)   ((x)^=(y)^=(x)^=(y)) 
 
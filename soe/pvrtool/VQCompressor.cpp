@@ -10,11 +10,25 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <thread>
 #include "Util.h"
+#include "PVR.h"
+#include "VQF.h"
+#include "FileView.h"
 #include "VQCompressor.h"
 
 extern unsigned char g_nOpaqueAlpha;
 
+//each thread compresses with its own VQ context, so files processed in
+//parallel don't get in each other's way. The context keeps its memory from
+//one file to the next, and is freed when the thread finishes
+struct VQContextHolder
+{
+    VQ_CONTEXT* pContext = NULL;
+    ~VQContextHolder() { if( pContext ) VqDestroyContext( pContext ); }
+};
+static thread_local VQContextHolder s_VQContext;
+
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
@@ -26,6 +40,15 @@ CVQCompressor::CVQCompressor()
     m_nCodeBookSize = 256;
     m_Dither = VQSubtleDither;
     m_Metric = VQMetricRGB;
+    m_Search = VQSearchNeighbours;
+    m_nThreads = 1;
+    m_nSubsample = 1;
+    m_nCoarseWidth = 0;
+    m_nExtraPasses = 0;
+    m_fMinImprovement = 0.0f;
+    m_fTimeBudget = 0.0f;
+    m_fSmallVQError = 0.0f;
+    m_bAnySmallVQSize = false;
 }
 
 CVQCompressor::~CVQCompressor()
@@ -38,22 +61,38 @@ CVQCompressor::~CVQCompressor()
 //////////////////////////////////////////////////////////////////////
 // VQ Generation
 //////////////////////////////////////////////////////////////////////
-CVQImage* CVQCompressor::GenerateVQ( CImage* pImage )
+
+//an image's levels, as the VQ library wants them
+struct VQInput
 {
-    bool bTempAlpha = false;
+    const void* LevelsRGB[11];      //1024x1024 down to 1x1
+    const void* LevelsAlpha[11];
+    int nLevels;
+    VQ_MIPMAP_MODES mipmapMode;
+    int nColourFormat;
+    bool bAlpha;
+    bool bReverseAlpha;
+    unsigned char* pTempAlpha;      //made up if the image has no alpha of its own
 
+    VQInput() { pTempAlpha = NULL; }
+    ~VQInput() { if( pTempAlpha ) free( pTempAlpha ); }
+};
+
+//makes sure the image can be VQ compressed, and converts it to 32 bit
+static bool CheckVQImage( CImage* pImage )
+{
     //make sure we've got an image
     if( pImage == NULL )
     {
         ShowErrorMessage( "Error: No image" );
-        return NULL;
+        return false;
     }
 
     //make sure image is square
     if( pImage->GetWidth()  != pImage->GetHeight() )
     {
         ShowErrorMessage( "Error: Image must be square" );
-        return NULL;
+        return false;
     }
 
     //make sure image is a size we can work with
@@ -75,7 +114,7 @@ CVQImage* CVQCompressor::GenerateVQ( CImage* pImage )
 //
         default:
             ShowErrorMessage( "Error: Image dimension must be a power of 2 between 8 and 1024" );
-            return NULL;
+            return false;
     }
 
     //convert the image to 32 bit
@@ -84,33 +123,38 @@ CVQImage* CVQCompressor::GenerateVQ( CImage* pImage )
         pImage->GetMMRGBA()->ConvertTo32Bit();
     }
     else
-        if( pImage->GetRGB() == NULL ) { ShowErrorMessage( "Error: No image"); return NULL; }
+        if( pImage->GetRGB() == NULL ) { ShowErrorMessage( "Error: No image"); return false; }
+
+    return true;
+}
 
+//gets the image's levels and alpha ready for compressing in the given colour format
+static void GetVQInput( CImage* pImage, ImageColourFormat icf, bool bMipmap, VQInput& Input )
+{
     //get a VQ friendly version of the colour format
-    int nColourFormat;
-    ImageColourFormat icf = m_icf;
-    if( m_icf == ICF_SMART || m_icf == ICF_SMARTYUV ) icf = pImage->GetMMRGBA()->GetBestColourFormat( m_icf );
     bool bAlpha = false;
     switch( icf )
     {
         default:
-        case ICF_4444:  nColourFormat = FORMAT_4444; bAlpha = true; break;
-        case ICF_565:   nColourFormat = FORMAT_565;  bAlpha = false; break;
-        case ICF_555:   nColourFormat = FORMAT_555;  bAlpha = false; break;
-        case ICF_1555:  nColourFormat = FORMAT_1555; bAlpha = true; break;
-        case ICF_YUV422:nColourFormat = FORMAT_YUV;  bAlpha = false; break;
+        case ICF_4444:  Input.nColourFormat = FORMAT_4444; bAlpha = true; break;
+        case ICF_565:   Input.nColourFormat = FORMAT_565;  bAlpha = false; break;
+        case ICF_555:   Input.nColourFormat = FORMAT_555;  bAlpha = false; break;
+        case ICF_1555:  Input.nColourFormat = FORMAT_1555; bAlpha = true; break;
+        case ICF_YUV422:Input.nColourFormat = FORMAT_YUV;  bAlpha = false; break;
     }
 
 
     //make sure we've got a valid alpha channel if they want want
     unsigned char* pAlpha = pImage->GetAlpha();
-    bool bReverseAlpha = false;
-    if( ( bAlpha && pAlpha == NULL ) || ( !bAlpha && nColourFormat == FORMAT_4444 ) )
+    bool bTempAlpha = false;
+    Input.bReverseAlpha = false;
+    if( ( bAlpha && pAlpha == NULL ) || ( !bAlpha && Input.nColourFormat == FORMAT_4444 ) )
     {
         if( pAlpha == NULL )
         {
             pAlpha = (unsigned char*)malloc( pImage->GetWidth() * pImage->GetWidth() );
             memset( pAlpha, g_nOpaqueAlpha, pImage->GetWidth() * pImage->GetWidth() );
+            Input.pTempAlpha = pAlpha;
             bTempAlpha = true;
         }
 
@@ -118,65 +162,135 @@ CVQImage* CVQCompressor::GenerateVQ( CImage* pImage )
     }
     else
     {
-        if( g_nOpaqueAlpha == 0x00 ) bReverseAlpha = true;
+        if( g_nOpaqueAlpha == 0x00 ) Input.bReverseAlpha = true;
     }
-
-    //see if the supplied image has mipmaps if mipmaps are requested
-    unsigned char* pInputRGB = pImage->GetRGB();
-    unsigned char* pInputAlpha = pAlpha;
-    bool bTempRGB = false;
-    VQ_MIPMAP_MODES mipmapMode = VQ_NO_MIPMAP;
-    if( m_bMipmap )
+    Input.bAlpha = bAlpha;
+
+    //see if the supplied image has mipmaps if mipmaps are requested. The levels are
+    //passed to the VQ library as they are, so there's no need to pack them together
+    MMRGBA* pMMRGBA = pImage->GetMMRGBA();
+    Input.nLevels = 1;
+    Input.mipmapMode = VQ_NO_MIPMAP;
+    if( bMipmap )
     {
         if( pImage->GetNumMipMaps() > 1 )
         {
-            mipmapMode = VQ_SUPPLIED_MIPMAP;
-
-            bTempRGB = true;
-            int nTempBufferSize = 0, nTempWidth = pImage->GetWidth();
-            while( nTempWidth > 0 ) { nTempBufferSize += (nTempWidth*nTempWidth); nTempWidth >>= 1; }
-            nTempWidth = pImage->GetWidth();
-
-            if( bTempAlpha ) { free( pInputAlpha );  pInputAlpha = NULL; }
-
-
-            pInputRGB = (unsigned char*)malloc( nTempBufferSize * 3 );
-            
-            
-            int i; unsigned char* pTmp = pInputRGB;
-            for( i = 0; i < pImage->GetNumMipMaps(); i++ )
-            {
-                int nSize = (nTempWidth >> i) * (nTempWidth >> i) * 3;
-                memcpy( pTmp, pImage->GetMMRGBA()->pRGB[i], nSize );
-                pTmp += nSize;
-            }
-
-            if( pAlpha )
-            {
-                pInputAlpha = (unsigned char*)malloc( nTempBufferSize );
-                if( bTempAlpha )
-                    memset( pInputAlpha, g_nOpaqueAlpha, nTempBufferSize );
-                else
-                {
-                    for( i = 0; i < pImage->GetNumMipMaps(); i++ )
-                    {
-                        int nSize = (nTempWidth >> i) * (nTempWidth >> i);
-                        memcpy( pTmp, pImage->GetMMRGBA()->pAlpha[i], nSize );
-                        pTmp += nSize;
-                    }
-                }
-            }
+            Input.mipmapMode = VQ_SUPPLIED_MIPMAP;
+            Input.nLevels = pImage->GetNumMipMaps();
+
+            //any levels without alpha are generated from the last one that has it
+            if( bAlpha && !bTempAlpha && pMMRGBA->nAlphaMipMaps < Input.nLevels ) Input.nLevels = pMMRGBA->nAlphaMipMaps;
+            if( Input.nLevels > 11 ) Input.nLevels = 11;
+        }
+        else
+            Input.mipmapMode = VQ_GENERATE_MIPMAP;
+    }
+
+    for( int i = 0; i < Input.nLevels; i++ )
+    {
+        Input.LevelsRGB[i] = pMMRGBA->pRGB[i];
+        Input.LevelsAlpha[i] = !bAlpha ? NULL : ( bTempAlpha || i == 0 ) ? pAlpha : pMMRGBA->pAlpha[i];
+    }
+}
+
+//smaller codebooks to try for a texture of the given width. A VQF can have any
+//size, but a PVR's SMALLVQ codebook size depends on the width of the texture
+static int GetSmallVQSizes( const CVQCompressor& VQCompressor, int nWidth, int nSmallSizes[4] )
+{
+    int nNumSmallSizes = 0;
+    if( VQCompressor.m_fSmallVQError > 0.0f )
+    {
+        if( VQCompressor.m_bAnySmallVQSize )
+        {
+            for( int n = 16; n <= 128 && n < VQCompressor.m_nCodeBookSize; n *= 2 ) nSmallSizes[nNumSmallSizes++] = n;
         }
         else
-            mipmapMode = VQ_GENERATE_MIPMAP;
+        {
+            int n = GetSmallVQCodeBookSize( nWidth, VQCompressor.m_bMipmap );
+            if( n < VQCompressor.m_nCodeBookSize ) nSmallSizes[nNumSmallSizes++] = n;
+        }
+    }
+    return nNumSmallSizes;
+}
+
+//this thread's VQ context, set up with the compressor's options
+static VQ_CONTEXT* GetVQContext( const CVQCompressor& VQCompressor, const int nSmallSizes[], int nNumSmallSizes, const VQCodebook* pWarmStart = NULL )
+{
+    if( s_VQContext.pContext == NULL ) s_VQContext.pContext = VqCreateContext();
+    if( s_VQContext.pContext )
+    {
+        VqContextSetThreadCount( s_VQContext.pContext, VQCompressor.m_nThreads == 0 ? std::thread::hardware_concurrency() : VQCompressor.m_nThreads );
+        VqContextSetSubsample( s_VQContext.pContext, VQCompressor.m_nSubsample );
+        VqContextSetCoarseTraining( s_VQContext.pContext, VQCompressor.m_nCoarseWidth );
+        VqContextSetSearchIndex( s_VQContext.pContext, VQCompressor.m_Search );
+        VqContextSetRefinement( s_VQContext.pContext, VQCompressor.m_nExtraPasses, VQCompressor.m_fMinImprovement, VQCompressor.m_fTimeBudget );
+        VqContextSetSmallCodebooks( s_VQContext.pContext, nSmallSizes, nNumSmallSizes, VQCompressor.m_fSmallVQError );
+        VqContextSetWarmStart( s_VQContext.pContext, pWarmStart ? pWarmStart->Codes : NULL, pWarmStart ? pWarmStart->nNumCodes : 0 );
+    }
+    return s_VQContext.pContext;
+}
+
+//builds the message for a finished compression: the error, the codebook size if
+//a smaller one was good enough, and the error after each pass if there was more than one
+static void BuildVQMessage( char* pszMessage, float fErrorFound, int nCodeBookSize, int nRequestedSize )
+{
+    sprintf( pszMessage, "Done. %.03f average error", fErrorFound );
+    if( nCodeBookSize != nRequestedSize ) sprintf( pszMessage + strlen(pszMessage), ", %d codes", nCodeBookSize );
+
+    float fPassErrors[16];
+    int nPasses = VqContextGetPassErrors( s_VQContext.pContext, fPassErrors, 16 );
+    if( nPasses > 1 )
+    {
+        strcat( pszMessage, " (passes:" );
+        for( int i = 0; i < nPasses && i < 16; i++ ) sprintf( pszMessage + strlen(pszMessage), " %.03f", fPassErrors[i] );
+        strcat( pszMessage, ")" );
+    }
+}
+
+static void ShowVQError( int nError )
+{
+    switch( nError )
+    {
+        case VQ_OUTOFMEMORY:       ShowErrorMessage( "VQ Error: Out of memory" ); break;
+        case VQ_INVALID_SIZE:      ShowErrorMessage( "VQ Error: Invalid size" ); break;
+        case VQ_INVALID_PARAMETER: ShowErrorMessage( "VQ Error: Invalid parameter" ); break;
+        default: ShowErrorMessage( "VQ Error: %d", nError ); break;
+    }
+}
+
+CVQImage* CVQCompressor::GenerateVQ( CImage* pImage, VQ_STATS* pStats /*NULL*/, const VQCodebook* pWarmStart /*NULL*/ ) const
+{
+    if( !CheckVQImage( pImage ) ) return NULL;
+
+    ImageColourFormat icf = m_icf;
+    if( m_icf == ICF_SMART || m_icf == ICF_SMARTYUV ) icf = pImage->GetMMRGBA()->GetBestColourFormat( m_icf );
+
+    //a warm start's codes are in its own colour format, so it can only be used if that's the format
+    //this image would get anyway (e.g. not if it's gained alpha since), and a PVR can only have a
+    //codebook size the hardware will take for the texture
+    if( pWarmStart )
+    {
+        bool bFormatOK = ( icf == pWarmStart->icf );
+        bool bSizeOK = m_bAnySmallVQSize || pWarmStart->nNumCodes >= m_nCodeBookSize || pWarmStart->nNumCodes == GetSmallVQCodeBookSize( pImage->GetWidth(), m_bMipmap );
+        if( !bFormatOK || !bSizeOK )
+        {
+            DisplayStatusMessage( "Can't start from the old codebook...building a new one..." );
+            pWarmStart = NULL;
+        }
     }
 
+    VQInput Input;
+    GetVQInput( pImage, icf, m_bMipmap, Input );
+
     //calculate how much space is needed to store the image
     float fErrorFound = 0.0f;
     VQ_COLOUR_METRIC Metric = m_Metric;
     if( m_bTolerateHigherFrequency ) Metric = VQ_COLOUR_METRIC( int(Metric)|VQMETRIC_FREQUENCY_FLAG );
 
-    int nSize = VqCalc2( pInputRGB, pInputAlpha, NULL, true, pImage->GetWidth(), 0, mipmapMode, bAlpha, false, m_Dither, m_nCodeBookSize, nColourFormat, bReverseAlpha, Metric, 0, &fErrorFound );
+    int nSize = VqCalcSize( pImage->GetWidth(), Input.mipmapMode, false, m_nCodeBookSize );
+
+    int nSmallSizes[4];
+    int nNumSmallSizes = GetSmallVQSizes( *this, pImage->GetWidth(), nSmallSizes );
 
     //perform processing
     if( nSize > 0 )
@@ -185,30 +299,40 @@ CVQImage* CVQCompressor::GenerateVQ( CImage* pImage )
 
         //allocate a buffer to hold the result
         unsigned char* pVQ = (unsigned char*)malloc( nSize );
-        memset( pVQ, 0, nSize );
+        if( pVQ ) memset( pVQ, 0, nSize );
 
         //perform the calculations
-        int nResult = VqCalc2( pInputRGB, pInputAlpha, pVQ, true, pImage->GetWidth(), 0, mipmapMode, bAlpha, false, m_Dither, m_nCodeBookSize, nColourFormat, bReverseAlpha, Metric, 0, &fErrorFound );
+        VQ_CONTEXT* pContext = pVQ ? GetVQContext( *this, nSmallSizes, pWarmStart ? 0 : nNumSmallSizes, pWarmStart ) : NULL;
+        int nResult = VQ_OUTOFMEMORY;
+        if( pContext )
+        {
+            nResult = VqCalcLevelsContext( pContext, Input.LevelsRGB, Input.LevelsAlpha, Input.nLevels, pVQ, true, pImage->GetWidth(), Input.mipmapMode, Input.bAlpha, false, m_Dither, m_nCodeBookSize, Input.nColourFormat, Input.bReverseAlpha, Metric, &fErrorFound );
+        }
 
         //display overall error
+        int nCodeBookSize = m_nCodeBookSize;
         if( nResult >= 0 )
         {
-            char szMessage[200]; sprintf( szMessage, "Done. %.03f average error", fErrorFound );
+            //the output is smaller if a smaller codebook was good enough
+            nCodeBookSize = VqContextGetCodebookSize( pContext );
+            if( nCodeBookSize != m_nCodeBookSize ) nSize = VqCalcSize( pImage->GetWidth(), Input.mipmapMode, false, nCodeBookSize );
+
+            char szMessage[200];
+            BuildVQMessage( szMessage, fErrorFound, nCodeBookSize, m_nCodeBookSize );
             DisplayStatusMessage( szMessage );
+
+            //pass on the stats if they're wanted
+            if( pStats ) VqContextGetStats( pContext, pStats );
         }
 
         //turn off long operation indicator
         IndicateLongOperation( false );
 
-        //remove temporary buffers
-        if( bTempAlpha ) free( pInputAlpha );
-        if( bTempRGB ) free( pInputRGB );
-
         //create a new CVQImage if it worked
         if( nResult >= 0 )
         {
             CVQImage* pVQImage = new CVQImage();
-            pVQImage->SetVQ( pVQ, nSize, m_nCodeBookSize, pImage->GetWidth(), icf, m_bMipmap );
+            pVQImage->SetVQ( pVQ, nSize, nCodeBookSize, pImage->GetWidth(), icf, m_bMipmap );
 #ifdef _WINDOWS
             pVQImage->m_bChanged = true;
             pVQImage->UncompressVQ();
@@ -217,23 +341,306 @@ CVQImage* CVQCompressor::GenerateVQ( CImage* pImage )
             return pVQImage;
         }
         else
+        {
+            ShowVQError( nResult );
+            free( pVQ );
             return NULL;
+        }
 
     }
     else
     {
-        switch( nSize )
+        ShowVQError( nSize );
+    }
+
+    return NULL;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Reads the codebook from a VQ compressed .pvr or .vqf file, e.g. the
+// last output for a texture, to start compressing it again from.
+// Returns false if there isn't one
+//////////////////////////////////////////////////////////////////////
+bool CVQCompressor::LoadCodebook( const char* pszFilename, VQCodebook& Codebook )
+{
+    CFileView view;
+    if( !view.Open( pszFilename ) ) return false;
+
+    const unsigned char* pPtr = view.GetData();
+
+    //skip any global index (only a PVR has one)
+    bool bGBIX = false;
+    const GlobalIndexHeader* pGBIX = (const GlobalIndexHeader*)pPtr;
+    if( view.Contains( pGBIX, sizeof(GlobalIndexHeader) ) && memcmp( pGBIX->GBIX, "GBIX", 4 ) == 0 )
+    {
+        if( pGBIX->nByteOffsetToNextTag < 4 || !view.Contains( pPtr, sizeof(GlobalIndexHeader) + (pGBIX->nByteOffsetToNextTag-4) ) ) return false;
+        pPtr += sizeof(GlobalIndexHeader) + (pGBIX->nByteOffsetToNextTag-4);
+        bGBIX = true;
+    }
+
+    const PVRHeader* pHeader = (const PVRHeader*)pPtr;
+    const VQFHeader* pVQFHeader = (const VQFHeader*)pPtr;
+    if( view.Contains( pHeader, sizeof(PVRHeader) ) && memcmp( pHeader->PVRT, "PVRT", 4 ) == 0 )
+    {
+        switch( pHeader->nTextureType & 0xFF )
+        {
+            case KM_TEXTURE_ARGB1555: Codebook.icf = ICF_1555; break;
+            case KM_TEXTURE_RGB565:   Codebook.icf = ICF_565; break;
+            case KM_TEXTURE_ARGB4444: Codebook.icf = ICF_4444; break;
+            case KM_TEXTURE_YUV422:   Codebook.icf = ICF_YUV422; break;
+            default: return false;
+        }
+        switch( pHeader->nTextureType & 0xFF00 )
         {
-            case VQ_OUTOFMEMORY:       ShowErrorMessage( "VQ Error: Out of memory" ); break;
-            case VQ_INVALID_SIZE:      ShowErrorMessage( "VQ Error: Invalid size" ); break;
-            case VQ_INVALID_PARAMETER: ShowErrorMessage( "VQ Error: Invalid parameter" ); break;
-            default: ShowErrorMessage( "VQ Error: %d", nSize ); break;
+            case KM_TEXTURE_VQ:
+            case KM_TEXTURE_VQ_MM:          Codebook.nNumCodes = 256; break;
+            case KM_TEXTURE_SMALLVQ:        Codebook.nNumCodes = GetSmallVQCodeBookSize( pHeader->nWidth, false ); break;
+            case KM_TEXTURE_SMALLVQ_MM:     Codebook.nNumCodes = GetSmallVQCodeBookSize( pHeader->nWidth, true ); break;
+            default: return false;
         }
+        pPtr += sizeof(PVRHeader);
     }
+    else if( !bGBIX && view.Contains( pVQFHeader, sizeof(VQFHeader) ) && memcmp( pVQFHeader->PV, "PV", 2 ) == 0 )
+    {
+        switch( pVQFHeader->nMapType & 0x3F )
+        {
+            case VQF_MAPTYPE_1555:   Codebook.icf = ICF_1555; break;
+            case VQF_MAPTYPE_555:    Codebook.icf = ICF_555; break;
+            case VQF_MAPTYPE_565:    Codebook.icf = ICF_565; break;
+            case VQF_MAPTYPE_4444:   Codebook.icf = ICF_4444; break;
+            case VQF_MAPTYPE_YUV422: Codebook.icf = ICF_YUV422; break;
+            default: return false;
+        }
+        if( pVQFHeader->nCodeBookSize > 5 ) return false;
+        Codebook.nNumCodes = 8 << pVQFHeader->nCodeBookSize;
+        pPtr += sizeof(VQFHeader);
+    }
+    else
+        return false;
 
-    //remove temporary buffers
-    if( bTempAlpha ) free( pInputAlpha );
-    if( bTempRGB ) free( pInputRGB );
+    if( !view.Contains( pPtr, Codebook.nNumCodes * 8 ) ) return false;
+    memcpy( Codebook.Codes, pPtr, Codebook.nNumCodes * 8 );
+    return true;
+}
 
-    return NULL;
+
+
+//////////////////////////////////////////////////////////////////////
+// Shared codebook VQ Generation
+//////////////////////////////////////////////////////////////////////
+
+//how much alpha a colour format keeps, so a set can use the one that suits all its images
+static int ColourFormatAlphaRank( ImageColourFormat icf )
+{
+    switch( icf )
+    {
+        case ICF_4444: return 2;
+        case ICF_1555: return 1;
+        default:       return 0;
+    }
+}
+
+//compresses a set of images with one codebook, trained on all of them. Each gets
+//its own CVQImage, with the codebook in front of its indices as usual, and
+//pfErrors gets each one's error. Returns false if the set couldn't be done
+bool CVQCompressor::GenerateVQSet( CImage* pImages[], int nImages, CVQImage* pVQImages[], float pfErrors[], VQ_STATS* pStats /*NULL*/ ) const
+{
+    if( nImages < 1 ) return false;
+    if( nImages > VQ_MAX_SET_TEXTURES )
+    {
+        ShowErrorMessage( "Error: A VQ set can have at most %d images", VQ_MAX_SET_TEXTURES );
+        return false;
+    }
+
+    for( int i = 0; i < nImages; i++ ) if( !CheckVQImage( pImages[i] ) ) return false;
+
+    //they all have to be in the same colour format, so if it's up to us use the
+    //one that keeps the most alpha any of them needs
+    ImageColourFormat icf = m_icf;
+    if( m_icf == ICF_SMART || m_icf == ICF_SMARTYUV )
+    {
+        icf = pImages[0]->GetMMRGBA()->GetBestColourFormat( m_icf );
+        for( int i = 1; i < nImages; i++ )
+        {
+            ImageColourFormat icfImage = pImages[i]->GetMMRGBA()->GetBestColourFormat( m_icf );
+            if( ColourFormatAlphaRank( icfImage ) > ColourFormatAlphaRank( icf ) ) icf = icfImage;
+        }
+    }
+
+    VQInput* pInputs = new VQInput[nImages];
+    VQ_SET_TEXTURE Textures[VQ_MAX_SET_TEXTURES];
+    int nSizes[VQ_MAX_SET_TEXTURES];
+    bool bReverseAlpha = false;
+    for( int i = 0; i < nImages; i++ )
+    {
+        GetVQInput( pImages[i], icf, m_bMipmap, pInputs[i] );
+        if( pInputs[i].bReverseAlpha ) bReverseAlpha = true;
+    }
+
+    //the alpha is inverted for all of them or none, so any made up alpha has to be opaque either way
+    for( int i = 0; i < nImages; i++ )
+    {
+        if( bReverseAlpha && pInputs[i].pTempAlpha ) memset( pInputs[i].pTempAlpha, 0xFF - g_nOpaqueAlpha, pImages[i]->GetWidth() * pImages[i]->GetWidth() );
+
+        nSizes[i] = VqCalcSize( pImages[i]->GetWidth(), pInputs[i].mipmapMode, false, m_nCodeBookSize );
+
+        Textures[i].LevelsRGB = pInputs[i].LevelsRGB;
+        Textures[i].LevelsAlpha = pInputs[i].LevelsAlpha;
+        Textures[i].nLevels = pInputs[i].nLevels;
+        Textures[i].nWidth = pImages[i]->GetWidth();
+        Textures[i].OutputMemory = calloc( 1, nSizes[i] );
+        Textures[i].fErrorFound = 0.0f;
+    }
+
+    //a smaller codebook is only any use if it suits every texture
+    int nSmallSizes[4];
+    int nNumSmallSizes = GetSmallVQSizes( *this, pImages[0]->GetWidth(), nSmallSizes );
+    for( int i = 1; i < nImages; i++ )
+    {
+        int nOtherSizes[4];
+        if( GetSmallVQSizes( *this, pImages[i]->GetWidth(), nOtherSizes ) != nNumSmallSizes || memcmp( nOtherSizes, nSmallSizes, nNumSmallSizes * sizeof(int) ) != 0 ) nNumSmallSizes = 0;
+    }
+
+    VQ_COLOUR_METRIC Metric = m_Metric;
+    if( m_bTolerateHigherFrequency ) Metric = VQ_COLOUR_METRIC( int(Metric)|VQMETRIC_FREQUENCY_FLAG );
+
+    IndicateLongOperation( true );
+
+    //perform the calculations. The mipmap mode only matters for whether there are mipmaps
+    float fErrorFound = 0.0f;
+    VQ_CONTEXT* pContext = GetVQContext( *this, nSmallSizes, nNumSmallSizes );
+    int nResult = VQ_OUTOFMEMORY;
+    if( pContext )
+    {
+        nResult = VqCalcSetContext( pContext, Textures, nImages, true, m_bMipmap ? VQ_GENERATE_MIPMAP : VQ_NO_MIPMAP, pInputs[0].bAlpha, false, m_Dither, m_nCodeBookSize, pInputs[0].nColourFormat, bReverseAlpha, Metric, &fErrorFound );
+    }
+
+    IndicateLongOperation( false );
+    delete[] pInputs;
+
+    if( nResult < 0 )
+    {
+        ShowVQError( nResult );
+        for( int i = 0; i < nImages; i++ ) free( Textures[i].OutputMemory );
+        return false;
+    }
+
+    //display overall error
+    int nCodeBookSize = VqContextGetCodebookSize( pContext );
+    char szMessage[200];
+    BuildVQMessage( szMessage, fErrorFound, nCodeBookSize, m_nCodeBookSize );
+    DisplayStatusMessage( szMessage );
+
+    if( pStats ) VqContextGetStats( pContext, pStats );
+
+    //the output is smaller if a smaller codebook was good enough
+    for( int i = 0; i < nImages; i++ )
+    {
+        int nWidth = pImages[i]->GetWidth();
+        int nSize = nSizes[i];
+        if( nCodeBookSize != m_nCodeBookSize ) nSize = VqCalcSize( nWidth, m_bMipmap ? VQ_GENERATE_MIPMAP : VQ_NO_MIPMAP, false, nCodeBookSize );
+
+        pVQImages[i] = new CVQImage();
+        pVQImages[i]->SetVQ( (unsigned char*)Textures[i].OutputMemory, nSize, nCodeBookSize, nWidth, icf, m_bMipmap );
+#ifdef _WINDOWS
+        pVQImages[i]->m_bChanged = true;
+        pVQImages[i]->UncompressVQ();
+#endif
+        pVQImages[i]->m_icf = icf;
+        pfErrors[i] = Textures[i].fErrorFound;
+    }
+
+    return true;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Stats output
+//////////////////////////////////////////////////////////////////////
+static void WriteJSONString( FILE* file, const char* psz )
+{
+    fputc( '"', file );
+    for( ; *psz; psz++ )
+    {
+        if( *psz == '"' || *psz == '\\' ) fputc( '\\', file );
+        if( (unsigned char)*psz < 0x20 ) fprintf( file, "\\u%04x", *psz ); else fputc( *psz, file );
+    }
+    fputc( '"', file );
+}
+
+//writes the stats from compressing pszSource as JSON, so they can be
+//compared from one build to the next
+bool CVQCompressor::SaveStats( const char* pszFilename, const char* pszSource, const VQ_STATS& Stats )
+{
+    FILE* file = fopen( pszFilename, "wt" );
+    if( file == NULL ) return ReturnError( "could not open file for output: ", pszFilename );
+
+    const char* pszSearch = "neighbours";
+    if( Stats.SearchIndex == VQSearchKdTree ) pszSearch = "kdtree";
+    if( Stats.SearchIndex == VQSearchExhaustive ) pszSearch = "exhaustive";
+
+    fprintf( file, "{\n" );
+    fprintf( file, "  \"source\": " ); WriteJSONString( file, pszSource ); fprintf( file, ",\n" );
+    fprintf( file, "  \"width\": %d,\n", Stats.Width );
+    fprintf( file, "  \"codes\": %d,\n", Stats.NumCodes );
+    fprintf( file, "  \"codes_used\": %d,\n", Stats.NumCodesUsed );
+    fprintf( file, "  \"vectors\": %d,\n", Stats.NumVectors );
+    fprintf( file, "  \"unique_vectors\": %d,\n", Stats.NumUniqueVectors );
+    fprintf( file, "  \"training_vectors\": %d,\n", Stats.NumTrainingVectors );
+
+    //stage times, in seconds
+    fprintf( file, "  \"times\": {\n" );
+    fprintf( file, "    \"vectorise\": %.6f,\n", Stats.VectoriseTime );
+    fprintf( file, "    \"mipmap\": %.6f,\n", Stats.MipMapTime );
+    fprintf( file, "    \"yuv\": %.6f,\n", Stats.YUVTime );
+    fprintf( file, "    \"train\": %.6f,\n", Stats.TrainTime );
+    fprintf( file, "    \"passes\": [" );
+    for( int i = 0; i < Stats.NumPasses; i++ ) fprintf( file, "%s%.6f", i ? ", " : "", Stats.PassTimes[i] );
+    fprintf( file, "],\n" );
+    fprintf( file, "    \"placement\": %.6f,\n", Stats.PlacementTime );
+    fprintf( file, "    \"write\": %.6f,\n", Stats.WriteTime );
+    fprintf( file, "    \"total\": %.6f\n", Stats.TotalTime );
+    fprintf( file, "  },\n" );
+
+    //RMS errors
+    fprintf( file, "  \"pass_errors\": [" );
+    for( int i = 0; i < Stats.NumPasses; i++ ) fprintf( file, "%s%.4f", i ? ", " : "", Stats.PassErrors[i] );
+    fprintf( file, "],\n" );
+    fprintf( file, "  \"level_errors\": [" );
+    for( int i = 0; i < Stats.NumLevels; i++ ) fprintf( file, "%s%.4f", i ? ", " : "", Stats.LevelErrors[i] );
+    fprintf( file, "],\n" );
+
+    //smaller codebooks tried before the one written
+    fprintf( file, "  \"codebooks_tried\": [" );
+    for( int i = 0; i < Stats.NumCodebooksTried; i++ ) fprintf( file, "%s{ \"codes\": %d, \"error\": %.4f }", i ? ", " : "", Stats.TriedCodes[i], Stats.TriedErrors[i] );
+    fprintf( file, "],\n" );
+
+    //nearest code search, over all the passes
+    fprintf( file, "  \"search\": {\n" );
+    fprintf( file, "    \"index\": \"%s\",\n", pszSearch );
+    fprintf( file, "    \"searches\": %lld,\n", Stats.NumSearches );
+    fprintf( file, "    \"distance_calcs\": %lld,\n", Stats.NumDistanceCalcs );
+    fprintf( file, "    \"setup_calcs\": %lld,\n", Stats.NumSetupCalcs );
+    fprintf( file, "    \"calcs_per_search\": %.3f,\n", Stats.NumSearches ? (double)Stats.NumDistanceCalcs / Stats.NumSearches : 0.0 );
+    if( Stats.SearchIndex == VQSearchNeighbours && Stats.NumSearches > 0 )
+        fprintf( file, "    \"tree_hit_rate\": %.4f\n", (double)Stats.NumTreeHits / Stats.NumSearches );
+    else
+        fprintf( file, "    \"tree_hit_rate\": null\n" );
+    fprintf( file, "  },\n" );
+
+    //working memory
+    fprintf( file, "  \"memory\": {\n" );
+    fprintf( file, "    \"allocations\": %d,\n", Stats.NumAllocs );
+    fprintf( file, "    \"system_allocations\": %d,\n", Stats.NumSystemAllocs );
+    fprintf( file, "    \"peak_kb\": %d\n", Stats.PeakMemoryKB );
+    fprintf( file, "  }\n" );
+    fprintf( file, "}\n" );
+
+    bool bOK = ( ferror( file ) == 0 );
+    if( fclose( file ) != 0 ) bOK = false;
+    if( !bOK ) return ReturnError( "could not write to file: ", pszFilename );
+    return true;
 }
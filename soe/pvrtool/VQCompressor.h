@@ -15,13 +15,25 @@ extern "C" {
 #include "vqdll.h"
 }
 
+//a codebook to start VQ compression from, as it was written (see CVQCompressor::LoadCodebook)
+struct VQCodebook
+{
+    unsigned char Codes[256 * 8];
+    int nNumCodes;
+    ImageColourFormat icf;
+};
+
 class CVQCompressor
 {
 public:
 	CVQCompressor();
 	virtual ~CVQCompressor();
 
-    CVQImage* GenerateVQ( CImage* pImage );
+    CVQImage* GenerateVQ( CImage* pImage, VQ_STATS* pStats = NULL, const VQCodebook* pWarmStart = NULL ) const;
+    bool GenerateVQSet( CImage* pImages[], int nImages, CVQImage* pVQImages[], float pfErrors[], VQ_STATS* pStats = NULL ) const;
+
+    static bool LoadCodebook( const char* pszFilename, VQCodebook& Codebook );
+    static bool SaveStats( const char* pszFilename, const char* pszSource, const VQ_STATS& Stats );
 
     ImageColourFormat m_icf;
 
@@ -30,6 +42,15 @@ public:
     int m_nCodeBookSize;
     VQ_DITHER_TYPES m_Dither;
     VQ_COLOUR_METRIC m_Metric;
+    VQ_SEARCH_INDEX m_Search;
+    int m_nThreads;
+    int m_nSubsample;
+    int m_nCoarseWidth;
+    int m_nExtraPasses;
+    float m_fMinImprovement;
+    float m_fTimeBudget;
+    float m_fSmallVQError;
+    bool m_bAnySmallVQSize;
 };
 
 #endif // !defined(AFX_VQCOMPRESSOR_H__29F9C1C2_968F_11D3_86DB_005004314EE7__INCLUDED_)
@@ -15,12 +15,14 @@
 
 #include <stdio.h>
 #include <string.h>
+#include "minmax.h"
 #include "VQF.h"
 #include "PVR.h"
 #include "Util.h"
 #include "Picture.h"
 #include "Image.h"
 #include "Twiddle.h"
+#include "FileView.h"
 
 
 
@@ -30,20 +32,15 @@
 //////////////////////////////////////////////////////////////////////
 bool LoadVQF( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags )
 {
-    //open the file
-    FILE* file = fopen( pszFilename, "rb" );
-    if( file == NULL ) return false;
+    //map the file
+    CFileView view;
+    if( !view.Open( pszFilename ) ) return false;
 
-    //load the file into a buffer
-    fseek( file, 0, SEEK_END ); int nFileLength = ftell( file ); fseek( file, 0, SEEK_SET );
-    unsigned char* pBuffer = (unsigned char*)malloc( nFileLength );
-    if( (int)fread( pBuffer, 1, nFileLength, file ) < nFileLength ) { fclose(file); free(pBuffer); return false; };
-    fclose(file);
-
-    unsigned char* pPtr = pBuffer;
+    const unsigned char* pPtr = view.GetData();
 
     //read header
-    VQFHeader* pHeader = (VQFHeader*)pPtr;
+    if( !view.Contains( pPtr, sizeof(VQFHeader) ) ) { ShowErrorMessage( "Truncated VQF file" ); return false; }
+    const VQFHeader* pHeader = (const VQFHeader*)pPtr;
     pPtr += sizeof(VQFHeader);
 
 
@@ -56,7 +53,7 @@ bool LoadVQF( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         case VQF_MAPTYPE_565:                 icf = ICF_565; break;
         case VQF_MAPTYPE_4444: bAlpha = true; icf = ICF_4444; break;
         case VQF_MAPTYPE_YUV422:              icf = ICF_YUV422; break;
-        default: ShowErrorMessage( "Unsupported colour format" ); free(pBuffer); return false;
+        default: ShowErrorMessage( "Unsupported colour format" ); return false;
     }
 
     //extract info from header
@@ -70,7 +67,7 @@ bool LoadVQF( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         case 3:  nCodeBookSize = 64; break;
         case 4:  nCodeBookSize = 128; break;
         case 5:  nCodeBookSize = 256; break;
-        default: ShowErrorMessage( "Unsupported codebook size" ); free( pBuffer ); return false;
+        default: ShowErrorMessage( "Unsupported codebook size" ); return false;
     }
     int nDimension;
     switch( pHeader->nTextureSize )
@@ -83,20 +80,28 @@ bool LoadVQF( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         case 5: nDimension = 16; break;
         case 6: nDimension = 512; break;
         case 7: nDimension = 1024; break;
-        default: ShowErrorMessage( "Unknown image size" ); free(pBuffer); return false;
+        default: ShowErrorMessage( "Unknown image size" ); return false;
     }
     mmrgba.Init( MMINIT_ALLOCATE|MMINIT_RGB|(( bAlpha && (dwFlags & LPF_LOADALPHA))?MMINIT_ALPHA:0) | (bMipMaps?MMINIT_MIPMAP:0), nDimension, nDimension );
     int nNumMipMaps = mmrgba.nMipMaps;
 
     //get texture data
-    VQFCodeBookEntry* pCodeBook = NULL;
-    pCodeBook = (VQFCodeBookEntry*)pPtr;
+    if( !view.Contains( pPtr, sizeof(VQFCodeBookEntry) * nCodeBookSize ) ) { ShowErrorMessage( "Truncated VQF file" ); return false; }
+    const VQFCodeBookEntry* pCodeBook = (const VQFCodeBookEntry*)pPtr;
     pPtr += sizeof(VQFCodeBookEntry) * nCodeBookSize;
 
 
     //skip over 1x1 placeholder
     if( bMipMaps ) pPtr+=1;
 
+    //unpack the codebook. A codebook of fewer than 256 codes takes the top of the index range
+    int nFirstCode = 256 - nCodeBookSize;
+    unsigned char CodeBGR[ 256 * 12 ], CodeAlpha[ 256 * 4 ];
+    UnpackCodeBook( pCodeBook, nCodeBookSize, icf, &CodeBGR[ nFirstCode * 12 ], &CodeAlpha[ nFirstCode * 4 ] );
+
+    //buffer for the untwiddled indices of the largest level
+    unsigned char* pIndices = (unsigned char*)malloc( (nDimension / 2) * (nDimension / 2) );
+
     //unpack image
     int iMipMap = bMipMaps ? mmrgba.nMipMaps - 2 : 0;
     int nTempWidth = bMipMaps ? 2 : mmrgba.nWidth;
@@ -106,44 +111,16 @@ bool LoadVQF( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         unsigned char* pRGB = mmrgba.pRGB[iMipMap];
         unsigned char* pAlpha = mmrgba.pAlpha ? mmrgba.pAlpha[iMipMap] : NULL;
 
-        //compute twiddle bit values
-        unsigned long int mask, shift;
-        ComputeMaskShift( nTempWidth / 2, nTempHeight / 2, mask, shift );
+        //read the image, untwiddling the indices first so the blocks can be read in order
+        int nMax = (nTempWidth / 2) * (nTempHeight / 2);
+        if( !view.Contains( pPtr, nMax ) ) { ShowErrorMessage( "Truncated VQF file" ); free( pIndices ); return false; }
+        Untwiddle( pPtr, pIndices, nTempWidth / 2, nTempHeight / 2, 8 );
 
-        //read the image
-        int nWrite = 0, nMax = (nTempWidth / 2) * (nTempHeight / 2);
-        int x = 0, y = 0;
-        while( nWrite < nMax )
+        if( !WriteCodeBlocks( pIndices, nTempWidth, nTempHeight, CodeBGR, CodeAlpha, nFirstCode, pRGB, bAlpha ? pAlpha : NULL ) )
         {
-            int iPos = CalcUntwiddledPos( x / 2, y / 2, mask, shift );
-
-            //unpack the twiddled 2x2 block
-            bool bDown = true;
-            for( int iTexel = 0; iTexel < 4; iTexel++ )
-            {
-                //get the texel
-                unsigned short int Texel = pCodeBook[ pPtr[iPos] ].Texel[iTexel];
-
-                //determine where to write
-                int iAlphaWrite = (x + (y * nTempWidth));
-                int iWrite = iAlphaWrite * 3;
-
-                //write the values into the buffer
-                unsigned char *pa, *pr, *pg, *pb;
-                pa = ( pAlpha && bAlpha ) ? &pAlpha[ iAlphaWrite ] : NULL;
-                pb = &pRGB[iWrite++];
-                pg = &pRGB[iWrite++];
-                pr = &pRGB[iWrite++];
-                UnpackTexel( x, y, Texel, pa, pr, pg, pb, icf );
-
-                //adjust x & y so we step through the image in a twiddled way
-                if( bDown ) y += 1; else { y -= 1; x += 1; }
-                bDown = !bDown;
-            }
-
-            //update write position
-            nWrite++;
-            if( x >= nTempWidth ) { x = 0; y += 2; }
+            ShowErrorMessage( "Truncated VQF file" );
+            free( pIndices );
+            return false;
         }
 
         //move pointer over the mipmap we just unpacked
@@ -154,12 +131,65 @@ bool LoadVQF( const char* pszFilename, MMRGBA& mmrgba, unsigned long int dwFlags
         nTempWidth *= 2;
         nTempHeight *= 2;
     }
+    free( pIndices );
 
     //set description
     sprintf( mmrgba.szDescription, "VQF texture %dx%d", mmrgba.nWidth, mmrgba.nHeight );
 
-    //clean up and return
-    free( pBuffer );
+    return true;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Unpacks the codebook into 2x2 blocks of BGR values (12 bytes per
+// entry, top row first) and alpha values (4 bytes per entry)
+//////////////////////////////////////////////////////////////////////
+void UnpackCodeBook( const VQFCodeBookEntry* pCodeBook, int nEntries, ImageColourFormat icf, unsigned char* pBGR, unsigned char* pAlpha )
+{
+    //put each entry's texels in row order so that the whole codebook is one
+    //row - each row of an entry is a YUV pair
+    unsigned short int* pTexels = (unsigned short int*)malloc( __max( 1, nEntries * 4 ) * sizeof(unsigned short int) );
+    for( int i = 0; i < nEntries; i++ )
+    {
+        pTexels[ i * 4 + 0 ] = pCodeBook[i].Texel[0];
+        pTexels[ i * 4 + 1 ] = pCodeBook[i].Texel[2];
+        pTexels[ i * 4 + 2 ] = pCodeBook[i].Texel[1];
+        pTexels[ i * 4 + 3 ] = pCodeBook[i].Texel[3];
+    }
+
+    UnpackTexelRow( pTexels, pBGR, pAlpha, nEntries * 4, icf );
+    free( pTexels );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////
+// Writes the unpacked 2x2 block for each of the (untwiddled) indices
+// into the image. The codebook is unpacked for all 256 indices, but
+// only those from nFirstCode up are used. pAlpha may be NULL. Returns
+// false if an index is outside the codebook
+//////////////////////////////////////////////////////////////////////
+bool WriteCodeBlocks( const unsigned char* pIndices, int nWidth, int nHeight, const unsigned char* pCodeBGR, const unsigned char* pCodeAlpha, int nFirstCode, unsigned char* pRGB, unsigned char* pAlpha )
+{
+    for( int y = 0; y < nHeight; y += 2 )
+        for( int x = 0; x < nWidth; x += 2 )
+        {
+            int iCode = *pIndices++;
+            if( iCode < nFirstCode ) return false;
+
+            int iWrite = x + ( y * nWidth );
+            memcpy( &pRGB[ iWrite * 3 ], &pCodeBGR[ iCode * 12 ], 6 );
+            memcpy( &pRGB[ ( iWrite + nWidth ) * 3 ], &pCodeBGR[ iCode * 12 + 6 ], 6 );
+            if( pAlpha )
+            {
+                pAlpha[ iWrite ] = pCodeAlpha[ iCode * 4 + 0 ];
+                pAlpha[ iWrite + 1 ] = pCodeAlpha[ iCode * 4 + 1 ];
+                pAlpha[ iWrite + nWidth ] = pCodeAlpha[ iCode * 4 + 2 ];
+                pAlpha[ iWrite + nWidth + 1 ] = pCodeAlpha[ iCode * 4 + 3 ];
+            }
+        }
+
     return true;
 }
 
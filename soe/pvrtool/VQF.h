@@ -41,6 +41,10 @@ extern bool LoadVQF( const char* pszFilename, MMRGBA &mmrgba, unsigned long int
 
 unsigned char* VQF2PVR( unsigned char* pVQFFile, int& nWidth, int& nCodebookSize, int& nPVRImageType );
 
+//VQ decoding - unpack the codebook once, then copy its 2x2 blocks into the image
+extern void UnpackCodeBook( const VQFCodeBookEntry* pCodeBook, int nEntries, ImageColourFormat icf, unsigned char* pBGR, unsigned char* pAlpha );
+extern bool WriteCodeBlocks( const unsigned char* pIndices, int nWidth, int nHeight, const unsigned char* pCodeBGR, const unsigned char* pCodeAlpha, int nFirstCode, unsigned char* pRGB, unsigned char* pAlpha );
+
 extern int GetWidthFromTextureSizeCode( unsigned char nTextureSizeCode );
 extern unsigned char GetTextureSizeCodeFromWidth( int nWidth );
 extern int GetCodebookSizeFromCode( unsigned char nCodeBookSizeCode );
@@ -9,6 +9,7 @@
 **************************************************/
 #include <stdio.h>
 #include <string.h>
+#include "minmax.h"
 #include "stricmp.h"
 #include "Picture.h"
 #include "Util.h"
@@ -34,6 +35,8 @@ CVQImage::CVQImage()
     m_nVQWidth = 0;
     m_icfVQ = ICF_NONE;
     m_bVQMipmap = false;
+    m_bGlobalIndex = false;
+    m_nGlobalIndex = 0;
 }
 
 CVQImage::~CVQImage()
@@ -75,6 +78,14 @@ bool CVQImage::UncompressVQ()
     VQFCodeBookEntry* pCodeBook = (VQFCodeBookEntry*)pVQ;
     pVQ += sizeof(VQFCodeBookEntry) * m_nVQCodebookSize;
 
+    //unpack the codebook. A codebook of fewer than 256 codes takes the top of the index range
+    int nFirstCode = 256 - m_nVQCodebookSize;
+    unsigned char CodeBGR[ 256 * 12 ], CodeAlpha[ 256 * 4 ];
+    UnpackCodeBook( pCodeBook, m_nVQCodebookSize, m_icfVQ, &CodeBGR[ nFirstCode * 12 ], &CodeAlpha[ nFirstCode * 4 ] );
+
+    //buffer for the untwiddled indices of the largest level
+    unsigned char* pIndices = (unsigned char*)malloc( __max( 1, (m_nVQWidth / 2) * (m_nVQWidth / 2) ) );
+
     //unpack image
     int iMipMap = m_bVQMipmap ? m_mmrgba.nMipMaps - 1 : 0;
     int nTempWidth = m_bVQMipmap ? 1 : m_mmrgba.nWidth;
@@ -84,54 +95,17 @@ bool CVQImage::UncompressVQ()
         unsigned char* pRGB = m_mmrgba.pRGB[iMipMap];
         unsigned char* pAlpha = m_mmrgba.pAlpha ? m_mmrgba.pAlpha[iMipMap] : NULL;
 
-        //compute twiddle bit values
-        unsigned long int mask, shift;
-        ComputeMaskShift( nTempWidth / 2, nTempHeight / 2, mask, shift );
-
-        //read the image
-        int nWrite = 0, nMax = (nTempWidth == 1) ? 1 : (nTempWidth / 2) * (nTempHeight / 2);
-        int x = 0, y = 0;
-        while( nWrite < nMax )
+        //read the image, untwiddling the indices first so the blocks can be read in order
+        int nMax = (nTempWidth == 1) ? 1 : (nTempWidth / 2) * (nTempHeight / 2);
+        if( nTempWidth == 1 ) //special case: 1x1 vq mipmap is stored as 565 and index 0 is used
+        {
+            if( pVQ[0] < nFirstCode ) { free( pIndices ); return false; }
+            UnpackTexel( 0, 0, pCodeBook[ pVQ[0] - nFirstCode ].Texel[0], ( pAlpha && bAlpha ) ? &pAlpha[0] : NULL, &pRGB[2], &pRGB[1], &pRGB[0], ICF_565 );
+        }
+        else
         {
-            int iPos = CalcUntwiddledPos( x / 2, y / 2, mask, shift );
-
-            if( nTempWidth == 1 ) //special case: 1x1 vq mipmap is stored as 565 and index 0 is used
-            {
-                //unpack and write the valies into the buffer
-                UnpackTexel( 0, 0, pCodeBook[ pVQ[iPos] ].Texel[0], ( pAlpha && bAlpha ) ? &pAlpha[0] : NULL, &pRGB[2], &pRGB[1], &pRGB[0], ICF_565 );
-            }
-            else
-            {
-                //unpack the twiddled 2x2 block
-                int xoff = 0, yoff = 0;
-                int iLinear[] = { 0, 2, 1, 3 }; //this is needed so that YUV can be unpacked properly
-                for( int iTexel = 0; iTexel < 4; iTexel++ )
-                {
-                    //get the texel
-                    unsigned short int Texel = pCodeBook[ pVQ[iPos] ].Texel[iLinear[iTexel]];
-
-                    //determine where to write
-                    int iAlphaWrite = (x + xoff + ( (y + yoff) * nTempWidth));
-                    int iWrite = iAlphaWrite * 3;
-
-                    //unpack and write the valies into the buffer
-                    unsigned char *pa, *pr, *pg, *pb;
-                    pa = ( pAlpha && bAlpha ) ? &pAlpha[ iAlphaWrite ] : NULL;
-                    pb = &pRGB[iWrite++];
-                    pg = &pRGB[iWrite++];
-                    pr = &pRGB[iWrite++];
-                    UnpackTexel( x + xoff, y + yoff, Texel, pa, pr, pg, pb, m_icfVQ );
-
-                    //adjust x & y
-                    xoff++;
-                    if( xoff == 2 ) { xoff = 0; yoff++; }
-                }
-            }
-
-            //update write position
-            nWrite++;
-            x += 2;
-            if( x >= nTempWidth ) { x = 0; y += 2; }
+            Untwiddle( pVQ, pIndices, nTempWidth / 2, nTempHeight / 2, 8 );
+            if( !WriteCodeBlocks( pIndices, nTempWidth, nTempHeight, CodeBGR, CodeAlpha, nFirstCode, pRGB, bAlpha ? pAlpha : NULL ) ) { free( pIndices ); return false; }
         }
 
 #ifdef _WINDOWS
@@ -148,6 +122,7 @@ bool CVQImage::UncompressVQ()
         nTempHeight *= 2;
     }
 
+    free( pIndices );
     return true;
 }
 #endif
@@ -171,6 +146,15 @@ void CVQImage::SetVQ( unsigned char *pNewVQ, int nVQSize, int nCodebookSize, int
 
 
 
+//////////////////////////////////////////////////////////////////////
+// Sets the global index written into exported PVR files
+//////////////////////////////////////////////////////////////////////
+void CVQImage::SetGlobalIndex( bool bEnable, unsigned long int nGlobalIndex )
+{
+    m_bGlobalIndex = bEnable;
+    m_nGlobalIndex = nGlobalIndex;
+}
+
 
 
 //////////////////////////////////////////////////////////////////////
@@ -332,13 +316,13 @@ bool CVQImage::SaveAsPVR(const char *pszFilename)
     if( file == NULL ) return false;
 
     //write out globalindex
-    if( g_bEnableGlobalIndex )
+    if( m_bGlobalIndex )
     {
         GlobalIndexHeader gbix;
         memcpy( gbix.GBIX, "GBIX", 4 );
         gbix.nByteOffsetToNextTag = 8;
-        gbix.nGlobalIndex = g_nGlobalIndex;
-        unsigned long int zero = 0;
+        gbix.nGlobalIndex = m_nGlobalIndex;
+        uint32_t zero = 0;
         if( fwrite( &gbix, 1, sizeof(GlobalIndexHeader), file ) < sizeof(GlobalIndexHeader) || fwrite( &zero, 1, sizeof(zero), file ) < sizeof(zero) )
         {
             fclose( file );
@@ -370,7 +354,8 @@ bool CVQImage::SaveAsPVR(const char *pszFilename)
 bool CVQImage::SaveAsC( const char* pszFilename )
 {
     //create a temporary file name
-    char* pszTempName = tmpnam( NULL );
+    char szTempName[L_tmpnam];
+    char* pszTempName = tmpnam( szTempName );
     if( pszTempName == NULL ) return ReturnError( "Failed to create a temporary file for: ", pszFilename );
 
     //create the PVR file into this temporary file
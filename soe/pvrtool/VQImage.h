@@ -20,6 +20,7 @@ public:
 	bool SaveAsPVR( const char* pszFilename );
 	bool SaveAsVQF( const char* pszFilename );
 	void SetVQ( unsigned char *pNewVQ, int nVQSize, int nCodebookSize, int nWidth, ImageColourFormat icf, bool bMipmap );
+	void SetGlobalIndex( bool bEnable, unsigned long int nGlobalIndex );
 	CVQImage();
 	virtual ~CVQImage();
 
@@ -45,6 +46,8 @@ protected:
     int m_nVQCodebookSize;
     ImageColourFormat m_icfVQ;
     bool m_bVQMipmap;
+    bool m_bGlobalIndex;
+    unsigned long int m_nGlobalIndex;
 
 };
 